@@ -6,14 +6,20 @@
 #include <cnoid/Archive>
 #include <cnoid/Body>
 #include <cnoid/DeviceList>
+#include <cnoid/Format>
 #include <cnoid/ItemManager>
+#include <cnoid/MessageView>
 #include <cnoid/MultiValueSeq>
 #include <cnoid/MultiValueSeqItem>
 #include <cnoid/PutPropertyFunction>
 #include <cnoid/SimulatorItem>
 #include <cnoid/StringUtil>
 #include <cnoid/Tokenizer>
+#include <cnoid/UTF8>
 #include <cnoid/ValueTreeUtil>
+#include <cnoid/stdx/filesystem>
+#include "ContactSensorNotifier.h"
+#include "ContactStateLog.h"
 #include "LoggerUtil.h"
 #include "PassiveMarker.h"
 #include <set>
@@ -21,6 +27,7 @@
 
 using namespace std;
 using namespace cnoid;
+namespace filesystem = cnoid::stdx::filesystem;
 
 namespace {
 
@@ -51,6 +58,33 @@ bool updateNames(const string& nameListString, string& out_newNameListString, ve
     return true;
 }
 
+// The first body of the log is loaded into the item and the others into its sub items
+bool loadContactStateLog(MultiValueSeqItem* item, const string& filename, ostream& os)
+{
+    ContactStateLog log;
+    if(!log.openForReading(filename)) {
+        os << formatC("\"{0}\" is not a contact state log that can be read.", filename) << endl;
+        return false;
+    }
+    if(log.numBodies() == 0) {
+        os << formatC("\"{0}\" has no bodies.", filename) << endl;
+        return false;
+    }
+    for(int i = 0; i < log.numBodies(); ++i) {
+        MultiValueSeqItem* seqItem = item;
+        if(i > 0) {
+            seqItem = new MultiValueSeqItem;
+            seqItem->setName(log.bodyName(i));
+            item->addSubItem(seqItem);
+        }
+        if(!log.expand(i, *seqItem->seq())) {
+            os << formatC("The states of {0} in \"{1}\" are broken.", log.bodyName(i), filename) << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 }
 
 namespace cnoid {
@@ -70,8 +104,17 @@ public:
 
     vector<MultiValueSeqItem*> collisionStateSeqItems;
     DeviceList<PassiveMarker> sensors;
+    ContactSensorNotifier sensorNotifier;
+    int debounceSteps;
+
+    bool isLogCompressed;
+    bool isCompressedLogExpanded;
+    int expansionLimit; // unit: MB
+    ContactStateLog contactLog;
+    string suffix;
 
     bool initializeSimulation(SimulatorItem* simulatorItem);
+    void finalizeSimulation();
     void onPostDynamics();
 };
 
@@ -93,6 +136,10 @@ CollisionSeqLoggerItem::Impl::Impl(CollisionSeqLoggerItem* self)
     simulatorItem = nullptr;
     collisionStateSeqItems.clear();
     sensors.clear();
+    debounceSteps = 0;
+    isLogCompressed = false;
+    isCompressedLogExpanded = true;
+    expansionLimit = 256;
 }
 
 
@@ -110,6 +157,10 @@ CollisionSeqLoggerItem::Impl::Impl(CollisionSeqLoggerItem* self, const Impl& org
 {
     bodies = org.bodies;
     bodyNameListString = getNameListString(bodyNames);
+    debounceSteps = org.debounceSteps;
+    isLogCompressed = org.isLogCompressed;
+    isCompressedLogExpanded = org.isCompressedLogExpanded;
+    expansionLimit = org.expansionLimit;
 }
 
 
@@ -123,7 +174,12 @@ void CollisionSeqLoggerItem::initializeClass(ExtensionManager* ext)
 {
     ext->itemManager()
         .registerClass<CollisionSeqLoggerItem, SubSimulatorItem>(N_("CollisionSeqLoggerItem"))
-        .addCreationPanel<CollisionSeqLoggerItem>();
+        .addCreationPanel<CollisionSeqLoggerItem>()
+        .addLoader<MultiValueSeqItem>(
+            _("Contact State Log"), "CONTACT-STATE-LOG", "cslog",
+            [](MultiValueSeqItem* item, const string& filename, ostream& os, Item*){
+                return loadContactStateLog(item, filename, os);
+            });
 }
 
 
@@ -140,6 +196,8 @@ bool CollisionSeqLoggerItem::Impl::initializeSimulation(SimulatorItem* simulator
     this->simulatorItem = simulatorItem;
     collisionStateSeqItems.clear();
     sensors.clear();
+    contactLog.close();
+    suffix = getCurrentTimeSuffix();
 
     std::set<string> bodyNameSet;
     for(auto& bodyName : bodyNames) {
@@ -153,8 +211,14 @@ bool CollisionSeqLoggerItem::Impl::initializeSimulation(SimulatorItem* simulator
             sensors << body->devices();
             if(!body->isStaticModel()) {
                 bodies.push_back(body);
+                for(int i = 0; i < body->numLinks(); ++i) {
+                    Link* link = body->link(i);
+                    link->mergeSensingMode(Link::LinkContactState);
+                }
+                if(isLogCompressed) {
+                    continue;
+                }
                 MultiValueSeqItem* collisionStateSeqItem = new MultiValueSeqItem;
-                string suffix = getCurrentTimeSuffix();
                 string name = body->name() + suffix;
                 collisionStateSeqItem->setName(name);
                 self->addSubItem(collisionStateSeqItem);
@@ -166,21 +230,35 @@ bool CollisionSeqLoggerItem::Impl::initializeSimulation(SimulatorItem* simulator
                 log->setNumParts(numParts);
                 log->setFrameRate(1.0 / simulatorItem->worldTimeStep());
                 log->setOffsetTime(0.0);
-
-                for(int i = 0; i < body->numLinks(); ++i) {
-                    Link* link = body->link(i);
-                    link->mergeSensingMode(Link::LinkContactState);
-                }
             }
         }
     }
 
+    vector<PassiveMarker*> sensorList;
     for(auto& sensor : sensors) {
         Link* link = sensor->link();
         link->mergeSensingMode(Link::LinkContactState);
+        sensorList.push_back(sensor);
+    }
+    sensorNotifier.setSensors(sensorList);
+    sensorNotifier.setDebounceSteps(debounceSteps);
+
+    if(bodies.size() && isLogCompressed) {
+        vector<string> names;
+        vector<int> numLinks;
+        for(auto& body : bodies) {
+            names.push_back(body->name());
+            numLinks.push_back(body->numLinks());
+        }
+        filesystem::path collisionDirPath(fromUTF8(mkdir(StandardPath::Downloads, "collision")));
+        string filename = toUTF8((collisionDirPath / filesystem::path(fromUTF8("contact" + suffix + ".cslog"))).string());
+        if(!contactLog.openForWriting(filename, 1.0 / simulatorItem->worldTimeStep(), names, numLinks)) {
+            MessageView::instance()->putln(
+                formatR(_("The contact log \"{0}\" cannot be opened."), filename), MessageView::Warning);
+        }
     }
 
-    if(bodies.size()) {
+    if(bodies.size() || sensors.size()) {
         this->simulatorItem->addPostDynamicsFunction([&](){ onPostDynamics(); });
     }
 
@@ -188,10 +266,85 @@ bool CollisionSeqLoggerItem::Impl::initializeSimulation(SimulatorItem* simulator
 }
 
 
+void CollisionSeqLoggerItem::finalizeSimulation()
+{
+    impl->finalizeSimulation();
+}
+
+
+int CollisionSeqLoggerItem::numTransitions(PassiveMarker* sensor) const
+{
+    for(int i = 0; i < impl->sensorNotifier.numSensors(); ++i) {
+        if(impl->sensorNotifier.sensor(i) == sensor) {
+            return impl->sensorNotifier.numTransitions(i);
+        }
+    }
+    return -1;
+}
+
+
+void CollisionSeqLoggerItem::Impl::finalizeSimulation()
+{
+    if(sensorNotifier.numSensors()) {
+        MessageView::instance()->putln(
+            formatR(_("{0} contact sensors were switched {1} times in {2} steps."),
+                    sensorNotifier.numSensors(), sensorNotifier.numTransitions(), sensorNotifier.numSteps()));
+    }
+
+    if(!contactLog.isWriting()) {
+        return;
+    }
+    contactLog.close();
+
+    size_t numLinks = 0;
+    for(auto& body : bodies) {
+        numLinks += body->numLinks();
+    }
+    MessageView::instance()->putln(
+        formatR(_("{0} frames of contact states were written to \"{1}\" as {2} events of {3} bytes ({4} bytes as sequences)."),
+                contactLog.numFrames(), contactLog.filename(), contactLog.numEvents(), contactLog.fileSize(),
+                (uint64_t)contactLog.numFrames() * numLinks * sizeof(double)));
+
+    const string filename = contactLog.filename();
+    if(isCompressedLogExpanded && numLinks > 0 && contactLog.openForReading(filename)) {
+        // The sequences take a double per link per frame, so a long log is expanded only
+        // for its last frames that fit in the limit
+        const int numFrames = contactLog.numFrames();
+        const uint64_t maxFrames = (uint64_t)expansionLimit * 1000000 / (numLinks * sizeof(double));
+        int beginFrame = 0;
+        if((uint64_t)numFrames > maxFrames) {
+            beginFrame = numFrames - (int)maxFrames;
+            MessageView::instance()->putln(
+                formatR(_("Only the last {0:.1f} s of the {1:.1f} s contact log are expanded within {2} MB. "
+                          "The whole log remains in \"{3}\"."),
+                        maxFrames / contactLog.frameRate(), numFrames / contactLog.frameRate(),
+                        expansionLimit, filename), MessageView::Warning);
+        }
+        for(int i = 0; i < contactLog.numBodies(); ++i) {
+            MultiValueSeqItem* collisionStateSeqItem = new MultiValueSeqItem;
+            collisionStateSeqItem->setName(contactLog.bodyName(i) + suffix);
+            contactLog.expand(i, *collisionStateSeqItem->seq(), beginFrame);
+            self->addSubItem(collisionStateSeqItem);
+            collisionStateSeqItems.push_back(collisionStateSeqItem);
+        }
+        contactLog.close();
+    }
+}
+
+
 void CollisionSeqLoggerItem::Impl::onPostDynamics()
 {
     int currentFrame = simulatorItem->currentFrame();
-    for(size_t i = 0; i < bodies.size(); ++i) {
+    if(contactLog.isWriting()) {
+        for(size_t i = 0; i < bodies.size(); ++i) {
+            Body* body = bodies[i];
+            for(int j = 0; j < body->numLinks(); ++j) {
+                contactLog.setContact(i, j, !body->link(j)->contactPoints().empty());
+            }
+        }
+        contactLog.commitFrame();
+    }
+    for(size_t i = 0; i < collisionStateSeqItems.size(); ++i) {
         Body* body = bodies[i];
         shared_ptr<MultiValueSeq> log = collisionStateSeqItems[i]->seq();
         auto frame = log->appendFrame();
@@ -202,12 +355,8 @@ void CollisionSeqLoggerItem::Impl::onPostDynamics()
         }
     }
 
-    for(auto& sensor : sensors) {
-        Link* link = sensor->link();
-        auto& contacts = link->contactPoints();
-        sensor->on(!contacts.empty());
-        sensor->notifyStateChange();
-    }
+    // Only the sensors whose states change are notified
+    sensorNotifier.update();
 }
 
 
@@ -222,6 +371,11 @@ void CollisionSeqLoggerItem::doPutProperties(PutPropertyFunction& putProperty)
     SubSimulatorItem::doPutProperties(putProperty);
     putProperty(_("Target bodies"), impl->bodyNameListString,
                 [&](const string& names){ return updateNames(names, impl->bodyNameListString, impl->bodyNames); });
+    putProperty.min(0)(_("Debounce steps"), impl->debounceSteps, changeProperty(impl->debounceSteps));
+    putProperty(_("Compressed log"), impl->isLogCompressed, changeProperty(impl->isLogCompressed));
+    putProperty(_("Expand compressed log"), impl->isCompressedLogExpanded,
+                changeProperty(impl->isCompressedLogExpanded));
+    putProperty.min(1)(_("Expansion limit [MB]"), impl->expansionLimit, changeProperty(impl->expansionLimit));
 }
 
 
@@ -231,6 +385,10 @@ bool CollisionSeqLoggerItem::store(Archive& archive)
         return false;
     }
     writeElements(archive, "target_bodies", impl->bodyNames, true);
+    archive.write("debounce_steps", impl->debounceSteps);
+    archive.write("compressed_log", impl->isLogCompressed);
+    archive.write("expand_compressed_log", impl->isCompressedLogExpanded);
+    archive.write("expansion_limit", impl->expansionLimit);
     return true;
 }
 
@@ -242,5 +400,9 @@ bool CollisionSeqLoggerItem::restore(const Archive& archive)
     }
     readElements(archive, "target_bodies", impl->bodyNames);
     impl->bodyNameListString = getNameListString(impl->bodyNames);
+    archive.read("debounce_steps", impl->debounceSteps);
+    archive.read("compressed_log", impl->isLogCompressed);
+    archive.read("expand_compressed_log", impl->isCompressedLogExpanded);
+    archive.read("expansion_limit", impl->expansionLimit);
     return true;
 }
\ No newline at end of file
@@ -9,6 +9,8 @@
 
 namespace cnoid {
 
+class PassiveMarker;
+
 class CollisionSeqLoggerItem : public SubSimulatorItem
 {
 public:
@@ -18,6 +20,10 @@ public:
 
     static void initializeClass(ExtensionManager* ext);
     virtual bool initializeSimulation(SimulatorItem* simulatorItem) override;
+    virtual void finalizeSimulation() override;
+
+    // Returns how many times the sensor has been switched in the simulation, or -1 for an unknown sensor
+    int numTransitions(PassiveMarker* sensor) const;
 
 protected:
     virtual Item* doCloneItem(CloneMap* cloneMap) const override;
@@ -3,14 +3,36 @@
 */
 
 #include "CollisionVisualizerItem.h"
-#include <cnoid/CollisionLinkPair>
+#include <cnoid/Archive>
+#include <cnoid/Body>
 #include <cnoid/ExtensionManager>
+#include <cnoid/Format>
 #include <cnoid/ItemManager>
+#include <cnoid/LazyCaller>
+#include <cnoid/PutPropertyFunction>
+#include <cnoid/SceneDrawables>
+#include <cnoid/SimulatorItem>
+#include <algorithm>
+#include <mutex>
+#include <vector>
 #include "gettext.h"
 
 using namespace std;
 using namespace cnoid;
 
+namespace {
+
+struct Contact
+{
+    Vector3f position;
+    Vector3f normal;
+};
+
+const Vector3f PointColor(1.0f, 0.2f, 0.2f);
+const Vector3f NormalColor(1.0f, 0.8f, 0.0f);
+
+}
+
 namespace cnoid {
 
 class CollisionVisualizerItem::Impl
@@ -21,6 +43,36 @@ public:
     Impl(CollisionVisualizerItem* self);
     Impl(CollisionVisualizerItem* self, const Impl& org);
     ~Impl();
+
+    SimulatorItem* simulatorItem;
+    vector<Body*> bodies;
+
+    int maxContacts;
+    int decimation;
+    int numHistoryFrames;
+    double pointSize;
+    double normalLength;
+
+    // The frame captured by the simulation thread, which the main thread takes when it draws
+    mutex contactMutex;
+    vector<Contact> pendingContacts;
+    bool isUpdatePending;
+    int stepCount;
+    int numDetectedContacts;
+    int numDrawnContacts;
+
+    // The frames drawn, of which the older ones fade out
+    vector<vector<Contact>> history;
+    int historyHead;
+
+    SgGroupPtr scene;
+    SgPointSetPtr pointSet;
+    SgLineSetPtr lineSet;
+
+    void createScene();
+    bool initializeSimulation(SimulatorItem* simulatorItem);
+    void onPostDynamics();
+    void updateScene();
 };
 
 }
@@ -29,13 +81,13 @@ public:
 void CollisionVisualizerItem::initializeClass(ExtensionManager* ext)
 {
     ItemManager& im = ext->itemManager();
-    im.registerClass<CollisionVisualizerItem, CollisionDetectionControllerItem>(N_("CollisionVisualizerItem"));
+    im.registerClass<CollisionVisualizerItem, SubSimulatorItem>(N_("CollisionVisualizerItem"));
     im.addCreationPanel<CollisionVisualizerItem>();
 }
 
 
 CollisionVisualizerItem::CollisionVisualizerItem()
-    : CollisionDetectionControllerItem()
+    : SubSimulatorItem()
 {
     impl = new Impl(this);
 }
@@ -44,12 +96,27 @@ CollisionVisualizerItem::CollisionVisualizerItem()
 CollisionVisualizerItem::Impl::Impl(CollisionVisualizerItem* self)
     : self(self)
 {
-
+    simulatorItem = nullptr;
+    bodies.clear();
+
+    maxContacts = 2000;
+    decimation = 10;
+    numHistoryFrames = 10;
+    pointSize = 5.0;
+    normalLength = 0.05;
+
+    pendingContacts.clear();
+    isUpdatePending = false;
+    stepCount = 0;
+    numDetectedContacts = 0;
+    numDrawnContacts = 0;
+    history.clear();
+    historyHead = 0;
 }
 
 
 CollisionVisualizerItem::CollisionVisualizerItem(const CollisionVisualizerItem& org)
-    : CollisionDetectionControllerItem(org),
+    : SubSimulatorItem(org),
       impl(new Impl(this, *org.impl))
 {
 
@@ -57,9 +124,13 @@ CollisionVisualizerItem::CollisionVisualizerItem(const CollisionVisualizerItem&
 
 
 CollisionVisualizerItem::Impl::Impl(CollisionVisualizerItem* self, const Impl& org)
-    : self(self)
+    : Impl(self)
 {
-
+    maxContacts = org.maxContacts;
+    decimation = org.decimation;
+    numHistoryFrames = org.numHistoryFrames;
+    pointSize = org.pointSize;
+    normalLength = org.normalLength;
 }
 
 
@@ -75,85 +146,229 @@ CollisionVisualizerItem::Impl::~Impl()
 }
 
 
-bool CollisionVisualizerItem::initialize(ControllerIO* io)
+SgNode* CollisionVisualizerItem::getScene()
 {
-    if(!CollisionDetectionControllerItem::initialize(io)) {
-        return false;
+    if(!impl->scene) {
+        impl->createScene();
     }
-    return true;
+    return impl->scene;
 }
 
 
-bool CollisionVisualizerItem::start()
+void CollisionVisualizerItem::Impl::createScene()
 {
-    if(!CollisionDetectionControllerItem::start()) {
-        return false;
-    }
-    return true;
+    scene = new SgGroup;
+
+    pointSet = new SgPointSet;
+    pointSet->getOrCreateVertices();
+    pointSet->getOrCreateColors();
+    pointSet->setPointSize(pointSize);
+    scene->addChild(pointSet);
+
+    lineSet = new SgLineSet;
+    lineSet->getOrCreateVertices();
+    lineSet->getOrCreateColors();
+    scene->addChild(lineSet);
 }
 
 
-void CollisionVisualizerItem::input()
+bool CollisionVisualizerItem::initializeSimulation(SimulatorItem* simulatorItem)
 {
-    CollisionDetectionControllerItem::input();
+    return impl->initializeSimulation(simulatorItem);
 }
 
 
-bool CollisionVisualizerItem::control()
+bool CollisionVisualizerItem::Impl::initializeSimulation(SimulatorItem* simulatorItem)
 {
-    if(!CollisionDetectionControllerItem::control()) {
-        return false;
+    this->simulatorItem = simulatorItem;
+    bodies.clear();
+
+    const vector<SimulationBody*>& simBodies = simulatorItem->simulationBodies();
+    for(auto& simBody : simBodies) {
+        Body* body = simBody->body();
+        if(!body->isStaticModel()) {
+            bodies.push_back(body);
+            for(int i = 0; i < body->numLinks(); ++i) {
+                Link* link = body->link(i);
+                link->mergeSensingMode(Link::LinkContactState);
+            }
+        }
     }
+
+    {
+        lock_guard<mutex> lock(contactMutex);
+        // The buffers are reserved for the budget, so drawing a frame does not allocate them again
+        pendingContacts.clear();
+        pendingContacts.reserve(maxContacts);
+        history.resize(std::max(numHistoryFrames, 1));
+        for(auto& frame : history) {
+            frame.clear();
+            frame.reserve(maxContacts);
+        }
+        historyHead = 0;
+        isUpdatePending = false;
+        stepCount = 0;
+        numDetectedContacts = 0;
+        numDrawnContacts = 0;
+    }
+
+    if(!scene) {
+        createScene();
+    }
+    updateScene();
+
+    if(bodies.size()) {
+        simulatorItem->addPostDynamicsFunction([&](){ onPostDynamics(); });
+    }
+
     return true;
 }
 
 
-void CollisionVisualizerItem::output()
+void CollisionVisualizerItem::Impl::onPostDynamics()
 {
-    CollisionDetectionControllerItem::output();
-}
+    if(++stepCount < decimation) {
+        return;
+    }
+    stepCount = 0;
 
+    lock_guard<mutex> lock(contactMutex);
 
-void CollisionVisualizerItem::stop()
-{
-    CollisionDetectionControllerItem::stop();
+    int numContacts = 0;
+    for(auto& body : bodies) {
+        for(int i = 0; i < body->numLinks(); ++i) {
+            numContacts += body->link(i)->contactPoints().size();
+        }
+    }
+    numDetectedContacts = numContacts;
+
+    // Every n-th contact is taken when the contacts exceed the budget, so they are thinned evenly
+    const int stride = numContacts > maxContacts ? (numContacts + maxContacts - 1) / maxContacts : 1;
+    pendingContacts.clear();
+    int index = 0;
+    for(auto& body : bodies) {
+        for(int i = 0; i < body->numLinks(); ++i) {
+            for(auto& point : body->link(i)->contactPoints()) {
+                if(index++ % stride == 0) {
+                    pendingContacts.push_back(Contact{ point.position().cast<float>(), point.normal().cast<float>() });
+                }
+            }
+        }
+    }
+
+    // A frame that the main thread has not drawn yet is replaced, so at most one update is queued.
+    // The queued update holds the item so that it is not deleted before the update.
+    if(!isUpdatePending) {
+        isUpdatePending = true;
+        CollisionVisualizerItemPtr item = self;
+        callLater([item](){ item->impl->updateScene(); });
+    }
 }
 
 
-Item* CollisionVisualizerItem::doCloneItem(CloneMap* cloneMap) const
+void CollisionVisualizerItem::Impl::updateScene()
 {
-    return new CollisionVisualizerItem(*this);
+    const int numFrames = history.size();
+    {
+        lock_guard<mutex> lock(contactMutex);
+        if(isUpdatePending && numFrames > 0) {
+            historyHead = (historyHead + 1) % numFrames;
+            history[historyHead].swap(pendingContacts);
+            numDrawnContacts = history[historyHead].size();
+            isUpdatePending = false;
+        }
+    }
+    if(!scene) {
+        return;
+    }
+
+    int numPoints = 0;
+    for(auto& frame : history) {
+        numPoints += frame.size();
+    }
+    const bool hasNormals = normalLength > 0.0;
+    const int numLineVertices = hasNormals ? numPoints * 2 : 0;
+
+    // All the contacts are a point set and a line set, whose arrays are rewritten in place
+    SgVertexArray& points = *pointSet->vertices();
+    SgColorArray& pointColors = *pointSet->colors();
+    points.resize(numPoints);
+    pointColors.resize(numPoints);
+    SgVertexArray& lineVertices = *lineSet->vertices();
+    SgColorArray& lineColors = *lineSet->colors();
+    SgIndexArray& lineIndices = lineSet->lineVertexIndices();
+    lineVertices.resize(numLineVertices);
+    lineColors.resize(numLineVertices);
+    lineIndices.resize(numLineVertices);
+
+    int index = 0;
+    for(int age = 0; age < numFrames; ++age) {
+        const float fade = 1.0f - (float)age / numFrames;
+        const Vector3f pointColor = PointColor * fade;
+        const Vector3f normalColor = NormalColor * fade;
+        for(auto& contact : history[(historyHead - age + numFrames) % numFrames]) {
+            points[index] = contact.position;
+            pointColors[index] = pointColor;
+            if(hasNormals) {
+                const int i = index * 2;
+                lineVertices[i] = contact.position;
+                lineVertices[i + 1] = contact.position + contact.normal * normalLength;
+                lineColors[i] = lineColors[i + 1] = normalColor;
+                lineIndices[i] = i;
+                lineIndices[i + 1] = i + 1;
+            }
+            ++index;
+        }
+    }
+
+    pointSet->setPointSize(pointSize);
+    pointSet->vertices()->notifyUpdate();
+    lineSet->vertices()->notifyUpdate();
 }
 
 
-void CollisionVisualizerItem::onCollisionsDetected(const vector<CollisionLinkPair>& collisions)
+Item* CollisionVisualizerItem::doCloneItem(CloneMap* cloneMap) const
 {
-    for(auto& collision : collisions) {
-        Link* link1 = collision.link(0);
-        Link* link2 = collision.link(1);
-    }
+    return new CollisionVisualizerItem(*this);
 }
 
 
 void CollisionVisualizerItem::doPutProperties(PutPropertyFunction& putProperty)
 {
-    CollisionDetectionControllerItem::doPutProperties(putProperty);
+    SubSimulatorItem::doPutProperties(putProperty);
+    putProperty.min(1)(_("Max contacts per frame"), impl->maxContacts, changeProperty(impl->maxContacts));
+    putProperty.min(1)(_("Decimation"), impl->decimation, changeProperty(impl->decimation));
+    putProperty.min(1)(_("History frames"), impl->numHistoryFrames, changeProperty(impl->numHistoryFrames));
+    putProperty.min(1.0)(_("Point size"), impl->pointSize, changeProperty(impl->pointSize));
+    putProperty.min(0.0)(_("Normal length [m]"), impl->normalLength, changeProperty(impl->normalLength));
+    lock_guard<mutex> lock(impl->contactMutex);
+    putProperty(_("Contacts"), formatR(_("{0} drawn of {1}"), impl->numDrawnContacts, impl->numDetectedContacts));
 }
 
 
 bool CollisionVisualizerItem::store(Archive& archive)
 {
-    if(!CollisionDetectionControllerItem::store(archive)) {
+    if(!SubSimulatorItem::store(archive)) {
         return false;
     }
+    archive.write("max_contacts", impl->maxContacts);
+    archive.write("decimation", impl->decimation);
+    archive.write("history_frames", impl->numHistoryFrames);
+    archive.write("point_size", impl->pointSize);
+    archive.write("normal_length", impl->normalLength);
     return true;
 }
 
 
 bool CollisionVisualizerItem::restore(const Archive& archive)
 {
-    if(!CollisionDetectionControllerItem::restore(archive)) {
+    if(!SubSimulatorItem::restore(archive)) {
         return false;
     }
+    archive.read("max_contacts", impl->maxContacts);
+    archive.read("decimation", impl->decimation);
+    archive.read("history_frames", impl->numHistoryFrames);
+    archive.read("point_size", impl->pointSize);
+    archive.read("normal_length", impl->normalLength);
     return true;
-}
\ No newline at end of file
+}
@@ -5,14 +5,15 @@
 #ifndef CNOID_MOTION_CAPTURE_PLUGIN_MARKER_COLLISION_VISUALIZER_ITEM_H
 #define CNOID_MOTION_CAPTURE_PLUGIN_MARKER_COLLISION_VISUALIZER_ITEM_H
 
-#include <cnoid/CollisionDetectionControllerItem>
+#include <cnoid/RenderableItem>
+#include <cnoid/SubSimulatorItem>
 #include "exportdecl.h"
 
 namespace cnoid {
 
 class ExtensionManager;
 
-class CNOID_EXPORT CollisionVisualizerItem : public CollisionDetectionControllerItem
+class CNOID_EXPORT CollisionVisualizerItem : public SubSimulatorItem, public RenderableItem
 {
 public:
     static void initializeClass(ExtensionManager* ext);
@@ -21,16 +22,11 @@ public:
     CollisionVisualizerItem(const CollisionVisualizerItem& org);
     virtual ~CollisionVisualizerItem();
 
-    virtual bool initialize(ControllerIO* io) override;
-    virtual bool start() override;
-    virtual void input() override;
-    virtual bool control() override;
-    virtual void output() override;
-    virtual void stop() override;
+    virtual bool initializeSimulation(SimulatorItem* simulatorItem) override;
+    virtual SgNode* getScene() override;
 
 protected:
     virtual Item* doCloneItem(CloneMap* cloneMap) const override;
-    virtual void onCollisionsDetected(const std::vector<CollisionLinkPair>& collisions);
     virtual void doPutProperties(PutPropertyFunction& putProperty) override;
     virtual bool store(Archive& archive) override;
     virtual bool restore(const Archive& archive) override;
@@ -44,4 +40,4 @@ typedef ref_ptr<CollisionVisualizerItem> CollisionVisualizerItemPtr;
 
 }
 
-#endif // CNOID_MOTION_CAPTURE_PLUGIN_MARKER_COLLISION_VISUALIZER_ITEM_H
\ No newline at end of file
+#endif // CNOID_MOTION_CAPTURE_PLUGIN_MARKER_COLLISION_VISUALIZER_ITEM_H
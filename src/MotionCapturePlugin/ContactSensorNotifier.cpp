@@ -0,0 +1,57 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "ContactSensorNotifier.h"
+#include <cnoid/Link>
+
+using namespace std;
+using namespace cnoid;
+
+
+ContactSensorNotifier::ContactSensorNotifier()
+{
+    states.clear();
+    debounceSteps_ = 0;
+    numTransitions_ = 0;
+    numSteps_ = 0;
+}
+
+
+void ContactSensorNotifier::setSensors(const vector<PassiveMarker*>& sensors)
+{
+    clear();
+    for(auto& sensor : sensors) {
+        states.push_back(SensorState{ sensor, 0, 0 });
+    }
+}
+
+
+void ContactSensorNotifier::clear()
+{
+    states.clear();
+    numTransitions_ = 0;
+    numSteps_ = 0;
+}
+
+
+int ContactSensorNotifier::update()
+{
+    int numNotified = 0;
+    for(auto& state : states) {
+        PassiveMarker* sensor = state.sensor;
+        const bool isInContact = !sensor->link()->contactPoints().empty();
+        if(isInContact == sensor->on()) {
+            state.pendingSteps = 0;
+        } else if(++state.pendingSteps > debounceSteps_) {
+            state.pendingSteps = 0;
+            sensor->on(isInContact);
+            sensor->notifyStateChange();
+            ++state.numTransitions;
+            ++numNotified;
+        }
+    }
+    numTransitions_ += numNotified;
+    ++numSteps_;
+    return numNotified;
+}
@@ -0,0 +1,52 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#ifndef CNOID_MOTION_CAPTURE_PLUGIN_CONTACT_SENSOR_NOTIFIER_H
+#define CNOID_MOTION_CAPTURE_PLUGIN_CONTACT_SENSOR_NOTIFIER_H
+
+#include <cstdint>
+#include <vector>
+#include "PassiveMarker.h"
+
+namespace cnoid {
+
+// Turns contact sensors on and off by the contacts of their links and notifies a sensor only when
+// its state changes. With debouncing, a new state has to last for more than the given number of
+// steps before the sensor follows it, so a chattering contact does not flood the handlers.
+class ContactSensorNotifier
+{
+public:
+    ContactSensorNotifier();
+
+    void setSensors(const std::vector<PassiveMarker*>& sensors);
+    void clear();
+    void setDebounceSteps(int steps) { debounceSteps_ = steps; }
+    int debounceSteps() const { return debounceSteps_; }
+
+    // Returns the number of sensors notified
+    int update();
+
+    int numSensors() const { return (int)states.size(); }
+    PassiveMarker* sensor(int index) const { return states[index].sensor; }
+    int numTransitions(int index) const { return states[index].numTransitions; }
+    uint64_t numTransitions() const { return numTransitions_; }
+    uint64_t numSteps() const { return numSteps_; }
+
+private:
+    struct SensorState
+    {
+        PassiveMarkerPtr sensor;
+        int pendingSteps; // since the contact has differed from the state of the sensor
+        int numTransitions;
+    };
+
+    std::vector<SensorState> states;
+    int debounceSteps_;
+    uint64_t numTransitions_;
+    uint64_t numSteps_;
+};
+
+}
+
+#endif // CNOID_MOTION_CAPTURE_PLUGIN_CONTACT_SENSOR_NOTIFIER_H
@@ -0,0 +1,345 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "ContactStateLog.h"
+#include <cnoid/MultiValueSeq>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+// file header: magic(4) + version(4) + frame rate(8) + number of bodies(4),
+//   then for each body: name length(4), name, number of links(4)
+// event record, all in unsigned LEB128:
+//   frames since the last event, body index, number of toggled links, link indices as differences
+// end record: frames since the last event, number of bodies
+const char Magic[4] = { 'C', 'S', 'L', 'G' };
+const uint32_t Version = 1;
+
+// The events are written when this many bytes have been buffered
+const size_t FlushSize = 65536;
+
+template<typename T> void append(vector<char>& buf, const T& value)
+{
+    const char* p = reinterpret_cast<const char*>(&value);
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+void appendVarint(vector<char>& buf, uint64_t value)
+{
+    while(value >= 0x80) {
+        buf.push_back((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buf.push_back((char)value);
+}
+
+template<typename T> bool extract(const vector<char>& buf, size_t& pos, T& value)
+{
+    if(pos + sizeof(T) > buf.size()) {
+        return false;
+    }
+    memcpy(&value, &buf[pos], sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+bool extractVarint(const vector<char>& buf, size_t& pos, uint64_t& value)
+{
+    value = 0;
+    for(int shift = 0; shift < 64 && pos < buf.size(); shift += 7) {
+        const uint8_t byte = buf[pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+
+ContactStateLog::ContactStateLog()
+{
+    filename_.clear();
+    isWriting_ = false;
+    isReading_ = false;
+    frameRate_ = 0.0;
+    bodies.clear();
+    numFrames_ = 0;
+    lastEventFrame = 0;
+    numEvents_ = 0;
+    fileSize_ = 0;
+}
+
+
+ContactStateLog::~ContactStateLog()
+{
+    close();
+}
+
+
+bool ContactStateLog::openForWriting(const string& filename, double frameRate,
+                                     const vector<string>& bodyNames, const vector<int>& numLinks)
+{
+    close();
+
+    stream.open(filename.c_str(), ios_base::out | ios_base::binary | ios_base::trunc);
+    if(!stream.is_open()) {
+        return false;
+    }
+    filename_ = filename;
+    isWriting_ = true;
+    frameRate_ = frameRate;
+    numFrames_ = 0;
+    lastEventFrame = 0;
+    numEvents_ = 0;
+
+    bodies.resize(bodyNames.size());
+    for(size_t i = 0; i < bodies.size(); ++i) {
+        BodyState& body = bodies[i];
+        body.name = bodyNames[i];
+        body.numLinks = numLinks[i];
+        body.current.assign((body.numLinks + 63) / 64, 0);
+        body.previous = body.current;
+    }
+
+    buffer.clear();
+    buffer.insert(buffer.end(), Magic, Magic + sizeof(Magic));
+    append(buffer, Version);
+    append(buffer, frameRate_);
+    append(buffer, (uint32_t)bodies.size());
+    for(auto& body : bodies) {
+        append(buffer, (uint32_t)body.name.size());
+        buffer.insert(buffer.end(), body.name.begin(), body.name.end());
+        append(buffer, (uint32_t)body.numLinks);
+    }
+    flush();
+    return stream.good();
+}
+
+
+void ContactStateLog::setContact(int body, int link, bool on)
+{
+    uint64_t& word = bodies[body].current[link >> 6];
+    const uint64_t bit = (uint64_t)1 << (link & 63);
+    if(on) {
+        word |= bit;
+    } else {
+        word &= ~bit;
+    }
+}
+
+
+void ContactStateLog::commitFrame()
+{
+    for(size_t i = 0; i < bodies.size(); ++i) {
+        BodyState& body = bodies[i];
+        toggledLinks.clear();
+        for(size_t j = 0; j < body.current.size(); ++j) {
+            uint64_t changes = body.current[j] ^ body.previous[j];
+            for(int k = 0; changes; ++k, changes >>= 1) {
+                if(changes & 1) {
+                    toggledLinks.push_back(j * 64 + k);
+                }
+            }
+        }
+        if(toggledLinks.empty()) {
+            continue;
+        }
+        appendVarint(buffer, numFrames_ - lastEventFrame);
+        appendVarint(buffer, i);
+        appendVarint(buffer, toggledLinks.size());
+        int lastLink = 0;
+        for(auto& link : toggledLinks) {
+            appendVarint(buffer, link - lastLink);
+            lastLink = link;
+        }
+        lastEventFrame = numFrames_;
+        body.previous = body.current;
+        ++numEvents_;
+    }
+    ++numFrames_;
+
+    if(buffer.size() >= FlushSize) {
+        flush();
+    }
+}
+
+
+void ContactStateLog::flush()
+{
+    stream.write(buffer.data(), buffer.size());
+    buffer.clear();
+    fileSize_ = stream.tellp();
+}
+
+
+bool ContactStateLog::openForReading(const string& filename)
+{
+    close();
+
+    stream.open(filename.c_str(), ios_base::in | ios_base::binary);
+    if(!stream.is_open()) {
+        return false;
+    }
+    stream.seekg(0, ios_base::end);
+    fileSize_ = stream.tellg();
+    stream.seekg(0, ios_base::beg);
+    buffer.resize(fileSize_);
+    stream.read(buffer.data(), buffer.size());
+    stream.close();
+
+    size_t pos = 0;
+    uint32_t version = 0;
+    uint32_t numBodies = 0;
+    if(fileSize_ < sizeof(Magic) || memcmp(buffer.data(), Magic, sizeof(Magic)) != 0) {
+        buffer.clear();
+        return false;
+    }
+    pos += sizeof(Magic);
+    if(!extract(buffer, pos, version) || version != Version
+       || !extract(buffer, pos, frameRate_) || !extract(buffer, pos, numBodies)) {
+        buffer.clear();
+        return false;
+    }
+    bodies.resize(numBodies);
+    for(auto& body : bodies) {
+        uint32_t nameLength = 0;
+        uint32_t numLinks = 0;
+        if(!extract(buffer, pos, nameLength) || pos + nameLength > buffer.size()) {
+            buffer.clear();
+            return false;
+        }
+        body.name.assign(&buffer[pos], nameLength);
+        pos += nameLength;
+        if(!extract(buffer, pos, numLinks)) {
+            buffer.clear();
+            return false;
+        }
+        body.numLinks = numLinks;
+    }
+    // Only the events are kept
+    buffer.erase(buffer.begin(), buffer.begin() + pos);
+
+    filename_ = filename;
+    isReading_ = scan();
+    if(!isReading_) {
+        buffer.clear();
+    }
+    return isReading_;
+}
+
+
+// Counts the events and the frames, which the end record gives
+bool ContactStateLog::scan()
+{
+    size_t pos = 0;
+    uint64_t frame = 0;
+    numEvents_ = 0;
+    while(true) {
+        uint64_t delta, body, numToggles, link;
+        if(!extractVarint(buffer, pos, delta) || !extractVarint(buffer, pos, body)) {
+            return false;
+        }
+        frame += delta;
+        if(body == bodies.size()) {
+            break;
+        }
+        if(body > bodies.size() || !extractVarint(buffer, pos, numToggles)) {
+            return false;
+        }
+        for(uint64_t i = 0; i < numToggles; ++i) {
+            if(!extractVarint(buffer, pos, link)) {
+                return false;
+            }
+        }
+        ++numEvents_;
+    }
+    numFrames_ = frame;
+    return true;
+}
+
+
+void ContactStateLog::close()
+{
+    if(isWriting_) {
+        appendVarint(buffer, numFrames_ - lastEventFrame);
+        appendVarint(buffer, bodies.size());
+        flush();
+        stream.close();
+        isWriting_ = false;
+    }
+    if(isReading_) {
+        buffer.clear();
+        isReading_ = false;
+    }
+}
+
+
+size_t ContactStateLog::memorySize() const
+{
+    size_t size = buffer.capacity() + toggledLinks.capacity() * sizeof(int);
+    for(auto& body : bodies) {
+        size += sizeof(BodyState) + (body.current.capacity() + body.previous.capacity()) * sizeof(uint64_t);
+    }
+    return size;
+}
+
+
+bool ContactStateLog::expand(int body, MultiValueSeq& seq, int beginFrame, int endFrame)
+{
+    if(!isReading_ || body < 0 || body >= (int)bodies.size()) {
+        return false;
+    }
+    if(endFrame < 0 || endFrame > numFrames_) {
+        endFrame = numFrames_;
+    }
+    beginFrame = std::min(std::max(beginFrame, 0), endFrame);
+    const int numLinks = bodies[body].numLinks;
+    seq.setNumParts(numLinks);
+    seq.setFrameRate(frameRate_);
+    seq.setNumFrames(endFrame - beginFrame);
+    seq.setOffsetTime(beginFrame / frameRate_);
+
+    // The events before the range are replayed only to know the states at its beginning
+    vector<double> states(numLinks, 0.0);
+    auto fill = [&](int begin, int end) {
+        begin = std::max(begin, beginFrame);
+        end = std::min(end, endFrame);
+        for(int i = begin; i < end; ++i) {
+            auto frame = seq.frame(i - beginFrame);
+            for(int j = 0; j < numLinks; ++j) {
+                frame[j] = states[j];
+            }
+        }
+    };
+
+    size_t pos = 0;
+    int frame = 0;
+    while(true) {
+        uint64_t delta, index, numToggles, link;
+        extractVarint(buffer, pos, delta);
+        extractVarint(buffer, pos, index);
+        fill(frame, frame + delta);
+        frame += delta;
+        if(index == bodies.size() || frame >= endFrame) {
+            break;
+        }
+        extractVarint(buffer, pos, numToggles);
+        int lastLink = 0;
+        for(uint64_t i = 0; i < numToggles; ++i) {
+            extractVarint(buffer, pos, link);
+            lastLink += link;
+            if((int)index == body && lastLink < numLinks) {
+                states[lastLink] = states[lastLink] != 0.0 ? 0.0 : 1.0;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#ifndef CNOID_MOTION_CAPTURE_PLUGIN_CONTACT_STATE_LOG_H
+#define CNOID_MOTION_CAPTURE_PLUGIN_CONTACT_STATE_LOG_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace cnoid {
+
+class MultiValueSeq;
+
+// Records the contact states of the links of bodies as change events. The states of a body are
+// kept as a bitset, and a frame only writes the links whose states differ from the last frame,
+// so a log of mostly unchanged states takes a few bytes per transition instead of a value per
+// link per frame. The events are streamed to the file as they are recorded, and a log that has
+// been read is expanded back to a MultiValueSeq of 0 and 1 for each body.
+class ContactStateLog
+{
+public:
+    ContactStateLog();
+    ~ContactStateLog();
+
+    bool openForWriting(const std::string& filename, double frameRate,
+                        const std::vector<std::string>& bodyNames, const std::vector<int>& numLinks);
+    void setContact(int body, int link, bool on);
+    // Writes the changes since the last frame and starts the next one
+    void commitFrame();
+    bool openForReading(const std::string& filename);
+    void close();
+
+    bool isWriting() const { return isWriting_; }
+    bool isReading() const { return isReading_; }
+    const std::string& filename() const { return filename_; }
+
+    double frameRate() const { return frameRate_; }
+    int numBodies() const { return (int)bodies.size(); }
+    const std::string& bodyName(int body) const { return bodies[body].name; }
+    int numLinks(int body) const { return bodies[body].numLinks; }
+    int numFrames() const { return numFrames_; }
+    uint64_t numEvents() const { return numEvents_; }
+    uint64_t fileSize() const { return fileSize_; }
+    // Bytes held while writing, which do not grow with the number of frames
+    size_t memorySize() const;
+
+    // Expands the frames from beginFrame to endFrame (the last frame for -1) of the body, so
+    // that a part of a long log can be expanded without holding a value per link per frame
+    bool expand(int body, MultiValueSeq& seq, int beginFrame = 0, int endFrame = -1);
+
+private:
+    struct BodyState
+    {
+        std::string name;
+        int numLinks;
+        std::vector<uint64_t> current;
+        std::vector<uint64_t> previous;
+    };
+
+    void flush();
+    bool scan();
+
+    std::fstream stream;
+    std::string filename_;
+    bool isWriting_;
+    bool isReading_;
+    double frameRate_;
+    std::vector<BodyState> bodies;
+    int numFrames_;
+    int lastEventFrame;
+    uint64_t numEvents_;
+    uint64_t fileSize_;
+    std::vector<char> buffer;
+    std::vector<int> toggledLinks;
+};
+
+}
+
+#endif // CNOID_MOTION_CAPTURE_PLUGIN_CONTACT_STATE_LOG_H
@@ -0,0 +1,378 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "MarkerCaptureBuffer.h"
+#include <cnoid/Format>
+#include <cnoid/MultiSE3Seq>
+#include <algorithm>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+// Binary file header: magic(4) + version(4) + number of markers(4),
+//   then for each marker: name length(4), name, color(4)
+// Binary frame record: time(8), then for each marker: on(1), position(4 * 3), rotation(4 * 4)
+const char Magic[4] = { 'M', 'C', 'A', 'P' };
+const uint32_t Version = 1;
+
+// The header of a PCD file is written before the number of its points is known,
+// so the number is written with a fixed width and overwritten when the file is closed
+const int CountWidth = 12;
+
+// The writer takes at most this many frames from the ring at a time
+const uint64_t ChunkFrames = 256;
+
+template<typename T> void append(vector<char>& buf, const T& value)
+{
+    const char* p = reinterpret_cast<const char*>(&value);
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+template<typename T> bool read(istream& is, T& value)
+{
+    return (bool)is.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+uint32_t packColor(const Vector3& color)
+{
+    uint32_t rgb = 0;
+    for(int i = 0; i < 3; ++i) {
+        const double c = std::min(std::max(color[i], 0.0), 1.0);
+        rgb = (rgb << 8) | (uint32_t)(c * 255.0 + 0.5);
+    }
+    return rgb;
+}
+
+}
+
+
+void MarkerCaptureBuffer::Sample::set(const Vector3& p, const Matrix3& R)
+{
+    const Quaternion q(R);
+    for(int i = 0; i < 3; ++i) {
+        position[i] = p[i];
+    }
+    rotation[0] = q.w();
+    rotation[1] = q.x();
+    rotation[2] = q.y();
+    rotation[3] = q.z();
+}
+
+
+Matrix3 MarkerCaptureBuffer::Sample::R() const
+{
+    return Quaternion(rotation[0], rotation[1], rotation[2], rotation[3]).normalized().toRotationMatrix();
+}
+
+
+MarkerCaptureBuffer::MarkerCaptureBuffer()
+{
+    capacity_ = 1000;
+    numMarkers_ = 0;
+    format = NoFile;
+    numPoints = 0;
+    countOffsets[0] = countOffsets[1] = 0;
+    fileSize_ = 0;
+    isRunning = false;
+    numPushedFrames_ = 0;
+    numWrittenFrames = 0;
+    numStalledFrames_ = 0;
+}
+
+
+MarkerCaptureBuffer::~MarkerCaptureBuffer()
+{
+    stop();
+}
+
+
+void MarkerCaptureBuffer::setCapacity(int numFrames)
+{
+    capacity_ = std::max(numFrames, 1);
+}
+
+
+bool MarkerCaptureBuffer::start(const vector<string>& names, const vector<Vector3>& colors,
+                                FileFormat format, const string& filename)
+{
+    stop();
+
+    numMarkers_ = names.size();
+    this->names = names;
+    colors_.clear();
+    for(auto& color : colors) {
+        colors_.push_back(packColor(color));
+    }
+    times.assign(capacity_, 0.0);
+    samples_.assign((size_t)capacity_ * numMarkers_, Sample());
+    numPushedFrames_ = 0;
+    numWrittenFrames = 0;
+    numStalledFrames_ = 0;
+    numPoints = 0;
+    fileSize_ = 0;
+
+    this->format = format;
+    filename_.clear();
+    if(format == NoFile) {
+        return true;
+    }
+    stream.open(filename.c_str(), ios_base::out | ios_base::binary | ios_base::trunc);
+    if(!stream.is_open()) {
+        this->format = NoFile;
+        return false;
+    }
+    filename_ = filename;
+    writeHeader();
+
+    isRunning = true;
+    writerThread = thread([this](){ run(); });
+    return true;
+}
+
+
+void MarkerCaptureBuffer::push(double time, const vector<Sample>& samples)
+{
+    {
+        unique_lock<mutex> lock(bufferMutex);
+        // The ring has wrapped around to the oldest frame that the writer has not taken
+        if(format != NoFile && numPushedFrames_ - numWrittenFrames >= (uint64_t)capacity_) {
+            ++numStalledFrames_;
+            writeCondition.wait(lock, [this](){ return numPushedFrames_ - numWrittenFrames < (uint64_t)capacity_; });
+        }
+        // Nothing has been overwritten yet, so the frames stay in order when the ring is enlarged
+        if(format == NoFile && numPushedFrames_ == (uint64_t)capacity_) {
+            capacity_ *= 2;
+            times.resize(capacity_);
+            samples_.resize((size_t)capacity_ * numMarkers_);
+        }
+        const size_t slot = numPushedFrames_ % capacity_;
+        times[slot] = time;
+        std::copy(samples.begin(), samples.begin() + numMarkers_, samples_.begin() + slot * numMarkers_);
+        ++numPushedFrames_;
+    }
+    pushCondition.notify_one();
+}
+
+
+void MarkerCaptureBuffer::stop()
+{
+    if(writerThread.joinable()) {
+        {
+            lock_guard<mutex> lock(bufferMutex);
+            isRunning = false;
+        }
+        pushCondition.notify_all();
+        writerThread.join();
+    }
+    if(stream.is_open()) {
+        if(format == PCD) {
+            const string count = formatC("{0:0{1}d}", numPoints, CountWidth);
+            for(auto& offset : countOffsets) {
+                stream.seekp(offset);
+                stream.write(count.data(), count.size());
+            }
+        }
+        stream.close();
+    }
+}
+
+
+int MarkerCaptureBuffer::numFrames() const
+{
+    return (int)std::min(numPushedFrames_, (uint64_t)capacity_);
+}
+
+
+double MarkerCaptureBuffer::time(int frame) const
+{
+    const uint64_t first = numPushedFrames_ - numFrames();
+    return times[(first + frame) % capacity_];
+}
+
+
+const MarkerCaptureBuffer::Sample& MarkerCaptureBuffer::sample(int frame, int marker) const
+{
+    const uint64_t first = numPushedFrames_ - numFrames();
+    return samples_[((first + frame) % capacity_) * numMarkers_ + marker];
+}
+
+
+uint64_t MarkerCaptureBuffer::numStalledFrames() const
+{
+    lock_guard<mutex> lock(bufferMutex);
+    return numStalledFrames_;
+}
+
+
+uint64_t MarkerCaptureBuffer::fileSize() const
+{
+    lock_guard<mutex> lock(bufferMutex);
+    return fileSize_;
+}
+
+
+void MarkerCaptureBuffer::run()
+{
+    vector<double> chunkTimes;
+    vector<Sample> chunkSamples;
+
+    while(true) {
+        {
+            unique_lock<mutex> lock(bufferMutex);
+            pushCondition.wait(lock, [this](){ return numWrittenFrames < numPushedFrames_ || !isRunning; });
+            // The pending frames are written before the writer quits
+            if(numWrittenFrames == numPushedFrames_) {
+                break;
+            }
+            const uint64_t n = std::min(numPushedFrames_ - numWrittenFrames, ChunkFrames);
+            chunkTimes.resize(n);
+            chunkSamples.resize(n * numMarkers_);
+            for(uint64_t i = 0; i < n; ++i) {
+                const size_t slot = (numWrittenFrames + i) % capacity_;
+                chunkTimes[i] = times[slot];
+                auto p = samples_.begin() + slot * numMarkers_;
+                std::copy(p, p + numMarkers_, chunkSamples.begin() + i * numMarkers_);
+            }
+            numWrittenFrames += n;
+        }
+        writeCondition.notify_one();
+
+        writeFrames(chunkTimes, chunkSamples);
+
+        lock_guard<mutex> lock(bufferMutex);
+        fileSize_ = stream.tellp();
+    }
+}
+
+
+void MarkerCaptureBuffer::writeHeader()
+{
+    if(format == Binary) {
+        buffer.clear();
+        buffer.insert(buffer.end(), Magic, Magic + sizeof(Magic));
+        append(buffer, Version);
+        append(buffer, (uint32_t)numMarkers_);
+        for(int i = 0; i < numMarkers_; ++i) {
+            append(buffer, (uint32_t)names[i].size());
+            buffer.insert(buffer.end(), names[i].begin(), names[i].end());
+            append(buffer, colors_[i]);
+        }
+        stream.write(buffer.data(), buffer.size());
+
+    } else if(format == PCD) {
+        // The label of a point is the index of its marker
+        const string zero(CountWidth, '0');
+        stream << "# .PCD v0.7 - Point Cloud Data file format\n"
+               << "VERSION 0.7\n"
+               << "FIELDS x y z rgb label\n"
+               << "SIZE 4 4 4 4 4\n"
+               << "TYPE F F F U U\n"
+               << "COUNT 1 1 1 1 1\n"
+               << "WIDTH ";
+        countOffsets[0] = stream.tellp();
+        stream << zero << "\n"
+               << "HEIGHT 1\n"
+               << "VIEWPOINT 0 0 0 1 0 0 0\n"
+               << "POINTS ";
+        countOffsets[1] = stream.tellp();
+        stream << zero << "\n"
+               << "DATA binary\n";
+    }
+}
+
+
+void MarkerCaptureBuffer::writeFrames(const vector<double>& frameTimes, const vector<Sample>& frameSamples)
+{
+    buffer.clear();
+    for(size_t i = 0; i < frameTimes.size(); ++i) {
+        const Sample* frame = &frameSamples[i * numMarkers_];
+        if(format == Binary) {
+            append(buffer, frameTimes[i]);
+            for(int j = 0; j < numMarkers_; ++j) {
+                append(buffer, (uint8_t)(frame[j].on ? 1 : 0));
+                append(buffer, frame[j].position);
+                append(buffer, frame[j].rotation);
+            }
+        } else {
+            for(int j = 0; j < numMarkers_; ++j) {
+                if(frame[j].on) {
+                    append(buffer, frame[j].position);
+                    append(buffer, colors_[j]);
+                    append(buffer, (uint32_t)j);
+                    ++numPoints;
+                }
+            }
+        }
+    }
+    stream.write(buffer.data(), buffer.size());
+}
+
+
+bool MarkerCaptureBuffer::load(const string& filename, MultiSE3Seq& seq, ostream& os)
+{
+    ifstream is(filename, ios::binary);
+    if(!is) {
+        os << formatC("\"{0}\" cannot be opened.", filename) << endl;
+        return false;
+    }
+    char magic[4];
+    uint32_t version = 0;
+    uint32_t numMarkers = 0;
+    if(!is.read(magic, sizeof(magic)) || !std::equal(magic, magic + 4, Magic)
+       || !read(is, version) || version != Version || !read(is, numMarkers)) {
+        os << formatC("\"{0}\" is not a marker capture of version {1}.", filename, Version) << endl;
+        return false;
+    }
+    for(uint32_t i = 0; i < numMarkers; ++i) {
+        uint32_t length;
+        uint32_t color;
+        if(!read(is, length) || !is.seekg(length, ios::cur) || !read(is, color)) {
+            os << formatC("The header of \"{0}\" is broken.", filename) << endl;
+            return false;
+        }
+    }
+
+    // A frame cut off at the end, as by a crash during the capture, is ignored
+    const streamoff begin = is.tellg();
+    is.seekg(0, ios::end);
+    const streamoff frameSize = sizeof(double) + numMarkers * (1 + sizeof(Sample::position) + sizeof(Sample::rotation));
+    const int numFrames = (is.tellg() - begin) / frameSize;
+    is.seekg(begin);
+
+    seq.setNumParts(numMarkers);
+    seq.setNumFrames(numFrames);
+    vector<Sample> last(numMarkers);
+    for(auto& sample : last) {
+        sample.set(Vector3::Zero(), Matrix3::Identity());
+    }
+    double firstTime = 0.0;
+    double lastTime = 0.0;
+    for(int i = 0; i < numFrames; ++i) {
+        double time;
+        read(is, time);
+        if(i == 0) {
+            firstTime = time;
+        }
+        lastTime = time;
+        auto frame = seq.frame(i);
+        for(uint32_t j = 0; j < numMarkers; ++j) {
+            uint8_t on;
+            Sample sample;
+            read(is, on);
+            read(is, sample.position);
+            read(is, sample.rotation);
+            if(on) {
+                last[j] = sample;
+            }
+            frame[j].set(last[j].p(), last[j].R());
+        }
+    }
+    seq.setOffsetTime(firstTime);
+    if(numFrames > 1 && lastTime > firstTime) {
+        seq.setFrameRate((numFrames - 1) / (lastTime - firstTime));
+    }
+    return true;
+}
@@ -0,0 +1,102 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#ifndef CNOID_MOTIONCAPTURE_PLUGIN_MARKER_CAPTURE_BUFFER_H
+#define CNOID_MOTIONCAPTURE_PLUGIN_MARKER_CAPTURE_BUFFER_H
+
+#include <cnoid/EigenTypes>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cnoid {
+
+class MultiSE3Seq;
+
+// Keeps the latest frames of the markers in a ring of a fixed capacity and streams every frame
+// to a file from a thread of its own, so that a long capture takes a constant memory.
+// When the writer falls a whole ring behind, a new frame waits for it instead of being lost.
+// Without a file, the ring grows instead so that every frame is kept.
+class MarkerCaptureBuffer
+{
+public:
+    enum FileFormat { NoFile, Binary, PCD };
+
+    struct Sample
+    {
+        float position[3];
+        float rotation[4]; // quaternion as w, x, y, z
+        bool on;
+
+        void set(const Vector3& p, const Matrix3& R);
+        Vector3 p() const { return Vector3(position[0], position[1], position[2]); }
+        Matrix3 R() const;
+    };
+
+    MarkerCaptureBuffer();
+    ~MarkerCaptureBuffer();
+
+    // Frames kept in the ring, which only sets its initial size when no file is written
+    void setCapacity(int numFrames);
+    int capacity() const { return capacity_; }
+
+    // The names and the colors are those of the markers, which the files keep
+    bool start(const std::vector<std::string>& names, const std::vector<Vector3>& colors,
+               FileFormat format, const std::string& filename);
+    void push(double time, const std::vector<Sample>& samples);
+    // Writes the pending frames and closes the file
+    void stop();
+
+    // The frames in the ring, the oldest first
+    int numFrames() const;
+    double time(int frame) const;
+    const Sample& sample(int frame, int marker) const;
+
+    int numMarkers() const { return numMarkers_; }
+    uint64_t numPushedFrames() const { return numPushedFrames_; }
+    uint64_t numStalledFrames() const; // frames that waited for the writer
+    uint64_t fileSize() const;
+    const std::string& filename() const { return filename_; }
+
+    // Reads the whole capture of a Binary file into the sequence, whose parts are the markers.
+    // A marker that is off keeps its last pose.
+    static bool load(const std::string& filename, MultiSE3Seq& seq, std::ostream& os);
+
+private:
+    void run();
+    void writeHeader();
+    void writeFrames(const std::vector<double>& frameTimes, const std::vector<Sample>& frameSamples);
+
+    int capacity_;
+    int numMarkers_;
+    std::vector<double> times;
+    std::vector<Sample> samples_; // index: numMarkers * slot + marker
+    std::vector<std::string> names;
+    std::vector<uint32_t> colors_; // packed as the rgb of PCD
+
+    FileFormat format;
+    std::string filename_;
+    std::ofstream stream;
+    uint64_t numPoints;
+    std::streamoff countOffsets[2]; // of the width and the points of PCD
+    uint64_t fileSize_;
+    std::vector<char> buffer;
+
+    std::thread writerThread;
+    mutable std::mutex bufferMutex;
+    std::condition_variable pushCondition;
+    std::condition_variable writeCondition;
+    bool isRunning;
+    uint64_t numPushedFrames_;
+    uint64_t numWrittenFrames;
+    uint64_t numStalledFrames_;
+};
+
+}
+
+#endif // CNOID_MOTIONCAPTURE_PLUGIN_MARKER_CAPTURE_BUFFER_H
@@ -6,15 +6,19 @@
 #include <cnoid/Archive>
 #include <cnoid/Body>
 #include <cnoid/DeviceList>
+#include <cnoid/Format>
 #include <cnoid/ItemManager>
+#include <cnoid/MessageView>
 #include <cnoid/MultiPointSetItem>
 #include <cnoid/MultiSE3SeqItem>
 #include <cnoid/PointSetItem>
 #include <cnoid/PutPropertyFunction>
+#include <cnoid/Selection>
 #include <cnoid/SimulatorItem>
 #include <cnoid/UTF8>
 #include <cnoid/stdx/filesystem>
 #include <vector>
+#include "MarkerCaptureBuffer.h"
 #include "PassiveMarker.h"
 #include "LoggerUtil.h"
 #include "gettext.h"
@@ -37,6 +41,14 @@ public:
     ItemList<PointSetItem> pointSetItems;
     MultiPointSetItemPtr multiPointSetItem;
     MultiSE3SeqItemPtr motionSeqItem;
+    SimulatorItem* simulatorItem;
+
+    int decimation;
+    int bufferedFrames;
+    Selection exportFormat;
+    MarkerCaptureBuffer buffer;
+    vector<MarkerCaptureBuffer::Sample> samples;
+    int stepCount;
 
     bool initializeSimulation(SimulatorItem* simulatorItem);
     void finalizeSimulation();
@@ -60,6 +72,15 @@ MotionCaptureItem::Impl::Impl(MotionCaptureItem* self)
     pointSetItems.clear();
     multiPointSetItem = nullptr;
     motionSeqItem = nullptr;
+    simulatorItem = nullptr;
+
+    decimation = 1;
+    bufferedFrames = 1000;
+    exportFormat.setSymbol(MarkerCaptureBuffer::NoFile, N_("None"));
+    exportFormat.setSymbol(MarkerCaptureBuffer::Binary, N_("Binary"));
+    exportFormat.setSymbol(MarkerCaptureBuffer::PCD, N_("PCD"));
+    exportFormat.select(MarkerCaptureBuffer::NoFile);
+    stepCount = 0;
 }
 
 
@@ -72,9 +93,11 @@ MotionCaptureItem::MotionCaptureItem(const MotionCaptureItem& org)
 
 
 MotionCaptureItem::Impl::Impl(MotionCaptureItem *self, const Impl& org)
-    : self(self)
+    : Impl(self)
 {
-
+    decimation = org.decimation;
+    bufferedFrames = org.bufferedFrames;
+    exportFormat = org.exportFormat;
 }
 
 
@@ -88,7 +111,12 @@ void MotionCaptureItem::initializeClass(ExtensionManager* ext)
 {
     ext->itemManager()
         .registerClass<MotionCaptureItem, SubSimulatorItem>(N_("MotionCaptureItem"))
-        .addCreationPanel<MotionCaptureItem>();
+        .addCreationPanel<MotionCaptureItem>()
+        .addLoader<MultiSE3SeqItem>(
+            _("Marker Capture"), "MARKER-CAPTURE", "mocap",
+            [](MultiSE3SeqItem* item, const string& filename, ostream& os, Item*){
+                return MarkerCaptureBuffer::load(filename, *item->seq(), os);
+            });
 }
 
 
@@ -100,6 +128,7 @@ bool MotionCaptureItem::initializeSimulation(SimulatorItem* simulatorItem)
 
 bool MotionCaptureItem::Impl::initializeSimulation(SimulatorItem* simulatorItem)
 {
+    this->simulatorItem = simulatorItem;
     markers.clear();
 
     for(auto& item : pointSetItems) {
@@ -123,11 +152,15 @@ bool MotionCaptureItem::Impl::initializeSimulation(SimulatorItem* simulatorItem)
         multiPointSetItem->setChecked(false);
         self->addSubItem(multiPointSetItem);
 
+        vector<string> names;
+        vector<Vector3> colors;
         for(auto& marker : markers) {
             PointSetItem* pointSetItem = new PointSetItem;
             pointSetItem->setName(marker->name());
             pointSetItem->setChecked(false);
             multiPointSetItem->addSubItem(pointSetItem);
+            names.push_back(marker->name());
+            colors.push_back(marker->color());
         }
         pointSetItems = multiPointSetItem->descendantItems();
 
@@ -139,9 +172,23 @@ bool MotionCaptureItem::Impl::initializeSimulation(SimulatorItem* simulatorItem)
         shared_ptr<MultiSE3Seq> log = motionSeqItem->seq();
         log->setNumFrames(0);
         log->setNumParts(numParts);
-        log->setFrameRate(1.0 / simulatorItem->worldTimeStep());
+        log->setFrameRate(1.0 / (simulatorItem->worldTimeStep() * decimation));
         log->setOffsetTime(0.0);
 
+        string filename;
+        if(!exportFormat.is(MarkerCaptureBuffer::NoFile)) {
+            filesystem::path mocapDirPath(fromUTF8(mkdir(StandardPath::Downloads, "mocap")));
+            string extension = exportFormat.is(MarkerCaptureBuffer::PCD) ? ".pcd" : ".mocap";
+            filename = toUTF8((mocapDirPath / filesystem::path(fromUTF8(multiPointSetItem->name() + getCurrentTimeSuffix() + extension))).string());
+        }
+        buffer.setCapacity(bufferedFrames);
+        if(!buffer.start(names, colors, (MarkerCaptureBuffer::FileFormat)exportFormat.which(), filename)) {
+            MessageView::instance()->putln(
+                formatR(_("The capture file \"{0}\" cannot be opened."), filename), MessageView::Warning);
+        }
+        samples.assign(markers.size(), MarkerCaptureBuffer::Sample());
+        stepCount = 0;
+
         simulatorItem->addPreDynamicsFunction([&](){ onPreDynamics(); });
     }
 
@@ -158,8 +205,45 @@ void MotionCaptureItem::finalizeSimulation()
 void MotionCaptureItem::Impl::finalizeSimulation()
 {
     if(multiPointSetItem) {
-        string suffix = getCurrentTimeSuffix();
-        filesystem::path mocapDirPath(fromUTF8(mkdir(StandardPath::Downloads, "mocap")));
+        buffer.stop();
+        if(!buffer.filename().empty()) {
+            MessageView::instance()->putln(
+                formatR(_("{0} frames of {1} markers were written to \"{2}\" ({3} bytes, {4} frames waited for the writer)."),
+                        buffer.numPushedFrames(), buffer.numMarkers(),
+                        buffer.filename(), buffer.fileSize(), buffer.numStalledFrames()));
+        }
+
+        // The sequence and the point sets show the frames left in the ring, which has kept
+        // all of them when no file was written
+        const int numFrames = buffer.numFrames();
+        if((uint64_t)numFrames < buffer.numPushedFrames()) {
+            if(buffer.filename().empty() || !exportFormat.is(MarkerCaptureBuffer::Binary)) {
+                MessageView::instance()->putln(
+                    formatR(_("MotionSeq keeps only the last {0} of the {1} captured frames. "
+                              "Increase \"Buffered frames\" or export a binary file to keep all of them."),
+                            numFrames, buffer.numPushedFrames()), MessageView::Warning);
+            } else {
+                MessageView::instance()->putln(
+                    formatR(_("MotionSeq keeps only the last {0} of the {1} captured frames. "
+                              "All of them can be loaded from \"{2}\" as a MultiSE3SeqItem."),
+                            numFrames, buffer.numPushedFrames(), buffer.filename()));
+            }
+        }
+        shared_ptr<MultiSE3Seq> log = motionSeqItem->seq();
+        log->setNumFrames(numFrames);
+        if(numFrames > 0) {
+            log->setOffsetTime(buffer.time(0));
+        }
+        for(int i = 0; i < numFrames; ++i) {
+            auto frame = log->frame(i);
+            for(size_t j = 0; j < markers.size(); ++j) {
+                const MarkerCaptureBuffer::Sample& sample = buffer.sample(i, j);
+                if(sample.on) {
+                    frame[j].set(sample.p(), sample.R());
+                }
+            }
+        }
+        motionSeqItem->notifyUpdate();
 
         multiPointSetItem->setChecked(true);
 
@@ -169,55 +253,54 @@ void MotionCaptureItem::Impl::finalizeSimulation()
             PointSetItem* pointSetItem = pointSetItems[i];
             auto pointSet_ = pointSetItem->pointSet();
 
-            vector<Vector3> src;
-            for(int j = 0; j < pointSetItem->numAttentionPoints(); ++j) {
-                src.push_back(pointSetItem->attentionPoint(j));
+            int numPoints = 0;
+            for(int j = 0; j < numFrames; ++j) {
+                if(buffer.sample(j, i).on) {
+                    ++numPoints;
+                }
             }
-            SgVertexArray& points = *pointSetItem->pointSet()->getOrCreateVertices();
-            const int numPoints = src.size();
+            SgVertexArray& points = *pointSet_->getOrCreateVertices();
             points.resize(numPoints);
-            for(int j = 0; j < numPoints; ++j) {
-                points[j] = Vector3f(src[j][0], src[j][1], src[j][2]);
+            int index = 0;
+            for(int j = 0; j < numFrames; ++j) {
+                const MarkerCaptureBuffer::Sample& sample = buffer.sample(j, i);
+                if(sample.on) {
+                    points[index++] = Vector3f(sample.position[0], sample.position[1], sample.position[2]);
+                }
             }
 
-            SgColorArray& colors = *pointSetItem->pointSet()->getOrCreateColors();
-            const int n = numPoints;
-            colors.resize(n);
-            for(int j = 0; j < n; ++j) {
+            SgColorArray& colors = *pointSet_->getOrCreateColors();
+            colors.resize(numPoints);
+            for(int j = 0; j < numPoints; ++j) {
                 Vector3f& c = colors[j];
                 c[0] = marker->color()[0];
                 c[1] = marker->color()[1];
                 c[2] = marker->color()[2];
             }
             pointSet_->notifyUpdate();
-
-            pointSetItem->clearAttentionPoints();
             pointSetItem->notifyUpdate();
-
-            string filename = toUTF8((mocapDirPath / filesystem::path(fromUTF8(pointSetItem->name() + suffix + ".pcd"))).string());
-            // pointSetItem->save(filename);
         }
-
-        string filename0 = toUTF8((mocapDirPath / filesystem::path(fromUTF8(multiPointSetItem->name() + suffix + ".yaml"))).string());
-        // multiPointSetItem->save(filename0);
     }
 }
 
 
 void MotionCaptureItem::Impl::onPreDynamics()
 {
-    shared_ptr<MultiSE3Seq> log = motionSeqItem->seq();
-    auto frame = log->appendFrame();
+    if(++stepCount < decimation) {
+        return;
+    }
+    stepCount = 0;
+
     for(size_t i = 0; i < markers.size(); ++i) {
         PassiveMarker* marker = markers[i];
-        if(marker->on()) {
+        MarkerCaptureBuffer::Sample& sample = samples[i];
+        sample.on = marker->on();
+        if(sample.on) {
             Link* link = marker->link();
-            Vector3 p = link->T() * marker->p_local();
-            Matrix3 R = link->R() * marker->R_local();
-            frame[i].set(p, R);
-            pointSetItems[i]->addAttentionPoint(p);
+            sample.set(link->T() * marker->p_local(), link->R() * marker->R_local());
         }
     }
+    buffer.push(simulatorItem->currentTime(), samples);
 }
 
 
@@ -230,6 +313,10 @@ Item* MotionCaptureItem::doCloneItem(CloneMap* cloneMap) const
 void MotionCaptureItem::doPutProperties(PutPropertyFunction& putProperty)
 {
     SubSimulatorItem::doPutProperties(putProperty);
+    putProperty.min(1)(_("Decimation"), impl->decimation, changeProperty(impl->decimation));
+    putProperty.min(1)(_("Buffered frames"), impl->bufferedFrames, changeProperty(impl->bufferedFrames));
+    putProperty(_("Export format"), impl->exportFormat,
+                [&](int which){ return impl->exportFormat.select(which); });
 }
 
 
@@ -238,6 +325,9 @@ bool MotionCaptureItem::store(Archive& archive)
     if(!SubSimulatorItem::store(archive)) {
         return false;
     }
+    archive.write("decimation", impl->decimation);
+    archive.write("buffered_frames", impl->bufferedFrames);
+    archive.write("export_format", impl->exportFormat.selectedSymbol());
     return true;
 }
 
@@ -247,5 +337,11 @@ bool MotionCaptureItem::restore(const Archive& archive)
     if(!SubSimulatorItem::restore(archive)) {
         return false;
     }
+    archive.read("decimation", impl->decimation);
+    archive.read("buffered_frames", impl->bufferedFrames);
+    string symbol;
+    if(archive.read("export_format", symbol)) {
+        impl->exportFormat.select(symbol);
+    }
     return true;
 }
\ No newline at end of file
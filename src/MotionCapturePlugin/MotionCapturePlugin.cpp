@@ -22,7 +22,7 @@ public:
     virtual bool initialize() override
     {
         CollisionSeqLoggerItem::initializeClass(this);
-        // CollisionVisualizerItem::initializeClass(this);
+        CollisionVisualizerItem::initializeClass(this);
         MotionCaptureItem::initializeClass(this);
         return true;
     }
@@ -0,0 +1,252 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include <cnoid/MultiValueSeq>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "../ContactStateLog.h"
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+struct Options {
+    int numBodies = 4;
+    int numLinks = 100;
+    double duration = 3600.0;   // unit: s
+    double timeStep = 0.001;    // unit: s
+    double verifyDuration = 60.0; // unit: s, of the log that is expanded and compared
+    string workDir = ".";
+    string output;
+};
+
+struct Result {
+    string name;
+    bool ok = true;
+    int numFrames = 0;
+    uint64_t numEvents = 0;
+    uint64_t sequenceBytes = 0; // of the MultiValueSeq of all the bodies
+    uint64_t logBytes = 0;
+    size_t logMemoryBytes = 0;
+    double writeTime = 0.0;     // unit: ms
+    double expandTime = 0.0;    // unit: ms
+    long peakRss = 0;           // unit: KB
+};
+
+long peakRss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+uint32_t hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// A crawler whose first 40% of links are track links touching the ground for 40% of
+// a 0.5 s cycle, and whose other links touch the rubble now and then for 50 ms
+bool isInContact(int body, int link, int frame, const Options& options)
+{
+    const int cycle = max((int)(0.5 / options.timeStep), 1);
+    const int bump = max((int)(0.05 / options.timeStep), 1);
+    if(link < options.numLinks * 2 / 5) {
+        const int phase = (hash(body * 4096 + link) % cycle);
+        return (frame + phase) % cycle < cycle * 2 / 5;
+    }
+    const uint32_t h = hash((body * 4096 + link) * 0x10000 + frame / bump);
+    return h % 2000 == 0;
+}
+
+bool writeLog(const string& filename, int numFrames, const Options& options, Result& result)
+{
+    vector<string> names;
+    vector<int> numLinks;
+    for(int i = 0; i < options.numBodies; ++i) {
+        names.push_back("Crawler" + to_string(i));
+        numLinks.push_back(options.numLinks);
+    }
+
+    ContactStateLog log;
+    if(!log.openForWriting(filename, 1.0 / options.timeStep, names, numLinks)) {
+        return false;
+    }
+    size_t memorySize = 0;
+    auto start = chrono::steady_clock::now();
+    for(int frame = 0; frame < numFrames; ++frame) {
+        for(int i = 0; i < options.numBodies; ++i) {
+            for(int j = 0; j < options.numLinks; ++j) {
+                log.setContact(i, j, isInContact(i, j, frame, options));
+            }
+        }
+        log.commitFrame();
+        memorySize = max(memorySize, log.memorySize());
+    }
+    log.close();
+    result.writeTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    result.numFrames = log.numFrames();
+    result.numEvents = log.numEvents();
+    result.logBytes = log.fileSize();
+    result.logMemoryBytes = memorySize;
+    result.sequenceBytes = (uint64_t)numFrames * options.numBodies * options.numLinks * sizeof(double);
+    return true;
+}
+
+bool expandLog(const string& filename, const Options& options, Result& result)
+{
+    ContactStateLog log;
+    if(!log.openForReading(filename) || log.numBodies() != options.numBodies) {
+        return false;
+    }
+    bool ok = true;
+    MultiValueSeq seq;
+    for(int i = 0; i < log.numBodies(); ++i) {
+        auto time = chrono::steady_clock::now();
+        ok &= log.expand(i, seq) && seq.numFrames() == result.numFrames && seq.numParts() == options.numLinks;
+        result.expandTime += chrono::duration<double, milli>(chrono::steady_clock::now() - time).count();
+        for(int frame = 0; ok && frame < seq.numFrames(); ++frame) {
+            auto values = seq.frame(frame);
+            for(int j = 0; j < options.numLinks; ++j) {
+                if((values[j] != 0.0) != isInContact(i, j, frame, options)) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> const char* { return (i + 1 < argc) ? argv[++i] : nullptr; };
+        const char* value = nullptr;
+        if(arg == "-h" || arg == "--help") {
+            return false;
+        } else if((arg == "--bodies") && (value = next())) {
+            options.numBodies = atoi(value);
+        } else if((arg == "--links") && (value = next())) {
+            options.numLinks = atoi(value);
+        } else if((arg == "--duration") && (value = next())) {
+            options.duration = atof(value);
+        } else if((arg == "--time-step") && (value = next())) {
+            options.timeStep = atof(value);
+        } else if((arg == "--verify-duration") && (value = next())) {
+            options.verifyDuration = atof(value);
+        } else if((arg == "--work-dir") && (value = next())) {
+            options.workDir = value;
+        } else if((arg == "--output") && (value = next())) {
+            options.output = value;
+        } else {
+            cerr << "Unknown or incomplete option: " << arg << endl;
+            return false;
+        }
+    }
+    options.numBodies = max(options.numBodies, 1);
+    options.numLinks = max(options.numLinks, 1);
+    options.timeStep = max(options.timeStep, 1.0e-5);
+    options.duration = max(options.duration, options.timeStep);
+    options.verifyDuration = min(max(options.verifyDuration, options.timeStep), options.duration);
+    return true;
+}
+
+void printUsage()
+{
+    cerr << "Usage: contact-log-benchmark [options]\n"
+         << "  --bodies N            number of crawlers\n"
+         << "  --links N             number of links of a crawler\n"
+         << "  --duration S          simulated time of the long log\n"
+         << "  --time-step S         time step of the simulation\n"
+         << "  --verify-duration S   simulated time of the log that is expanded and compared\n"
+         << "  --work-dir DIR        directory for the logs\n"
+         << "  --output FILE         write the result as JSON to FILE (default: stdout)" << endl;
+}
+
+void writeJson(ostream& os, const Options& options, const vector<Result>& results)
+{
+    os << "{\n";
+    os << "  \"benchmark\": \"ContactStateLog\",\n";
+    os << "  \"parameters\": { \"bodies\": " << options.numBodies << ", \"links\": " << options.numLinks
+       << ", \"duration\": " << options.duration << ", \"time_step\": " << options.timeStep
+       << ", \"verify_duration\": " << options.verifyDuration << " },\n";
+    os << "  \"results\": [\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        const double ratio = r.logBytes > 0 ? (double)r.sequenceBytes / r.logBytes : 0.0;
+        const double frameTime = r.numFrames > 0 ? r.writeTime * 1.0e6 / r.numFrames : 0.0;
+        os << "    { \"name\": \"" << r.name << "\", \"ok\": " << (r.ok ? "true" : "false")
+           << ", \"frames\": " << r.numFrames << ", \"events\": " << r.numEvents
+           << ", \"sequence_bytes\": " << r.sequenceBytes << ", \"log_bytes\": " << r.logBytes
+           << ", \"file_reduction\": " << fixed << ratio
+           << ", \"log_memory_bytes\": " << r.logMemoryBytes
+           << ", \"memory_reduction\": " << (r.logMemoryBytes > 0 ? (double)r.sequenceBytes / r.logMemoryBytes : 0.0)
+           << ", \"write_ms\": " << r.writeTime << ", \"write_ns_per_frame\": " << frameTime
+           << ", \"expand_ms\": " << r.expandTime
+           << ", \"peak_rss_kb\": " << r.peakRss << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}" << endl;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if(!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    vector<Result> results;
+
+    // The long log is only written, as its sequences would not fit in memory
+    Result longRun;
+    longRun.name = "long";
+    const string longFile = options.workDir + "/benchmark_long.cslog";
+    longRun.ok = writeLog(longFile, (int)(options.duration / options.timeStep + 0.5), options, longRun);
+    longRun.peakRss = peakRss();
+    results.push_back(longRun);
+
+    Result verifyRun;
+    verifyRun.name = "verify";
+    const string verifyFile = options.workDir + "/benchmark_verify.cslog";
+    verifyRun.ok = writeLog(verifyFile, (int)(options.verifyDuration / options.timeStep + 0.5), options, verifyRun)
+        && expandLog(verifyFile, options, verifyRun);
+    verifyRun.peakRss = peakRss();
+    results.push_back(verifyRun);
+
+    remove(longFile.c_str());
+    remove(verifyFile.c_str());
+
+    if(options.output.empty()) {
+        writeJson(cout, options, results);
+    } else {
+        ofstream out(options.output);
+        writeJson(out, options, results);
+    }
+
+    bool ok = true;
+    for(auto& result : results) {
+        ok &= result.ok;
+    }
+    return ok ? 0 : 1;
+}
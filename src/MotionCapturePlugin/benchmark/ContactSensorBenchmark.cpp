@@ -0,0 +1,241 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include <cnoid/Link>
+#include <cnoid/SceneDevice>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../ContactSensorNotifier.h"
+#include "../PassiveMarker.h"
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+struct Options {
+    int numSensors = 500;
+    int numSteps = 20000;
+    int cycle = 200;     // unit: steps, of the contact of a sensor
+    int chatter = 3;     // unit: steps, of the bouncing at the edges of a contact
+    int debounceSteps = 3;
+    string output;
+};
+
+struct Result {
+    string name;
+    bool ok = true;
+    double stepTime = 0.0;  // unit: us
+    uint64_t numNotifications = 0;
+    uint64_t numSceneUpdates = 0;
+};
+
+// The sensors on the track of a crawler touch the ground for 40% of a cycle each.
+// With chatter, a contact also bounces off and on in the steps around its edges.
+bool isInContact(int sensor, int step, const Options& options, bool hasChatter)
+{
+    const int t = (step + sensor * 7) % options.cycle;
+    const int length = options.cycle * 2 / 5;
+    bool on = t < length;
+    if(hasChatter && options.chatter > 0) {
+        const int edge = min(t, abs(t - length));
+        if(edge < options.chatter && (t + sensor) % 2) {
+            on = !on;
+        }
+    }
+    return on;
+}
+
+class Scenario
+{
+public:
+    Scenario(const Options& options)
+        : options(options)
+    {
+        for(int i = 0; i < options.numSensors; ++i) {
+            LinkPtr link = new Link;
+            PassiveMarkerPtr sensor = new PassiveMarker;
+            sensor->setLink(link);
+            // The scene device of a sensor is what the GUI updates on each notification
+            SceneDevicePtr sceneDevice = SceneDevice::create(sensor);
+            if(sceneDevice) {
+                sceneDevice->setSceneUpdateConnection(true);
+                sceneDevices.push_back(sceneDevice);
+            }
+            sensor->sigStateChanged().connect([this](){ ++numSceneUpdates; });
+            links.push_back(link);
+            sensors.push_back(sensor);
+        }
+    }
+
+    bool hasSceneDevices() const { return (int)sceneDevices.size() == options.numSensors; }
+
+    void setContacts(int step, bool hasChatter)
+    {
+        for(int i = 0; i < options.numSensors; ++i) {
+            auto& contacts = links[i]->contactPoints();
+            const bool on = isInContact(i, step, options, hasChatter);
+            if(on && contacts.empty()) {
+                contacts.emplace_back();
+            } else if(!on) {
+                contacts.clear();
+            }
+        }
+    }
+
+    Result run(const string& name, bool hasChatter, const function<int()>& notify)
+    {
+        Result result;
+        result.name = name;
+        numSceneUpdates = 0;
+        double totalTime = 0.0;
+        for(int step = 0; step < options.numSteps; ++step) {
+            setContacts(step, hasChatter);
+            auto time = chrono::steady_clock::now();
+            result.numNotifications += notify();
+            totalTime += chrono::duration<double, micro>(chrono::steady_clock::now() - time).count();
+        }
+        result.stepTime = totalTime / options.numSteps;
+        result.numSceneUpdates = numSceneUpdates;
+        result.ok = result.numNotifications == numSceneUpdates;
+        return result;
+    }
+
+    // What the logger did before, which notifies every sensor on every step
+    int notifyAll()
+    {
+        for(auto& sensor : sensors) {
+            sensor->on(!sensor->link()->contactPoints().empty());
+            sensor->notifyStateChange();
+        }
+        return sensors.size();
+    }
+
+    vector<PassiveMarker*> sensorList() const
+    {
+        vector<PassiveMarker*> list;
+        for(auto& sensor : sensors) {
+            list.push_back(sensor);
+        }
+        return list;
+    }
+
+private:
+    const Options& options;
+    vector<LinkPtr> links;
+    vector<PassiveMarkerPtr> sensors;
+    vector<SceneDevicePtr> sceneDevices;
+    uint64_t numSceneUpdates;
+};
+
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> const char* { return (i + 1 < argc) ? argv[++i] : nullptr; };
+        const char* value = nullptr;
+        if(arg == "-h" || arg == "--help") {
+            return false;
+        } else if((arg == "--sensors") && (value = next())) {
+            options.numSensors = atoi(value);
+        } else if((arg == "--steps") && (value = next())) {
+            options.numSteps = atoi(value);
+        } else if((arg == "--cycle") && (value = next())) {
+            options.cycle = atoi(value);
+        } else if((arg == "--chatter") && (value = next())) {
+            options.chatter = atoi(value);
+        } else if((arg == "--debounce") && (value = next())) {
+            options.debounceSteps = atoi(value);
+        } else if((arg == "--output") && (value = next())) {
+            options.output = value;
+        } else {
+            cerr << "Unknown or incomplete option: " << arg << endl;
+            return false;
+        }
+    }
+    options.numSensors = max(options.numSensors, 1);
+    options.numSteps = max(options.numSteps, 1);
+    options.cycle = max(options.cycle, 10);
+    options.chatter = max(options.chatter, 0);
+    options.debounceSteps = max(options.debounceSteps, 0);
+    return true;
+}
+
+void printUsage()
+{
+    cerr << "Usage: contact-sensor-benchmark [options]\n"
+         << "  --sensors N     number of contact sensors\n"
+         << "  --steps N       number of simulation steps\n"
+         << "  --cycle N       steps of the contact cycle of a sensor\n"
+         << "  --chatter N     steps of bouncing around the edges of a contact\n"
+         << "  --debounce N    debounce steps of the debounced scenario\n"
+         << "  --output FILE   write the result as JSON to FILE (default: stdout)" << endl;
+}
+
+void writeJson(ostream& os, const Options& options, bool hasSceneDevices, const vector<Result>& results)
+{
+    os << "{\n";
+    os << "  \"benchmark\": \"ContactSensorNotifier\",\n";
+    os << "  \"parameters\": { \"sensors\": " << options.numSensors << ", \"steps\": " << options.numSteps
+       << ", \"cycle\": " << options.cycle << ", \"chatter\": " << options.chatter
+       << ", \"debounce\": " << options.debounceSteps
+       << ", \"scene_devices\": " << (hasSceneDevices ? "true" : "false") << " },\n";
+    os << "  \"results\": [\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        os << "    { \"name\": \"" << r.name << "\", \"ok\": " << (r.ok ? "true" : "false")
+           << ", \"step_us\": " << fixed << r.stepTime
+           << ", \"notifications_per_step\": " << (double)r.numNotifications / options.numSteps
+           << ", \"scene_updates\": " << r.numSceneUpdates << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}" << endl;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if(!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    Scenario scenario(options);
+    ContactSensorNotifier notifier;
+    vector<Result> results;
+
+    results.push_back(scenario.run("every_step", false, [&](){ return scenario.notifyAll(); }));
+
+    notifier.setSensors(scenario.sensorList());
+    results.push_back(scenario.run("on_transition", false, [&](){ return notifier.update(); }));
+
+    notifier.setSensors(scenario.sensorList());
+    results.push_back(scenario.run("chatter_on_transition", true, [&](){ return notifier.update(); }));
+
+    notifier.setSensors(scenario.sensorList());
+    notifier.setDebounceSteps(options.debounceSteps);
+    results.push_back(scenario.run("chatter_debounced", true, [&](){ return notifier.update(); }));
+
+    if(options.output.empty()) {
+        writeJson(cout, options, scenario.hasSceneDevices(), results);
+    } else {
+        ofstream out(options.output);
+        writeJson(out, options, scenario.hasSceneDevices(), results);
+    }
+
+    bool ok = true;
+    for(auto& result : results) {
+        ok &= result.ok;
+    }
+    return ok ? 0 : 1;
+}
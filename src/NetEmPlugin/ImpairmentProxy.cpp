@@ -0,0 +1,1141 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "ImpairmentProxy.h"
+#include <cnoid/Format>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+int64_t monotonicTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Datagram or chunk of a stream waiting for its departure
+struct Packet
+{
+    unique_ptr<char[]> data; // kept when the packet is reused
+    size_t capacity = 0;
+    size_t size = 0;
+    int64_t departure = 0; // unit: ns of CLOCK_MONOTONIC
+    int direction = 0;
+    int flow = 0;
+    uint32_t serial = 0;   // generation of the flow, to drop the packets of a closed one
+    int next = -1;
+};
+
+// Hashed timer wheel of Varghese and Lauck.
+// A packet is put into the slot of its departure tick and the slots are visited as the
+// time goes by, so scheduling costs O(1) at any number of waiting packets. The packets
+// further than one turn stay in their slot until their turn comes. A bitmap of the
+// occupied slots gives the next expiry, at which the timer of the loop is armed.
+class TimerWheel
+{
+public:
+    static constexpr int NumSlots = 4096;
+    static constexpr int64_t Tick = 100000; // unit: ns, a turn is 409.6 ms
+
+    TimerWheel(vector<Packet>& pool);
+
+    void reset(int64_t now);
+    void insert(int index);
+    void expire(int64_t now, vector<int>& due);
+    int64_t nextExpiry() const; // -1 when empty
+    int size() const { return count; }
+
+private:
+    struct Slot {
+        int head = -1;
+        int tail = -1;
+        int64_t earliest = INT64_MAX;
+    };
+
+    int findOccupied(int start) const;
+
+    vector<Packet>& pool;
+    vector<Slot> slots;
+    uint64_t occupied[NumSlots / 64];
+    int64_t currentTick;
+    int count;
+};
+
+struct AtomicStatistics
+{
+    atomic<uint64_t> receivedPackets { 0 };
+    atomic<uint64_t> sentPackets { 0 };
+    atomic<uint64_t> sentBytes { 0 };
+    atomic<uint64_t> lostPackets { 0 };
+    atomic<uint64_t> overflowedPackets { 0 };
+    atomic<uint64_t> reorderedPackets { 0 };
+
+    void clear() {
+        receivedPackets = sentPackets = sentBytes = 0;
+        lostPackets = overflowedPackets = reorderedPackets = 0;
+    }
+};
+
+struct Link
+{
+    NetemParameters parameters;
+    int64_t transmissionEnd = 0; // end of the last packet on the rate limited link
+    int numQueued = 0;
+};
+
+struct UdpFlow
+{
+    sockaddr_in client;
+    uint64_t key = 0;
+    int socket = -1; // connected to the target
+    int64_t lastActive = 0;
+    uint32_t serial = 0;
+    bool isOpen = false;
+};
+
+struct TcpFlow
+{
+    int sockets[2] = { -1, -1 }; // the receivers of the directions, [Inbound] client and [Outbound] target
+    uint32_t events[2] = { 0, 0 };
+    bool isConnected = false;
+    bool isReadClosed[2] = { false, false }; // by the sender of the direction
+    int64_t lastDeparture[2] = { 0, 0 };
+    size_t pendingBytes[2] = { 0, 0 };   // in the wheel and in the buffer
+    string buffers[2];                   // delivered but not yet written
+    size_t offsets[2] = { 0, 0 };
+    uint32_t serial = 0;
+    bool isOpen = false;
+};
+
+enum EventKind { ListenEvent, TimerEvent, WakeEvent, UdpTargetEvent, TcpSocketEvent };
+
+// The side is the direction whose receiver is the socket. The serial tells the events of
+// a closed flow from those of a new one in the same place.
+uint64_t eventData(EventKind kind, int flow = 0, int side = 0, uint32_t serial = 0)
+{
+    return ((uint64_t)(serial & 0xffff) << 48) | ((uint64_t)kind << 40) | ((uint64_t)side << 32) | (uint32_t)flow;
+}
+
+const size_t ChunkSize = 16384;
+const size_t MaxPendingBytes = 1 << 20; // reading of a stream pauses beyond this
+
+}
+
+namespace cnoid {
+
+class ImpairmentProxy::Impl
+{
+public:
+    Impl();
+    ~Impl();
+
+    bool start(Protocol protocol, int listenPort, const string& targetHost, int targetPort);
+    void stop();
+    bool setError(const string& message);
+    void run();
+
+    int allocatePacket(size_t size);
+    void releasePacket(int index);
+    void schedule(int direction, int index, int64_t now, bool isStream, int64_t& lastDeparture);
+    double sampleJitter(const NetemParameters& parameters);
+    double uniform() { return uniformDistribution(random); }
+    void deliver(int index);
+
+    void onUdpListen(int64_t now);
+    int openUdp(const sockaddr_in& client, uint64_t key, int64_t now);
+    void onUdpTarget(int flow, int64_t now);
+    void sendUdp(Packet& packet);
+    void closeUdp(int flow);
+    void closeIdleUdpFlows(int64_t now);
+
+    void onTcpAccept();
+    void onTcpSocket(int flow, int side, uint32_t events, int64_t now);
+    void readTcp(int flow, int direction, int64_t now);
+    bool flushTcp(int flow, int direction);
+    void updateTcpEvents(int flow);
+    void closeTcp(int flow);
+
+    Protocol protocol;
+    sockaddr_in targetAddress;
+    int listenSocket;
+    int listenPort;
+    int epollFd;
+    int timerFd;
+    int wakeFd;
+    int64_t armedTime;
+    thread loopThread;
+    atomic<bool> isRunning;
+
+    mutable mutex parameterMutex;
+    NetemParameters sharedParameters[NumDirections];
+    atomic<bool> isParameterChanged;
+    uint64_t seed;
+
+    Link links[NumDirections];
+    AtomicStatistics statistics[NumDirections];
+    vector<Packet> pool;
+    vector<int> freePackets;
+    TimerWheel wheel;
+    vector<int> due;
+
+    unordered_map<uint64_t, int> udpFlowMap;
+    vector<UdpFlow> udpFlows;
+    vector<int> freeUdpFlows;
+    atomic<int> numUdpFlows;
+    int64_t udpIdleTimeout; // unit: ns
+    int maxUdpFlows;
+    int64_t nextUdpSweep;
+    vector<TcpFlow> tcpFlows;
+    vector<char> receiveBuffer;
+
+    mt19937_64 random;
+    uniform_real_distribution<double> uniformDistribution;
+    normal_distribution<double> normalDistribution;
+
+    string errorMessage;
+};
+
+}
+
+
+TimerWheel::TimerWheel(vector<Packet>& pool)
+    : pool(pool),
+      slots(NumSlots)
+{
+    reset(0);
+}
+
+
+void TimerWheel::reset(int64_t now)
+{
+    std::fill(slots.begin(), slots.end(), Slot());
+    memset(occupied, 0, sizeof(occupied));
+    currentTick = now / Tick;
+    count = 0;
+}
+
+
+void TimerWheel::insert(int index)
+{
+    Packet& packet = pool[index];
+    const int64_t tick = std::max(packet.departure / Tick, currentTick);
+    const int s = tick & (NumSlots - 1);
+    Slot& slot = slots[s];
+    packet.next = -1;
+    if(slot.tail >= 0) {
+        pool[slot.tail].next = index;
+    } else {
+        slot.head = index;
+        occupied[s >> 6] |= (uint64_t)1 << (s & 63);
+    }
+    slot.tail = index;
+    slot.earliest = std::min(slot.earliest, packet.departure);
+    ++count;
+}
+
+
+// Moves the packets due by now to the end of due, in the order of their ticks
+void TimerWheel::expire(int64_t now, vector<int>& due)
+{
+    const int64_t nowTick = now / Tick;
+    if(nowTick < currentTick) {
+        return;
+    }
+    const int64_t numTicks = std::min<int64_t>(nowTick - currentTick + 1, NumSlots);
+    for(int64_t k = 0; k < numTicks && count > 0; ++k) {
+        const int s = (currentTick + k) & (NumSlots - 1);
+        Slot& slot = slots[s];
+        if(slot.head < 0 || slot.earliest > now) {
+            continue;
+        }
+        int index = slot.head;
+        slot = Slot();
+        while(index >= 0) {
+            Packet& packet = pool[index];
+            const int next = packet.next;
+            if(packet.departure <= now) {
+                due.push_back(index);
+                --count;
+            } else {
+                // a later turn
+                packet.next = -1;
+                if(slot.tail >= 0) {
+                    pool[slot.tail].next = index;
+                } else {
+                    slot.head = index;
+                }
+                slot.tail = index;
+                slot.earliest = std::min(slot.earliest, packet.departure);
+            }
+            index = next;
+        }
+        if(slot.head < 0) {
+            occupied[s >> 6] &= ~((uint64_t)1 << (s & 63));
+        }
+    }
+    currentTick = nowTick;
+}
+
+
+int TimerWheel::findOccupied(int start) const
+{
+    const int numWords = NumSlots / 64;
+    int word = start >> 6;
+    uint64_t bits = occupied[word] & (~(uint64_t)0 << (start & 63));
+    for(int i = 0; i <= numWords; ++i) {
+        if(bits) {
+            return (word << 6) + __builtin_ctzll(bits);
+        }
+        word = (word + 1) % numWords;
+        bits = occupied[word];
+    }
+    return -1;
+}
+
+
+int64_t TimerWheel::nextExpiry() const
+{
+    if(count == 0) {
+        return -1;
+    }
+    const int start = currentTick & (NumSlots - 1);
+    const int s = findOccupied(start);
+    if(s < 0) {
+        return -1;
+    }
+    // A slot may hold only the packets of a later turn, then it is revisited at the end of its tick
+    const int64_t distance = (s - start + NumSlots) & (NumSlots - 1);
+    const int64_t tickEnd = (currentTick + distance + 1) * Tick;
+    return std::min(slots[s].earliest, tickEnd);
+}
+
+
+ImpairmentProxy::ImpairmentProxy()
+{
+    impl = new Impl;
+}
+
+
+ImpairmentProxy::Impl::Impl()
+    : wheel(pool),
+      uniformDistribution(0.0, 1.0),
+      normalDistribution(0.0, 1.0)
+{
+    protocol = UDP;
+    memset(&targetAddress, 0, sizeof(targetAddress));
+    listenSocket = -1;
+    listenPort = 0;
+    epollFd = -1;
+    timerFd = -1;
+    wakeFd = -1;
+    armedTime = -1;
+    isRunning = false;
+    isParameterChanged = false;
+    seed = 0;
+    numUdpFlows = 0;
+    udpIdleTimeout = 60000000000;
+    maxUdpFlows = 1024;
+    nextUdpSweep = 0;
+    receiveBuffer.resize(65536);
+}
+
+
+ImpairmentProxy::~ImpairmentProxy()
+{
+    delete impl;
+}
+
+
+ImpairmentProxy::Impl::~Impl()
+{
+    stop();
+}
+
+
+bool ImpairmentProxy::start(Protocol protocol, int listenPort, const string& targetHost, int targetPort)
+{
+    return impl->start(protocol, listenPort, targetHost, targetPort);
+}
+
+
+bool ImpairmentProxy::Impl::start(Protocol protocol, int port, const string& targetHost, int targetPort)
+{
+    stop();
+    this->protocol = protocol;
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = (protocol == UDP) ? SOCK_DGRAM : SOCK_STREAM;
+    addrinfo* result = nullptr;
+    int e = getaddrinfo(targetHost.c_str(), to_string(targetPort).c_str(), &hints, &result);
+    if(e != 0 || !result) {
+        errorMessage = formatC("{0}:{1}: {2}", targetHost, targetPort, gai_strerror(e));
+        return false;
+    }
+    memcpy(&targetAddress, result->ai_addr, sizeof(targetAddress));
+    freeaddrinfo(result);
+
+    listenSocket = socket(AF_INET, hints.ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenSocket < 0) {
+        return setError("socket");
+    }
+    int on = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if(::bind(listenSocket, (sockaddr*)&address, sizeof(address)) < 0) {
+        return setError(formatC("bind({0})", port));
+    }
+    if(protocol == TCP && ::listen(listenSocket, 64) < 0) {
+        return setError("listen");
+    }
+    socklen_t length = sizeof(address);
+    getsockname(listenSocket, (sockaddr*)&address, &length);
+    listenPort = ntohs(address.sin_port);
+    if(protocol == UDP) {
+        // A burst of datagrams must not overflow the socket before the loop reads it
+        int size = 4 << 20;
+        setsockopt(listenSocket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(epollFd < 0 || timerFd < 0 || wakeFd < 0) {
+        return setError("epoll");
+    }
+    const pair<int, EventKind> sources[] = { { listenSocket, ListenEvent }, { timerFd, TimerEvent }, { wakeFd, WakeEvent } };
+    for(auto& source : sources) {
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = eventData(source.second);
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, source.first, &event);
+    }
+
+    {
+        lock_guard<mutex> lock(parameterMutex);
+        for(int i = 0; i < NumDirections; ++i) {
+            links[i] = Link();
+            links[i].parameters = sharedParameters[i];
+            statistics[i].clear();
+        }
+        isParameterChanged = false;
+    }
+    random.seed(seed);
+    wheel.reset(monotonicTime());
+    armedTime = -1;
+    errorMessage.clear();
+
+    isRunning = true;
+    loopThread = thread([this](){ run(); });
+    return true;
+}
+
+
+bool ImpairmentProxy::Impl::setError(const string& message)
+{
+    errorMessage = message + ": " + strerror(errno);
+    stop();
+    return false;
+}
+
+
+void ImpairmentProxy::stop()
+{
+    impl->stop();
+}
+
+
+void ImpairmentProxy::Impl::stop()
+{
+    if(loopThread.joinable()) {
+        isRunning = false;
+        uint64_t one = 1;
+        ssize_t result = ::write(wakeFd, &one, sizeof(one));
+        (void)result;
+        loopThread.join();
+    }
+    for(size_t i = 0; i < udpFlows.size(); ++i) {
+        closeUdp(i);
+    }
+    udpFlows.clear();
+    udpFlowMap.clear();
+    freeUdpFlows.clear();
+    for(size_t i = 0; i < tcpFlows.size(); ++i) {
+        closeTcp(i);
+    }
+    tcpFlows.clear();
+    for(int* fd : { &listenSocket, &epollFd, &timerFd, &wakeFd }) {
+        if(*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    pool.clear();
+    freePackets.clear();
+    wheel.reset(0);
+}
+
+
+bool ImpairmentProxy::isRunning() const
+{
+    return impl->isRunning;
+}
+
+
+int ImpairmentProxy::listenPort() const
+{
+    return impl->listenPort;
+}
+
+
+void ImpairmentProxy::setParameters(Direction direction, const NetemParameters& parameters)
+{
+    {
+        lock_guard<mutex> lock(impl->parameterMutex);
+        impl->sharedParameters[direction] = parameters;
+    }
+    impl->isParameterChanged = true;
+    // The loop may be waiting for a packet, and the next one must already see the change
+    if(impl->wakeFd >= 0) {
+        uint64_t one = 1;
+        ssize_t result = ::write(impl->wakeFd, &one, sizeof(one));
+        (void)result;
+    }
+}
+
+
+NetemParameters ImpairmentProxy::parameters(Direction direction) const
+{
+    lock_guard<mutex> lock(impl->parameterMutex);
+    return impl->sharedParameters[direction];
+}
+
+
+void ImpairmentProxy::setSeed(uint64_t seed)
+{
+    impl->seed = seed;
+}
+
+
+ImpairmentProxy::Statistics ImpairmentProxy::statistics(Direction direction) const
+{
+    const AtomicStatistics& source = impl->statistics[direction];
+    Statistics statistics;
+    statistics.receivedPackets = source.receivedPackets;
+    statistics.sentPackets = source.sentPackets;
+    statistics.sentBytes = source.sentBytes;
+    statistics.lostPackets = source.lostPackets;
+    statistics.overflowedPackets = source.overflowedPackets;
+    statistics.reorderedPackets = source.reorderedPackets;
+    return statistics;
+}
+
+
+void ImpairmentProxy::setUdpFlowLimits(double idleTimeout, int maxFlows)
+{
+    impl->udpIdleTimeout = (int64_t)(std::max(idleTimeout, 0.001) * 1.0e9);
+    impl->maxUdpFlows = std::max(maxFlows, 1);
+}
+
+
+int ImpairmentProxy::numUdpFlows() const
+{
+    return impl->numUdpFlows;
+}
+
+
+const string& ImpairmentProxy::errorMessage() const
+{
+    return impl->errorMessage;
+}
+
+
+void ImpairmentProxy::Impl::run()
+{
+    // The default slack of 50 us would dominate the error of short delays
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    epoll_event events[64];
+    while(isRunning) {
+        const int64_t now = monotonicTime();
+        wheel.expire(now, due);
+        for(int index : due) {
+            --links[pool[index].direction].numQueued;
+            deliver(index);
+        }
+        due.clear();
+        if(numUdpFlows > 0 && now >= nextUdpSweep) {
+            closeIdleUdpFlows(now);
+        }
+
+        int64_t next = wheel.nextExpiry();
+        if(numUdpFlows > 0 && (next < 0 || nextUdpSweep < next)) {
+            next = nextUdpSweep;
+        }
+        if(next != armedTime) {
+            itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            if(next >= 0) {
+                // A zero value would disarm the timer
+                const int64_t time = std::max<int64_t>(next, 1);
+                spec.it_value.tv_sec = time / 1000000000;
+                spec.it_value.tv_nsec = time % 1000000000;
+            }
+            timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+            armedTime = next;
+        }
+
+        const int n = epoll_wait(epollFd, events, 64, -1);
+
+        // A change made before a packet was sent must apply to it, so it is taken before the events
+        if(isParameterChanged.exchange(false)) {
+            lock_guard<mutex> lock(parameterMutex);
+            for(int i = 0; i < NumDirections; ++i) {
+                links[i].parameters = sharedParameters[i];
+            }
+        }
+        const int64_t received = monotonicTime();
+        for(int i = 0; i < n; ++i) {
+            const uint64_t data = events[i].data.u64;
+            const EventKind kind = (EventKind)((data >> 40) & 0xff);
+            const int flow = (int)(uint32_t)data;
+            const int side = (int)((data >> 32) & 0xff);
+            uint64_t value;
+            ssize_t result;
+            switch(kind) {
+            case ListenEvent:
+                if(protocol == UDP) {
+                    onUdpListen(received);
+                } else {
+                    onTcpAccept();
+                }
+                break;
+            case TimerEvent:
+                armedTime = -1;
+                result = ::read(timerFd, &value, sizeof(value));
+                break;
+            case WakeEvent:
+                result = ::read(wakeFd, &value, sizeof(value));
+                break;
+            case UdpTargetEvent:
+                if(udpFlows[flow].isOpen && (udpFlows[flow].serial & 0xffff) == (data >> 48)) {
+                    onUdpTarget(flow, received);
+                }
+                break;
+            case TcpSocketEvent:
+                if(tcpFlows[flow].isOpen && (tcpFlows[flow].serial & 0xffff) == (data >> 48)) {
+                    onTcpSocket(flow, side, events[i].events, received);
+                }
+                break;
+            }
+            (void)result;
+        }
+    }
+}
+
+
+int ImpairmentProxy::Impl::allocatePacket(size_t size)
+{
+    int index;
+    if(freePackets.empty()) {
+        index = pool.size();
+        pool.emplace_back();
+    } else {
+        index = freePackets.back();
+        freePackets.pop_back();
+    }
+    Packet& packet = pool[index];
+    if(packet.capacity < size) {
+        packet.capacity = std::max<size_t>(size, 2048);
+        packet.data.reset(new char[packet.capacity]);
+    }
+    packet.size = size;
+    return index;
+}
+
+
+void ImpairmentProxy::Impl::releasePacket(int index)
+{
+    freePackets.push_back(index);
+}
+
+
+// Jitter with the standard deviation of the parameter, except for Uniform which spans ±jitter as netem does
+double ImpairmentProxy::Impl::sampleJitter(const NetemParameters& parameters)
+{
+    // Pareto of the shape 3 normalized to the mean 0 and the deviation 1
+    auto pareto = [this](){
+        return (1.0 / cbrt(1.0 - uniform()) - 1.5) / 0.8660254;
+    };
+    switch(parameters.distribution) {
+    case NetemParameters::Normal:
+        return parameters.jitter * normalDistribution(random);
+    case NetemParameters::Pareto:
+        return parameters.jitter * pareto();
+    case NetemParameters::ParetoNormal:
+        return parameters.jitter * (0.25 * normalDistribution(random) + 0.75 * pareto());
+    default:
+        return parameters.jitter * (2.0 * uniform() - 1.0);
+    }
+}
+
+
+// Decides the fate and the departure of a received packet, which is sent, queued or released
+void ImpairmentProxy::Impl::schedule(int direction, int index, int64_t now, bool isStream, int64_t& lastDeparture)
+{
+    Link& link = links[direction];
+    AtomicStatistics& counts = statistics[direction];
+    const NetemParameters& parameters = link.parameters;
+    Packet& packet = pool[index];
+    counts.receivedPackets.fetch_add(1, memory_order_relaxed);
+
+    if(!isStream) {
+        if(link.numQueued >= parameters.limit) {
+            counts.overflowedPackets.fetch_add(1, memory_order_relaxed);
+            releasePacket(index);
+            return;
+        }
+        if(parameters.loss > 0.0 && uniform() * 100.0 < parameters.loss) {
+            counts.lostPackets.fetch_add(1, memory_order_relaxed);
+            releasePacket(index);
+            return;
+        }
+    }
+
+    int64_t departure = now;
+    // As in netem, a reordered packet skips the delay and overtakes the ones waiting
+    if(!isStream && parameters.reorder > 0.0 && parameters.delay > 0.0 && uniform() * 100.0 < parameters.reorder) {
+        counts.reorderedPackets.fetch_add(1, memory_order_relaxed);
+    } else {
+        double delay = parameters.delay;
+        if(parameters.jitter > 0.0) {
+            delay += sampleJitter(parameters);
+        }
+        departure += (int64_t)(std::max(delay, 0.0) * 1.0e6);
+    }
+    if(parameters.rate > 0.0) {
+        const int64_t start = std::max(departure, link.transmissionEnd);
+        departure = start + (int64_t)(packet.size * 1.0e6 / parameters.rate);
+        link.transmissionEnd = departure;
+    }
+    // The chunks of a stream keep their order
+    departure = std::max(departure, lastDeparture);
+    lastDeparture = departure;
+    packet.departure = departure;
+
+    // The packets are sent at once only while nothing waits, so that the order is kept
+    if(departure <= now && link.numQueued == 0) {
+        deliver(index);
+        return;
+    }
+    ++link.numQueued;
+    wheel.insert(index);
+}
+
+
+void ImpairmentProxy::Impl::deliver(int index)
+{
+    Packet& packet = pool[index];
+    if(protocol == UDP) {
+        sendUdp(packet);
+    } else {
+        const int flow = packet.flow;
+        const int direction = packet.direction;
+        if(flow < (int)tcpFlows.size() && tcpFlows[flow].isOpen && tcpFlows[flow].serial == packet.serial) {
+            TcpFlow& tcpFlow = tcpFlows[flow];
+            tcpFlow.buffers[direction].append(packet.data.get(), packet.size);
+            statistics[direction].sentPackets.fetch_add(1, memory_order_relaxed);
+            statistics[direction].sentBytes.fetch_add(packet.size, memory_order_relaxed);
+            flushTcp(flow, direction);
+        }
+    }
+    releasePacket(index);
+}
+
+
+void ImpairmentProxy::Impl::onUdpListen(int64_t now)
+{
+    // A bounded batch keeps the replies and the timer served under a flood
+    for(int i = 0; i < 256; ++i) {
+        sockaddr_in client;
+        socklen_t length = sizeof(client);
+        ssize_t size = ::recvfrom(listenSocket, receiveBuffer.data(), receiveBuffer.size(), 0, (sockaddr*)&client, &length);
+        if(size < 0) {
+            break;
+        }
+        const uint64_t key = ((uint64_t)client.sin_addr.s_addr << 16) | client.sin_port;
+        auto found = udpFlowMap.find(key);
+        int flow;
+        if(found != udpFlowMap.end()) {
+            flow = found->second;
+            udpFlows[flow].lastActive = now;
+        } else {
+            flow = openUdp(client, key, now);
+            if(flow < 0) {
+                continue;
+            }
+        }
+        int index = allocatePacket(size);
+        Packet& packet = pool[index];
+        memcpy(packet.data.get(), receiveBuffer.data(), size);
+        packet.direction = Outbound;
+        packet.flow = flow;
+        packet.serial = udpFlows[flow].serial;
+        int64_t lastDeparture = 0;
+        schedule(Outbound, index, now, false, lastDeparture);
+    }
+}
+
+
+// Each client gets its own socket to the target, so that the replies find their way back
+int ImpairmentProxy::Impl::openUdp(const sockaddr_in& client, uint64_t key, int64_t now)
+{
+    if(numUdpFlows >= maxUdpFlows) {
+        int leastRecent = -1;
+        for(size_t i = 0; i < udpFlows.size(); ++i) {
+            if(udpFlows[i].isOpen && (leastRecent < 0 || udpFlows[i].lastActive < udpFlows[leastRecent].lastActive)) {
+                leastRecent = i;
+            }
+        }
+        closeUdp(leastRecent);
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0 || ::connect(fd, (sockaddr*)&targetAddress, sizeof(targetAddress)) < 0) {
+        if(fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    int bufferSize = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    int flow;
+    if(freeUdpFlows.empty()) {
+        flow = udpFlows.size();
+        udpFlows.emplace_back();
+    } else {
+        flow = freeUdpFlows.back();
+        freeUdpFlows.pop_back();
+    }
+    UdpFlow& udpFlow = udpFlows[flow];
+    udpFlow.client = client;
+    udpFlow.key = key;
+    udpFlow.socket = fd;
+    udpFlow.lastActive = now;
+    ++udpFlow.serial;
+    udpFlow.isOpen = true;
+    udpFlowMap[key] = flow;
+    if(numUdpFlows++ == 0) {
+        nextUdpSweep = now + udpIdleTimeout;
+    }
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = eventData(UdpTargetEvent, flow, 0, udpFlow.serial);
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    return flow;
+}
+
+
+void ImpairmentProxy::Impl::onUdpTarget(int flow, int64_t now)
+{
+    udpFlows[flow].lastActive = now;
+    for(int i = 0; i < 256; ++i) {
+        ssize_t size = ::recv(udpFlows[flow].socket, receiveBuffer.data(), receiveBuffer.size(), 0);
+        if(size < 0) {
+            break;
+        }
+        int index = allocatePacket(size);
+        Packet& packet = pool[index];
+        memcpy(packet.data.get(), receiveBuffer.data(), size);
+        packet.direction = Inbound;
+        packet.flow = flow;
+        packet.serial = udpFlows[flow].serial;
+        int64_t lastDeparture = 0;
+        schedule(Inbound, index, now, false, lastDeparture);
+    }
+}
+
+
+void ImpairmentProxy::Impl::sendUdp(Packet& packet)
+{
+    const UdpFlow& flow = udpFlows[packet.flow];
+    if(!flow.isOpen || flow.serial != packet.serial) {
+        return;
+    }
+    ssize_t result;
+    if(packet.direction == Outbound) {
+        result = ::send(flow.socket, packet.data.get(), packet.size, 0);
+    } else {
+        result = ::sendto(listenSocket, packet.data.get(), packet.size, 0, (const sockaddr*)&flow.client, sizeof(flow.client));
+    }
+    AtomicStatistics& counts = statistics[packet.direction];
+    if(result < 0) {
+        // the socket buffer is full, so the packet is lost as on a congested link
+        counts.overflowedPackets.fetch_add(1, memory_order_relaxed);
+    } else {
+        counts.sentPackets.fetch_add(1, memory_order_relaxed);
+        counts.sentBytes.fetch_add(packet.size, memory_order_relaxed);
+    }
+}
+
+
+// The packets of the flow left in the wheel are dropped on their delivery by the serial
+void ImpairmentProxy::Impl::closeUdp(int flow)
+{
+    UdpFlow& udpFlow = udpFlows[flow];
+    if(!udpFlow.isOpen) {
+        return;
+    }
+    ::close(udpFlow.socket);
+    udpFlow.socket = -1;
+    udpFlow.isOpen = false;
+    udpFlowMap.erase(udpFlow.key);
+    freeUdpFlows.push_back(flow);
+    --numUdpFlows;
+}
+
+
+// Closes the flows idle for the timeout and sets the time of the next sweep to the earliest
+// expiry of the others. The sweeps are at least 1/16 of the timeout apart, so that a busy
+// flow does not make the loop scan the flows at each of its packets.
+void ImpairmentProxy::Impl::closeIdleUdpFlows(int64_t now)
+{
+    int64_t earliest = INT64_MAX;
+    for(size_t i = 0; i < udpFlows.size(); ++i) {
+        UdpFlow& udpFlow = udpFlows[i];
+        if(udpFlow.isOpen) {
+            const int64_t expiry = udpFlow.lastActive + udpIdleTimeout;
+            if(expiry <= now) {
+                closeUdp(i);
+            } else {
+                earliest = std::min(earliest, expiry);
+            }
+        }
+    }
+    nextUdpSweep = std::max(earliest, now + udpIdleTimeout / 16);
+}
+
+
+void ImpairmentProxy::Impl::onTcpAccept()
+{
+    while(true) {
+        int client = accept4(listenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client < 0) {
+            break;
+        }
+        int target = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(target < 0
+           || (::connect(target, (sockaddr*)&targetAddress, sizeof(targetAddress)) < 0 && errno != EINPROGRESS)) {
+            ::close(client);
+            if(target >= 0) {
+                ::close(target);
+            }
+            continue;
+        }
+        // The delays are added here, so the sockets must not hold the small chunks back
+        int on = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(target, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        int flow = 0;
+        while(flow < (int)tcpFlows.size() && tcpFlows[flow].isOpen) {
+            ++flow;
+        }
+        if(flow == (int)tcpFlows.size()) {
+            tcpFlows.emplace_back();
+        }
+        TcpFlow& tcpFlow = tcpFlows[flow];
+        const uint32_t serial = tcpFlow.serial + 1;
+        tcpFlow = TcpFlow();
+        tcpFlow.serial = serial;
+        tcpFlow.isOpen = true;
+        tcpFlow.sockets[Inbound] = client;
+        tcpFlow.sockets[Outbound] = target;
+        for(int side = 0; side < NumDirections; ++side) {
+            epoll_event event;
+            event.events = 0;
+            event.data.u64 = eventData(TcpSocketEvent, flow, side, serial);
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, tcpFlow.sockets[side], &event);
+        }
+        updateTcpEvents(flow);
+    }
+}
+
+
+void ImpairmentProxy::Impl::onTcpSocket(int flow, int side, uint32_t events, int64_t now)
+{
+    TcpFlow& tcpFlow = tcpFlows[flow];
+    if(side == Outbound && !tcpFlow.isConnected) {
+        if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(tcpFlow.sockets[Outbound], SOL_SOCKET, SO_ERROR, &error, &length);
+        if(error != 0) {
+            closeTcp(flow);
+            return;
+        }
+        tcpFlow.isConnected = true;
+        if(!flushTcp(flow, Outbound)) {
+            return;
+        }
+        events &= ~EPOLLOUT;
+    }
+    // The socket is read for the opposite direction
+    if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        readTcp(flow, 1 - side, now);
+        if(!tcpFlow.isOpen) {
+            return;
+        }
+    }
+    if(events & EPOLLOUT) {
+        if(!flushTcp(flow, side)) {
+            return;
+        }
+    }
+    updateTcpEvents(flow);
+}
+
+
+void ImpairmentProxy::Impl::readTcp(int flow, int direction, int64_t now)
+{
+    TcpFlow& tcpFlow = tcpFlows[flow];
+    const int source = tcpFlow.sockets[1 - direction];
+    while(!tcpFlow.isReadClosed[direction] && tcpFlow.pendingBytes[direction] < MaxPendingBytes) {
+        int index = allocatePacket(ChunkSize);
+        Packet& packet = pool[index];
+        ssize_t size = ::recv(source, packet.data.get(), ChunkSize, 0);
+        if(size <= 0) {
+            releasePacket(index);
+            if(size == 0) {
+                // Closed by the sender, which is passed on once the data before it has been written
+                tcpFlow.isReadClosed[direction] = true;
+                flushTcp(flow, direction);
+            } else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                closeTcp(flow);
+            }
+            return;
+        }
+        packet.size = size;
+        packet.direction = direction;
+        packet.flow = flow;
+        packet.serial = tcpFlow.serial;
+        tcpFlow.pendingBytes[direction] += size;
+        schedule(direction, index, now, true, tcpFlow.lastDeparture[direction]);
+        if(!tcpFlow.isOpen) {
+            return;
+        }
+    }
+}
+
+
+// Writes the delivered bytes of the direction and returns false when the flow has been closed
+bool ImpairmentProxy::Impl::flushTcp(int flow, int direction)
+{
+    TcpFlow& tcpFlow = tcpFlows[flow];
+    if(!tcpFlow.isConnected) {
+        return true;
+    }
+    string& buffer = tcpFlow.buffers[direction];
+    size_t& offset = tcpFlow.offsets[direction];
+    while(offset < buffer.size()) {
+        ssize_t size = ::send(tcpFlow.sockets[direction], buffer.data() + offset, buffer.size() - offset, MSG_NOSIGNAL);
+        if(size < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            closeTcp(flow);
+            return false;
+        }
+        offset += size;
+        tcpFlow.pendingBytes[direction] -= size;
+    }
+    if(offset == buffer.size()) {
+        buffer.clear();
+        offset = 0;
+    }
+    if(tcpFlow.isReadClosed[direction] && tcpFlow.pendingBytes[direction] == 0) {
+        shutdown(tcpFlow.sockets[direction], SHUT_WR);
+        if(tcpFlow.isReadClosed[1 - direction] && tcpFlow.pendingBytes[1 - direction] == 0) {
+            closeTcp(flow);
+            return false;
+        }
+    }
+    updateTcpEvents(flow);
+    return true;
+}
+
+
+void ImpairmentProxy::Impl::updateTcpEvents(int flow)
+{
+    TcpFlow& tcpFlow = tcpFlows[flow];
+    for(int side = 0; side < NumDirections; ++side) {
+        // The socket of a side is read for the opposite direction and written for its own
+        const int opposite = 1 - side;
+        uint32_t events = 0;
+        if(tcpFlow.isConnected && !tcpFlow.isReadClosed[opposite] && tcpFlow.pendingBytes[opposite] < MaxPendingBytes) {
+            events |= EPOLLIN;
+        }
+        if((side == Outbound && !tcpFlow.isConnected) || !tcpFlow.buffers[side].empty()) {
+            events |= EPOLLOUT;
+        }
+        if(events != tcpFlow.events[side]) {
+            epoll_event event;
+            event.events = events;
+            event.data.u64 = eventData(TcpSocketEvent, flow, side, tcpFlow.serial);
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, tcpFlow.sockets[side], &event);
+            tcpFlow.events[side] = events;
+        }
+    }
+}
+
+
+void ImpairmentProxy::Impl::closeTcp(int flow)
+{
+    TcpFlow& tcpFlow = tcpFlows[flow];
+    if(!tcpFlow.isOpen) {
+        return;
+    }
+    // The chunks left in the wheel are dropped on their delivery by the serial
+    for(int side = 0; side < NumDirections; ++side) {
+        ::close(tcpFlow.sockets[side]);
+        tcpFlow.sockets[side] = -1;
+        tcpFlow.buffers[side].clear();
+        tcpFlow.offsets[side] = 0;
+        tcpFlow.pendingBytes[side] = 0;
+    }
+    tcpFlow.isOpen = false;
+}
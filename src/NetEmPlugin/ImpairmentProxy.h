@@ -0,0 +1,68 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#ifndef CNOID_NETEM_PLUGIN_IMPAIRMENT_PROXY_H
+#define CNOID_NETEM_PLUGIN_IMPAIRMENT_PROXY_H
+
+#include <cstdint>
+#include <string>
+#include "NetlinkTrafficControl.h"
+
+namespace cnoid {
+
+// Relays UDP datagrams or TCP streams from a local port to a target and applies the
+// netem parameters in userspace, so neither root nor the kernel modules are needed.
+// The outbound parameters apply from the clients to the target, and the inbound ones
+// to the replies. The bytes of a TCP stream must arrive intact and in order, so its
+// chunks are only delayed and rate limited, and are neither lost nor reordered.
+class ImpairmentProxy
+{
+public:
+    enum Protocol { UDP, TCP };
+    enum Direction { Inbound, Outbound, NumDirections };
+
+    struct Statistics
+    {
+        uint64_t receivedPackets = 0;
+        uint64_t sentPackets = 0;
+        uint64_t sentBytes = 0;
+        uint64_t lostPackets = 0;      // dropped by the loss
+        uint64_t overflowedPackets = 0; // dropped beyond the limit of the queue
+        uint64_t reorderedPackets = 0;
+    };
+
+    ImpairmentProxy();
+    ~ImpairmentProxy();
+
+    // The port 0 lets the system choose one, which listenPort() returns after the start
+    bool start(Protocol protocol, int listenPort, const std::string& targetHost, int targetPort);
+    void stop();
+    bool isRunning() const;
+    int listenPort() const;
+
+    // May be called while running; the packets already scheduled keep their times
+    void setParameters(Direction direction, const NetemParameters& parameters);
+    NetemParameters parameters(Direction direction) const;
+
+    // Seeds the loss, jitter and reordering for reproducible runs
+    void setSeed(uint64_t seed);
+
+    // Each UDP client has its own socket to the target. The socket of a client that has
+    // sent and received nothing for the idle timeout is closed, and so is that of the least
+    // recently active one when a new client would exceed the maximum. The defaults are
+    // 60 s and 1024, and a change applies at the next start.
+    void setUdpFlowLimits(double idleTimeout, int maxFlows);
+    int numUdpFlows() const;
+
+    Statistics statistics(Direction direction) const;
+    const std::string& errorMessage() const;
+
+private:
+    class Impl;
+    Impl* impl;
+};
+
+}
+
+#endif // CNOID_NETEM_PLUGIN_IMPAIRMENT_PROXY_H
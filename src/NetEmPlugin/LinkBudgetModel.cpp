@@ -0,0 +1,229 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "LinkBudgetModel.h"
+#include <cnoid/Body>
+#include <cnoid/MeshExtractor>
+#include <cnoid/SceneDrawables>
+#include <cnoid/ValueTree>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+// SNRs of the slowest and the fastest rates of a typical wireless LAN
+const double MinimumSnr = 5.0;   // unit: dB
+const double MaximumRateSnr = 25.0; // unit: dB
+
+// The grid is coarsened until filling it takes at most this many ray-wall tests
+const double MaxGridTests = 5.0e7;
+const double MaxCells = 4.0e6;
+
+// Whether the segment from p to p + d passes through the box
+bool intersects(const Vector3& p, const Vector3& d, const Vector3& min, const Vector3& max)
+{
+    double t0 = 0.0;
+    double t1 = 1.0;
+    for(int k = 0; k < 3; ++k) {
+        if(fabs(d[k]) < 1.0e-12) {
+            if(p[k] < min[k] || p[k] > max[k]) {
+                return false;
+            }
+        } else {
+            double a = (min[k] - p[k]) / d[k];
+            double b = (max[k] - p[k]) / d[k];
+            if(a > b) {
+                std::swap(a, b);
+            }
+            t0 = std::max(t0, a);
+            t1 = std::min(t1, b);
+            if(t0 > t1) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool contains(const Vector3& min, const Vector3& max, const Vector3& p)
+{
+    return (p.array() >= min.array()).all() && (p.array() <= max.array()).all();
+}
+
+}
+
+
+LinkBudgetModel::LinkBudgetModel()
+{
+    gridOrigin.setZero();
+    gridSize[0] = gridSize[1] = gridSize[2] = 0;
+    cellSize_ = settings_.cellSize;
+}
+
+
+void LinkBudgetModel::setSettings(const Settings& settings)
+{
+    settings_ = settings;
+}
+
+
+void LinkBudgetModel::build(const vector<Body*>& staticBodies)
+{
+    walls.clear();
+    grid.clear();
+    gridSize[0] = gridSize[1] = gridSize[2] = 0;
+    cellSize_ = std::max(settings_.cellSize, 0.01);
+
+    MeshExtractor extractor;
+    for(auto& body : staticBodies) {
+        for(int i = 0; i < body->numLinks(); ++i) {
+            Link* link = body->link(i);
+            const double loss = link->info()->get("wall_loss", settings_.wallLoss);
+            if(loss <= 0.0 || !link->collisionShape()) {
+                continue;
+            }
+            extractor.extract(link->collisionShape(), [&](){
+                SgMesh* mesh = extractor.currentMesh();
+                const Affine3 T = link->T() * extractor.currentTransform();
+                Wall wall;
+                wall.min.setConstant(numeric_limits<double>::max());
+                wall.max.setConstant(-numeric_limits<double>::max());
+                for(auto& vertex : *mesh->vertices()) {
+                    const Vector3 v = T * vertex.cast<double>();
+                    wall.min = wall.min.cwiseMin(v);
+                    wall.max = wall.max.cwiseMax(v);
+                }
+                if(!mesh->vertices()->empty()) {
+                    wall.loss = loss;
+                    walls.push_back(wall);
+                }
+            });
+        }
+    }
+    if(walls.empty()) {
+        return;
+    }
+
+    Vector3 min = settings_.baseStation;
+    Vector3 max = settings_.baseStation;
+    for(auto& wall : walls) {
+        min = min.cwiseMin(wall.min);
+        max = max.cwiseMax(wall.max);
+    }
+    const Vector3 extent = max - min;
+    const double maxCells = std::min(MaxCells, MaxGridTests / walls.size());
+    while(true) {
+        double numCells = 1.0;
+        for(int k = 0; k < 3; ++k) {
+            gridSize[k] = (int)ceil(extent[k] / cellSize_) + 1;
+            numCells *= gridSize[k];
+        }
+        if(numCells <= maxCells) {
+            break;
+        }
+        cellSize_ *= std::max(cbrt(numCells / maxCells), 1.01);
+    }
+    gridOrigin = min;
+
+    grid.resize(gridSize[0] * gridSize[1] * gridSize[2]);
+    size_t index = 0;
+    for(int z = 0; z < gridSize[2]; ++z) {
+        for(int y = 0; y < gridSize[1]; ++y) {
+            for(int x = 0; x < gridSize[0]; ++x) {
+                grid[index++] = traceAttenuation(gridOrigin + Vector3(x, y, z) * cellSize_);
+            }
+        }
+    }
+}
+
+
+// The walls containing either end are skipped, such as the floor under a robot
+double LinkBudgetModel::traceAttenuation(const Vector3& position) const
+{
+    const Vector3& base = settings_.baseStation;
+    const Vector3 d = position - base;
+    double loss = 0.0;
+    for(auto& wall : walls) {
+        if(intersects(base, d, wall.min, wall.max)
+           && !contains(wall.min, wall.max, base) && !contains(wall.min, wall.max, position)) {
+            loss += wall.loss;
+        }
+    }
+    return loss;
+}
+
+
+// Interpolates the grid, so the attenuation changes gradually around the shadow of a wall
+double LinkBudgetModel::attenuation(const Vector3& position) const
+{
+    if(grid.empty()) {
+        return traceAttenuation(position);
+    }
+    int index[3];
+    double t[3];
+    for(int k = 0; k < 3; ++k) {
+        const double f = (position[k] - gridOrigin[k]) / cellSize_;
+        if(f < -0.5 || f > gridSize[k] - 0.5) {
+            return traceAttenuation(position);
+        }
+        if(gridSize[k] == 1) {
+            index[k] = 0;
+            t[k] = 0.0;
+        } else {
+            const double c = std::min(std::max(f, 0.0), gridSize[k] - 1.0);
+            index[k] = std::min((int)c, gridSize[k] - 2);
+            t[k] = c - index[k];
+        }
+    }
+    const int strides[3] = { 1, gridSize[0], gridSize[0] * gridSize[1] };
+    const size_t base = index[0] + index[1] * strides[1] + index[2] * strides[2];
+    double loss = 0.0;
+    for(int corner = 0; corner < 8; ++corner) {
+        double weight = 1.0;
+        size_t offset = base;
+        for(int k = 0; k < 3; ++k) {
+            if(corner & (1 << k)) {
+                weight *= t[k];
+                offset += strides[k];
+            } else {
+                weight *= 1.0 - t[k];
+            }
+        }
+        if(weight > 0.0) {
+            loss += weight * grid[offset];
+        }
+    }
+    return loss;
+}
+
+
+double LinkBudgetModel::snr(const Vector3& position) const
+{
+    const double distance = std::max((position - settings_.baseStation).norm(), 1.0);
+    const double pathLoss = settings_.referenceLoss + 10.0 * settings_.pathLossExponent * log10(distance);
+    return settings_.transmitPower - pathLoss - attenuation(position) - settings_.noiseFloor;
+}
+
+
+NetemParameters LinkBudgetModel::parameters(double snr) const
+{
+    double lossRatio;
+    if(settings_.fading > 0.0) {
+        lossRatio = 0.5 * erfc((snr - MinimumSnr) / (settings_.fading * M_SQRT2));
+    } else {
+        lossRatio = snr < MinimumSnr ? 1.0 : 0.0;
+    }
+    const double capacity = log2(1.0 + pow(10.0, snr / 10.0)) / log2(1.0 + pow(10.0, MaximumRateSnr / 10.0));
+
+    NetemParameters parameters;
+    parameters.delay = settings_.baseDelay / (1.0 - std::min(lossRatio, 0.99));
+    // The rate 0 would disable the limit
+    parameters.rate = std::max(settings_.maxRate * std::min(capacity, 1.0), 1.0);
+    parameters.loss = 100.0 * lossRatio;
+    return parameters;
+}
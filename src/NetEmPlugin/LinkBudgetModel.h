@@ -0,0 +1,75 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#ifndef CNOID_NETEM_PLUGIN_LINK_BUDGET_MODEL_H
+#define CNOID_NETEM_PLUGIN_LINK_BUDGET_MODEL_H
+
+#include <cnoid/EigenTypes>
+#include <vector>
+#include "NetlinkTrafficControl.h"
+
+namespace cnoid {
+
+class Body;
+
+// Estimates the netem parameters of a radio link to a base station from the range and the walls
+// in between. Each mesh of the static bodies is a wall by its bounding box. The attenuation of the
+// walls along the line of sight from the base station is computed on a grid when the model is built,
+// so evaluating a position during the simulation only interpolates the grid.
+class LinkBudgetModel
+{
+public:
+    struct Settings
+    {
+        Vector3 baseStation = Vector3::Zero(); // unit: m
+        double transmitPower = 20.0;  // unit: dBm
+        double referenceLoss = 40.0;  // unit: dB, the path loss at 1 m
+        double pathLossExponent = 2.5;
+        double wallLoss = 10.0;       // unit: dB, unless the link info gives "wall_loss"
+        double noiseFloor = -95.0;    // unit: dBm
+        double fading = 4.0;          // unit: dB, standard deviation of the shadowing
+        double baseDelay = 1.0;       // unit: ms
+        double maxRate = 10000.0;     // unit: kbps of tc
+        double cellSize = 1.0;        // unit: m, of the occlusion grid
+    };
+
+    LinkBudgetModel();
+
+    void setSettings(const Settings& settings);
+    const Settings& settings() const { return settings_; }
+
+    // Collects the walls of the bodies and fills the occlusion grid
+    void build(const std::vector<Body*>& staticBodies);
+    int numWalls() const { return (int)walls.size(); }
+    int numCells() const { return (int)grid.size(); }
+    double cellSize() const { return cellSize_; } // may be larger than the setting on a large world
+
+    double attenuation(const Vector3& position) const; // unit: dB of the walls in between
+    double snr(const Vector3& position) const;         // unit: dB
+
+    // The loss follows the shadowing around the SNR that the slowest rate needs, the rate the
+    // capacity up to the SNR of the fastest one, and the delay the retransmissions of the losses
+    NetemParameters parameters(double snr) const;
+
+private:
+    struct Wall
+    {
+        Vector3 min;
+        Vector3 max;
+        double loss;
+    };
+
+    double traceAttenuation(const Vector3& position) const;
+
+    Settings settings_;
+    std::vector<Wall> walls;
+    std::vector<float> grid;
+    Vector3 gridOrigin;
+    int gridSize[3];
+    double cellSize_;
+};
+
+}
+
+#endif // CNOID_NETEM_PLUGIN_LINK_BUDGET_MODEL_H
@@ -4,16 +4,26 @@
 
 #include "NetEm.h"
 #include <cnoid/Format>
+#include <cnoid/MessageView>
 #include <QProcess>
+#include <chrono>
 #include <net/if.h>
-#include <sys/ioctl.h>
 #include <stdlib.h>
-#include <sys/socket.h>
-#include <unistd.h>
+#include <algorithm>
+#include "NetlinkTrafficControl.h"
+#include "TrafficControlState.h"
+#include "gettext.h"
 
 using namespace std;
 using namespace cnoid;
 
+namespace {
+
+// The htb classes do not limit the rate, which is left to netem
+const char* htbClass = "htb rate 10gbit quantum 60000";
+
+}
+
 namespace cnoid {
 
 class NetEm::Impl
@@ -27,20 +37,36 @@ public:
     vector<string> ifbdevices;
     int currentInterfaceID;
     int currentIfbdeviceID;
-    string sourceIP;
-    string destinationIP;
-    double delays[2];
-    double rates[2];
-    double losses[2];
+    map<int, Flow> flows;
     bool isUpdated;
     bool isFinalized;
 
+    // What is installed on each device; unknown until the first update after the start
+    map<string, TrafficControlState> installedStates;
+    function<bool(const string& command)> commandExecutor;
+    NetlinkTrafficControl netlink;
+    bool isNetlinkEnabled;
+    bool isNetlinkFailed;
+    double lastLatency;
+    bool isLastInPlace;
+
+    Backend backend;
+    ImpairmentProxy proxy;
+    ImpairmentProxy::Protocol proxyProtocol;
+    int proxyListenPort;
+    string proxyTargetHost;
+    int proxyTargetPort;
+
     QProcess process;
 
     void start();
-    void write(const string& program);
+    bool write(const string& program);
     void clear();
     void update();
+    const string& device(int direction) const;
+    TrafficControlState desiredState(int direction) const;
+    bool apply(int direction, const TrafficControlState& desired);
+    bool changeInPlace(int direction, const TrafficControlState::NetemChange& change);
     void close();
 };
 
@@ -59,29 +85,33 @@ NetEm::Impl::Impl()
     ifbdevices.clear();
     currentInterfaceID = 0;
     currentIfbdeviceID = 0;
-    sourceIP = "0.0.0.0/0";
-    destinationIP = "0.0.0.0/0";
-    delays[0] = delays[1] = 0.0;
-    rates[0] = rates[1] = 0.0;
-    losses[0] = losses[1] = 0.0;
+    flows[0] = Flow();
     isUpdated = false;
     isFinalized = true;
+    isNetlinkEnabled = true;
+    isNetlinkFailed = false;
+    lastLatency = 0.0;
+    isLastInPlace = false;
+    backend = TrafficControl;
+    proxyProtocol = ImpairmentProxy::UDP;
+    proxyListenPort = 0;
+    proxyTargetHost = "127.0.0.1";
+    proxyTargetPort = 0;
+    commandExecutor = [](const string& command){ return system(command.c_str()) == 0; };
 
     // registration of interfaces
-    static int IFR_MAX = 10;
-    struct ifreq ifr[IFR_MAX];
-    struct ifconf ifc;
-    int fd = socket(AF_INET, SOCK_DGRAM, 0);
-
-    ifc.ifc_len = sizeof(ifr);
-    ifc.ifc_ifcu.ifcu_buf = (char*)ifr;
-    ioctl(fd, SIOCGIFCONF, &ifc);
-    int nifs = ifc.ifc_len / sizeof(struct ifreq);
-    for (int i = 0; i < nifs; ++i) {
-        string interface = ifr[i].ifr_name;
-        interfaces.push_back(interface);
+    // if_nameindex has no limit on the number of interfaces, unlike SIOCGIFCONF with a fixed buffer.
+    // The ifb devices only receive the mirrored traffic, so they are not listed.
+    struct if_nameindex* nameIndices = if_nameindex();
+    if(nameIndices) {
+        for(struct if_nameindex* p = nameIndices; p->if_index != 0; ++p) {
+            string interface = p->if_name;
+            if(interface.compare(0, 3, "ifb") != 0) {
+                interfaces.push_back(interface);
+            }
+        }
+        if_freenameindex(nameIndices);
     }
-    ::close(fd);
 
     // registration of ifbdevices
     ifbdevices.push_back("ifb0");
@@ -125,12 +155,24 @@ void NetEm::Impl::start()
     if(!isFinalized) {
         close();
     }
+    if(backend == UserspaceProxy) {
+        if(proxy.start(proxyProtocol, proxyListenPort, proxyTargetHost, proxyTargetPort)) {
+            MessageView::instance()->putln(
+                formatR(_("NetEm relays port {0} to {1}:{2}."), proxy.listenPort(), proxyTargetHost, proxyTargetPort));
+            isFinalized = false;
+        } else {
+            MessageView::instance()->putln(
+                formatR(_("NetEm cannot start the proxy ({0})."), proxy.errorMessage()), MessageView::Error);
+        }
+        return;
+    }
     write("sudo modprobe ifb;");
     write("sudo modprobe act_mirred;");
     write(formatC("sudo ip link set dev {0} up;",
                       ifbdevices[currentIfbdeviceID]));
     isUpdated = false;
     isFinalized = false;
+    isNetlinkFailed = false;
 }
 
 
@@ -143,44 +185,125 @@ void NetEm::update()
 void NetEm::Impl::update()
 {
     if(!isFinalized) {
-        clear();
-        write(formatC("sudo tc qdisc add dev {0} ingress handle ffff:;",
-                          interfaces[currentInterfaceID]));
-        write(formatC("sudo tc filter add dev {0} parent ffff: protocol ip u32 match u32 0 0 action mirred egress redirect dev {1};",
-                          interfaces[currentInterfaceID], ifbdevices[currentIfbdeviceID]));
-
-        string effects[2];
-        for(int i = 0 ; i < 2; ++i) {
-            if(delays[i] > 0.0) {
-               effects[i] +=  formatC(" delay {0:.2f}ms", delays[i]);
+        auto startTime = chrono::steady_clock::now();
+        isLastInPlace = false;
+        if(backend == UserspaceProxy) {
+            const Flow& flow = flows[0];
+            proxy.setParameters(ImpairmentProxy::Inbound, flow.parameters[0]);
+            proxy.setParameters(ImpairmentProxy::Outbound, flow.parameters[1]);
+            isLastInPlace = true;
+        } else {
+            bool isInPlace = isUpdated;
+            if(!isUpdated) {
+                // Whatever an earlier run left is unknown, so it is deleted once before the states are trusted
+                write(formatC("sudo tc qdisc del dev {0} ingress 2> /dev/null;", device(1)));
+                for(int i = 0; i < 2; ++i) {
+                    write(formatC("sudo tc qdisc del dev {0} root 2> /dev/null;", device(i)));
+                }
+                installedStates.clear();
             }
-            if(rates[i] > 0.0) {
-                effects[i] +=  formatC(" rate {0:.2f}kbps", rates[i]);
-            }
-            if(losses[i] > 0.0) {
-                effects[i] +=  formatC(" loss {0:.2f}%", losses[i]);
+            // The ifb device comes first, as the ingress of the interface redirects to it
+            for(int i = 0; i < 2; ++i) {
+                if(!apply(i, desiredState(i))) {
+                    isInPlace = false;
+                }
             }
+            // The state of a device whose commands failed is unknown, so the trees are rebuilt next time
+            isUpdated = installedStates.size() == 2;
+            isLastInPlace = isInPlace;
         }
+        lastLatency = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+    }
+}
 
-        write(formatC("sudo tc qdisc add dev {0} root handle 1: prio bands 16 priomap 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0;",
-                          ifbdevices[currentIfbdeviceID]));
-        write(formatC("sudo tc qdisc add dev {0} parent 1:1 handle 10: netem limit 2000;",
-                          ifbdevices[currentIfbdeviceID]));
-        write(formatC("sudo tc qdisc add dev {0} parent 1:2 handle 20: netem limit 2000{1};",
-                          ifbdevices[currentIfbdeviceID], effects[0]));
-        write(formatC("sudo tc filter add dev {0} protocol ip parent 1: prio 2 u32 match ip src {1} match ip dst {2} flowid 1:2;",
-                          ifbdevices[currentIfbdeviceID], destinationIP, sourceIP));
 
-        write(formatC("sudo tc qdisc add dev {0} root handle 1: prio bands 16 priomap 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0;",
-                          interfaces[currentInterfaceID]));
-        write(formatC("sudo tc qdisc add dev {0} parent 1:1 handle 10: netem limit 2000;",
-                          interfaces[currentInterfaceID]));
-        write(formatC("sudo tc qdisc add dev {0} parent 1:2 handle 20: netem limit 2000{1};",
-                          interfaces[currentInterfaceID], effects[1]));
-        write(formatC("sudo tc filter add dev {0} protocol ip parent 1: prio 2 u32 match ip src {1} match ip dst {2} flowid 1:2;",
-                          interfaces[currentInterfaceID], sourceIP, destinationIP));
-        isUpdated = true;
+// [0] inbound through the ifb device and [1] outbound through the interface
+const string& NetEm::Impl::device(int direction) const
+{
+    return direction == 0 ? ifbdevices[currentIfbdeviceID] : interfaces[currentInterfaceID];
+}
+
+
+// Flow n is the htb class 1:n+2 with the netem qdisc n+20:, as flow 0 was the band 1:2 with 20:.
+// The filters are tried in the order of their priorities, so flow 0 takes what the others leave,
+// and the packets of no flow go to the class 1:1.
+TrafficControlState NetEm::Impl::desiredState(int direction) const
+{
+    using Handle = NetlinkTrafficControl;
+    TrafficControlState state;
+    state.addQdisc(TrafficControlState::Root, Handle::handle(1, 0), "htb", "default 1");
+    state.addClass(Handle::handle(1, 0), Handle::handle(1, 1), htbClass);
+    state.addNetem(Handle::handle(1, 1), Handle::handle(0x10, 0), NetemParameters());
+
+    for(auto& p : flows) {
+        const int id = p.first;
+        const Flow& flow = p.second;
+        const uint32_t classid = Handle::handle(1, id + 2);
+        state.addClass(Handle::handle(1, 0), classid, htbClass);
+        state.addNetem(classid, Handle::handle(id + 0x20, 0), flow.parameters[direction]);
+
+        // Inbound packets come from the remote side and outbound ones go to it
+        const string& source = direction == 0 ? flow.destinationIP : flow.sourceIP;
+        const string& destination = direction == 0 ? flow.sourceIP : flow.destinationIP;
+        string port;
+        if(flow.port > 0) {
+            port = formatC(" match ip {0} {1} 0xffff", direction == 0 ? "sport" : "dport", flow.port);
+        }
+        state.addFilter(Handle::handle(1, 0), id > 0 ? id : MaxFlows,
+                        formatC("u32 match ip src {0} match ip dst {1}{2} flowid {3}",
+                                source, destination, port, TrafficControlState::handleName(classid)));
+    }
+
+    if(direction == 1) {
+        state.addQdisc(TrafficControlState::Ingress, Handle::handle(0xffff, 0), "ingress");
+        state.addFilter(Handle::handle(0xffff, 0), 1,
+                        formatC("u32 match u32 0 0 action mirred egress redirect dev {0}", device(0)));
+    }
+    return state;
+}
+
+
+// Returns false if tc commands were needed
+bool NetEm::Impl::apply(int direction, const TrafficControlState& desired)
+{
+    TrafficControlState& installed = installedStates[device(direction)];
+    vector<string> commands;
+    vector<TrafficControlState::NetemChange> changes;
+    installed.diff(device(direction), desired, commands, changes);
+    bool isWritten = true;
+    for(auto& command : commands) {
+        isWritten &= write(command);
+    }
+    bool isInPlace = commands.empty();
+    for(auto& change : changes) {
+        if(!changeInPlace(direction, change)) {
+            isWritten &= write(TrafficControlState::changeCommand(device(direction), change));
+            isInPlace = false;
+        }
+    }
+    if(isWritten) {
+        installed = desired;
+    } else {
+        installedStates.erase(device(direction));
+    }
+    return isInPlace;
+}
+
+
+bool NetEm::Impl::changeInPlace(int direction, const TrafficControlState::NetemChange& change)
+{
+    if(!isNetlinkEnabled || isNetlinkFailed) {
+        return false;
+    }
+    if(netlink.changeNetem(device(direction), change.parent, change.handle, change.parameters)) {
+        return true;
     }
+    // Typically the process lacks CAP_NET_ADMIN, so the tc commands are used until the next start
+    isNetlinkFailed = true;
+    MessageView::instance()->putln(
+        formatR(_("NetEm cannot change the qdiscs through netlink ({0}). tc commands are used instead."),
+                netlink.errorMessage()), MessageView::Warning);
+    return false;
 }
 
 
@@ -190,15 +313,14 @@ void NetEm::stop()
 }
 
 
+// Deleting the qdiscs at the top deletes the rest of the trees
 void NetEm::Impl::clear()
 {
     if(isUpdated) {
-        write(formatC("sudo tc qdisc del dev {0} ingress;",
-                          interfaces[currentInterfaceID]));
-        write(formatC("sudo tc qdisc del dev {0} root;",
-                          ifbdevices[currentIfbdeviceID]));
-        write(formatC("sudo tc qdisc del dev {0} root;",
-                          interfaces[currentInterfaceID]));
+        for(int i = 1; i >= 0; --i) {
+            apply(i, TrafficControlState());
+        }
+        installedStates.clear();
         isUpdated = false;
     }
 }
@@ -206,6 +328,10 @@ void NetEm::Impl::clear()
 
 void NetEm::Impl::close()
 {
+    if(proxy.isRunning()) {
+        proxy.stop();
+        isFinalized = true;
+    }
     if(!isFinalized) {
         clear();
         write(formatC("sudo ip link set dev {0} down;",
@@ -215,38 +341,141 @@ void NetEm::Impl::close()
     }
 }
 
-
 void NetEm::setDelay(const int& id, const double& delay)
 {
-    impl->delays[id] = delay;
+    impl->flows[0].parameters[id].delay = delay;
+}
+
+
+void NetEm::setJitter(const int& id, const double& jitter)
+{
+    impl->flows[0].parameters[id].jitter = jitter;
+}
+
+
+void NetEm::setDistribution(const int& id, const NetemParameters::Distribution& distribution)
+{
+    impl->flows[0].parameters[id].distribution = distribution;
 }
 
 
 void NetEm::setRate(const int& id, const double& rate)
 {
-    impl->rates[id] = rate;
+    impl->flows[0].parameters[id].rate = rate;
 }
 
 
 void NetEm::setLoss(const int& id, const double& loss)
 {
-    impl->losses[id] = loss;
+    impl->flows[0].parameters[id].loss = loss;
+}
+
+
+void NetEm::setReorder(const int& id, const double& reorder)
+{
+    impl->flows[0].parameters[id].reorder = reorder;
 }
 
 
 void NetEm::setSourceIP(const string& sourceIP)
 {
-    impl->sourceIP = sourceIP;
+    impl->flows[0].sourceIP = sourceIP;
 }
 
 
 void NetEm::setDestinationIP(const string& destinationIP)
 {
-    impl->destinationIP = destinationIP;
+    impl->flows[0].destinationIP = destinationIP;
+}
+
+
+bool NetEm::setFlow(int id, const Flow& flow)
+{
+    if(id < 0 || id >= MaxFlows) {
+        return false;
+    }
+    impl->flows[id] = flow;
+    return true;
+}
+
+
+void NetEm::removeFlow(int id)
+{
+    impl->flows.erase(id);
+}
+
+
+void NetEm::clearFlows()
+{
+    auto& flows = impl->flows;
+    flows.erase(flows.upper_bound(0), flows.end());
+}
+
+
+const map<int, NetEm::Flow>& NetEm::flows() const
+{
+    return impl->flows;
+}
+
+
+void NetEm::setBackend(Backend backend)
+{
+    impl->backend = backend;
+}
+
+
+NetEm::Backend NetEm::backend() const
+{
+    return impl->backend;
+}
+
+
+void NetEm::setProxy(ImpairmentProxy::Protocol protocol, int listenPort, const string& targetHost, int targetPort)
+{
+    impl->proxyProtocol = protocol;
+    impl->proxyListenPort = listenPort;
+    impl->proxyTargetHost = targetHost;
+    impl->proxyTargetPort = targetPort;
+}
+
+
+ImpairmentProxy& NetEm::proxy()
+{
+    return impl->proxy;
+}
+
+
+void NetEm::setNetlinkEnabled(bool on)
+{
+    impl->isNetlinkEnabled = on;
+}
+
+
+void NetEm::setCommandExecutor(function<bool(const string& command)> executor)
+{
+    impl->commandExecutor = executor;
+}
+
+
+bool NetEm::isNetlinkEnabled() const
+{
+    return impl->isNetlinkEnabled;
+}
+
+
+double NetEm::lastUpdateLatency() const
+{
+    return impl->lastLatency;
+}
+
+
+bool NetEm::isLastUpdateInPlace() const
+{
+    return impl->isLastInPlace;
 }
 
 
-void NetEm::Impl::write(const string& program)
+bool NetEm::Impl::write(const string& program)
 {
-    int ret = system(program.c_str());
+    return commandExecutor(program);
 }
@@ -6,7 +6,11 @@
 #define CNOID_NETEM_PLUGIN_NETEM_H
 
 #include <cnoid/Referenced>
+#include <functional>
+#include <map>
+#include <string>
 #include <vector>
+#include "ImpairmentProxy.h"
 
 namespace cnoid {
 
@@ -16,6 +20,15 @@ public:
     NetEm();
     virtual ~NetEm();
 
+    // TrafficControl shapes the interface with tc and needs sudo. UserspaceProxy relays the
+    // traffic sent to a local port instead, without any privilege, and ignores the addresses.
+    // The proxy applies the parameters of flow 0 only.
+    enum Backend { TrafficControl, UserspaceProxy };
+    void setBackend(Backend backend);
+    Backend backend() const;
+    void setProxy(ImpairmentProxy::Protocol protocol, int listenPort, const std::string& targetHost, int targetPort);
+    ImpairmentProxy& proxy();
+
     std::vector<std::string>& interfaces() const;
 
     void start(const int& interfaceID = 0, const int& ifbdeviceID = 0);
@@ -23,11 +36,48 @@ public:
     void stop();
 
     void setDelay(const int& id, const double& delay);
+    void setJitter(const int& id, const double& jitter);
+    void setDistribution(const int& id, const NetemParameters::Distribution& distribution);
     void setRate(const int& id, const double& rate);
     void setLoss(const int& id, const double& loss);
+    void setReorder(const int& id, const double& reorder);
     void setSourceIP(const std::string& sourceIP);
     void setDestinationIP(const std::string& destinationIP);
 
+    // A flow is the traffic between the local and the remote addresses, optionally to a remote
+    // port, shaped by netem qdiscs of its own. update() compares the qdiscs, classes and filters
+    // the flows need with the installed ones and changes only the differences, so the queues of
+    // the other flows are kept.
+    // The setters above change flow 0, which takes the traffic no other flow matches.
+    struct Flow
+    {
+        std::string sourceIP = "0.0.0.0/0";      // local side
+        std::string destinationIP = "0.0.0.0/0"; // remote side
+        int port = 0; // remote port, 0 matches any
+        NetemParameters parameters[2]; // [0] inbound, [1] outbound
+
+        bool isSameFilter(const Flow& rhs) const {
+            return sourceIP == rhs.sourceIP && destinationIP == rhs.destinationIP && port == rhs.port;
+        }
+    };
+    enum { MaxFlows = 0x1000 };
+    bool setFlow(int id, const Flow& flow);
+    void removeFlow(int id);
+    void clearFlows(); // removes all the flows except flow 0
+    const std::map<int, Flow>& flows() const;
+
+    // Changes the installed netem qdiscs in place through rtnetlink when only their parameters
+    // change, and otherwise runs tc commands for the changed flows (default: true)
+    void setNetlinkEnabled(bool on);
+    bool isNetlinkEnabled() const;
+
+    // Runs the shell commands, which are system() by default; a check may record them instead
+    void setCommandExecutor(std::function<bool(const std::string& command)> executor);
+
+    // Time taken by the last update and whether it was done in place
+    double lastUpdateLatency() const; // unit: ms
+    bool isLastUpdateInPlace() const;
+
 private:
     class Impl;
     Impl* impl;
@@ -0,0 +1,216 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "NetlinkTrafficControl.h"
+#include <cnoid/Format>
+#include <linux/netlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <limits>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+// Request of RTM_NEWQDISC with room for its attributes
+struct QdiscRequest
+{
+    nlmsghdr header;
+    tcmsg message;
+    char attributes[512];
+};
+
+rtattr* addAttribute(QdiscRequest* request, int type, const void* data, int length)
+{
+    nlmsghdr* header = &request->header;
+    rtattr* attribute = (rtattr*)((char*)request + NLMSG_ALIGN(header->nlmsg_len));
+    attribute->rta_type = type;
+    attribute->rta_len = RTA_LENGTH(length);
+    if(length > 0) {
+        memcpy(RTA_DATA(attribute), data, length);
+    }
+    header->nlmsg_len = NLMSG_ALIGN(header->nlmsg_len) + RTA_ALIGN(attribute->rta_len);
+    return attribute;
+}
+
+// The kernel counts the latency of tc_netem_qopt in scheduler ticks of 64 ns
+uint32_t toTicks(int64_t nanoseconds)
+{
+    return (uint32_t)std::min<int64_t>(nanoseconds >> 6, numeric_limits<uint32_t>::max());
+}
+
+// Probabilities are fractions of UINT32_MAX
+uint32_t toProbability(double percent)
+{
+    return (uint32_t)llround(std::min(std::max(percent, 0.0), 100.0) / 100.0 * numeric_limits<uint32_t>::max());
+}
+
+}
+
+
+const char* NetemParameters::distributionName(Distribution distribution)
+{
+    static const char* names[] = { "uniform", "normal", "pareto", "paretonormal" };
+    return (distribution >= Uniform && distribution < NumDistributions) ? names[distribution] : names[Uniform];
+}
+
+
+NetlinkTrafficControl::NetlinkTrafficControl()
+{
+    socket_ = -1;
+    sequence_ = 0;
+    error_ = 0;
+}
+
+
+NetlinkTrafficControl::~NetlinkTrafficControl()
+{
+    close();
+}
+
+
+bool NetlinkTrafficControl::open()
+{
+    if(socket_ >= 0) {
+        return true;
+    }
+    socket_ = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if(socket_ < 0) {
+        return setError(errno, "socket");
+    }
+    // An unanswered request must not block the caller
+    timeval timeout = { 1, 0 };
+    setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    if(::bind(socket_, (sockaddr*)&address, sizeof(address)) < 0) {
+        int e = errno;
+        close();
+        return setError(e, "bind");
+    }
+    sequence_ = (uint32_t)time(nullptr);
+    return true;
+}
+
+
+void NetlinkTrafficControl::close()
+{
+    if(socket_ >= 0) {
+        ::close(socket_);
+        socket_ = -1;
+    }
+}
+
+
+bool NetlinkTrafficControl::changeNetem(const string& device, uint32_t parent, uint32_t handle, const NetemParameters& parameters)
+{
+    if(!open()) {
+        return false;
+    }
+    int index = if_nametoindex(device.c_str());
+    if(index == 0) {
+        return setError(errno, formatC("if_nametoindex({0})", device));
+    }
+
+    QdiscRequest request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(tcmsg));
+    request.header.nlmsg_type = RTM_NEWQDISC;
+    // Neither NLM_F_CREATE nor NLM_F_REPLACE, that is "tc qdisc change"
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    request.header.nlmsg_seq = ++sequence_;
+    request.message.tcm_family = AF_UNSPEC;
+    request.message.tcm_ifindex = index;
+    request.message.tcm_parent = parent;
+    request.message.tcm_handle = handle;
+    addAttribute(&request, TCA_KIND, "netem", sizeof("netem"));
+
+    const int64_t latency = llround(std::max(parameters.delay, 0.0) * 1.0e6);
+    const int64_t jitter = llround(std::max(parameters.jitter, 0.0) * 1.0e6);
+    tc_netem_qopt options;
+    memset(&options, 0, sizeof(options));
+    options.latency = toTicks(latency);
+    options.jitter = toTicks(jitter);
+    options.limit = parameters.limit;
+    options.loss = toProbability(parameters.loss);
+    // Every packet may be reordered, as tc sets the gap when only the probability is given
+    const bool isReordered = parameters.reorder > 0.0 && options.latency > 0;
+    options.gap = isReordered ? 1 : 0;
+
+    // The netem options are the struct followed by its own attributes, without the nested flag.
+    // Every field is sent, because the kernel keeps the value of an omitted attribute.
+    // The 64 bit times are only added where the ticks overflow, as tc does for older kernels.
+    rtattr* nest = addAttribute(&request, TCA_OPTIONS, &options, sizeof(options));
+    if(options.latency == numeric_limits<uint32_t>::max()) {
+        addAttribute(&request, TCA_NETEM_LATENCY64, &latency, sizeof(latency));
+    }
+    if(options.jitter == numeric_limits<uint32_t>::max()) {
+        addAttribute(&request, TCA_NETEM_JITTER64, &jitter, sizeof(jitter));
+    }
+    if(isReordered) {
+        tc_netem_reorder reorder;
+        memset(&reorder, 0, sizeof(reorder));
+        reorder.probability = toProbability(parameters.reorder);
+        addAttribute(&request, TCA_NETEM_REORDER, &reorder, sizeof(reorder));
+    }
+    const uint64_t bytesPerSecond = llround(std::max(parameters.rate, 0.0) * 1000.0);
+    tc_netem_rate rate;
+    memset(&rate, 0, sizeof(rate));
+    rate.rate = (uint32_t)std::min<uint64_t>(bytesPerSecond, numeric_limits<uint32_t>::max());
+    addAttribute(&request, TCA_NETEM_RATE, &rate, sizeof(rate));
+    if(bytesPerSecond >= numeric_limits<uint32_t>::max()) {
+        addAttribute(&request, TCA_NETEM_RATE64, &bytesPerSecond, sizeof(bytesPerSecond));
+    }
+    nest->rta_len = (char*)&request + request.header.nlmsg_len - (char*)nest;
+
+    sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if(::sendto(socket_, &request, request.header.nlmsg_len, 0, (sockaddr*)&kernel, sizeof(kernel)) < 0) {
+        return setError(errno, "sendto");
+    }
+
+    char buffer[4096];
+    while(true) {
+        ssize_t size = ::recv(socket_, buffer, sizeof(buffer), 0);
+        if(size < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return setError(errno, "recv");
+        }
+        for(nlmsghdr* header = (nlmsghdr*)buffer; NLMSG_OK(header, (size_t)size); header = NLMSG_NEXT(header, size)) {
+            if(header->nlmsg_seq != sequence_ || header->nlmsg_type != NLMSG_ERROR) {
+                continue;
+            }
+            const nlmsgerr* ack = (const nlmsgerr*)NLMSG_DATA(header);
+            if(ack->error != 0) {
+                return setError(-ack->error, formatC("netem change on {0}", device));
+            }
+            error_ = 0;
+            errorMessage_.clear();
+            return true;
+        }
+    }
+}
+
+
+bool NetlinkTrafficControl::setError(int error, const string& message)
+{
+    error_ = error;
+    errorMessage_ = message + ": " + strerror(error);
+    return false;
+}
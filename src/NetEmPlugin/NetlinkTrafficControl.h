@@ -0,0 +1,71 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#ifndef CNOID_NETEM_PLUGIN_NETLINK_TRAFFIC_CONTROL_H
+#define CNOID_NETEM_PLUGIN_NETLINK_TRAFFIC_CONTROL_H
+
+#include <cstdint>
+#include <string>
+
+namespace cnoid {
+
+// Parameters of a netem qdisc in the units of the tc command line
+struct NetemParameters
+{
+    // Distribution of the jitter; the others than Uniform need the tables of tc
+    enum Distribution { Uniform, Normal, Pareto, ParetoNormal, NumDistributions };
+
+    double delay = 0.0;  // unit: ms
+    double jitter = 0.0; // unit: ms
+    Distribution distribution = Uniform;
+    double rate = 0.0;   // unit: kbps of tc, that is 1000 bytes/s; 0 disables the limit
+    double loss = 0.0;   // unit: %
+    double reorder = 0.0; // unit: %, the packets sent without the delay
+    int limit = 2000;    // unit: packets
+
+    bool operator==(const NetemParameters& rhs) const {
+        return delay == rhs.delay && jitter == rhs.jitter && distribution == rhs.distribution
+            && rate == rhs.rate && loss == rhs.loss && reorder == rhs.reorder && limit == rhs.limit;
+    }
+    bool operator!=(const NetemParameters& rhs) const { return !(*this == rhs); }
+
+    // Names used by tc, e.g. "paretonormal"
+    static const char* distributionName(Distribution distribution);
+};
+
+// Changes existing netem qdiscs through a rtnetlink socket instead of running tc.
+// The qdisc is modified in place, so the packets queued in it and the rest of the
+// tree are kept. The process needs CAP_NET_ADMIN.
+// The distribution table is not sent, so the one installed by tc stays in effect.
+class NetlinkTrafficControl
+{
+public:
+    NetlinkTrafficControl();
+    ~NetlinkTrafficControl();
+
+    bool open();
+    void close();
+    bool isOpen() const { return socket_ >= 0; }
+
+    // Handles are written as in tc, e.g. handle(0x20, 0) for "20:" and handle(1, 2) for "1:2"
+    static uint32_t handle(uint32_t major, uint32_t minor) { return (major << 16) | (minor & 0xffff); }
+
+    bool changeNetem(const std::string& device, uint32_t parent, uint32_t handle, const NetemParameters& parameters);
+
+    // errno of the last failure and its description
+    int error() const { return error_; }
+    const std::string& errorMessage() const { return errorMessage_; }
+
+private:
+    bool setError(int error, const std::string& message);
+
+    int socket_;
+    uint32_t sequence_;
+    int error_;
+    std::string errorMessage_;
+};
+
+}
+
+#endif // CNOID_NETEM_PLUGIN_NETLINK_TRAFFIC_CONTROL_H
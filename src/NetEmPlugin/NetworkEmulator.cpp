@@ -8,6 +8,7 @@
 #include <cnoid/ComboBox>
 #include <cnoid/Dialog>
 #include <cnoid/ExtensionManager>
+#include <cnoid/Format>
 #include <cnoid/MainMenu>
 #include <cnoid/Separator>
 #include <cnoid/SpinBox>
@@ -29,6 +30,7 @@ public:
 
 private:
     void on_startButton_toggled(bool checked);
+    void update();
 
     enum { In, Out, NumInterfaces };
 
@@ -36,8 +38,10 @@ private:
     QComboBox* interfaceComboBox;
     QComboBox* ifbdeviceComboBox;
     QDoubleSpinBox* delaySpinBoxes[NumInterfaces];
+    QDoubleSpinBox* jitterSpinBoxes[NumInterfaces];
     QDoubleSpinBox* rateSpinBoxes[NumInterfaces];
     QDoubleSpinBox* lossSpinBoxes[NumInterfaces];
+    QLabel* statusLabel;
     QPushButton* startButton;
     QDialogButtonBox* buttonBox;
 };
@@ -87,22 +91,37 @@ EmulatorDialog::EmulatorDialog(QWidget* parent)
     for(int i = 0; i < NumInterfaces; ++i) {
         delaySpinBoxes[i] = new QDoubleSpinBox;
         delaySpinBoxes[i]->setRange(0.0, 100000.0);
+        jitterSpinBoxes[i] = new QDoubleSpinBox;
+        jitterSpinBoxes[i]->setRange(0.0, 100000.0);
         rateSpinBoxes[i] = new QDoubleSpinBox;
         rateSpinBoxes[i]->setRange(0.0, 11000000.0);
         lossSpinBoxes[i] = new QDoubleSpinBox;
         lossSpinBoxes[i]->setRange(0.0, 100.0);
+
+        // The running emulator follows the values, in place where possible
+        for(auto spinBox : { delaySpinBoxes[i], jitterSpinBoxes[i], rateSpinBoxes[i], lossSpinBoxes[i] }) {
+            connect(spinBox, &QDoubleSpinBox::editingFinished, [&](){
+                if(startButton->isChecked()) {
+                    update();
+                }
+            });
+        }
     }
 
     auto formLayout = new QFormLayout;
     formLayout->addRow(_("Interface"), interfaceComboBox);
     formLayout->addRow(_("IFB Device"), ifbdeviceComboBox);
     formLayout->addRow(_("Inbound Delay [ms]"), delaySpinBoxes[In]);
+    formLayout->addRow(_("Inbound Jitter [ms]"), jitterSpinBoxes[In]);
     formLayout->addRow(_("Inbound Rate [kbit/s]"), rateSpinBoxes[In]);
     formLayout->addRow(_("Inbound Loss [%]"), lossSpinBoxes[In]);
     formLayout->addRow(_("Outbound Delay [ms]"), delaySpinBoxes[Out]);
+    formLayout->addRow(_("Outbound Jitter [ms]"), jitterSpinBoxes[Out]);
     formLayout->addRow(_("Outbound Rate [kbit/s]"), rateSpinBoxes[Out]);
     formLayout->addRow(_("Outbound Loss [%]"), lossSpinBoxes[Out]);
 
+    statusLabel = new QLabel;
+
     buttonBox = new QDialogButtonBox(this);
     startButton = new QPushButton(_("&Start"));
     startButton->setCheckable(true);
@@ -111,6 +130,7 @@ EmulatorDialog::EmulatorDialog(QWidget* parent)
 
     auto mainLayout = new QVBoxLayout;
     mainLayout->addLayout(formLayout);
+    mainLayout->addWidget(statusLabel);
     mainLayout->addStretch();
     mainLayout->addWidget(new HSeparator);
     mainLayout->addWidget(buttonBox);
@@ -125,14 +145,23 @@ void EmulatorDialog::on_startButton_toggled(bool checked)
     if(checked) {
         startButton->setText(_("&Stop"));
         emulator->start(interfaceComboBox->currentIndex(), ifbdeviceComboBox->currentIndex());
-        for(int i = 0; i < NumInterfaces; ++i) {
-            emulator->setDelay(i, delaySpinBoxes[i]->value());
-            emulator->setRate(i, rateSpinBoxes[i]->value());
-            emulator->setLoss(i, lossSpinBoxes[i]->value());
-        }
-        emulator->update();
+        update();
     } else {
         startButton->setText(_("&Start"));
         emulator->stop();
     }
-}
\ No newline at end of file
+}
+
+
+void EmulatorDialog::update()
+{
+    for(int i = 0; i < NumInterfaces; ++i) {
+        emulator->setDelay(i, delaySpinBoxes[i]->value());
+        emulator->setJitter(i, jitterSpinBoxes[i]->value());
+        emulator->setRate(i, rateSpinBoxes[i]->value());
+        emulator->setLoss(i, lossSpinBoxes[i]->value());
+    }
+    emulator->update();
+    statusLabel->setText(formatR(_("Last update: {0:.1f} ms ({1})"), emulator->lastUpdateLatency(),
+                                 emulator->isLastUpdateInPlace() ? _("netlink, in place") : _("tc commands")).c_str());
+}
@@ -5,13 +5,23 @@
 #include "NetworkEmulatorItem.h"
 #include <cnoid/Archive>
 #include <cnoid/Body>
+#include <cnoid/EigenArchive>
+#include <cnoid/EigenUtil>
 #include <cnoid/ItemManager>
 #include <cnoid/LazyCaller>
+#include <cnoid/MessageView>
 #include <cnoid/PutPropertyFunction>
 #include <cnoid/SimulatorItem>
 #include <cnoid/WorldItem>
 #include <cnoid/MultiColliderItem>
+#include <cnoid/Format>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include "LinkBudgetModel.h"
 #include "NetEm.h"
+#include "NetlinkTrafficControl.h"
 #include "gettext.h"
 
 using namespace std;
@@ -32,6 +42,15 @@ vector<string> split(const string& s, char delim)
     return elements;
 }
 
+string trimmed(const string& s)
+{
+    size_t begin = s.find_first_not_of(" \t");
+    if(begin == string::npos) {
+        return string();
+    }
+    return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
 bool checkIP(const string& address)
 {
     bool result = false;
@@ -54,6 +73,49 @@ bool checkIP(const string& address)
     return result;
 }
 
+// Effective parameters of the links, [0] inbound through the ifb device and [1] outbound through the interface
+typedef NetEm::Flow LinkState;
+
+// A flow of NetEm and the bodies whose positions set it. Flow 0 is shared by the bodies given no
+// address, and the others belong to one robot each, whose address the colliders do not change.
+struct Flow
+{
+    vector<Body*> bodies;
+    bool isRobotFlow = false;
+    bool isRequested = false;
+    bool isApplied = false;
+    LinkState targetState;
+    LinkState appliedState;
+};
+
+// TC colliders switch between the presets of the colliders the bodies are in, and LinkBudget
+// degrades the links continuously with the range to the base station and the walls in between
+enum LinkModel { ColliderModel, LinkBudget };
+
+// A step of 0 leaves the value as it is
+double quantize(double value, double step)
+{
+    return step > 0.0 ? round(value / step) * step : value;
+}
+
+// Rounds to a power of the ratio, so that the steps are relative like the rate hysteresis
+double quantizeRatio(double value, double ratio)
+{
+    if(value <= 0.0 || ratio <= 1.0) {
+        return value;
+    }
+    return pow(ratio, round(log(value) / log(ratio)));
+}
+
+// Turning an effect on or off is always a change, otherwise the difference must exceed the threshold
+bool exceeds(double value, double applied, double threshold)
+{
+    if((value > 0.0) != (applied > 0.0)) {
+        return true;
+    }
+    return fabs(value - applied) > threshold;
+}
+
 }
 
 namespace cnoid {
@@ -67,13 +129,36 @@ public:
     Impl(NetworkEmulatorItem* self, const Impl& org);
 
     NetEmPtr netem;
-    vector<Body*> bodies;
+    vector<Flow> flows;
     Selection interface;
     Selection ifbDevice;
+    Selection backend;
+    Selection proxyProtocol;
+    int proxyListenPort;
+    string proxyTarget;
+    string robotFlows;
     ItemList<MultiColliderItem> colliders;
+    Selection linkModel;
+    LinkBudgetModel::Settings linkBudget;
+    LinkBudgetModel linkBudgetModel;
+    double samplingRate;
+    double lastSampleTime;
+    SimulatorItem* simulatorItem;
+
+    double lastUpdateTime;
+    double minUpdateInterval;
+    double delayHysteresis;
+    double rateHysteresis;
+    double lossHysteresis;
+    int numIssuedUpdates;
+    int numSuppressedUpdates;
 
     bool initializeSimulation(SimulatorItem* simulatorItem);
     void onPreDynamics();
+    int applyColliders();
+    int sampleLinkBudget(double time);
+    bool isChanged(const Flow& flow) const;
+    void issueUpdate(double time, const vector<int>& changedFlows);
 };
 
 }
@@ -98,8 +183,16 @@ NetworkEmulatorItem::Impl::Impl(NetworkEmulatorItem* self)
     : self(self)
 {
     netem = new NetEm;
-    bodies.clear();
+    flows.clear();
     colliders.clear();
+    simulatorItem = nullptr;
+    lastUpdateTime = 0.0;
+    minUpdateInterval = 0.1;
+    delayHysteresis = 1.0;
+    rateHysteresis = 5.0;
+    lossHysteresis = 0.5;
+    numIssuedUpdates = 0;
+    numSuppressedUpdates = 0;
 
     for(size_t i = 0; i < netem->interfaces().size(); ++i) {
         interface.setSymbol(i, netem->interfaces()[i]);
@@ -107,6 +200,17 @@ NetworkEmulatorItem::Impl::Impl(NetworkEmulatorItem* self)
 
     ifbDevice.setSymbol(0, N_("ifb0"));
     ifbDevice.setSymbol(1, N_("ifb1"));
+
+    backend.setSymbol(NetEm::TrafficControl, N_("tc"));
+    backend.setSymbol(NetEm::UserspaceProxy, N_("Userspace proxy"));
+    proxyProtocol.setSymbol(ImpairmentProxy::UDP, N_("UDP"));
+    proxyProtocol.setSymbol(ImpairmentProxy::TCP, N_("TCP"));
+    proxyListenPort = 0;
+
+    linkModel.setSymbol(ColliderModel, N_("TC colliders"));
+    linkModel.setSymbol(LinkBudget, N_("Link budget"));
+    samplingRate = 10.0;
+    lastSampleTime = 0.0;
 }
 
 
@@ -119,10 +223,22 @@ NetworkEmulatorItem::NetworkEmulatorItem(const NetworkEmulatorItem &org)
 
 
 NetworkEmulatorItem::Impl::Impl(NetworkEmulatorItem* self, const Impl& org)
-    : self(self)
+    : Impl(self)
 {
     interface = org.interface;
     ifbDevice = org.ifbDevice;
+    backend = org.backend;
+    proxyProtocol = org.proxyProtocol;
+    proxyListenPort = org.proxyListenPort;
+    proxyTarget = org.proxyTarget;
+    robotFlows = org.robotFlows;
+    linkModel = org.linkModel;
+    linkBudget = org.linkBudget;
+    samplingRate = org.samplingRate;
+    minUpdateInterval = org.minUpdateInterval;
+    delayHysteresis = org.delayHysteresis;
+    rateHysteresis = org.rateHysteresis;
+    lossHysteresis = org.lossHysteresis;
 }
 
 
@@ -140,12 +256,71 @@ bool NetworkEmulatorItem::initializeSimulation(SimulatorItem* simulatorItem)
 
 bool NetworkEmulatorItem::Impl::initializeSimulation(SimulatorItem* simulatorItem)
 {
-    bodies.clear();
+    this->simulatorItem = simulatorItem;
+    flows.clear();
     colliders.clear();
+    lastUpdateTime = 0.0;
+    lastSampleTime = -numeric_limits<double>::infinity();
+    numIssuedUpdates = 0;
+    numSuppressedUpdates = 0;
+
+    // The robot flows are written as name=address, name=:port or name=address:port
+    map<string, LinkState> robotStates;
+    for(auto& entry : split(robotFlows, ',')) {
+        size_t equal = entry.find('=');
+        if(equal == string::npos) {
+            continue;
+        }
+        string name = trimmed(entry.substr(0, equal));
+        string address = trimmed(entry.substr(equal + 1));
+        LinkState state;
+        size_t colon = address.rfind(':');
+        if(colon != string::npos) {
+            state.port = atoi(address.substr(colon + 1).c_str());
+            address = address.substr(0, colon);
+        }
+        if(!address.empty() && address.find('/') == string::npos) {
+            address += "/32";
+        }
+        if(checkIP(address)) {
+            state.destinationIP = address;
+        } else if(!address.empty() || state.port <= 0) {
+            MessageView::instance()->putln(
+                formatR(_("The robot flow \"{0}\" of {1} is invalid."), trimmed(entry), self->displayName()),
+                MessageView::Warning);
+            continue;
+        }
+        robotStates[name] = state;
+    }
 
+    flows.resize(1);
+    vector<Body*> staticBodies;
     const vector<SimulationBody*>& simBodies = simulatorItem->simulationBodies();
     for(auto& simBody : simBodies) {
-        bodies.push_back(simBody->body());
+        Body* body = simBody->body();
+        if(body->isStaticModel()) {
+            staticBodies.push_back(body);
+        }
+        auto p = robotStates.find(body->name());
+        if(p == robotStates.end() || (int)flows.size() >= NetEm::MaxFlows) {
+            flows[0].bodies.push_back(body);
+        } else {
+            Flow flow;
+            flow.bodies.push_back(body);
+            flow.isRobotFlow = true;
+            flow.targetState = p->second;
+            flows.push_back(flow);
+        }
+    }
+
+    if(linkModel.is(LinkBudget)) {
+        // The walls do not move, so their occlusion is computed once here instead of every step
+        linkBudgetModel.setSettings(linkBudget);
+        linkBudgetModel.build(staticBodies);
+        MessageView::instance()->putln(
+            formatR(_("{0} models {1} walls on an occlusion grid of {2} cells of {3:.2f} m."),
+                    self->displayName(), linkBudgetModel.numWalls(), linkBudgetModel.numCells(),
+                    linkBudgetModel.cellSize()));
     }
 
     WorldItem* worldItem = simulatorItem->findOwnerItem<WorldItem>();
@@ -159,6 +334,20 @@ bool NetworkEmulatorItem::Impl::initializeSimulation(SimulatorItem* simulatorIte
     }
 
     if(simBodies.size()) {
+        // The robot flows of the previous simulation must not be installed again
+        netem->clearFlows();
+        netem->setBackend((NetEm::Backend)backend.which());
+        if(backend.is(NetEm::UserspaceProxy)) {
+            // The target is written as host:port
+            string host = proxyTarget;
+            int port = 0;
+            size_t colon = proxyTarget.rfind(':');
+            if(colon != string::npos) {
+                host = proxyTarget.substr(0, colon);
+                port = atoi(proxyTarget.substr(colon + 1).c_str());
+            }
+            netem->setProxy((ImpairmentProxy::Protocol)proxyProtocol.which(), proxyListenPort, host, port);
+        }
         netem->start(interface.which(), ifbDevice.which());
         simulatorItem->addPreDynamicsFunction([&](){ onPreDynamics(); });
     }
@@ -172,10 +361,62 @@ void NetworkEmulatorItem::finalizeSimulation()
 }
 
 
+void NetworkEmulatorItem::setMinimumUpdateInterval(double interval)
+{
+    impl->minUpdateInterval = std::max(interval, 0.0);
+}
+
+
+double NetworkEmulatorItem::minimumUpdateInterval() const
+{
+    return impl->minUpdateInterval;
+}
+
+
+int NetworkEmulatorItem::numIssuedUpdates() const
+{
+    return impl->numIssuedUpdates;
+}
+
+
+int NetworkEmulatorItem::numSuppressedUpdates() const
+{
+    return impl->numSuppressedUpdates;
+}
+
+
 void NetworkEmulatorItem::Impl::onPreDynamics()
 {
-    for(auto& body : bodies) {
-        if(!body->isStaticModel()) {
+    const double time = simulatorItem->currentTime();
+    int numRequests = linkModel.is(LinkBudget) ? sampleLinkBudget(time) : applyColliders();
+
+    // A change held back by the interval is still issued after the bodies have left the colliders
+    vector<int> changedFlows;
+    for(size_t i = 0; i < flows.size(); ++i) {
+        if(isChanged(flows[i])) {
+            changedFlows.push_back(i);
+        }
+    }
+    if(!changedFlows.empty() && (numIssuedUpdates == 0 || time - lastUpdateTime >= minUpdateInterval)) {
+        issueUpdate(time, changedFlows);
+        --numRequests;
+    }
+    if(numRequests > 0) {
+        numSuppressedUpdates += numRequests;
+    }
+}
+
+
+// Every body inside a collider used to issue its own update, so each of them is counted
+int NetworkEmulatorItem::Impl::applyColliders()
+{
+    int numRequests = 0;
+    for(auto& flow : flows) {
+        LinkState& state = flow.targetState;
+        for(auto& body : flow.bodies) {
+            if(body->isStaticModel()) {
+                continue;
+            }
             Link* link = body->rootLink();
             for(auto& collider : colliders) {
                 if(collision(collider, link->T().translation())) {
@@ -183,27 +424,116 @@ void NetworkEmulatorItem::Impl::onPreDynamics()
                     const int rates[] = { (int)collider->inboundRate(), (int)collider->outboundRate() };
                     const double losses[] = { collider->inboundLoss(), collider->outboundLoss() };
                     for(int i = 0; i < 2; ++i) {
+                        NetemParameters& parameters = state.parameters[i];
                         if(delays[i] >= 0) {
-                            netem->setDelay(i, delays[i]);
+                            parameters.delay = delays[i];
                         }
                         if(rates[i] >= 0) {
-                            netem->setRate(i, rates[i]);
+                            parameters.rate = rates[i];
                         }
                         if(losses[i] >= 0.0) {
-                            netem->setLoss(i, losses[i]);
+                            parameters.loss = losses[i];
                         }
                     }
                     if(checkIP(collider->source())) {
-                        netem->setSourceIP(collider->source());
+                        state.sourceIP = collider->source();
                     }
-                    if(checkIP(collider->destination())) {
-                        netem->setSourceIP(collider->destination());
+                    if(!flow.isRobotFlow && checkIP(collider->destination())) {
+                        state.destinationIP = collider->destination();
                     }
-                    callLater([&](){ netem->update(); });
+                    flow.isRequested = true;
+                    ++numRequests;
                 }
             }
         }
     }
+    return numRequests;
+}
+
+
+// Each sampled flow is a request. A flow shared by several bodies takes the worst of their links.
+// The parameters are quantized to the hysteresis steps, so that only a new step is issued.
+int NetworkEmulatorItem::Impl::sampleLinkBudget(double time)
+{
+    if(samplingRate <= 0.0 || time - lastSampleTime < 1.0 / samplingRate) {
+        return 0;
+    }
+    lastSampleTime = time;
+
+    int numRequests = 0;
+    for(auto& flow : flows) {
+        double snr = numeric_limits<double>::infinity();
+        for(auto& body : flow.bodies) {
+            if(!body->isStaticModel()) {
+                snr = std::min(snr, linkBudgetModel.snr(body->rootLink()->T().translation()));
+            }
+        }
+        if(std::isinf(snr)) {
+            continue;
+        }
+        NetemParameters parameters = linkBudgetModel.parameters(snr);
+        parameters.delay = quantize(parameters.delay, delayHysteresis);
+        parameters.rate = quantizeRatio(parameters.rate, 1.0 + rateHysteresis / 100.0);
+        parameters.loss = std::min(quantize(parameters.loss, lossHysteresis), 100.0);
+        flow.targetState.parameters[0] = flow.targetState.parameters[1] = parameters;
+        flow.isRequested = true;
+        ++numRequests;
+    }
+    return numRequests;
+}
+
+
+// A flow no collider has ever set keeps the parameters NetEm started with
+bool NetworkEmulatorItem::Impl::isChanged(const Flow& flow) const
+{
+    if(!flow.isRequested) {
+        return false;
+    }
+    const LinkState& targetState = flow.targetState;
+    const LinkState& appliedState = flow.appliedState;
+    if(!flow.isApplied || !targetState.isSameFilter(appliedState)) {
+        return true;
+    }
+    if(linkModel.is(LinkBudget)) {
+        return targetState.parameters[0] != appliedState.parameters[0]
+            || targetState.parameters[1] != appliedState.parameters[1];
+    }
+    for(int i = 0; i < 2; ++i) {
+        const NetemParameters& target = targetState.parameters[i];
+        const NetemParameters& applied = appliedState.parameters[i];
+        if(target.distribution != applied.distribution
+           || exceeds(target.delay, applied.delay, delayHysteresis)
+           || exceeds(target.jitter, applied.jitter, delayHysteresis)
+           || exceeds(target.rate, applied.rate, applied.rate * rateHysteresis / 100.0)
+           || exceeds(target.loss, applied.loss, lossHysteresis)
+           || exceeds(target.reorder, applied.reorder, lossHysteresis)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void NetworkEmulatorItem::Impl::issueUpdate(double time, const vector<int>& changedFlows)
+{
+    // The changed flows are sent together, so NetEm applies the robots moved in a step at once
+    vector<pair<int, LinkState>> states;
+    for(auto& id : changedFlows) {
+        Flow& flow = flows[id];
+        flow.appliedState = flow.targetState;
+        flow.isApplied = true;
+        states.emplace_back(id, flow.appliedState);
+    }
+    lastUpdateTime = time;
+    ++numIssuedUpdates;
+
+    // The states are copied, so the simulation may go on changing the targets while NetEm runs
+    callLater([this, states](){
+        for(auto& state : states) {
+            netem->setFlow(state.first, state.second);
+        }
+        netem->update();
+    });
 }
 
 
@@ -220,6 +550,40 @@ void NetworkEmulatorItem::doPutProperties(PutPropertyFunction& putProperty)
                 [&](int which){ return impl->interface.select(which); });
     putProperty(_("IFB Device"), impl->ifbDevice,
                 [&](int which){ return impl->ifbDevice.select(which); });
+    putProperty(_("Backend"), impl->backend,
+                [&](int which){ return impl->backend.select(which); });
+    putProperty(_("Proxy protocol"), impl->proxyProtocol,
+                [&](int which){ return impl->proxyProtocol.select(which); });
+    putProperty.min(0).max(65535)(_("Proxy listen port"), impl->proxyListenPort,
+                                  changeProperty(impl->proxyListenPort));
+    putProperty(_("Proxy target"), impl->proxyTarget, changeProperty(impl->proxyTarget));
+    putProperty(_("Robot flows"), impl->robotFlows, changeProperty(impl->robotFlows));
+    putProperty(_("Link model"), impl->linkModel,
+                [&](int which){ return impl->linkModel.select(which); });
+    LinkBudgetModel::Settings& budget = impl->linkBudget;
+    const Vector3& b = budget.baseStation;
+    putProperty(_("Base station [m]"), formatC("{0:.3g} {1:.3g} {2:.3g}", b.x(), b.y(), b.z()),
+                [&](const string& text){ return toVector3(text, budget.baseStation); });
+    putProperty(_("Transmit power [dBm]"), budget.transmitPower, changeProperty(budget.transmitPower));
+    putProperty(_("Path loss at 1 m [dB]"), budget.referenceLoss, changeProperty(budget.referenceLoss));
+    putProperty.min(0.0)(_("Path loss exponent"), budget.pathLossExponent, changeProperty(budget.pathLossExponent));
+    putProperty.min(0.0)(_("Wall loss [dB]"), budget.wallLoss, changeProperty(budget.wallLoss));
+    putProperty(_("Noise floor [dBm]"), budget.noiseFloor, changeProperty(budget.noiseFloor));
+    putProperty.min(0.0)(_("Fading [dB]"), budget.fading, changeProperty(budget.fading));
+    putProperty.min(0.0)(_("Base delay [ms]"), budget.baseDelay, changeProperty(budget.baseDelay));
+    putProperty.min(1.0)(_("Maximum rate [kbps]"), budget.maxRate, changeProperty(budget.maxRate));
+    putProperty.min(0.01)(_("Occlusion grid cell [m]"), budget.cellSize, changeProperty(budget.cellSize));
+    putProperty.min(0.0)(_("Link sampling rate [Hz]"), impl->samplingRate, changeProperty(impl->samplingRate));
+    putProperty.min(0.0)(_("Minimum update interval [s]"), impl->minUpdateInterval,
+                         changeProperty(impl->minUpdateInterval));
+    putProperty.min(0.0)(_("Delay hysteresis [ms]"), impl->delayHysteresis,
+                         changeProperty(impl->delayHysteresis));
+    putProperty.min(0.0).max(100.0)(_("Rate hysteresis [%]"), impl->rateHysteresis,
+                                    changeProperty(impl->rateHysteresis));
+    putProperty.min(0.0).max(100.0)(_("Loss hysteresis [%]"), impl->lossHysteresis,
+                                    changeProperty(impl->lossHysteresis));
+    putProperty(_("NetEm updates"),
+                formatR(_("{0} issued, {1} suppressed"), impl->numIssuedUpdates, impl->numSuppressedUpdates));
 }
 
 
@@ -230,6 +594,28 @@ bool NetworkEmulatorItem::store(Archive& archive)
     }
     archive.write("interface", impl->interface.selectedSymbol());
     archive.write("ifb_device", impl->ifbDevice.selectedSymbol());
+    archive.write("backend", impl->backend.selectedSymbol());
+    archive.write("proxy_protocol", impl->proxyProtocol.selectedSymbol());
+    archive.write("proxy_listen_port", impl->proxyListenPort);
+    archive.write("proxy_target", impl->proxyTarget);
+    archive.write("robot_flows", impl->robotFlows);
+    archive.write("link_model", impl->linkModel.selectedSymbol());
+    const LinkBudgetModel::Settings& budget = impl->linkBudget;
+    write(archive, "base_station", budget.baseStation);
+    archive.write("transmit_power", budget.transmitPower);
+    archive.write("reference_loss", budget.referenceLoss);
+    archive.write("path_loss_exponent", budget.pathLossExponent);
+    archive.write("wall_loss", budget.wallLoss);
+    archive.write("noise_floor", budget.noiseFloor);
+    archive.write("fading", budget.fading);
+    archive.write("base_delay", budget.baseDelay);
+    archive.write("max_rate", budget.maxRate);
+    archive.write("occlusion_cell_size", budget.cellSize);
+    archive.write("link_sampling_rate", impl->samplingRate);
+    archive.write("min_update_interval", impl->minUpdateInterval);
+    archive.write("delay_hysteresis", impl->delayHysteresis);
+    archive.write("rate_hysteresis", impl->rateHysteresis);
+    archive.write("loss_hysteresis", impl->lossHysteresis);
     return true;
 }
 
@@ -246,5 +632,34 @@ bool NetworkEmulatorItem::restore(const Archive& archive)
     if(archive.read("ifb_device", interface)) {
         impl->ifbDevice.select(interface);
     }
+    string symbol;
+    if(archive.read("backend", symbol)) {
+        impl->backend.select(symbol);
+    }
+    if(archive.read("proxy_protocol", symbol)) {
+        impl->proxyProtocol.select(symbol);
+    }
+    archive.read("proxy_listen_port", impl->proxyListenPort);
+    archive.read("proxy_target", impl->proxyTarget);
+    archive.read("robot_flows", impl->robotFlows);
+    if(archive.read("link_model", symbol)) {
+        impl->linkModel.select(symbol);
+    }
+    LinkBudgetModel::Settings& budget = impl->linkBudget;
+    read(archive, "base_station", budget.baseStation);
+    archive.read("transmit_power", budget.transmitPower);
+    archive.read("reference_loss", budget.referenceLoss);
+    archive.read("path_loss_exponent", budget.pathLossExponent);
+    archive.read("wall_loss", budget.wallLoss);
+    archive.read("noise_floor", budget.noiseFloor);
+    archive.read("fading", budget.fading);
+    archive.read("base_delay", budget.baseDelay);
+    archive.read("max_rate", budget.maxRate);
+    archive.read("occlusion_cell_size", budget.cellSize);
+    archive.read("link_sampling_rate", impl->samplingRate);
+    archive.read("min_update_interval", impl->minUpdateInterval);
+    archive.read("delay_hysteresis", impl->delayHysteresis);
+    archive.read("rate_hysteresis", impl->rateHysteresis);
+    archive.read("loss_hysteresis", impl->lossHysteresis);
     return true;
 }
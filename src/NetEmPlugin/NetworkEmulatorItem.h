@@ -20,6 +20,15 @@ public:
     virtual bool initializeSimulation(SimulatorItem* simulatorItem) override;
     virtual void finalizeSimulation() override;
 
+    // The link parameters are pushed to NetEm only when they change by more than the hysteresis,
+    // and not more often than this interval of the simulation time
+    void setMinimumUpdateInterval(double interval);
+    double minimumUpdateInterval() const;
+
+    // Updates issued to NetEm and updates withheld because nothing had changed enough or too early
+    int numIssuedUpdates() const;
+    int numSuppressedUpdates() const;
+
 protected:
     virtual Item* doCloneItem(CloneMap* cloneMap) const override;
     virtual void doPutProperties(PutPropertyFunction& putProperty) override;
@@ -0,0 +1,248 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "TrafficControlState.h"
+#include <cnoid/Format>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+uint32_t major(uint32_t handle)
+{
+    return handle & 0xffff0000;
+}
+
+bool isTop(uint32_t parent)
+{
+    return parent == TrafficControlState::Root || parent == TrafficControlState::Ingress;
+}
+
+string qdiscCommand(const char* verb, const string& device, uint32_t handle, const TrafficControlState::Qdisc& qdisc)
+{
+    string command = formatC("sudo tc qdisc {0} dev {1}", verb, device);
+    if(qdisc.parent == TrafficControlState::Ingress) {
+        command += " ingress";
+    } else if(qdisc.parent == TrafficControlState::Root) {
+        command += " root";
+    } else {
+        command += " parent " + TrafficControlState::handleName(qdisc.parent);
+    }
+    if(string(verb) != "del") {
+        command += " handle " + TrafficControlState::handleName(handle);
+        if(qdisc.parent != TrafficControlState::Ingress) {
+            command += " " + qdisc.kind;
+            command += qdisc.kind == "netem" ? TrafficControlState::netemOptions(qdisc.netem) : qdisc.options;
+        }
+    } else if(!isTop(qdisc.parent)) {
+        command += " handle " + TrafficControlState::handleName(handle);
+    }
+    return command + ";";
+}
+
+}
+
+
+void TrafficControlState::addQdisc(uint32_t parent, uint32_t handle, const string& kind, const string& options)
+{
+    Qdisc& qdisc = qdiscs_[handle];
+    qdisc.parent = parent;
+    qdisc.kind = kind;
+    qdisc.options = options.empty() ? options : " " + options;
+}
+
+
+void TrafficControlState::addNetem(uint32_t parent, uint32_t handle, const NetemParameters& parameters)
+{
+    addQdisc(parent, handle, "netem");
+    qdiscs_[handle].netem = parameters;
+}
+
+
+void TrafficControlState::addClass(uint32_t parent, uint32_t classid, const string& options)
+{
+    classes_[classid] = Class{ parent, options };
+}
+
+
+void TrafficControlState::addFilter(uint32_t parent, int priority, const string& selector)
+{
+    filters_[FilterKey(parent, priority)] = selector;
+}
+
+
+void TrafficControlState::clear()
+{
+    qdiscs_.clear();
+    classes_.clear();
+    filters_.clear();
+}
+
+
+// A netem qdisc is replaced for a new distribution, as a change keeps the table of the old one
+bool TrafficControlState::isReplaced(uint32_t handle, const Qdisc& qdisc, const TrafficControlState& desired) const
+{
+    auto p = desired.qdiscs_.find(handle);
+    if(p == desired.qdiscs_.end()) {
+        return true;
+    }
+    const Qdisc& other = p->second;
+    return other.parent != qdisc.parent || other.kind != qdisc.kind || other.options != qdisc.options
+        || (qdisc.kind == "netem" && other.netem.distribution != qdisc.netem.distribution);
+}
+
+
+// The kernel deletes the classes, qdiscs and filters under a qdisc with it
+void TrafficControlState::removeQdisc(uint32_t handle)
+{
+    qdiscs_.erase(handle);
+    vector<uint32_t> children;
+    for(auto& c : classes_) {
+        if(major(c.first) == major(handle)) {
+            children.push_back(c.first);
+        }
+    }
+    for(auto& classid : children) {
+        removeClass(classid);
+    }
+    for(auto p = filters_.begin(); p != filters_.end(); ) {
+        p = (p->first.first == handle) ? filters_.erase(p) : std::next(p);
+    }
+}
+
+
+void TrafficControlState::removeClass(uint32_t classid)
+{
+    classes_.erase(classid);
+    vector<uint32_t> children;
+    for(auto& q : qdiscs_) {
+        if(q.second.parent == classid) {
+            children.push_back(q.first);
+        }
+    }
+    for(auto& handle : children) {
+        removeQdisc(handle);
+    }
+}
+
+
+void TrafficControlState::diff(const string& device, const TrafficControlState& desired,
+                               vector<string>& commands, vector<NetemChange>& netemChanges) const
+{
+    // What the commands leave of this state
+    TrafficControlState current = *this;
+
+    for(auto& q : qdiscs_) {
+        if(isTop(q.second.parent) && isReplaced(q.first, q.second, desired)) {
+            commands.push_back(qdiscCommand("del", device, q.first, q.second));
+            current.removeQdisc(q.first);
+        }
+    }
+    for(auto p = current.filters_.begin(); p != current.filters_.end(); ) {
+        auto other = desired.filters_.find(p->first);
+        if(other == desired.filters_.end() || other->second != p->second) {
+            commands.push_back(formatC("sudo tc filter del dev {0} parent {1} prio {2};",
+                                       device, handleName(p->first.first), p->first.second));
+            p = current.filters_.erase(p);
+        } else {
+            ++p;
+        }
+    }
+    const map<uint32_t, Class> classes = current.classes_;
+    for(auto& c : classes) {
+        auto other = desired.classes_.find(c.first);
+        if(other == desired.classes_.end() || other->second.parent != c.second.parent) {
+            commands.push_back(formatC("sudo tc class del dev {0} classid {1};", device, handleName(c.first)));
+            current.removeClass(c.first);
+        }
+    }
+    const map<uint32_t, Qdisc> qdiscs = current.qdiscs_;
+    for(auto& q : qdiscs) {
+        if(isReplaced(q.first, q.second, desired)) {
+            commands.push_back(qdiscCommand("del", device, q.first, q.second));
+            current.removeQdisc(q.first);
+        }
+    }
+
+    for(auto& q : desired.qdiscs_) {
+        if(isTop(q.second.parent) && !current.qdiscs_.count(q.first)) {
+            commands.push_back(qdiscCommand("add", device, q.first, q.second));
+        }
+    }
+    for(auto& c : desired.classes_) {
+        auto p = current.classes_.find(c.first);
+        if(p == current.classes_.end()) {
+            commands.push_back(formatC("sudo tc class add dev {0} parent {1} classid {2} {3};",
+                                       device, handleName(c.second.parent), handleName(c.first), c.second.options));
+        } else if(p->second.options != c.second.options) {
+            commands.push_back(formatC("sudo tc class change dev {0} parent {1} classid {2} {3};",
+                                       device, handleName(c.second.parent), handleName(c.first), c.second.options));
+        }
+    }
+    for(auto& q : desired.qdiscs_) {
+        if(isTop(q.second.parent)) {
+            continue;
+        }
+        auto p = current.qdiscs_.find(q.first);
+        if(p == current.qdiscs_.end()) {
+            commands.push_back(qdiscCommand("add", device, q.first, q.second));
+        } else if(q.second.kind == "netem" && p->second.netem != q.second.netem) {
+            netemChanges.push_back(NetemChange{ q.second.parent, q.first, q.second.netem });
+        }
+    }
+    for(auto& f : desired.filters_) {
+        if(!current.filters_.count(f.first)) {
+            commands.push_back(formatC("sudo tc filter add dev {0} parent {1} protocol ip prio {2} {3};",
+                                       device, handleName(f.first.first), f.first.second, f.second));
+        }
+    }
+}
+
+
+string TrafficControlState::changeCommand(const string& device, const NetemChange& change)
+{
+    // netem keeps the rate that a change leaves out, so no rate is sent as rate 0
+    string options = netemOptions(change.parameters);
+    if(change.parameters.rate <= 0.0) {
+        options += " rate 0bit";
+    }
+    return formatC("sudo tc qdisc change dev {0} parent {1} handle {2} netem{3};",
+                   device, handleName(change.parent), handleName(change.handle), options);
+}
+
+
+string TrafficControlState::handleName(uint32_t handle)
+{
+    if(handle & 0xffff) {
+        return formatC("{0:x}:{1:x}", handle >> 16, handle & 0xffff);
+    }
+    return formatC("{0:x}:", handle >> 16);
+}
+
+
+string TrafficControlState::netemOptions(const NetemParameters& parameters)
+{
+    string options = formatC(" limit {0}", parameters.limit);
+    if(parameters.delay > 0.0 || parameters.jitter > 0.0) {
+        options += formatC(" delay {0:.2f}ms", parameters.delay);
+        if(parameters.jitter > 0.0) {
+            options += formatC(" {0:.2f}ms", parameters.jitter);
+            if(parameters.distribution != NetemParameters::Uniform) {
+                options += formatC(" distribution {0}", NetemParameters::distributionName(parameters.distribution));
+            }
+        }
+    }
+    if(parameters.rate > 0.0) {
+        options += formatC(" rate {0:.2f}kbps", parameters.rate);
+    }
+    if(parameters.loss > 0.0) {
+        options += formatC(" loss {0:.2f}%", parameters.loss);
+    }
+    // tc refuses to reorder without a delay
+    if(parameters.reorder > 0.0 && parameters.delay > 0.0) {
+        options += formatC(" reorder {0:.2f}%", parameters.reorder);
+    }
+    return options;
+}
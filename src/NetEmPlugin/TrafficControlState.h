@@ -0,0 +1,87 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#ifndef CNOID_NETEM_PLUGIN_TRAFFIC_CONTROL_STATE_H
+#define CNOID_NETEM_PLUGIN_TRAFFIC_CONTROL_STATE_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "NetlinkTrafficControl.h"
+
+namespace cnoid {
+
+// The qdiscs, classes and filters of a device. NetEm keeps the state it has installed and
+// compares it with the one its flows need, so that only the differences reach the kernel.
+// The tree is a qdisc at the root or the ingress, its classes and a qdisc under each class.
+class TrafficControlState
+{
+public:
+    // Parents of the qdiscs at the top, as in tcmsg
+    static const uint32_t Root = 0xffffffff;
+    static const uint32_t Ingress = 0xfffffff1;
+
+    struct Qdisc
+    {
+        uint32_t parent;
+        std::string kind;
+        std::string options; // as written to tc, except those of netem
+        NetemParameters netem;
+    };
+
+    struct Class
+    {
+        uint32_t parent;
+        std::string options;
+    };
+
+    // A filter is identified by its parent and its priority
+    typedef std::pair<uint32_t, int> FilterKey;
+
+    // A netem qdisc whose parameters change but whose distribution does not,
+    // which may be changed in place through netlink
+    struct NetemChange
+    {
+        uint32_t parent;
+        uint32_t handle;
+        NetemParameters parameters;
+    };
+
+    void addQdisc(uint32_t parent, uint32_t handle, const std::string& kind, const std::string& options = std::string());
+    void addNetem(uint32_t parent, uint32_t handle, const NetemParameters& parameters);
+    void addClass(uint32_t parent, uint32_t classid, const std::string& options);
+    void addFilter(uint32_t parent, int priority, const std::string& selector);
+    void clear();
+    bool empty() const { return qdiscs_.empty(); }
+
+    const std::map<uint32_t, Qdisc>& qdiscs() const { return qdiscs_; }
+    const std::map<uint32_t, Class>& classes() const { return classes_; }
+    const std::map<FilterKey, std::string>& filters() const { return filters_; }
+
+    // Appends the tc commands that turn this state into the desired one, the deletions from the
+    // leaves and the additions from the root. The netem changes are left to the caller.
+    void diff(const std::string& device, const TrafficControlState& desired,
+              std::vector<std::string>& commands, std::vector<NetemChange>& netemChanges) const;
+
+    static std::string changeCommand(const std::string& device, const NetemChange& change);
+
+    // Handles as tc writes them, e.g. "1:2" and "20:"
+    static std::string handleName(uint32_t handle);
+    static std::string netemOptions(const NetemParameters& parameters);
+
+private:
+    bool isReplaced(uint32_t handle, const Qdisc& qdisc, const TrafficControlState& desired) const;
+    void removeQdisc(uint32_t handle);
+    void removeClass(uint32_t classid);
+
+    std::map<uint32_t, Qdisc> qdiscs_;
+    std::map<uint32_t, Class> classes_;
+    std::map<FilterKey, std::string> filters_;
+};
+
+}
+
+#endif // CNOID_NETEM_PLUGIN_TRAFFIC_CONTROL_STATE_H
@@ -0,0 +1,643 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "../ImpairmentProxy.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+struct Options {
+    int packets = 2000;
+    int rate = 1000;   // unit: packets/s of the paced cases
+    int size = 200;    // unit: bytes of a datagram
+    int floodPackets = 100000;
+    uint64_t seed = 1;
+    string output;
+};
+
+struct Result {
+    string name;
+    string protocol;
+    int sent = 0;
+    int received = 0;
+    double throughput = 0.0; // unit: packets/s
+    double bandwidth = 0.0;  // unit: kB/s
+    double addedMedian = 0.0; // unit: ms above the direct round trip
+    double addedP99 = 0.0;
+    double addedStdDev = 0.0;
+    double loss = 0.0;    // unit: %
+    double reorder = 0.0; // unit: %
+};
+
+struct Check {
+    string name;
+    double value;
+    double tolerance;
+};
+
+int64_t now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+sockaddr_in loopback(int port)
+{
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    return address;
+}
+
+int boundPort(int fd)
+{
+    sockaddr_in address;
+    socklen_t length = sizeof(address);
+    getsockname(fd, (sockaddr*)&address, &length);
+    return ntohs(address.sin_port);
+}
+
+double percentile(vector<double> values, double p)
+{
+    if(values.empty()) {
+        return 0.0;
+    }
+    sort(values.begin(), values.end());
+    return values[min(values.size() - 1, (size_t)(p / 100.0 * values.size()))];
+}
+
+// Returns every datagram to its sender, as the far end of a link
+class UdpEchoServer
+{
+public:
+    UdpEchoServer() {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in address = loopback(0);
+        ::bind(fd, (sockaddr*)&address, sizeof(address));
+        int size = 8 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        port = boundPort(fd);
+        isRunning = true;
+        serverThread = thread([this](){
+            vector<char> buffer(65536);
+            pollfd p = { fd, POLLIN, 0 };
+            while(isRunning) {
+                if(poll(&p, 1, 50) <= 0) {
+                    continue;
+                }
+                sockaddr_in peer;
+                socklen_t length = sizeof(peer);
+                ssize_t size = recvfrom(fd, buffer.data(), buffer.size(), 0, (sockaddr*)&peer, &length);
+                if(size > 0) {
+                    sendto(fd, buffer.data(), size, 0, (sockaddr*)&peer, length);
+                }
+            }
+        });
+    }
+    ~UdpEchoServer() {
+        isRunning = false;
+        serverThread.join();
+        ::close(fd);
+    }
+    int port;
+
+private:
+    int fd;
+    atomic<bool> isRunning;
+    thread serverThread;
+};
+
+// Echoes the connections one after another
+class TcpEchoServer
+{
+public:
+    TcpEchoServer() {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in address = loopback(0);
+        ::bind(fd, (sockaddr*)&address, sizeof(address));
+        ::listen(fd, 8);
+        port = boundPort(fd);
+        isRunning = true;
+        serverThread = thread([this](){
+            vector<char> buffer(65536);
+            pollfd p = { fd, POLLIN, 0 };
+            while(isRunning) {
+                if(poll(&p, 1, 50) <= 0) {
+                    continue;
+                }
+                int connection = accept(fd, nullptr, nullptr);
+                if(connection < 0) {
+                    continue;
+                }
+                int on = 1;
+                setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                ssize_t size;
+                while(isRunning && (size = recv(connection, buffer.data(), buffer.size(), 0)) > 0) {
+                    ssize_t offset = 0;
+                    while(offset < size) {
+                        ssize_t written = send(connection, buffer.data() + offset, size - offset, MSG_NOSIGNAL);
+                        if(written <= 0) {
+                            break;
+                        }
+                        offset += written;
+                    }
+                }
+                ::close(connection);
+            }
+        });
+    }
+    ~TcpEchoServer() {
+        isRunning = false;
+        serverThread.join();
+        ::close(fd);
+    }
+    int port;
+
+private:
+    int fd;
+    atomic<bool> isRunning;
+    thread serverThread;
+};
+
+// Sends numbered and stamped datagrams at the rate (0: as fast as possible) and collects the echoes
+Result runUdp(const string& name, int port, int count, int rate, int size, double baseline, double settleTime)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address = loopback(port);
+    ::connect(fd, (sockaddr*)&address, sizeof(address));
+    int bufferSize = 8 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+
+    vector<double> roundTrips(count, -1.0);
+    vector<int> arrivals;
+    arrivals.reserve(count);
+    atomic<int64_t> lastArrival(0);
+    atomic<bool> isSending(true);
+    int64_t firstArrival = 0;
+
+    thread receiver([&](){
+        vector<char> buffer(65536);
+        pollfd p = { fd, POLLIN, 0 };
+        while(true) {
+            if(poll(&p, 1, 20) <= 0) {
+                // Stops when nothing has come back for the settle time after the last send
+                if(!isSending && now() - max(lastArrival.load(), (int64_t)0) > settleTime * 1.0e9) {
+                    break;
+                }
+                continue;
+            }
+            ssize_t n = recv(fd, buffer.data(), buffer.size(), 0);
+            const int64_t t = now();
+            if(n < 16) {
+                continue;
+            }
+            int64_t sequence, stamp;
+            memcpy(&sequence, buffer.data(), 8);
+            memcpy(&stamp, buffer.data() + 8, 8);
+            if(sequence >= 0 && sequence < count && roundTrips[sequence] < 0.0) {
+                roundTrips[sequence] = (t - stamp) * 1.0e-6;
+                arrivals.push_back(sequence);
+                if(firstArrival == 0) {
+                    firstArrival = t;
+                }
+                lastArrival = t;
+            }
+        }
+    });
+
+    vector<char> payload(max(size, 16), 'x');
+    const int64_t start = now();
+    for(int64_t i = 0; i < count; ++i) {
+        if(rate > 0) {
+            const int64_t due = start + i * 1000000000 / rate;
+            while(now() < due) {
+                const int64_t rest = due - now();
+                if(rest > 200000) {
+                    this_thread::sleep_for(chrono::nanoseconds(rest - 100000));
+                }
+            }
+        }
+        const int64_t stamp = now();
+        memcpy(payload.data(), &i, 8);
+        memcpy(payload.data() + 8, &stamp, 8);
+        while(send(fd, payload.data(), payload.size(), 0) < 0 && errno == ENOBUFS) {
+            this_thread::yield();
+        }
+    }
+    lastArrival = max(lastArrival.load(), now());
+    isSending = false;
+    receiver.join();
+    ::close(fd);
+
+    Result result;
+    result.name = name;
+    result.protocol = "udp";
+    result.sent = count;
+    result.received = arrivals.size();
+    const double duration = (lastArrival - firstArrival) * 1.0e-9;
+    if(result.received > 1 && duration > 0.0) {
+        result.throughput = (result.received - 1) / duration;
+        result.bandwidth = result.throughput * payload.size() / 1000.0;
+    }
+    vector<double> added;
+    for(double rtt : roundTrips) {
+        if(rtt >= 0.0) {
+            added.push_back(rtt - baseline);
+        }
+    }
+    result.addedMedian = percentile(added, 50.0);
+    result.addedP99 = percentile(added, 99.0);
+    double mean = 0.0;
+    for(double a : added) {
+        mean += a;
+    }
+    mean /= max<size_t>(added.size(), 1);
+    double variance = 0.0;
+    for(double a : added) {
+        variance += (a - mean) * (a - mean);
+    }
+    result.addedStdDev = sqrt(variance / max<size_t>(added.size(), 1));
+    result.loss = 100.0 * (count - result.received) / count;
+    // A packet that arrives before one sent earlier was reordered
+    int numReordered = 0;
+    for(int i = (int)arrivals.size() - 1, minSequence = count; i >= 0; --i) {
+        if(arrivals[i] > minSequence) {
+            ++numReordered;
+        }
+        minSequence = min(minSequence, arrivals[i]);
+    }
+    result.reorder = 100.0 * numReordered / max(result.received, 1);
+    return result;
+}
+
+// Writes the bytes through the connection while reading the echo, and compares them
+Result runTcpBulk(const string& name, int port, size_t bytes, int& mismatches)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = loopback(port);
+    ::connect(fd, (sockaddr*)&address, sizeof(address));
+    vector<char> data(bytes);
+    for(size_t i = 0; i < bytes; ++i) {
+        data[i] = (char)((i * 2654435761u) >> 13);
+    }
+    vector<char> echo;
+    echo.reserve(bytes);
+    const int64_t start = now();
+    int64_t end = start;
+    thread reader([&](){
+        vector<char> buffer(65536);
+        while(echo.size() < bytes) {
+            ssize_t n = recv(fd, buffer.data(), buffer.size(), 0);
+            if(n <= 0) {
+                break;
+            }
+            echo.insert(echo.end(), buffer.begin(), buffer.begin() + n);
+        }
+        end = now();
+    });
+    size_t offset = 0;
+    while(offset < bytes) {
+        ssize_t n = send(fd, data.data() + offset, min<size_t>(65536, bytes - offset), MSG_NOSIGNAL);
+        if(n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+    reader.join();
+    ::close(fd);
+
+    mismatches = (echo.size() == bytes) ? 0 : 1;
+    for(size_t i = 0; i < echo.size() && mismatches == 0; ++i) {
+        if(echo[i] != data[i]) {
+            mismatches = 1;
+        }
+    }
+    Result result;
+    result.name = name;
+    result.protocol = "tcp";
+    result.sent = bytes;
+    result.received = echo.size();
+    const double duration = (end - start) * 1.0e-9;
+    result.bandwidth = duration > 0.0 ? echo.size() / duration / 1000.0 : 0.0;
+    return result;
+}
+
+// Round trips of small messages over one connection
+Result runTcpPingPong(const string& name, int port, int count, double baseline)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    sockaddr_in address = loopback(port);
+    ::connect(fd, (sockaddr*)&address, sizeof(address));
+    vector<double> added;
+    char message[64] = { 0 };
+    for(int i = 0; i < count; ++i) {
+        const int64_t start = now();
+        if(send(fd, message, sizeof(message), MSG_NOSIGNAL) != sizeof(message)) {
+            break;
+        }
+        size_t received = 0;
+        while(received < sizeof(message)) {
+            ssize_t n = recv(fd, message + received, sizeof(message) - received, 0);
+            if(n <= 0) {
+                break;
+            }
+            received += n;
+        }
+        if(received < sizeof(message)) {
+            break;
+        }
+        added.push_back((now() - start) * 1.0e-6 - baseline);
+    }
+    ::close(fd);
+    Result result;
+    result.name = name;
+    result.protocol = "tcp";
+    result.sent = count;
+    result.received = added.size();
+    result.addedMedian = percentile(added, 50.0);
+    result.addedP99 = percentile(added, 99.0);
+    return result;
+}
+
+int countOpenFiles()
+{
+    int count = 0;
+    if(DIR* dir = opendir("/proc/self/fd")) {
+        while(readdir(dir)) {
+            ++count;
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+// Sends one datagram from each of the clients through the proxy and counts the echoes
+int echoFromClients(int port, int numClients)
+{
+    int numEchoes = 0;
+    sockaddr_in address = loopback(port);
+    char message[16] = { 0 };
+    for(int i = 0; i < numClients; ++i) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        ::connect(fd, (sockaddr*)&address, sizeof(address));
+        send(fd, message, sizeof(message), 0);
+        pollfd p = { fd, POLLIN, 0 };
+        if(poll(&p, 1, 500) > 0 && recv(fd, message, sizeof(message), 0) == sizeof(message)) {
+            ++numEchoes;
+        }
+        ::close(fd);
+    }
+    return numEchoes;
+}
+
+NetemParameters netem(double delay, double jitter = 0.0, double rate = 0.0, double loss = 0.0, double reorder = 0.0,
+                      NetemParameters::Distribution distribution = NetemParameters::Uniform)
+{
+    NetemParameters parameters;
+    parameters.delay = delay;
+    parameters.jitter = jitter;
+    parameters.distribution = distribution;
+    parameters.rate = rate;
+    parameters.loss = loss;
+    parameters.reorder = reorder;
+    return parameters;
+}
+
+void printResult(const Result& r)
+{
+    fprintf(stderr, "%-22s %s %7d/%-7d %10.0f pkt/s %9.1f kB/s  added %7.3f ms (p99 %7.3f, sd %6.3f)  loss %5.2f%%  reorder %5.2f%%\n",
+            r.name.c_str(), r.protocol.c_str(), r.received, r.sent, r.throughput, r.bandwidth,
+            r.addedMedian, r.addedP99, r.addedStdDev, r.loss, r.reorder);
+}
+
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> const char* { return (i + 1 < argc) ? argv[++i] : nullptr; };
+        const char* value = nullptr;
+        if(arg == "-h" || arg == "--help") {
+            return false;
+        } else if((arg == "--packets") && (value = next())) {
+            options.packets = max(atoi(value), 100);
+        } else if((arg == "--rate") && (value = next())) {
+            options.rate = max(atoi(value), 1);
+        } else if((arg == "--size") && (value = next())) {
+            options.size = min(max(atoi(value), 16), 65000);
+        } else if((arg == "--flood-packets") && (value = next())) {
+            options.floodPackets = max(atoi(value), 100);
+        } else if((arg == "--seed") && (value = next())) {
+            options.seed = strtoull(value, nullptr, 10);
+        } else if((arg == "--output") && (value = next())) {
+            options.output = value;
+        } else {
+            cerr << "Unknown or incomplete option: " << arg << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void printUsage()
+{
+    cerr << "Usage: netem-benchmark [options]\n"
+         << "  --packets N        datagrams of each paced case (default: 2000)\n"
+         << "  --rate N           datagrams per second of the paced cases (default: 1000)\n"
+         << "  --size N           bytes of a datagram (default: 200)\n"
+         << "  --flood-packets N  datagrams sent as fast as possible in the flood cases (default: 100000)\n"
+         << "  --seed N           seed of the loss, jitter and reordering (default: 1)\n"
+         << "  --output FILE      write the result as JSON to FILE (default: stdout)" << endl;
+}
+
+void writeJson(ostream& os, const Options& options, const vector<Result>& results, const vector<Check>& checks)
+{
+    os << "{\n";
+    os << "  \"benchmark\": \"NetEmPlugin\",\n";
+    os << "  \"parameters\": { \"packets\": " << options.packets << ", \"rate\": " << options.rate
+       << ", \"size\": " << options.size << ", \"flood_packets\": " << options.floodPackets
+       << ", \"seed\": " << options.seed << " },\n";
+    os << "  \"results\": [\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        os << "    { \"name\": \"" << r.name << "\", \"protocol\": \"" << r.protocol << "\", \"sent\": " << r.sent
+           << ", \"received\": " << r.received << ", \"packets_per_second\": " << fixed << r.throughput
+           << ", \"kilobytes_per_second\": " << r.bandwidth << ", \"added_median_ms\": " << r.addedMedian
+           << ", \"added_p99_ms\": " << r.addedP99 << ", \"added_stddev_ms\": " << r.addedStdDev
+           << ", \"loss_percent\": " << r.loss << ", \"reorder_percent\": " << r.reorder << " }"
+           << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ],\n";
+    os << "  \"checks\": [\n";
+    for(size_t i = 0; i < checks.size(); ++i) {
+        const Check& c = checks[i];
+        os << "    { \"name\": \"" << c.name << "\", \"value\": " << c.value << ", \"tolerance\": " << c.tolerance
+           << ", \"ok\": " << (fabs(c.value) <= c.tolerance ? "true" : "false") << " }"
+           << (i + 1 < checks.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}" << endl;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if(!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    UdpEchoServer udpServer;
+    TcpEchoServer tcpServer;
+    ImpairmentProxy udpProxy;
+    ImpairmentProxy tcpProxy;
+    udpProxy.setSeed(options.seed);
+    if(!udpProxy.start(ImpairmentProxy::UDP, 0, "127.0.0.1", udpServer.port)
+       || !tcpProxy.start(ImpairmentProxy::TCP, 0, "127.0.0.1", tcpServer.port)) {
+        cerr << udpProxy.errorMessage() << tcpProxy.errorMessage() << endl;
+        return 1;
+    }
+
+    vector<Result> results;
+    vector<Check> checks;
+    auto add = [&](const Result& result) -> const Result& {
+        printResult(result);
+        results.push_back(result);
+        return results.back();
+    };
+    auto set = [](ImpairmentProxy& proxy, const NetemParameters& outbound, const NetemParameters& inbound) {
+        proxy.setParameters(ImpairmentProxy::Outbound, outbound);
+        proxy.setParameters(ImpairmentProxy::Inbound, inbound);
+    };
+
+    // The loopback round trip is subtracted from the others, so they show what the proxy adds
+    const int n = options.packets;
+    const double baseline = add(runUdp("direct", udpServer.port, n, options.rate, options.size, 0.0, 0.2)).addedMedian;
+
+    set(udpProxy, netem(0.0), netem(0.0));
+    const Result& passthrough = add(runUdp("passthrough", udpProxy.listenPort(), n, options.rate, options.size, baseline, 0.2));
+    checks.push_back({ "passthrough_added_median_ms", passthrough.addedMedian, 0.5 });
+
+    set(udpProxy, netem(10.0), netem(5.0));
+    const Result& delay = add(runUdp("delay_10+5ms", udpProxy.listenPort(), n, options.rate, options.size, baseline, 0.3));
+    checks.push_back({ "delay_median_error_ms", delay.addedMedian - 15.0, 0.5 });
+    checks.push_back({ "delay_p99_error_ms", delay.addedP99 - 15.0, 2.0 });
+    checks.push_back({ "delay_loss_percent", delay.loss, 0.0 });
+
+    set(udpProxy, netem(20.0, 5.0, 0.0, 0.0, 0.0, NetemParameters::Normal), netem(0.0));
+    const Result& jitter = add(runUdp("jitter_20ms_normal_5ms", udpProxy.listenPort(), n, options.rate, options.size, baseline, 0.3));
+    checks.push_back({ "jitter_median_error_ms", jitter.addedMedian - 20.0, 1.0 });
+    checks.push_back({ "jitter_stddev_error_ms", jitter.addedStdDev - 5.0, 1.0 });
+
+    set(udpProxy, netem(0.0, 0.0, 0.0, 5.0), netem(0.0));
+    const Result& loss = add(runUdp("loss_5%", udpProxy.listenPort(), n, options.rate, options.size, baseline, 0.2));
+    checks.push_back({ "loss_error_percent", loss.loss - 5.0, 4.0 * sqrt(5.0 * 95.0 / n) });
+
+    // The reordered packets skip the 10 ms, so they overtake about ten packets at 1000 packets/s
+    set(udpProxy, netem(10.0, 0.0, 0.0, 0.0, 25.0), netem(0.0));
+    const Result& reorder = add(runUdp("reorder_25%", udpProxy.listenPort(), n, options.rate, options.size, baseline, 0.3));
+    checks.push_back({ "reorder_error_percent", reorder.reorder - 25.0, 4.0 * sqrt(25.0 * 75.0 / n) + 1.0 });
+
+    // The rate limits the payload to 500 kB/s, below the offered load, so the queue builds up
+    const double offered = 1.5 * 500.0 * 1000.0 / options.size;
+    set(udpProxy, netem(0.0, 0.0, 500.0), netem(0.0));
+    const Result& rate = add(runUdp("rate_500kBps", udpProxy.listenPort(), n, (int)offered, options.size, baseline, 0.5));
+    checks.push_back({ "rate_error_percent", 100.0 * (rate.bandwidth - 500.0) / 500.0, 5.0 });
+
+    // Throughput of the scheduler with no delay and with many packets waiting in the wheel
+    add(runUdp("flood_direct", udpServer.port, options.floodPackets, 0, 64, baseline, 0.3));
+    set(udpProxy, netem(0.0), netem(0.0));
+    add(runUdp("flood", udpProxy.listenPort(), options.floodPackets, 0, 64, baseline, 0.3));
+    NetemParameters waiting = netem(50.0);
+    waiting.limit = options.floodPackets;
+    set(udpProxy, waiting, waiting);
+    add(runUdp("flood_delay_50+50ms", udpProxy.listenPort(), options.floodPackets, 0, 64, baseline, 0.5));
+
+    const ImpairmentProxy::Statistics statistics = udpProxy.statistics(ImpairmentProxy::Outbound);
+    fprintf(stderr, "udp proxy outbound: %llu received, %llu sent, %llu lost, %llu overflowed, %llu reordered\n",
+            (unsigned long long)statistics.receivedPackets, (unsigned long long)statistics.sentPackets,
+            (unsigned long long)statistics.lostPackets, (unsigned long long)statistics.overflowedPackets,
+            (unsigned long long)statistics.reorderedPackets);
+
+    set(tcpProxy, netem(0.0), netem(0.0));
+    const double tcpBaseline = add(runTcpPingPong("tcp_direct", tcpServer.port, 200, 0.0)).addedMedian;
+    set(tcpProxy, netem(10.0), netem(5.0));
+    const Result& pingPong = add(runTcpPingPong("tcp_delay_10+5ms", tcpProxy.listenPort(), 100, tcpBaseline));
+    checks.push_back({ "tcp_delay_median_error_ms", pingPong.addedMedian - 15.0, 0.5 });
+
+    int mismatches = 0;
+    set(tcpProxy, netem(0.0, 0.0, 2000.0), netem(0.0));
+    const Result& bulk = add(runTcpBulk("tcp_rate_2000kBps", tcpProxy.listenPort(), 4 << 20, mismatches));
+    checks.push_back({ "tcp_integrity_mismatches", (double)mismatches, 0.0 });
+    checks.push_back({ "tcp_rate_error_percent", 100.0 * (bulk.bandwidth - 2000.0) / 2000.0, 5.0 });
+
+    set(tcpProxy, netem(5.0), netem(5.0));
+    add(runTcpBulk("tcp_delay_5+5ms", tcpProxy.listenPort(), 16 << 20, mismatches));
+    checks.push_back({ "tcp_delay_integrity_mismatches", (double)mismatches, 0.0 });
+
+    // The sockets of the UDP clients are closed beyond the maximum and after the idle timeout
+    ImpairmentProxy flowProxy;
+    flowProxy.setUdpFlowLimits(0.2, 64);
+    const int numOpenFiles = countOpenFiles();
+    if(flowProxy.start(ImpairmentProxy::UDP, 0, "127.0.0.1", udpServer.port)) {
+        const int numFiles = countOpenFiles();
+        const int numEchoes = echoFromClients(flowProxy.listenPort(), 200);
+        checks.push_back({ "udp_flow_echo_misses", 200.0 - numEchoes, 0.0 });
+        checks.push_back({ "udp_flows_beyond_maximum", flowProxy.numUdpFlows() - 64.0, 0.0 });
+        checks.push_back({ "udp_flow_sockets_beyond_maximum", countOpenFiles() - numFiles - 64.0, 0.0 });
+        this_thread::sleep_for(chrono::milliseconds(400));
+        checks.push_back({ "udp_flows_after_idle_timeout", (double)flowProxy.numUdpFlows(), 0.0 });
+        checks.push_back({ "udp_flow_sockets_after_idle_timeout", (double)(countOpenFiles() - numFiles), 0.0 });
+        checks.push_back({ "udp_flow_echo_misses_after_idle_timeout", 1.0 - echoFromClients(flowProxy.listenPort(), 1), 0.0 });
+        flowProxy.stop();
+    }
+    checks.push_back({ "udp_flow_sockets_after_stop", (double)(countOpenFiles() - numOpenFiles), 0.0 });
+
+    udpProxy.stop();
+    tcpProxy.stop();
+
+    if(options.output.empty()) {
+        writeJson(cout, options, results, checks);
+    } else {
+        ofstream out(options.output);
+        writeJson(out, options, results, checks);
+    }
+
+    bool ok = true;
+    for(auto& check : checks) {
+        ok &= fabs(check.value) <= check.tolerance;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,514 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "../NetEm.h"
+#include <QCoreApplication>
+#include <dirent.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+struct Check {
+    string name;
+    double value;
+    double tolerance;
+};
+
+struct Step {
+    string name;
+    int commands;
+    double latency; // unit: ms
+};
+
+// Keeps the tc tree of each device as the kernel would and refuses what the kernel refuses,
+// such as adding an existing qdisc or deleting a class that a filter still points to
+class FakeKernel
+{
+public:
+    struct Qdisc
+    {
+        string parent; // "root", "ingress" or a class
+        string kind;
+        string options;
+    };
+
+    struct Device
+    {
+        map<string, Qdisc> qdiscs;
+        map<string, string> classes; // classid to parent
+        map<pair<string, int>, string> filters; // parent and priority to flowid
+    };
+
+    map<string, Device> devices;
+    int numCommands = 0;
+    int numRefusals = 0; // the next commands refused as if tc failed
+    vector<string> errors;
+
+    bool execute(const string& line)
+    {
+        // The commands whose errors are discarded may fail
+        string command = line;
+        strip(command, ";");
+        const bool isQuiet = strip(command, " 2> /dev/null");
+        if(command.compare(0, 5, "sudo ") == 0) {
+            command = command.substr(5);
+        }
+        istringstream stream(command);
+        vector<string> tokens;
+        for(string token; stream >> token; ) {
+            tokens.push_back(token);
+        }
+        if(tokens.size() < 5 || tokens[0] != "tc") {
+            return true;
+        }
+        ++numCommands;
+        if(numRefusals > 0 && !isQuiet) {
+            --numRefusals;
+            return false;
+        }
+        string error = apply(tokens);
+        if(error.empty()) {
+            return true;
+        }
+        if(!isQuiet) {
+            errors.push_back(line + " (" + error + ")");
+        }
+        return false;
+    }
+
+private:
+    static bool strip(string& s, const string& suffix)
+    {
+        if(s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            s.erase(s.size() - suffix.size());
+            return true;
+        }
+        return false;
+    }
+
+    static string argument(const vector<string>& tokens, const string& name)
+    {
+        for(size_t i = 0; i + 1 < tokens.size(); ++i) {
+            if(tokens[i] == name) {
+                return tokens[i + 1];
+            }
+        }
+        return string();
+    }
+
+    static bool has(const vector<string>& tokens, const string& name)
+    {
+        for(auto& token : tokens) {
+            if(token == name) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static string clause(const string& options, const string& name)
+    {
+        istringstream stream(options);
+        vector<string> tokens;
+        for(string token; stream >> token; ) {
+            tokens.push_back(token);
+        }
+        string value = argument(tokens, name);
+        return value.empty() ? string() : " " + name + " " + value;
+    }
+
+    // netem_change replaces what tc puts in tc_netem_qopt, such as the limit, the delay and the loss,
+    // and keeps the attributes that a change leaves out, such as the rate and the distribution
+    static string mergeNetem(const string& installed, const string& change)
+    {
+        string options = change;
+        for(auto& name : { "rate", "distribution" }) {
+            if(clause(change, name).empty()) {
+                options += clause(installed, name);
+            }
+        }
+        return options;
+    }
+
+    static string major(const string& handle)
+    {
+        return handle.substr(0, handle.find(':') + 1);
+    }
+
+    static string join(const vector<string>& tokens, size_t begin)
+    {
+        string s;
+        for(size_t i = begin; i < tokens.size(); ++i) {
+            s += (i > begin ? " " : "") + tokens[i];
+        }
+        return s;
+    }
+
+    string findTop(Device& device, const string& parent)
+    {
+        for(auto& q : device.qdiscs) {
+            if(q.second.parent == parent) {
+                return q.first;
+            }
+        }
+        return string();
+    }
+
+    void removeQdisc(Device& device, const string& handle)
+    {
+        device.qdiscs.erase(handle);
+        for(auto p = device.classes.begin(); p != device.classes.end(); ) {
+            if(major(p->first) == handle) {
+                string classid = p->first;
+                p = device.classes.erase(p);
+                removeLeaves(device, classid);
+            } else {
+                ++p;
+            }
+        }
+        for(auto p = device.filters.begin(); p != device.filters.end(); ) {
+            p = (p->first.first == handle) ? device.filters.erase(p) : next(p);
+        }
+    }
+
+    void removeLeaves(Device& device, const string& classid)
+    {
+        vector<string> leaves;
+        for(auto& q : device.qdiscs) {
+            if(q.second.parent == classid) {
+                leaves.push_back(q.first);
+            }
+        }
+        for(auto& leaf : leaves) {
+            removeQdisc(device, leaf);
+        }
+    }
+
+    string apply(const vector<string>& tokens)
+    {
+        const string& object = tokens[1];
+        const string& verb = tokens[2];
+        Device& device = devices[argument(tokens, "dev")];
+
+        if(object == "qdisc") {
+            string parent = has(tokens, "root") ? "root" : has(tokens, "ingress") ? "ingress" : argument(tokens, "parent");
+            string handle = argument(tokens, "handle");
+            if(verb == "add") {
+                if(handle.empty() || device.qdiscs.count(handle)) {
+                    return "File exists";
+                }
+                if(parent == "root" || parent == "ingress") {
+                    if(!findTop(device, parent).empty()) {
+                        return "Exclusivity flag on, cannot modify";
+                    }
+                } else if(!device.classes.count(parent)) {
+                    return "Invalid parent";
+                }
+                Qdisc& qdisc = device.qdiscs[handle];
+                qdisc.parent = parent;
+                if(parent == "ingress") {
+                    qdisc.kind = "ingress";
+                } else {
+                    size_t i = 0;
+                    while(tokens[i] != "handle") {
+                        ++i;
+                    }
+                    qdisc.kind = tokens[i + 2];
+                    qdisc.options = join(tokens, i + 3);
+                }
+                return string();
+            }
+            if(parent == "root" || parent == "ingress") {
+                handle = findTop(device, parent);
+            }
+            if(handle.empty() || !device.qdiscs.count(handle)) {
+                return "No such file or directory";
+            }
+            if(verb == "del") {
+                removeQdisc(device, handle);
+            } else if(verb == "change") {
+                Qdisc& qdisc = device.qdiscs[handle];
+                size_t i = 0;
+                while(i < tokens.size() && tokens[i] != qdisc.kind) {
+                    ++i;
+                }
+                if(i == tokens.size()) {
+                    return "Invalid argument";
+                }
+                qdisc.options = mergeNetem(qdisc.options, join(tokens, i + 1));
+            }
+            return string();
+        }
+
+        if(object == "class") {
+            string classid = argument(tokens, "classid");
+            if(verb == "add") {
+                string parent = argument(tokens, "parent");
+                if(!device.qdiscs.count(parent)) {
+                    return "Invalid parent";
+                }
+                if(device.classes.count(classid)) {
+                    return "File exists";
+                }
+                device.classes[classid] = parent;
+                return string();
+            }
+            if(!device.classes.count(classid)) {
+                return "No such file or directory";
+            }
+            if(verb == "del") {
+                for(auto& f : device.filters) {
+                    if(f.second == classid) {
+                        return "Device or resource busy";
+                    }
+                }
+                device.classes.erase(classid);
+                removeLeaves(device, classid);
+            }
+            return string();
+        }
+
+        if(object == "filter") {
+            auto key = make_pair(argument(tokens, "parent"), atoi(argument(tokens, "prio").c_str()));
+            if(verb == "add") {
+                if(!device.qdiscs.count(key.first)) {
+                    return "Invalid parent";
+                }
+                if(device.filters.count(key)) {
+                    return "File exists";
+                }
+                string flowid = argument(tokens, "flowid");
+                if(!flowid.empty() && !device.classes.count(flowid)) {
+                    return "Invalid class";
+                }
+                device.filters[key] = flowid;
+            } else if(verb == "del") {
+                if(!device.filters.erase(key)) {
+                    return "No such file or directory";
+                }
+            }
+            return string();
+        }
+        return "Unknown object";
+    }
+};
+
+// The interfaces of the system except the ifb devices, as listed by sysfs
+int countInterfaces()
+{
+    int count = 0;
+    if(DIR* dir = opendir("/sys/class/net")) {
+        while(dirent* entry = readdir(dir)) {
+            string name = entry->d_name;
+            if(name != "." && name != ".." && name.compare(0, 3, "ifb") != 0) {
+                ++count;
+            }
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+NetEm::Flow robotFlow(int id)
+{
+    NetEm::Flow flow;
+    flow.destinationIP = "10.0." + to_string(id / 250) + "." + to_string(id % 250 + 1) + "/32";
+    flow.parameters[0].delay = id;
+    flow.parameters[1].delay = id;
+    flow.parameters[1].loss = 1.0;
+    return flow;
+}
+
+void printUsage()
+{
+    cerr << "Usage: netem-state-check [--output FILE]\n"
+         << "  Runs NetEm against a fake tc that models the qdisc trees, and checks\n"
+         << "  that each update sends only the changes and that the kernel would accept them." << endl;
+}
+
+void writeJson(ostream& os, const vector<Step>& steps, const vector<Check>& checks)
+{
+    os << "{\n";
+    os << "  \"benchmark\": \"NetEmStateCheck\",\n";
+    os << "  \"steps\": [\n";
+    for(size_t i = 0; i < steps.size(); ++i) {
+        const Step& s = steps[i];
+        os << "    { \"name\": \"" << s.name << "\", \"tc_commands\": " << s.commands
+           << ", \"latency_ms\": " << fixed << s.latency << " }" << (i + 1 < steps.size() ? "," : "") << "\n";
+    }
+    os << "  ],\n";
+    os << "  \"checks\": [\n";
+    for(size_t i = 0; i < checks.size(); ++i) {
+        const Check& c = checks[i];
+        os << "    { \"name\": \"" << c.name << "\", \"value\": " << c.value << ", \"tolerance\": " << c.tolerance
+           << ", \"ok\": " << (fabs(c.value) <= c.tolerance ? "true" : "false") << " }"
+           << (i + 1 < checks.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}" << endl;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    string output;
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if(arg == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+    QCoreApplication app(argc, argv);
+
+    FakeKernel kernel;
+    NetEmPtr netem = new NetEm;
+    netem->setCommandExecutor([&](const string& command){ return kernel.execute(command); });
+    netem->setNetlinkEnabled(false);
+
+    vector<Check> checks;
+    vector<Step> steps;
+    checks.push_back({ "interfaces_missing", (double)(countInterfaces() - (int)netem->interfaces().size()), 0.0 });
+
+    // The fake interface carries what an earlier run left, which the first update must clear
+    const string interface = "fake0";
+    const string ifb = "ifb0";
+    netem->interfaces().push_back(interface);
+    kernel.execute("sudo tc qdisc add dev fake0 root handle 1: prio bands 16;");
+    kernel.execute("sudo tc qdisc add dev fake0 handle ffff: ingress;");
+
+    auto update = [&](const string& name) {
+        const int before = kernel.numCommands;
+        netem->update();
+        steps.push_back({ name, kernel.numCommands - before, netem->lastUpdateLatency() });
+        return steps.back().commands;
+    };
+    auto count = [&](const string& name, double value, double expected) {
+        checks.push_back({ name, value - expected, 0.0 });
+    };
+    auto device = [&](const string& name) -> FakeKernel::Device& { return kernel.devices[name]; };
+
+    netem->start((int)netem->interfaces().size() - 1, 0);
+    netem->setDelay(1, 10.0);
+    update("install");
+    count("install_root_is_htb", device(interface).qdiscs["1:"].kind == "htb", 1);
+    count("install_interface_qdiscs", device(interface).qdiscs.size(), 4);
+    count("install_interface_classes", device(interface).classes.size(), 2);
+    count("install_interface_filters", device(interface).filters.size(), 2);
+    count("install_ifb_qdiscs", device(ifb).qdiscs.size(), 3);
+    count("install_ifb_filters", device(ifb).filters.size(), 1);
+
+    netem->setDelay(1, 20.0);
+    count("change_delay_commands", update("change_delay"), 1);
+    count("change_delay_applied", device(interface).qdiscs["20:"].options.find("delay 20.00ms") != string::npos, 1);
+
+    // The tc change keeps the rate it leaves out, so a cleared rate has to be sent
+    auto rate = [&](const string& handle) {
+        istringstream stream(device(interface).qdiscs[handle].options);
+        for(string token; stream >> token; ) {
+            if(token == "rate" && stream >> token) {
+                return atof(token.c_str());
+            }
+        }
+        return 0.0;
+    };
+    netem->setRate(1, 100.0);
+    count("set_rate_commands", update("set_rate"), 1);
+    count("set_rate_applied", rate("20:"), 100.0);
+    netem->setRate(1, 0.0);
+    count("clear_rate_commands", update("clear_rate"), 1);
+    count("clear_rate_applied", rate("20:"), 0.0);
+
+    // A refused command leaves the trees unknown, so the next update deletes and rebuilds them
+    kernel.numRefusals = 1;
+    netem->setDelay(1, 30.0);
+    update("refused_change");
+    update("rebuild");
+    count("rebuild_delay_applied", device(interface).qdiscs["20:"].options.find("delay 30.00ms") != string::npos, 1);
+    count("rebuild_interface_filters", device(interface).filters.size(), 2);
+    netem->setDelay(1, 20.0);
+    update("restore_delay");
+
+    const int numRobots = 40;
+    for(int id = 1; id <= numRobots; ++id) {
+        netem->setFlow(id, robotFlow(id));
+    }
+    count("add_flows_commands", update("add_40_flows"), 6 * numRobots);
+    count("add_flows_interface_filters", device(interface).filters.size(), 2 + numRobots);
+
+    count("unchanged_commands", update("unchanged"), 0);
+    count("unchanged_in_place", netem->isLastUpdateInPlace(), 1);
+
+    NetEm::Flow moved = robotFlow(5);
+    moved.destinationIP = "10.1.0.5/32";
+    netem->setFlow(5, moved);
+    count("move_address_commands", update("move_address"), 4);
+
+    NetEm::Flow normal = robotFlow(7);
+    normal.parameters[1].jitter = 5.0;
+    normal.parameters[1].distribution = NetemParameters::Normal;
+    netem->setFlow(7, normal);
+    count("distribution_commands", update("change_distribution"), 2);
+
+    NetEm::Flow delayed = robotFlow(9);
+    delayed.parameters[0].delay = 50.0;
+    delayed.parameters[1].delay = 50.0;
+    netem->setFlow(9, delayed);
+    count("change_flow_commands", update("change_flow_delay"), 2);
+
+    netem->removeFlow(3);
+    count("remove_flow_commands", update("remove_flow"), 4);
+    count("remove_flow_interface_classes", device(interface).classes.size(), 2 + numRobots - 1);
+
+    int before = kernel.numCommands;
+    netem->stop();
+    count("stop_commands", kernel.numCommands - before, 3);
+    count("stop_interface_qdiscs", device(interface).qdiscs.size(), 0);
+    count("stop_ifb_qdiscs", device(ifb).qdiscs.size(), 0);
+
+    // The states are unknown again after a restart, so the trees are cleared quietly and rebuilt
+    netem->start((int)netem->interfaces().size() - 1, 0);
+    update("restart");
+    count("restart_interface_filters", device(interface).filters.size(), 2 + numRobots - 1);
+
+    // A new simulation starts from flow 0 only
+    netem->clearFlows();
+    update("clear_flows");
+    count("clear_flows_count", netem->flows().size(), 1);
+    count("clear_flows_interface_filters", device(interface).filters.size(), 2);
+    netem->stop();
+
+    count("kernel_errors", kernel.errors.size(), 0);
+    for(auto& error : kernel.errors) {
+        cerr << error << endl;
+    }
+
+    if(output.empty()) {
+        writeJson(cout, steps, checks);
+    } else {
+        ofstream out(output);
+        writeJson(out, steps, checks);
+    }
+
+    bool ok = true;
+    for(auto& check : checks) {
+        ok &= fabs(check.value) <= check.tolerance;
+    }
+    return ok ? 0 : 1;
+}
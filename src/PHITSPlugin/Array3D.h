@@ -4,26 +4,134 @@
 #ifndef CNOID_PHITS_PLUGIN_ARRAY_3D_H
 #define CNOID_PHITS_PLUGIN_ARRAY_3D_H
 
+#include <algorithm>
+#include <cstddef>
+#include <new>
 #include <vector>
 
 namespace cnoid {
 
+// キャッシュライン境界に揃えて確保するアロケータ
+template<class T, std::size_t Alignment = 64> class AlignedAllocator
+{
+public:
+    typedef T value_type;
+
+    template<class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() noexcept { }
+    template<class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept { }
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* p, std::size_t) noexcept
+    {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template<class U> bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+    template<class U> bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+};
+
+// Array3D の一部（スライスや部分領域）をコピーせずに参照するビュー
+// T に const 型を指定すると読み取り専用のビューになる
+template<class T> class Array3DView
+{
+public:
+    Array3DView()
+        : data_(nullptr), size_x_(0), size_y_(0), size_z_(0), stride_x_(0), stride_y_(0), stride_z_(0) { }
+
+    Array3DView(T* data, std::size_t x, std::size_t y, std::size_t z,
+                std::ptrdiff_t stride_x, std::ptrdiff_t stride_y, std::ptrdiff_t stride_z)
+        : data_(data), size_x_(x), size_y_(y), size_z_(z),
+          stride_x_(stride_x), stride_y_(stride_y), stride_z_(stride_z) { }
+
+    T& operator()(std::size_t x, std::size_t y = 0, std::size_t z = 0) const
+    {
+        return data_[stride_x_ * x + stride_y_ * y + stride_z_ * z];
+    }
+
+    bool empty() const { return size_x_ == 0 || size_y_ == 0 || size_z_ == 0; }
+    std::size_t size() const { return size_x_ * size_y_ * size_z_; }
+    std::size_t size_x() const { return size_x_; }
+    std::size_t size_y() const { return size_y_; }
+    std::size_t size_z() const { return size_z_; }
+
+    Array3DView subBox(std::size_t x, std::size_t y, std::size_t z,
+                       std::size_t nx, std::size_t ny, std::size_t nz) const
+    {
+        return Array3DView(&(*this)(x, y, z), nx, ny, nz, stride_x_, stride_y_, stride_z_);
+    }
+
+    // axis 方向の index 番目の断面．断面の (u, v) は軸を巡回させた順 (axis + 1, axis + 2) に対応する
+    Array3DView slice(int axis, std::size_t index) const
+    {
+        const std::size_t sizes[] = { size_x_, size_y_, size_z_ };
+        const std::ptrdiff_t strides[] = { stride_x_, stride_y_, stride_z_ };
+        int u = (axis + 1) % 3;
+        int v = (axis + 2) % 3;
+        return Array3DView(data_ + strides[axis] * index, sizes[u], sizes[v], 1, strides[u], strides[v], 0);
+    }
+
+    template<class U> void fill(const U& value) const
+    {
+        forEach([&](T& element){ element = value; });
+    }
+
+    template<class Function> void transform(Function func) const
+    {
+        forEach([&](T& element){ element = func(element); });
+    }
+
+    template<class Function> void forEach(Function func) const
+    {
+        for(std::size_t z = 0; z < size_z_; ++z) {
+            for(std::size_t y = 0; y < size_y_; ++y) {
+                T* p = data_ + stride_y_ * y + stride_z_ * z;
+                for(std::size_t x = 0; x < size_x_; ++x) {
+                    func(p[stride_x_ * x]);
+                }
+            }
+        }
+    }
+
+private:
+    T* data_;
+    std::size_t size_x_;
+    std::size_t size_y_;
+    std::size_t size_z_;
+    std::ptrdiff_t stride_x_;
+    std::ptrdiff_t stride_y_;
+    std::ptrdiff_t stride_z_;
+};
+
 template<class T> class Array3D
 {
 public:
+    typedef T value_type;
+    typedef std::vector<T, AlignedAllocator<T>> Container;
+    typedef Array3DView<T> View;
+    typedef Array3DView<const T> ConstView;
+
     Array3D()
     {
         size_x_ = size_y_ = size_z_ = 0;
         array_.clear();
     }
 
+    Array3D(std::size_t x, std::size_t y, std::size_t z, const T& value = T())
+    {
+        size_x_ = size_y_ = size_z_ = 0;
+        resize(x, y, z, value);
+    }
+
     virtual ~Array3D() { }
 
-    bool resize(unsigned int x = 0, unsigned int y = 1, unsigned int z = 1)
+    bool resize(std::size_t x = 0, std::size_t y = 1, std::size_t z = 1)
     {
-        if(x < 0 || y < 0 || z < 0) {
-            return false;
-        }
         array_.resize(x * y * z);
         size_x_ = x;
         size_y_ = y;
@@ -31,20 +139,60 @@ public:
         return true;
     }
 
-    T* front() const { return array_.empty() ? nullptr : &(array_[0]); }
+    bool resize(std::size_t x, std::size_t y, std::size_t z, const T& value)
+    {
+        array_.assign(x * y * z, value);
+        size_x_ = x;
+        size_y_ = y;
+        size_z_ = z;
+        return true;
+    }
+
+    T* front() const { return array_.empty() ? nullptr : const_cast<T*>(array_.data()); }
+    T* data() { return array_.data(); }
+    const T* data() const { return array_.data(); }
+
+    T operator()(std::size_t x, std::size_t y = 0, std::size_t z = 0) const { return array_[index(x, y, z)]; }
+    T& operator()(std::size_t x, std::size_t y = 0, std::size_t z = 0) { return array_[index(x, y, z)]; }
+
+    std::size_t index(std::size_t x, std::size_t y, std::size_t z) const { return (size_y_ * z + y) * size_x_ + x; }
+
+    unsigned int size_x() const { return static_cast<unsigned int>(size_x_); }
+    unsigned int size_y() const { return static_cast<unsigned int>(size_y_); }
+    unsigned int size_z() const { return static_cast<unsigned int>(size_z_); }
+    std::size_t size() const { return array_.size(); }
+    bool empty() const { return array_.empty(); }
+
+    void fill(const T& value) { std::fill(array_.begin(), array_.end(), value); }
+
+    template<class Function> void transform(Function func)
+    {
+        for(auto& element : array_) {
+            element = func(element);
+        }
+    }
+
+    View view() { return View(data(), size_x_, size_y_, size_z_, 1, size_x_, size_x_ * size_y_); }
+    ConstView view() const { return ConstView(data(), size_x_, size_y_, size_z_, 1, size_x_, size_x_ * size_y_); }
+
+    View subBox(std::size_t x, std::size_t y, std::size_t z, std::size_t nx, std::size_t ny, std::size_t nz)
+    {
+        return view().subBox(x, y, z, nx, ny, nz);
+    }
 
-    T operator()(unsigned int x, unsigned int y = 0, unsigned int z = 0) const { return array_[size_y_ * size_x_ * z + size_x_ * y + x]; }
-    T& operator()(unsigned int x, unsigned int y = 0, unsigned int z = 0) { return array_[size_y_ * size_x_ * z + size_x_ * y + x]; }
+    ConstView subBox(std::size_t x, std::size_t y, std::size_t z, std::size_t nx, std::size_t ny, std::size_t nz) const
+    {
+        return view().subBox(x, y, z, nx, ny, nz);
+    }
 
-    unsigned int size_x() const { return size_x_; }
-    unsigned int size_y() const { return size_y_; }
-    unsigned int size_z() const { return size_z_; }
+    View slice(int axis, std::size_t index) { return view().slice(axis, index); }
+    ConstView slice(int axis, std::size_t index) const { return view().slice(axis, index); }
 
 private:
-    unsigned int size_x_;
-    unsigned int size_y_;
-    unsigned int size_z_;
-    std::vector<T> array_;
+    std::size_t size_x_;
+    std::size_t size_y_;
+    std::size_t size_z_;
+    Container array_;
 };
 
 typedef Array3D<int> array3i;
@@ -134,6 +134,8 @@ public:
 
     PHITSRunner phitsRunner;
     PHITSRunner qadRunners[MAX_PROCESS];
+    PHITSWriter phitsWriter;
+    QADWriter qadWriter;
     GammaData::CalcInfo calcInfo;
     int countQAD;
     string defaultNuclideTableFile;
@@ -322,33 +324,33 @@ void CrossSectionItem::Impl::createScene()
             }
         }
 
+        double xside = xrange / (double)nx;
+        double yside = yrange / (double)ny;
+        double xcenter = xcoord[0] + xrange / 2.0;
+        double ycenter = ycoord[0] + yrange / 2.0;
+
+        ColorScale scale;
+        double min = nodeData->min();
+        double max = nodeData->max();
+        int exp = (int)floor(log10(fabs(max))) + 1;
+        min = 1.0 * pow(10, exp - 6);
+        max = 1.0 * pow(10, exp);
+        scale.setRange(min, max);
+
+        // 断面の (i, j) は coordID の順に並ぶため，セル配列をコピーせずにビューとして参照する
+        OrthoGridArray::ConstView slice;
+        if(index != -1) {
+            slice = nodeData->cellSlice(coordID[id][2], index);
+        }
+
         for(int j = 0; j < height; ++j) {
             for(int i = 0; i < width; ++i) {
-                double xside = xrange / (double)nx;
-                double yside = yrange / (double)ny;
-                double xcenter = xcoord[0] + xrange / 2.0;
-                double ycenter = ycoord[0] + yrange / 2.0;
-
-                ColorScale scale;
-                double min = nodeData->min();
-                double max = nodeData->max();
-                int exp = (int)floor(log10(fabs(max))) + 1;
-                min = 1.0 * pow(10, exp - 6);
-                max = 1.0 * pow(10, exp);
-                scale.setRange(min, max);
-
-                const int positionID[][3] = {
-                    { (int)i, (int)j, index},
-                    { index, (int)i, (int)j },
-                    { (int)j, index, (int)i }
-                };
-
                 Vector3 color;
                 if(index != -1) {
                     if(colorScale.is(LOG_SCALE)) {
-                        color = scale.logColor(nodeData->value(positionID[id][0], positionID[id][1], positionID[id][2]));
+                        color = scale.logColor(slice(i, j));
                     } else if(colorScale.is(LINER_SCALE)){
-                        color = scale.linerColor(nodeData->value(positionID[id][0], positionID[id][1], positionID[id][2]));
+                        color = scale.linerColor(slice(i, j));
                     }
                 } else {
                     if(colorScale.is(LOG_SCALE)) {
@@ -743,13 +745,11 @@ void DoseConfigDialog::start(bool checked)
 
         if(index == PHITS) {
             filename0 = toUTF8((parentDirPath / "dose_xy.out").string());
-            PHITSWriter phitsWriter;
             phitsWriter.setDefaultNuclideTableFile(defaultNuclideTableFile);
             phitsWriter.setDefaultElementTableFile(defaultElementTableFile);
             result = writeTextFile(filename, phitsWriter.writePHITS(calcInfo));
         } else if(index == QAD) {
             filename0 = toUTF8((parentDirPath / filePath.stem()).string()) + ".out";
-            QADWriter qadWriter;
             qadWriter.setDefaultNuclideTableFile(defaultNuclideTableFile);
             qadWriter.setDefaultElementTableFile(defaultElementTableFile);
             result = writeTextFile(filename, qadWriter.writeQAD(calcInfo, 0));
@@ -18,6 +18,9 @@
 #include <QBoxLayout>
 #include <QDialogButtonBox>
 #include <QLabel>
+#include <algorithm>
+#include <list>
+#include "GammaData.h"
 #include "gettext.h"
 
 using namespace std;
@@ -57,6 +60,17 @@ public:
     Impl(EnergyFilter* self);
 
     EnergyFilterDialog* config;
+
+    struct WindowCache {
+        const GammaData* gammaData;
+        int revision; // unique among all the GammaData, so a reused address does not hit
+        vector<pair<int, int>> windows;
+        vector<double> values;
+    };
+
+    // 先頭が最も最近使用した窓
+    list<WindowCache> windowCaches;
+    static const size_t maxWindowCaches = 8;
 };
 
 }
@@ -135,6 +149,94 @@ vector<EnergyFilter::NuclideFilterInfo> EnergyFilter::nuclideFilterInfo() const
 }
 
 
+vector<pair<int, int>> EnergyFilter::channelWindows(int channelNumber) const
+{
+    vector<pair<int, int>> windows;
+    if(channelNumber <= 0) {
+        return windows;
+    }
+
+    // ダイアログのチャンネルは 1 始まり
+    auto addWindow = [&](int min, int max){
+        if(min > max) {
+            std::swap(min, max);
+        }
+        min = std::max(min - 1, 0);
+        max = std::min(max - 1, channelNumber - 1);
+        if(min <= max) {
+            windows.push_back(make_pair(min, max));
+        }
+    };
+
+    switch(mode()) {
+    case NO_FILTER:
+        windows.push_back(make_pair(0, channelNumber - 1));
+        break;
+    case RANGE_FILTER:
+        addWindow(min(), max());
+        break;
+    case NUCLIDE_FILTER:
+        for(auto& info : nuclideFilterInfo()) {
+            addWindow(info.min, info.max);
+        }
+        break;
+    default:
+        break;
+    }
+
+    // 重なる窓を結合し，同じチャンネルを二重に数えないようにする
+    std::sort(windows.begin(), windows.end());
+    vector<pair<int, int>> merged;
+    for(auto& window : windows) {
+        if(!merged.empty() && window.first <= merged.back().second + 1) {
+            merged.back().second = std::max(merged.back().second, window.second);
+        } else {
+            merged.push_back(window);
+        }
+    }
+    return merged;
+}
+
+
+const vector<double>& EnergyFilter::directionValues(const GammaData& gammaData)
+{
+    vector<pair<int, int>> windows = channelWindows(gammaData.energySpectrumChannelNumber());
+    auto& caches = impl->windowCaches;
+
+    for(auto it = caches.begin(); it != caches.end(); ++it) {
+        if(it->gammaData == &gammaData && it->revision == gammaData.revision() && it->windows == windows) {
+            caches.splice(caches.begin(), caches, it);
+            return caches.front().values;
+        }
+    }
+
+    // 古いデータのキャッシュは破棄する
+    caches.remove_if(
+        [&](const Impl::WindowCache& cache){
+            return cache.gammaData == &gammaData && cache.revision != gammaData.revision();
+        });
+    if(caches.size() >= Impl::maxWindowCaches) {
+        caches.pop_back();
+    }
+
+    Impl::WindowCache cache;
+    cache.gammaData = &gammaData;
+    cache.revision = gammaData.revision();
+    cache.windows = windows;
+    int numDirections = gammaData.numDirections();
+    cache.values.resize(numDirections, 0.0);
+    for(int i = 0; i < numDirections; ++i) {
+        double value = 0.0;
+        for(auto& window : windows) {
+            value += gammaData.energyWindowSum(i, window.first, window.second);
+        }
+        cache.values[i] = value;
+    }
+    caches.push_front(std::move(cache));
+    return caches.front().values;
+}
+
+
 bool EnergyFilter::load(const string& filename, ostream& os)
 {
     TreeWidget* nuclideTree = impl->config->nuclideTree;
@@ -7,10 +7,13 @@
 
 #include <cnoid/Archive>
 #include <cnoid/NullOut>
+#include <utility>
 #include <vector>
 
 namespace cnoid {
 
+class GammaData;
+
 class EnergyFilter
 {
 public:
@@ -38,6 +41,13 @@ public:
 
     std::vector<EnergyFilter::NuclideFilterInfo> nuclideFilterInfo() const;
 
+    // フィルタ窓を 0 始まりのチャンネル範囲 [first, second] として重複なく返す
+    std::vector<std::pair<int, int>> channelWindows(int channelNumber) const;
+
+    // 各方向についてフィルタ窓内のカウントの合計を返す
+    // 最近使用した窓の結果はデータが更新されるまでキャッシュされる
+    const std::vector<double>& directionValues(const GammaData& gammaData);
+
     bool load(const std::string& filename, std::ostream& os = nullout());
 
     void storeState(Archive& archive);
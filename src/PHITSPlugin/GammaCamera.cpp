@@ -13,6 +13,7 @@ using namespace cnoid;
 GammaCamera::GammaCamera()
 {
     isReady_ = false;
+    dataRevision_ = 0;
     dataType_ = 0;
     resolution_ << 8, 8;
     material_.clear();
@@ -51,6 +52,7 @@ void GammaCamera::copyGammaCameraStateFrom(const GammaCamera& other, bool doCopy
     }
 
     isReady_ = other.isReady_;
+    dataRevision_ = other.dataRevision_;
     dataType_ = other.dataType_;
     resolution_ = other.resolution_;
     material_ = other.material_;
@@ -26,6 +26,9 @@ public:
 
     void setReady(bool isReady) { isReady_ = isReady; }
     bool isReady() const { return isReady_; }
+    // 計算結果が更新されるたびに増加する
+    void updateDataRevision() { ++dataRevision_; }
+    int dataRevision() const { return dataRevision_; }
     void setDataType(const int& dataType) { dataType_ = dataType; }
     int dataType() const { return dataType_; }
     void setResolution(Vector2 resolution) { resolution_ = resolution; }
@@ -43,6 +46,7 @@ protected:
 private:
     GammaData gammaData_;
     bool isReady_;
+    int dataRevision_;
     int dataType_;
     Vector2 resolution_;
     std::string material_;
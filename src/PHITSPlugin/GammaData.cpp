@@ -4,6 +4,8 @@
 
 #include "GammaData.h"
 #include <cnoid/EigenUtil>
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <sstream>
 #include <math.h>
@@ -15,6 +17,13 @@ using namespace cnoid;
 
 namespace {
 
+// すべてのGammaDataで一意なリビジョンを発行する
+int newRevision()
+{
+    static std::atomic<int> lastRevision(0);
+    return ++lastRevision;
+}
+
 struct PHITSDataInfo {
     float xdata;
     float ydata;
@@ -73,12 +82,18 @@ string getLineRight(string str)
 
 GammaData::GammaData()
 {
-
+    _dataMode = 0;
+    _energySpectrumChannelNumber = 0;
+    revision_ = newRevision();
+    loadedPointID_ = -1;
+    loadedRevision_ = -1;
+    cumulativeRevision_ = -1;
 }
 
 
 bool GammaData::read(const string& filename)
 {
+    revision_ = newRevision();
     ifstream in;
     in.open(filename.data(),ios_base::in |ios_base::binary);
     if(!in) {
@@ -139,6 +154,7 @@ bool GammaData::read(const string& filename)
 
 bool GammaData::readPHITS(const string& filename, const uint8_t _readMode)
 {
+    revision_ = newRevision();
     // phits outputからデータの読み込み
     ifstream in;
     in.open(filename, ios_base::in);
@@ -422,6 +438,7 @@ bool GammaData::readPHITS(const string& filename, const uint8_t _readMode)
 
 bool GammaData::readQAD(const string& filename, CalcInfo calcInfo, int iSrc)
 {
+    revision_ = newRevision();
     // QAD outputからデータの読み込み
     ifstream in;
     in.open(filename, ios_base::in);
@@ -645,6 +662,7 @@ bool GammaData::readQAD(const string& filename, CalcInfo calcInfo, int iSrc)
 
 bool GammaData::write(const string& filename)
 {
+    revision_ = newRevision();
     ofstream out;
     out.open(filename.data(), ios_base::out | ios_base::binary);
     if(!out) {
@@ -692,6 +710,11 @@ bool GammaData::write(const string& filename)
 
 bool GammaData::getDataHeaderInfo(GeometryInfo geoInfo)
 {
+    // 読み込み済みの計算点であればファイルを再度読み込まない
+    if(geoInfo.calcPointID == loadedPointID_ && loadedRevision_ == revision_) {
+        return true;
+    }
+
     ifstream in;
     in.open(filename_.data(),ios_base::in |ios_base::binary);
     if(!in) {
@@ -766,6 +789,10 @@ bool GammaData::getDataHeaderInfo(GeometryInfo geoInfo)
 
     in.close();
 
+    revision_ = newRevision();
+    loadedPointID_ = geoInfo.calcPointID;
+    loadedRevision_ = revision_;
+
     return true;
 }
 
@@ -843,6 +870,7 @@ bool GammaData::setDataHeaderInfo(GeometryInfo geoInfo)
 
 void GammaData::addDataInfo(const DataInfo& dataInfo)
 {
+    revision_ = newRevision();
     for(int i = 0; i < this->dataInfo().calcDirectionNumber; i++) {
         for(int j = 0; j < this->_energySpectrumChannelNumber; j++) {
             this->_dataInfo.calcDirectionRec[i].dirData[j] +=
@@ -850,3 +878,59 @@ void GammaData::addDataInfo(const DataInfo& dataInfo)
         }
     }
 }
+
+
+int GammaData::numDirections() const
+{
+    if(_dataMode == 0) {
+        return static_cast<int>(_dataInfo.calcDirectionPo.size());
+    } else if(_dataMode == 1) {
+        return static_cast<int>(_dataInfo.calcDirectionRec.size());
+    }
+    return 0;
+}
+
+
+void GammaData::updateCumulativeSpectra() const
+{
+    int numChannels = _energySpectrumChannelNumber;
+    int numDirs = numDirections();
+    size_t stride = numChannels + 1;
+    cumulativeSpectra_.resize(stride * numDirs);
+
+    for(int i = 0; i < numDirs; ++i) {
+        const vector<float>& dirData = (_dataMode == 0)
+            ? _dataInfo.calcDirectionPo[i].dirData : _dataInfo.calcDirectionRec[i].dirData;
+        double* sum = &cumulativeSpectra_[stride * i];
+        sum[0] = 0.0;
+        for(int j = 0; j < numChannels; ++j) {
+            double value = j < (int)dirData.size() ? dirData[j] : 0.0;
+            sum[j + 1] = sum[j] + value;
+        }
+    }
+    cumulativeRevision_ = revision_;
+}
+
+
+double GammaData::energyWindowSum(int direction, int minChannel, int maxChannel) const
+{
+    if(cumulativeRevision_ != revision_) {
+        updateCumulativeSpectra();
+    }
+
+    int numChannels = _energySpectrumChannelNumber;
+    if(direction < 0 || direction >= numDirections() || numChannels <= 0) {
+        return 0.0;
+    }
+    if(minChannel > maxChannel) {
+        std::swap(minChannel, maxChannel);
+    }
+    minChannel = std::max(minChannel, 0);
+    maxChannel = std::min(maxChannel, numChannels - 1);
+    if(minChannel > maxChannel) {
+        return 0.0;
+    }
+
+    const double* sum = &cumulativeSpectra_[(numChannels + 1) * direction];
+    return sum[maxChannel + 1] - sum[minChannel];
+}
@@ -84,7 +84,14 @@ public:
     GeometryInfo geometryInfo(const int& number) const { return _geometryHeaderInfo[number]; }
 
     void addDataInfo(const DataInfo& dataInfo);
-    DataInfo dataInfo() const { return _dataInfo; }
+    const DataInfo& dataInfo() const { return _dataInfo; }
+
+    // 方向 direction のエネルギーチャンネル [minChannel, maxChannel]（0始まり）の合計値
+    // 方向ごとの累積スペクトルを保持し，任意の窓の合計を2回の参照で求める
+    double energyWindowSum(int direction, int minChannel, int maxChannel) const;
+    int numDirections() const;
+    // データが更新されるたびに変わり，ほかのGammaDataとは重複しない
+    int revision() const { return revision_; }
 
     bool read(const std::string& filename);
     bool write(const std::string& filename);
@@ -105,6 +112,13 @@ private:
     int _calculatingPointNumber;
     std::vector<GeometryInfo> _geometryHeaderInfo;
     DataInfo _dataInfo;
+    int revision_;
+    int loadedPointID_;
+    int loadedRevision_;
+    mutable int cumulativeRevision_;
+    mutable std::vector<double> cumulativeSpectra_;
+
+    void updateCumulativeSpectra() const;
 
     std::string title;
     float xmin, ymin, zmin, emin;
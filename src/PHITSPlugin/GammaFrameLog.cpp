@@ -0,0 +1,279 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include "GammaFrameLog.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+// file header: magic(4) + version(4)
+// frame record: payload size(4) + payload
+//   time(8), name length(4), name, data type(4), resolution x(4), resolution y(4),
+//   window position(4 * 4), energy min(4), energy max(4),
+//   channel number(4), spectrum(4 * channel number), counts(4 * resolution x * resolution y)
+const char Magic[4] = { 'G', 'F', 'L', 'G' };
+const uint32_t Version = 1;
+
+template<typename T> void append(vector<char>& buf, const T& value)
+{
+    const char* p = reinterpret_cast<const char*>(&value);
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+void appendArray(vector<char>& buf, const vector<float>& values)
+{
+    const char* p = reinterpret_cast<const char*>(values.data());
+    buf.insert(buf.end(), p, p + values.size() * sizeof(float));
+}
+
+template<typename T> bool extract(const vector<char>& buf, size_t& pos, T& value)
+{
+    if(pos + sizeof(T) > buf.size()) {
+        return false;
+    }
+    memcpy(&value, &buf[pos], sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+bool extractArray(const vector<char>& buf, size_t& pos, size_t n, vector<float>& values)
+{
+    if(pos + n * sizeof(float) > buf.size()) {
+        return false;
+    }
+    values.resize(n);
+    if(n > 0) {
+        memcpy(values.data(), &buf[pos], n * sizeof(float));
+    }
+    pos += n * sizeof(float);
+    return true;
+}
+
+}
+
+
+GammaFrameLog::GammaFrameLog()
+{
+    filename_.clear();
+    isWriting_ = false;
+    isReading_ = false;
+    frameIndex.clear();
+}
+
+
+GammaFrameLog::~GammaFrameLog()
+{
+    close();
+}
+
+
+bool GammaFrameLog::openForWriting(const string& filename)
+{
+    close();
+
+    stream.open(filename.c_str(), ios_base::out | ios_base::binary | ios_base::trunc);
+    if(!stream) {
+        return false;
+    }
+    stream.write(Magic, sizeof(Magic));
+    stream.write((const char*)&Version, sizeof(Version));
+    filename_ = filename;
+    isWriting_ = true;
+    return stream.good();
+}
+
+
+bool GammaFrameLog::write(const Frame& frame)
+{
+    if(!isWriting_) {
+        return false;
+    }
+
+    size_t numCounts = static_cast<size_t>(frame.resolutionX) * frame.resolutionY;
+    if(frame.counts.size() != numCounts) {
+        return false;
+    }
+
+    buffer.clear();
+    append(buffer, frame.time);
+    append(buffer, static_cast<uint32_t>(frame.name.size()));
+    buffer.insert(buffer.end(), frame.name.begin(), frame.name.end());
+    append(buffer, static_cast<int32_t>(frame.dataType));
+    append(buffer, static_cast<int32_t>(frame.resolutionX));
+    append(buffer, static_cast<int32_t>(frame.resolutionY));
+    append(buffer, static_cast<float>(frame.topLeft[0]));
+    append(buffer, static_cast<float>(frame.topLeft[1]));
+    append(buffer, static_cast<float>(frame.bottomRight[0]));
+    append(buffer, static_cast<float>(frame.bottomRight[1]));
+    append(buffer, frame.energyMin);
+    append(buffer, frame.energyMax);
+    append(buffer, static_cast<uint32_t>(frame.spectrum.size()));
+    appendArray(buffer, frame.spectrum);
+    appendArray(buffer, frame.counts);
+
+    std::streamoff offset = stream.tellp();
+    uint32_t size = static_cast<uint32_t>(buffer.size());
+    stream.write((const char*)&size, sizeof(size));
+    stream.write(buffer.data(), buffer.size());
+    stream.flush();
+    if(!stream) {
+        return false;
+    }
+
+    frameIndex[frame.name].push_back({ frame.time, offset });
+    return true;
+}
+
+
+bool GammaFrameLog::openForReading(const string& filename)
+{
+    close();
+
+    stream.open(filename.c_str(), ios_base::in | ios_base::binary);
+    if(!stream) {
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    stream.read(magic, sizeof(magic));
+    stream.read((char*)&version, sizeof(version));
+    if(!stream || memcmp(magic, Magic, sizeof(Magic)) != 0 || version != Version) {
+        stream.close();
+        return false;
+    }
+
+    stream.seekg(0, ios_base::end);
+    std::streamoff fileSize = stream.tellg();
+    std::streamoff offset = sizeof(Magic) + sizeof(Version);
+
+    // ペイロードを読み飛ばしながら時刻とカメラ名のみで索引を作成する
+    while(offset + (std::streamoff)sizeof(uint32_t) <= fileSize) {
+        uint32_t size = 0;
+        double time = 0.0;
+        uint32_t nameLength = 0;
+        stream.seekg(offset);
+        stream.read((char*)&size, sizeof(size));
+        stream.read((char*)&time, sizeof(time));
+        stream.read((char*)&nameLength, sizeof(nameLength));
+        if(!stream || offset + (std::streamoff)sizeof(size) + size > fileSize
+           || sizeof(time) + sizeof(nameLength) + nameLength > size) {
+            // 書き込み途中で終了したレコードは無視する
+            break;
+        }
+        string name(nameLength, '\0');
+        stream.read(&name[0], nameLength);
+
+        vector<IndexEntry>& entries = frameIndex[name];
+        if(!entries.empty() && time < entries.back().time) {
+            // 時刻が巻き戻った場合（シミュレーションの再実行など）は以降のフレームを採用する
+            entries.erase(
+                upper_bound(entries.begin(), entries.end(), time,
+                            [](double t, const IndexEntry& entry){ return t < entry.time; }),
+                entries.end());
+        }
+        entries.push_back({ time, offset });
+        offset += sizeof(size) + size;
+    }
+    stream.clear();
+
+    filename_ = filename;
+    isReading_ = true;
+    return true;
+}
+
+
+void GammaFrameLog::close()
+{
+    if(stream.is_open()) {
+        stream.close();
+    }
+    stream.clear();
+    isWriting_ = false;
+    isReading_ = false;
+    frameIndex.clear();
+}
+
+
+int GammaFrameLog::findFrame(const string& name, double time) const
+{
+    auto it = frameIndex.find(name);
+    if(it == frameIndex.end()) {
+        return -1;
+    }
+    const vector<IndexEntry>& entries = it->second;
+    auto p = upper_bound(entries.begin(), entries.end(), time,
+                         [](double t, const IndexEntry& entry){ return t < entry.time; });
+    return static_cast<int>(p - entries.begin()) - 1;
+}
+
+
+bool GammaFrameLog::readFrame(const string& name, int index, Frame& frame)
+{
+    if(!isReading_) {
+        return false;
+    }
+    auto it = frameIndex.find(name);
+    if(it == frameIndex.end() || index < 0 || index >= (int)it->second.size()) {
+        return false;
+    }
+
+    uint32_t size = 0;
+    stream.clear();
+    stream.seekg(it->second[index].offset);
+    stream.read((char*)&size, sizeof(size));
+    buffer.resize(size);
+    stream.read(buffer.data(), size);
+    if(!stream) {
+        return false;
+    }
+
+    size_t pos = 0;
+    uint32_t nameLength = 0;
+    int32_t dataType, resolutionX, resolutionY;
+    float tlx, tly, brx, bry;
+    uint32_t numChannels = 0;
+    if(!extract(buffer, pos, frame.time) || !extract(buffer, pos, nameLength)
+       || pos + nameLength > buffer.size()) {
+        return false;
+    }
+    frame.name.assign(&buffer[pos], nameLength);
+    pos += nameLength;
+    if(!extract(buffer, pos, dataType) || !extract(buffer, pos, resolutionX) || !extract(buffer, pos, resolutionY)
+       || !extract(buffer, pos, tlx) || !extract(buffer, pos, tly) || !extract(buffer, pos, brx) || !extract(buffer, pos, bry)
+       || !extract(buffer, pos, frame.energyMin) || !extract(buffer, pos, frame.energyMax)
+       || !extract(buffer, pos, numChannels) || !extractArray(buffer, pos, numChannels, frame.spectrum)
+       || resolutionX < 0 || resolutionY < 0
+       || !extractArray(buffer, pos, static_cast<size_t>(resolutionX) * resolutionY, frame.counts)) {
+        return false;
+    }
+    frame.dataType = dataType;
+    frame.resolutionX = resolutionX;
+    frame.resolutionY = resolutionY;
+    frame.topLeft << tlx, tly;
+    frame.bottomRight << brx, bry;
+    return true;
+}
+
+
+int GammaFrameLog::numFrames(const string& name) const
+{
+    auto it = frameIndex.find(name);
+    return it != frameIndex.end() ? static_cast<int>(it->second.size()) : 0;
+}
+
+
+int GammaFrameLog::numFrames() const
+{
+    int n = 0;
+    for(auto& kv : frameIndex) {
+        n += static_cast<int>(kv.second.size());
+    }
+    return n;
+}
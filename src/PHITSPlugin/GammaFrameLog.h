@@ -0,0 +1,71 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#ifndef CNOID_PHITS_PLUGIN_GAMMA_FRAME_LOG_H
+#define CNOID_PHITS_PLUGIN_GAMMA_FRAME_LOG_H
+
+#include <cnoid/EigenTypes>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cnoid {
+
+// ガンマカメラの計算結果（カウント画像，エネルギースペクトル，メタデータ）を
+// シミュレーション時刻ごとのバイナリフレームとして記録・再生する
+class GammaFrameLog
+{
+public:
+    GammaFrameLog();
+    virtual ~GammaFrameLog();
+
+    struct Frame {
+        double time = 0.0;
+        std::string name; // "<body name>/<camera name>"
+        int dataType = 0;
+        int resolutionX = 0;
+        int resolutionY = 0;
+        Vector2 topLeft = Vector2::Zero();
+        Vector2 bottomRight = Vector2::Zero();
+        float energyMin = 0.0f;
+        float energyMax = 0.0f;
+        std::vector<float> spectrum;
+        std::vector<float> counts; // index: resolutionX * y + x
+
+        float count(int x, int y) const { return counts[resolutionX * y + x]; }
+    };
+
+    bool openForWriting(const std::string& filename);
+    bool write(const Frame& frame);
+    bool openForReading(const std::string& filename);
+    void close();
+
+    bool isWriting() const { return isWriting_; }
+    bool isReading() const { return isReading_; }
+    const std::string& filename() const { return filename_; }
+
+    // 時刻 time 以前の最新フレームの番号を返す．存在しない場合は -1
+    int findFrame(const std::string& name, double time) const;
+    bool readFrame(const std::string& name, int index, Frame& frame);
+    int numFrames(const std::string& name) const;
+    int numFrames() const;
+
+private:
+    struct IndexEntry {
+        double time;
+        std::streamoff offset;
+    };
+
+    std::fstream stream;
+    std::string filename_;
+    bool isWriting_;
+    bool isReading_;
+    std::map<std::string, std::vector<IndexEntry>> frameIndex;
+    std::vector<char> buffer;
+};
+
+}
+
+#endif // CNOID_PHITS_PLUGIN_GAMMA_FRAME_LOG_H
@@ -279,7 +279,7 @@ void windowsPosition(const uint32_t width, const uint32_t height,
 }
 
 vector<DirClippingInfo> getDirectionsClipping(
-        const GammaData& gammaData, const vector<double>& energyFilter,
+        const GammaData& gammaData, const vector<double>& directionValues,
         const Vector3d& camEyeVec, const Vector3d& camUpVec,
         const double& fov, const double aspectRatio,
         const double& nearClip, const double& farClip)
@@ -294,10 +294,11 @@ vector<DirClippingInfo> getDirectionsClipping(
     getPerspectiveProjectionMatrix(fovy(aspectRatio, fov), aspectRatio, nearClip, farClip, mat);
 
     vector<DirClippingInfo> dist;
-    int dirCount = gammaData.dataInfo().calcDirectionNumber;
+    const GammaData::DataInfo& dataInfo = gammaData.dataInfo();
+    int dirCount = dataInfo.calcDirectionNumber;
     for(int i = 0; i < dirCount; i++) {
 
-        GammaData::CalcDirectionPoInfo dir = gammaData.dataInfo().calcDirectionPo[i];
+        const GammaData::CalcDirectionPoInfo& dir = dataInfo.calcDirectionPo[i];
 //        for(int ig = 0; ig < dir.dirData.size(); ig++) {
 //            if(dir.dirData[ig]>0)cout<<ig<<","<<dir.dirData[ig]<<endl;
 //        }
@@ -341,14 +342,8 @@ vector<DirClippingInfo> getDirectionsClipping(
                 dc.bl_x = cVbl.x(); dc.bl_y = cVbl.y();
                 dc.br_x = cVbr.x(); dc.br_y = cVbr.y();
                 dc.tr_x = cVtr.x(); dc.tr_y = cVtr.y();
-                dc.value = 0.0;
-                //debug
-                //cout<<dir.dirData.size()<<endl;
-                for(int ig = 0; ig < dir.dirData.size(); ig++) {
-                    dc.value += dir.dirData[ig] * energyFilter[ig];
-                    //debug
-                    //if(dir.dirData[ig]>0)cout<<dir.dirData[ig]<<endl;
-                }
+                //エネルギーフィルタ適用済みの方向データ
+                dc.value = i < directionValues.size() ? directionValues[i] : 0.0;
                 dist.push_back(dc);
             }
         }
@@ -371,9 +366,14 @@ public:
 
     double effectiveDist;
     Camera* camera;
+    GammaDataInfo lastDataInfo;
 
     void generateImage(Camera* camera, std::shared_ptr<Image>& image);
+    void generateImage(const GammaFrameLog::Frame& frame, std::shared_ptr<Image>& image);
+    bool getLastFrame(GammaFrameLog::Frame& frame) const;
     void onGenerateGammaImage(Image& image);
+    void drawGammaImage(const GammaDataInfo& dataInfo, const int width, const int height);
+    void overlayGammaImage(std::shared_ptr<Image>& image);
     bool setGammaDataInfo(GammaData& gammaData, Vector3d position1);
     bool calc(GammaCamera* camera, const uint32_t widht,
               const uint32_t height, GammaDataInfo& dataInfo, EnergyFilter& filter);
@@ -417,18 +417,79 @@ void GammaImageGenerator::Impl::generateImage(Camera* camera, std::shared_ptr<Im
     }
     this->camera = camera;
 
-    QImage qImage = toQImage(*image.get());
-    if(camera) {
-        onGenerateGammaImage(*image.get());
-        if(!qImage.isNull() && !g_qimage.isNull()) {
-            QPainter painter(&qImage);
-            painter.setRenderHint(QPainter::Antialiasing, true);
-            painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
-            painter.drawImage(0, 0, g_qimage);
-            painter.end();
+    onGenerateGammaImage(*image.get());
+    overlayGammaImage(image);
+}
+
+
+void GammaImageGenerator::generateImage(const GammaFrameLog::Frame& frame, std::shared_ptr<Image>& image)
+{
+    impl->generateImage(frame, image);
+}
+
+
+void GammaImageGenerator::Impl::generateImage(const GammaFrameLog::Frame& frame, std::shared_ptr<Image>& image)
+{
+    if(!image) {
+        return;
+    }
+
+    GammaDataInfo dataInfo;
+    dataInfo.name = frame.name;
+    dataInfo.resizeImage(frame.resolutionX, frame.resolutionY);
+    for(int j = 0; j < frame.resolutionY; ++j) {
+        for(int i = 0; i < frame.resolutionX; ++i) {
+            dataInfo.setValue(i, j, frame.count(i, j));
+        }
+    }
+    dataInfo.setWindowsPosition(frame.topLeft, frame.bottomRight);
+
+    drawGammaImage(dataInfo, image->width(), image->height());
+    overlayGammaImage(image);
+}
+
+
+bool GammaImageGenerator::getLastFrame(GammaFrameLog::Frame& frame) const
+{
+    return impl->getLastFrame(frame);
+}
+
+
+bool GammaImageGenerator::Impl::getLastFrame(GammaFrameLog::Frame& frame) const
+{
+    int resX = static_cast<int>(lastDataInfo.resolutionX());
+    int resY = static_cast<int>(lastDataInfo.resolutionY());
+    if(resX == 0 || resY == 0) {
+        return false;
+    }
+
+    frame.name = lastDataInfo.name;
+    frame.resolutionX = resX;
+    frame.resolutionY = resY;
+    frame.counts.resize(resX * resY);
+    for(int j = 0; j < resY; ++j) {
+        for(int i = 0; i < resX; ++i) {
+            frame.counts[resX * j + i] = static_cast<float>(lastDataInfo.value(i, j));
         }
     }
-    *image.get() = toCnoidImage(qImage);
+    auto winPos = lastDataInfo.windowsPosition();
+    frame.topLeft = get<0>(winPos);
+    frame.bottomRight = get<1>(winPos);
+    return true;
+}
+
+
+void GammaImageGenerator::Impl::overlayGammaImage(std::shared_ptr<Image>& image)
+{
+    // カメラ画像の画素バッファに直接描画する
+    QImage qImage = wrapQImage(*image.get());
+    if(!qImage.isNull() && !g_qimage.isNull()) {
+        QPainter painter(&qImage);
+        painter.setRenderHint(QPainter::Antialiasing, true);
+        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+        painter.drawImage(0, 0, g_qimage);
+        painter.end();
+    }
 }
 
 
@@ -454,10 +515,17 @@ void GammaImageGenerator::Impl::onGenerateGammaImage(Image& image)
             calcCompton(comptonCamera, image.width(), image.height(), dataInfo);
         }
     }
+    lastDataInfo = dataInfo;
 
-    QImage qimage(image.width(),image.height(),QImage::Format_ARGB32);
-    for(int j = 0 ; j < image.height() ; ++j) {
-        for(int i = 0 ; i < image.width() ; ++i) {
+    drawGammaImage(dataInfo, image.width(), image.height());
+}
+
+
+void GammaImageGenerator::Impl::drawGammaImage(const GammaDataInfo& dataInfo, const int width, const int height)
+{
+    QImage qimage(width, height, QImage::Format_ARGB32);
+    for(int j = 0 ; j < height ; ++j) {
+        for(int i = 0 ; i < width ; ++i) {
             qimage.setPixel(i, j, qRgba(0, 0, 0, 0));
         }
     }
@@ -497,7 +565,7 @@ void GammaImageGenerator::Impl::onGenerateGammaImage(Image& image)
         // max = 1.0 * pow(10, exp);
         scale->setRange(min, max);
         static const uint8_t transparency = 0;
-        drawGammaData(painter, QRect(0, 0, image.width(), image.height()), dataInfo, *scale,
+        drawGammaData(painter, QRect(0, 0, width, height), dataInfo, *scale,
                       transparency, QPointF(topLeft.x(), topLeft.y()), QPointF(bottomRight.x(), bottomRight.y()));
         painter.end();
     }
@@ -556,60 +624,13 @@ bool GammaImageGenerator::Impl::calc(GammaCamera* camera, const uint32_t width,
 
     dataInfo.resizeImage(resX, resY); //gamDatを初期化
 
-    int channelNumber = gammaData.energySpectrumChannelNumber();
-
-    //エネルギーフィルタ用の配列を作成
-    vector<double> energyFilter(channelNumber, 0.0);
-
-    switch (filter.mode()) {
-    case EnergyFilter::NO_FILTER:
-    {
-        for(int i = 0; i < channelNumber; i++) {
-            energyFilter[i] = 1.0;
-        }
-        break;
-    }
-    case EnergyFilter::RANGE_FILTER:
-    {
-        int inputMin = filter.min();
-        int inputMax = filter.max();
-
-        int wkMin = inputMin;
-        int wkMax = inputMax;
-
-        if(inputMin > inputMax) {
-            wkMin = inputMax;
-            wkMax = inputMin;
-        }
-
-        for(int i = 0; i < channelNumber; i++) {
-            if(wkMin-1 <= i && i <= wkMax-1) {
-                energyFilter[i] = 1.0;
-            }
-        }
-        break;
-    }
-    case EnergyFilter::NUCLIDE_FILTER:
-    {
-        for(auto& item : filter.nuclideFilterInfo()) {
-            int min = item.min;
-            int max = item.max;
-            for(int i = 0; i < channelNumber; i++) {
-                if(min-1 <= i && i <= max-1) {
-                    energyFilter[i] = 1.0;
-                }
-            }
-        }
-        break;
-    }
-    default:
-        break;
-    }
+    //エネルギーフィルタを適用した方向ごとの値（累積スペクトルから求め，窓ごとにキャッシュされる）
+    const vector<double>& directionValues = filter.directionValues(gammaData);
 
 //    vector<double>  energyFilter = energyFilterVector(channelNumber, engFiltProp);
     //画角に含まれる方向データをクリップ座標系で生成
     vector<DirClippingInfo> dirsClip =
-            getDirectionsClipping(gammaData, energyFilter,
+            getDirectionsClipping(gammaData, directionValues,
                                   dataInfo.view_direction, dataInfo.up_vector, gammaFov, width / height, nearClip, farClip);
 
     //方向データ（クリップ座標系）から各ピクセル(i,j)の値を計算
@@ -678,7 +699,7 @@ bool GammaImageGenerator::Impl::calcPinhole(PinholeCamera* camera, const uint32_
 
     int channelNumber = gammaData.energySpectrumChannelNumber();
 
-    GammaData::DataInfo di = gammaData.dataInfo();
+    const GammaData::DataInfo& di = gammaData.dataInfo();
 
     float minx = di.calcDirectionRec[0].directionX;
     float miny = di.calcDirectionRec[0].directionY;
@@ -735,7 +756,7 @@ bool GammaImageGenerator::Impl::calcCompton(ComptonCamera* camera, const uint32_
 
     int channelNumber = gammaData.energySpectrumChannelNumber();
 
-    GammaData::DataInfo di = gammaData.dataInfo();
+    const GammaData::DataInfo& di = gammaData.dataInfo();
 
     float minx = di.calcDirectionRec[0].directionX;
     float miny = di.calcDirectionRec[0].directionY;
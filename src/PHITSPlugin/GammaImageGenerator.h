@@ -7,6 +7,7 @@
 
 #include <cnoid/Camera>
 #include <cnoid/Image>
+#include "GammaFrameLog.h"
 
 namespace cnoid {
 
@@ -18,6 +19,12 @@ public:
 
     void generateImage(Camera* camera, std::shared_ptr<Image>& image);
 
+    // 記録済みのフレームから画像を生成する（再計算は行わない）
+    void generateImage(const GammaFrameLog::Frame& frame, std::shared_ptr<Image>& image);
+
+    // 直前に generateImage() で計算したカウント画像とメタデータを取得する
+    bool getLastFrame(GammaFrameLog::Frame& frame) const;
+
 private:
     class Impl;
     Impl* impl;
@@ -3,19 +3,42 @@
 */
 
 #include "GammaVisionSimulatorItem.h"
+#include <cnoid/Archive>
 #include <cnoid/Body>
+#include <cnoid/BodyItem>
+#include <cnoid/ConnectionSet>
 #include <cnoid/DeviceList>
+#include <cnoid/Format>
 #include <cnoid/ItemManager>
+#include <cnoid/MessageView>
+#include <cnoid/PutPropertyFunction>
 #include <cnoid/SimulatorItem>
+#include <cnoid/TimeBar>
+#include <cnoid/UTF8>
 #include <cnoid/WorldItem>
+#include <cnoid/WorldLogFileItem>
+#include <cnoid/stdx/filesystem>
+#include <cstring>
+#include <map>
 #include "ComptonCamera.h"
 #include "GammaEffect.h"
+#include "GammaFrameLog.h"
 #include "GammaImageGenerator.h"
 #include "PinholeCamera.h"
 #include "gettext.h"
 
 using namespace std;
 using namespace cnoid;
+namespace filesystem = cnoid::stdx::filesystem;
+
+namespace {
+
+string frameName(GammaCamera* camera)
+{
+    return camera->link()->body()->name() + "/" + camera->name();
+}
+
+}
 
 namespace cnoid {
 
@@ -35,9 +58,23 @@ public:
     vector<GammaEffect*> comptonEffects;
     vector<GammaEffect*> pinholeEffects;
 
+    // gamma frame log
+    SimulatorItem* simulatorItem;
+    bool isGammaFrameRecordingEnabled;
+    bool isSimulating;
+    bool isPlaybackFileChecked;
+    GammaFrameLog frameLog;
+    map<GammaCamera*, int> recordedRevisions;
+    map<string, int> playbackIndices;
+    ScopedConnection timeChangeConnection;
+
     bool initializeSimulation(SimulatorItem* simulatorItem);
     void finalizeSimulation();
     void onPostDynamics();
+    void generateImage(GammaCamera* camera);
+    void recordFrame(GammaCamera* camera);
+    string gammaFrameLogFile() const;
+    void onTimeChanged(double time);
 };
 
 }
@@ -64,6 +101,14 @@ GammaVisionSimulatorItem::Impl::Impl(GammaVisionSimulatorItem* self)
     pinholeCameras.clear();
     comptonEffects.clear();
     pinholeEffects.clear();
+    simulatorItem = nullptr;
+    isGammaFrameRecordingEnabled = true;
+    isSimulating = false;
+    isPlaybackFileChecked = false;
+
+    timeChangeConnection =
+        TimeBar::instance()->sigTimeChanged().connect(
+            [&](double time){ onTimeChanged(time); return true; });
 }
 
 
@@ -82,6 +127,20 @@ GammaVisionSimulatorItem::Impl::Impl(GammaVisionSimulatorItem* self, const Impl&
     pinholeCameras.clear();
     comptonEffects.clear();
     pinholeEffects.clear();
+    simulatorItem = nullptr;
+    isGammaFrameRecordingEnabled = org.isGammaFrameRecordingEnabled;
+    isSimulating = false;
+    isPlaybackFileChecked = false;
+
+    timeChangeConnection =
+        TimeBar::instance()->sigTimeChanged().connect(
+            [&](double time){ onTimeChanged(time); return true; });
+}
+
+
+GammaVisionSimulatorItem::Impl::~Impl()
+{
+    frameLog.close();
 }
 
 
@@ -106,6 +165,10 @@ bool GammaVisionSimulatorItem::Impl::initializeSimulation(SimulatorItem* simulat
     pinholeCameras.clear();
     comptonEffects.clear();
     pinholeEffects.clear();
+    recordedRevisions.clear();
+    playbackIndices.clear();
+    this->simulatorItem = simulatorItem;
+    isSimulating = true;
 
     const vector<SimulationBody*>& simBodies = simulatorItem->simulationBodies();
     for(auto& simBody : simBodies) {
@@ -126,8 +189,18 @@ bool GammaVisionSimulatorItem::Impl::initializeSimulation(SimulatorItem* simulat
         pinholeEffects.push_back(effect);
     }
 
+    frameLog.close();
     if(comptonCameras.size() || pinholeCameras.size()) {
         simulatorItem->addPostDynamicsFunction([&](){ onPostDynamics(); });
+
+        if(isGammaFrameRecordingEnabled) {
+            string filename = gammaFrameLogFile();
+            if(!filename.empty() && !frameLog.openForWriting(filename)) {
+                MessageView::instance()->putln(
+                    formatR(_("Gamma frame log \"{0}\" cannot be opened."), filename),
+                    MessageView::Warning);
+            }
+        }
     }
 
     return true;
@@ -149,26 +222,139 @@ void GammaVisionSimulatorItem::Impl::finalizeSimulation()
     for(auto& effect : pinholeEffects) {
         effect->start(false);
     }
+
+    isSimulating = false;
+    if(frameLog.isWriting()) {
+        string filename = frameLog.filename();
+        frameLog.openForReading(filename);
+        MessageView::instance()->putln(
+            formatR(_("{0} gamma frames have been recorded to \"{1}\"."), frameLog.numFrames(), filename));
+    }
+    isPlaybackFileChecked = true;
+    playbackIndices.clear();
 }
 
 
 void GammaVisionSimulatorItem::Impl::onPostDynamics()
 {
     for(auto& camera : comptonCameras) {
-        Image image = *camera->sharedImage();
-        if(!image.empty()) {
-            std::shared_ptr<Image> sharedImage = std::make_shared<Image>(image);
-            generator.generateImage(camera, sharedImage);
-            camera->setImage(sharedImage);
-        }
+        generateImage(camera);
     }
 
     for(auto& camera : pinholeCameras) {
-        Image image = *camera->sharedImage();
-        if(!image.empty()) {
-            std::shared_ptr<Image> sharedImage = std::make_shared<Image>(image);
-            generator.generateImage(camera, sharedImage);
-            camera->setImage(sharedImage);
+        generateImage(camera);
+    }
+}
+
+
+void GammaVisionSimulatorItem::Impl::generateImage(GammaCamera* camera)
+{
+    Image image = *camera->sharedImage();
+    if(!image.empty()) {
+        std::shared_ptr<Image> sharedImage = std::make_shared<Image>(image);
+        generator.generateImage(camera, sharedImage);
+        camera->setImage(sharedImage);
+        recordFrame(camera);
+    }
+}
+
+
+void GammaVisionSimulatorItem::Impl::recordFrame(GammaCamera* camera)
+{
+    // 計算結果が更新されたときのみフレームを記録する
+    if(!frameLog.isWriting() || !camera->isReady()) {
+        return;
+    }
+    auto it = recordedRevisions.find(camera);
+    if(it != recordedRevisions.end() && it->second == camera->dataRevision()) {
+        return;
+    }
+
+    GammaFrameLog::Frame frame;
+    if(!generator.getLastFrame(frame)) {
+        return;
+    }
+    frame.time = simulatorItem->currentTime();
+    frame.name = frameName(camera);
+    frame.dataType = camera->dataType();
+
+    GammaData& gammaData = camera->gammaData();
+    frame.energyMin = gammaData.energySpectrumMin();
+    frame.energyMax = gammaData.energySpectrumMax();
+    const GammaData::DataInfo& dataInfo = gammaData.dataInfo();
+    for(auto& rec : dataInfo.calcDirectionRec) {
+        if(frame.spectrum.size() < rec.dirData.size()) {
+            frame.spectrum.resize(rec.dirData.size(), 0.0f);
+        }
+        for(size_t i = 0; i < rec.dirData.size(); ++i) {
+            frame.spectrum[i] += rec.dirData[i];
+        }
+    }
+
+    if(frameLog.write(frame)) {
+        recordedRevisions[camera] = camera->dataRevision();
+    }
+}
+
+
+string GammaVisionSimulatorItem::Impl::gammaFrameLogFile() const
+{
+    // ワールドログファイルと同じ場所に記録する
+    WorldItem* worldItem = self->findOwnerItem<WorldItem>();
+    if(worldItem) {
+        ItemList<WorldLogFileItem> logItems = worldItem->descendantItems<WorldLogFileItem>();
+        if(logItems.size() && !logItems[0]->logFile().empty()) {
+            return logItems[0]->logFile() + ".gamma";
+        }
+    }
+    return string();
+}
+
+
+void GammaVisionSimulatorItem::Impl::onTimeChanged(double time)
+{
+    if(isSimulating) {
+        return;
+    }
+
+    if(!frameLog.isReading()) {
+        if(isPlaybackFileChecked) {
+            return;
+        }
+        isPlaybackFileChecked = true;
+        string filename = gammaFrameLogFile();
+        if(filename.empty() || !filesystem::exists(filesystem::path(fromUTF8(filename)))
+           || !frameLog.openForReading(filename)) {
+            return;
+        }
+    }
+
+    WorldItem* worldItem = self->findOwnerItem<WorldItem>();
+    if(!worldItem) {
+        return;
+    }
+
+    // 記録済みのフレームへ直接シークし，PHITSや再構成を再実行せずに画像を復元する
+    for(auto& bodyItem : worldItem->descendantItems<BodyItem>()) {
+        DeviceList<GammaCamera> cameras(bodyItem->body()->devices());
+        for(auto& camera : cameras) {
+            string name = frameName(camera);
+            int index = frameLog.findFrame(name, time);
+            auto it = playbackIndices.find(name);
+            if(index < 0 || (it != playbackIndices.end() && it->second == index)) {
+                continue;
+            }
+
+            GammaFrameLog::Frame frame;
+            if(frameLog.readFrame(name, index, frame)) {
+                std::shared_ptr<Image> image = std::make_shared<Image>();
+                image->setSize(camera->resolutionX(), camera->resolutionY(), 3);
+                memset(image->pixels(), 0, image->width() * image->height() * image->numComponents());
+                generator.generateImage(frame, image);
+                camera->setImage(image);
+                camera->notifyStateChange();
+                playbackIndices[name] = index;
+            }
         }
     }
 }
@@ -183,6 +369,8 @@ Item* GammaVisionSimulatorItem::doCloneItem(CloneMap* cloneMap) const
 void GammaVisionSimulatorItem::doPutProperties(PutPropertyFunction& putProperty)
 {
     GLVisionSimulatorItem::doPutProperties(putProperty);
+    putProperty(_("Record gamma frames"), impl->isGammaFrameRecordingEnabled,
+                changeProperty(impl->isGammaFrameRecordingEnabled));
 }
 
 
@@ -191,6 +379,7 @@ bool GammaVisionSimulatorItem::store(Archive& archive)
     if(!GLVisionSimulatorItem::store(archive)) {
         return false;
     }
+    archive.write("record_gamma_frames", impl->isGammaFrameRecordingEnabled);
     return true;
 }
 
@@ -200,5 +389,7 @@ bool GammaVisionSimulatorItem::restore(const Archive& archive)
     if(!GLVisionSimulatorItem::restore(archive)) {
         return false;
     }
+    archive.read("record_gamma_frames", impl->isGammaFrameRecordingEnabled);
+    impl->isPlaybackFileChecked = false;
     return true;
 }
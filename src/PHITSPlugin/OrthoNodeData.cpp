@@ -46,7 +46,7 @@ public:
 
     virtual bool isValid() const { return isValid_; }
     virtual size_t size(const int axis) const { return coordinates_[axis].size() - 1; }
-    virtual vector<double> coordinates(const int axis) const { return coordinates_[axis]; }
+    virtual const vector<double>& coordinates(const int axis) const { return coordinates_[axis]; }
     virtual double min() const { return *min_element(cell_values_.begin(), cell_values_.end()); }
     virtual double max() const { return *max_element(cell_values_.begin(), cell_values_.end()); }
     virtual double value(const uint32_t x, const uint32_t y, const uint32_t) const;
@@ -552,7 +552,7 @@ OrthoNodeData::OrthoNodeData(const GammaData& gammaData)
     size_t yNodeSize = yCellSize + 1;
     size_t zNodeSize = zCellSize + 1;
 
-    array3d xNodeGrid;
+    OrthoGridArray xNodeGrid;
     xNodeGrid.resize(xNodeSize, yCellSize, zCellSize);
 
     for(size_t k = 0 ; k < zCellSize ; ++k) {
@@ -565,14 +565,14 @@ OrthoNodeData::OrthoNodeData(const GammaData& gammaData)
                 } else {
                     Boxd pb = cellBounds(i - 1, j, k);
                     Boxd nb = cellBounds(i, j, k);
-                    xNodeGrid(i, j, k) = linearInterpolateByLength(cell_(i - 1, j, k), cell_(i, j, k), pb.x() / 2.0, nb.x() / 2.0);
+                    xNodeGrid(i, j, k) = linearInterpolateByLength<double>(cell_(i - 1, j, k), cell_(i, j, k), pb.x() / 2.0, nb.x() / 2.0);
 
                 }
             }
         }
     }
 
-    array3d yNodeGrid;
+    OrthoGridArray yNodeGrid;
     yNodeGrid.resize(xNodeSize, yNodeSize, zCellSize);
     for(size_t k = 0 ; k < zCellSize ; ++k) {
         for(size_t j = 0 ; j < yNodeSize ; j++) {
@@ -633,7 +633,7 @@ bool OrthoNodeData::createShieldData(string& filename, const GammaData& gammaDat
 
     int numShield = shields.size();
 
-    cell_shield_ = new array3d[numShield] {};
+    cell_shield_ = new OrthoGridArray[numShield] {};
 
     size_t xsize = cellGrid.size(AxisID::X_AXIS);
     size_t ysize = cellGrid.size(AxisID::Y_AXIS);
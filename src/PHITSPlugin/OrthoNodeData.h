@@ -15,6 +15,13 @@
 
 namespace cnoid {
 
+// CNOID_PHITS_PLUGIN_USE_FLOAT_GRID を定義するとセル・ノードの値を単精度で保持し，メモリ使用量を半減する
+#ifdef CNOID_PHITS_PLUGIN_USE_FLOAT_GRID
+typedef array3f OrthoGridArray;
+#else
+typedef array3d OrthoGridArray;
+#endif
+
 class OrthoNodeData : public Referenced
 {
 public:
@@ -35,12 +42,17 @@ public:
     bool isValid() const { return isValid_; }
     void clear();
     size_t size(const int axis) const { return coordinates_[axis].size() - 1; }
-    std::vector<double> coordinates(const int axis) const { return coordinates_[axis]; }
+    const std::vector<double>& coordinates(const int axis) const { return coordinates_[axis]; }
     double min() const { return min_; }
     double max() const { return max_; }
     double value(const uint32_t x, const uint32_t y, const uint32_t z) const { return cell_(x, y, z); }
     double value_shield(int id, const uint32_t x, const uint32_t y, const uint32_t z) const { return cell_shield_[id](x, y, z); }
     double value_node(const uint32_t x, const uint32_t y, const uint32_t z) const { return node_(x, y, z); }
+
+    // axis 方向の index 番目の断面．(u, v) は (axis + 1, axis + 2) 軸のセル番号
+    OrthoGridArray::ConstView cellSlice(const int axis, const uint32_t index) const { return cell_.slice(axis, index); }
+    OrthoGridArray::ConstView nodeSlice(const int axis, const uint32_t index) const { return node_.slice(axis, index); }
+
     Boxd bounds() const {
         Vector3d min(coordinates_[X_AXIS].front() ,coordinates_[Y_AXIS].front(), coordinates_[Z_AXIS].front());
         Vector3d max(coordinates_[X_AXIS].back() ,coordinates_[Y_AXIS].back(), coordinates_[Z_AXIS].back());
@@ -60,9 +72,9 @@ private:
     bool isValid_;
     double min_;
     double max_;
-    array3d cell_;
-    array3d* cell_shield_;
-    array3d node_;
+    OrthoGridArray cell_;
+    OrthoGridArray* cell_shield_;
+    OrthoGridArray node_;
     std::vector<double> coordinates_[NumAxes];
 };
 
@@ -136,6 +136,7 @@ bool PHITSRunner::loadGammaData(const string& filename, GammaCamera* camera)
         string name = filename + ".gbin";
         if(gammaData.write(name)) {
             gammaData.setDataHeaderInfo(gammaData.geometryInfo(0));
+            camera->updateDataRevision();
             isReady = true;
         }
     }
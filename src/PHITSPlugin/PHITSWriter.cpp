@@ -12,8 +12,11 @@
 #include <cnoid/RootItem>
 #include <cnoid/SceneGraph>
 #include <cnoid/ValueTree>
+#include <sys/stat.h>
+#include <chrono>
 #include <iomanip>
 #include <iostream>
+#include <set>
 #include <sstream>
 #include "PHITSRunner.h"
 #include "gettext.h"
@@ -21,11 +24,70 @@
 using namespace std;
 using namespace cnoid;
 
+namespace {
+
+time_t lastModifiedTime(const string& filename)
+{
+    struct stat st;
+    if(stat(filename.c_str(), &st) == 0) {
+        return st.st_mtime;
+    }
+    return 0;
+}
+
+void hashCombine(size_t& seed, size_t value)
+{
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+void hashValueNode(const ValueNode* node, size_t& seed)
+{
+    if(node->isScalar()) {
+        hashCombine(seed, hash<string>()(node->toString()));
+    } else if(node->isMapping()) {
+        hashCombine(seed, 1);
+        for(auto& kv : *node->toMapping()) {
+            hashCombine(seed, hash<string>()(kv.first));
+            hashValueNode(kv.second, seed);
+        }
+    } else if(node->isListing()) {
+        hashCombine(seed, 2);
+        for(auto& element : *node->toListing()) {
+            hashValueNode(element, seed);
+        }
+    }
+}
+
+// リンクの注釈と形状の大きさから求める値で，線源・遮蔽体パラメータの変更を検出する
+size_t linkSignature(Link* link)
+{
+    size_t seed = 0;
+    hashValueNode(link->info(), seed);
+    if(SgNode* shape = link->shape()) {
+        const BoundingBox& bb = shape->boundingBox();
+        for(int i = 0; i < 3; ++i) {
+            hashCombine(seed, hash<double>()(bb.min()[i]));
+            hashCombine(seed, hash<double>()(bb.max()[i]));
+        }
+    }
+    return seed;
+}
+
+}
+
 
 PHITSWriter::PHITSWriter()
 {
     defaultNuclideTableFile_.clear();
     defaultElementTableFile_.clear();
+    nuclideTableTime_ = 0;
+    elementTableTime_ = 0;
+    ccamera = nullptr;
+    pcamera = nullptr;
+    energy_ = 0.0;
+    lastWriteTime_ = 0.0;
+    numRegeneratedBlocks_ = 0;
+    numBlocks_ = 0;
 }
 
 
@@ -44,15 +106,33 @@ void PHITSWriter::setCamera(Camera* camera)
 
 void PHITSWriter::setDefaultNuclideTableFile(const string& filename)
 {
+    // ファイルが更新されていなければ読み込み済みのテーブルを使う
+    time_t time = lastModifiedTime(filename);
+    if(filename == defaultNuclideTableFile_ && time == nuclideTableTime_) {
+        return;
+    }
     defaultNuclideTableFile_ = filename;
+    nuclideTableTime_ = time;
     nuclideTable.load(defaultNuclideTableFile_);
+
+    // 線源のエネルギーはテーブルから展開されているため，すべて読み直す
+    bodyEntries.clear();
 }
 
 
 void PHITSWriter::setDefaultElementTableFile(const string& filename)
 {
+    time_t time = lastModifiedTime(filename);
+    if(filename == defaultElementTableFile_ && time == elementTableTime_) {
+        return;
+    }
     defaultElementTableFile_ = filename;
+    elementTableTime_ = time;
     elementTable.load(defaultElementTableFile_);
+
+    // Material IDと密度が変わるため，すべて読み直す
+    materialBlock.clear();
+    bodyEntries.clear();
 }
 
 
@@ -92,233 +172,304 @@ void PHITSWriter::initialize()
     strObsShape.clear();
     obsMaterialId.clear();
 
-    materialRho.clear();
+    sourceEntries.clear();
+    obstacleEntries.clear();
     resolution << 8, 8;
 }
 
 
-bool PHITSWriter::searchLink(bool flagQAD)
+bool PHITSWriter::readLinkEntry(Link* link, LinkEntry& entry, bool flagQAD)
 {
-    initialize();
-
-    // リンクの検索
-    //
-    RootItem* rootItem = RootItem::instance();
-    ItemList<BodyItem> checked = rootItem->checkedItems<BodyItem>();
-
-    for(const auto& item : checked) {
-        // RadiationSourceの取得
-        Body* body = item->body();
-        for(Link* link : body->links()) {
-            const Mapping* info = link->info();
-
-            // for radiation source
-            {
-                // 核種名指定 or エネルギー指定
-                ValueNode* nuclideNameNode = info->find("nuclide");
-                ValueNode* energyNode = info->find("energy");
-                if(nuclideNameNode->isValid() || energyNode->isValid()) {
-                    MessageView::instance()->putln(formatR(_("{0} has been detected."), link->name()));
-                    if(nuclideNameNode->isValid()) {
-                        int nNuc;
-                        vector<string> strNucNames;
-                        vector<double> nucActictities;
-                        // 核種名と濃度の取得
-                        int offSet = 2;
-                        if(nuclideNameNode != nullptr && nuclideNameNode->isListing()) {
-                            Listing* list = nuclideNameNode->toListing();
-                            nNuc = list->size() / offSet;
-                            std::vector<std::string> tmpNucNames;
-                            std::vector<double> tmpActivities;
-                            for(int i = 0; i < nNuc; ++i) {
-                                strNucNames.push_back(list->get(i * offSet).toString());
-                                nucActictities.push_back((double)list->get(i * offSet + 1).toDouble());
-                            }
-                        }
-                        // エネルギー指定に合わせる
-                        nEne.push_back(0);
-                        std::vector<double> tmpEnergy;
-                        std::vector<double> tmpRate;
-                        std::vector<double> tmpActivity;
-                        for(int iNuc = 0; iNuc < nNuc; ++iNuc) {
-                            int id = 0;
-                            bool flgNuc = false;
-                            for(auto& item : nuclideTable.nuclideName()) {
-                                string NucName = get<0>(item);
-                                int nEnergy = get<1>(item);
-
-                                if(strNucNames[iNuc] == NucName) {
-                                    nEne[nSource] += nEnergy;
-                                    flgNuc = true;
-                                    for(int iEne = 0; iEne < nEnergy; iEne++) {
-                                        tmpEnergy.push_back(nuclideTable.sourceEnergy()[id][iEne]);
-                                        tmpRate.push_back(nuclideTable.sourceIncidenceRate()[id][iEne]);
-                                        tmpActivity.push_back(nucActictities[iNuc]);
-                                    }
-                                    break;
-                                }
-                                id++;
-                            }
-                            if(flgNuc == false) {
-                                cout << strNucNames[iNuc] << " is not found." << endl;
-                                return false;
-                            }
-                        }
-                        dEnergy.push_back(tmpEnergy);
-                        dRate.push_back(tmpRate);
-                        dActivity.push_back(tmpActivity);
-                    } else if(energyNode->isValid()) {
-                        // エネルギー、放出割合、濃度の取得
-                        int offSet = 3;
-                        if(energyNode != nullptr && energyNode->isListing()) {
-                            Listing* list = energyNode->toListing();
-                            nEne.push_back(list->size() / offSet);
-                            std::vector<double> tmpEnergy;
-                            std::vector<double> tmpRate;
-                            std::vector<double> tmpActivity;
-                            for(int i = 0; i < nEne[nSource]; ++i) {
-                                tmpEnergy.push_back((double)list->get(i * offSet).toDouble());
-                                tmpRate.push_back((double)list->get(i * offSet + 1).toDouble());
-                                tmpActivity.push_back((double)list->get(i * offSet + 2).toDouble());
+    const Mapping* info = link->info();
+    entry.link = link;
+
+    // for radiation source
+    {
+        // 核種名指定 or エネルギー指定
+        ValueNode* nuclideNameNode = info->find("nuclide");
+        ValueNode* energyNode = info->find("energy");
+        if(nuclideNameNode->isValid() || energyNode->isValid()) {
+            if(MessageView* mv = MessageView::instance()) {
+                mv->putln(formatR(_("{0} has been detected."), link->name()));
+            }
+            if(nuclideNameNode->isValid()) {
+                int nNuc = 0;
+                vector<string> strNucNames;
+                vector<double> nucActictities;
+                // 核種名と濃度の取得
+                int offSet = 2;
+                if(nuclideNameNode->isListing()) {
+                    Listing* list = nuclideNameNode->toListing();
+                    nNuc = list->size() / offSet;
+                    for(int i = 0; i < nNuc; ++i) {
+                        strNucNames.push_back(list->get(i * offSet).toString());
+                        nucActictities.push_back((double)list->get(i * offSet + 1).toDouble());
+                    }
+                }
+                // エネルギー指定に合わせる
+                for(int iNuc = 0; iNuc < nNuc; ++iNuc) {
+                    int id = 0;
+                    bool flgNuc = false;
+                    for(auto& item : nuclideTable.nuclideName()) {
+                        string NucName = get<0>(item);
+                        int nEnergy = get<1>(item);
+
+                        if(strNucNames[iNuc] == NucName) {
+                            entry.nEne += nEnergy;
+                            flgNuc = true;
+                            for(int iEne = 0; iEne < nEnergy; iEne++) {
+                                entry.energy.push_back(nuclideTable.sourceEnergy()[id][iEne]);
+                                entry.rate.push_back(nuclideTable.sourceIncidenceRate()[id][iEne]);
+                                entry.activity.push_back(nucActictities[iNuc]);
                             }
-                            dEnergy.push_back(tmpEnergy);
-                            dRate.push_back(tmpRate);
-                            dActivity.push_back(tmpActivity);
+                            break;
                         }
+                        id++;
                     }
-                    double sumActivities = 0;
-                    for(int i = 0; i < nEne[nSource]; ++i) {
-                        sumActivities += dActivity[nSource][i] * dRate[nSource][i];
-                    }
-                    srcTotalActivity.push_back(sumActivities);
-
-                    //
-                    // 共通ノードの読み込み
-                    //
-                    // ***** sourceShape *****
-                    ValueNode* sourceShapeNode = info->find({ "object_type", "objectType" });
-                    if(!sourceShapeNode->isValid()) {
+                    if(flgNuc == false) {
+                        cout << strNucNames[iNuc] << " is not found." << endl;
                         return false;
-                    } else {
-                        strSrcShape.push_back(sourceShapeNode->toString());
                     }
-
-                    // ***** materialId *****
-                    ValueNode* srcMaterialIdNode = info->find("materialId");
-                    ValueNode* materialNode = info->find("material");
-                    if(srcMaterialIdNode->isValid()) {
-                        srcMaterialId.push_back(srcMaterialIdNode->toDouble());
-                    } else if(materialNode->isValid()) {
-                        string name = materialNode->toString();
-                        int materialId = elementTable.materialId(name);
-                        srcMaterialId.push_back(materialId);
-                    } else {
-                        return false;
+                }
+            } else if(energyNode->isValid()) {
+                // エネルギー、放出割合、濃度の取得
+                int offSet = 3;
+                if(energyNode->isListing()) {
+                    Listing* list = energyNode->toListing();
+                    entry.nEne = list->size() / offSet;
+                    for(int i = 0; i < entry.nEne; ++i) {
+                        entry.energy.push_back((double)list->get(i * offSet).toDouble());
+                        entry.rate.push_back((double)list->get(i * offSet + 1).toDouble());
+                        entry.activity.push_back((double)list->get(i * offSet + 2).toDouble());
                     }
+                }
+            }
+            double sumActivities = 0;
+            double dRate_max = 0.0;
+            for(int i = 0; i < entry.nEne; ++i) {
+                sumActivities += entry.activity[i] * entry.rate[i];
+                // コンプトンカメラでは放出割合が最大のエネルギーを用いる
+                if(dRate_max <= entry.rate[i]) {
+                    dRate_max = entry.rate[i];
+                    entry.peakEnergy = entry.energy[i];
+                }
+            }
+            entry.totalActivity = sumActivities;
+
+            //
+            // 共通ノードの読み込み
+            //
+            // ***** sourceShape *****
+            ValueNode* sourceShapeNode = info->find({ "object_type", "objectType" });
+            if(!sourceShapeNode->isValid()) {
+                return false;
+            } else {
+                entry.shape = sourceShapeNode->toString();
+            }
 
-                    // リンクの中心座標の取得
-                    const Isometry3 position = link->position();
-                    Vector3 translation = position.translation();
-                    srcCX.push_back(translation.x() * 100); // [m]->[cm]
-                    srcCY.push_back(translation.y() * 100);
-                    srcCZ.push_back(translation.z() * 100);
-                    // リンクの境界の取得
-                    SgNode* node1 = link->shape();
-                    const BoundingBox &bb1 = node1->boundingBox();
-                    // 回転角度の取得
-                    srcRotMat.push_back(link->R());
-                    //const Vector3 rpy = rpyFromRot(mat1); // radian
-
-                    srcW.push_back((bb1.max().x() - bb1.min().x()) * 100);
-                    srcD.push_back((bb1.max().y() - bb1.min().y()) * 100);
-                    srcH.push_back((bb1.max().z() - bb1.min().z()) * 100);
-
-                    if(item->findRootItem() == nullptr) {
-                        link = nullptr;
-                    }
+            // ***** materialId *****
+            ValueNode* srcMaterialIdNode = info->find("materialId");
+            ValueNode* materialNode = info->find("material");
+            if(srcMaterialIdNode->isValid()) {
+                entry.materialId = srcMaterialIdNode->toDouble();
+            } else if(materialNode->isValid()) {
+                string name = materialNode->toString();
+                entry.materialId = elementTable.materialId(name);
+            } else {
+                return false;
+            }
 
-                    // srcVolumeの計算
-                    if(strSrcShape[nSource] == "SRC_BOX") {
-                        srcVolume.push_back(srcW[nSource] * srcD[nSource] * srcH[nSource]);
-                    } else if(strSrcShape[nSource] == "SRC_CYLINDER") {
-                        srcVolume.push_back(pow(srcW[nSource] / 2, 2) * srcD[nSource] * M_PI);
-                    } else if(strSrcShape[nSource] == "SRC_SPHERE") {
-                        srcVolume.push_back((4.0 / 3.0) * M_PI * pow(srcW[nSource] / 2, 3));
-                    } else {
-                        return false;
-                    }
+            // 線源形状の確認
+            if(entry.shape != "SRC_BOX" && entry.shape != "SRC_CYLINDER" && entry.shape != "SRC_SPHERE") {
+                return false;
+            }
 
-                    // QADパラメータの読み込み
-                    if(flagQAD) {
-                        // only used in QAD
-                        // 線源分割数
-                        ValueNode* divisionNode = info->find({ "source_division", "sourceDivision" });
-                        if(!divisionNode->isValid()) {
-                            cout << "sourceDivision node is not found." << endl;
-                            return false;
-                        }
-                        // 線源分割数の取得
-                        if(divisionNode != nullptr && divisionNode->isListing()) {
-                            Listing* list = divisionNode->toListing();
-                            LSO.push_back(list->get(0).toInt()); // R(cyl.),  X(cart.), ρ(spher.)
-                            NSO.push_back(list->get(1).toInt()); // φ(cyl.), Y(cart.), φ(spher.)
-                            MSO.push_back(list->get(2).toInt()); // Z(cyl.),  Z(cart.), θ(spher.)
-                        }
+            // QADパラメータの読み込み
+            if(flagQAD) {
+                // only used in QAD
+                // 線源分割数
+                ValueNode* divisionNode = info->find({ "source_division", "sourceDivision" });
+                if(!divisionNode->isValid()) {
+                    cout << "sourceDivision node is not found." << endl;
+                    return false;
+                }
+                // 線源分割数の取得
+                if(divisionNode->isListing()) {
+                    Listing* list = divisionNode->toListing();
+                    entry.lso = list->get(0).toInt(); // R(cyl.),  X(cart.), ρ(spher.)
+                    entry.nso = list->get(1).toInt(); // φ(cyl.), Y(cart.), φ(spher.)
+                    entry.mso = list->get(2).toInt(); // Z(cyl.),  Z(cart.), θ(spher.)
+                }
 
-                        ValueNode* buildupNode = info->find({ "buildup_factor", "buildupFactor" });
-                        if(!buildupNode->isValid()) {
-                            cout << "buildupFactor node is not found." << endl;
-                            return false;
-                        }
-                        buildupName.push_back(buildupNode->toString());
-                    }
+                ValueNode* buildupNode = info->find({ "buildup_factor", "buildupFactor" });
+                if(!buildupNode->isValid()) {
+                    cout << "buildupFactor node is not found." << endl;
+                    return false;
+                }
+                entry.buildupName = buildupNode->toString();
+            }
+
+            entry.isSource = true;
+        }
+    }
 
-                    nSource += 1;
+    // for obstacle
+    if(!entry.isSource) {
+        ValueNode* obstacleShapeNode = info->find({ "object_type", "objectType" });
+        if(obstacleShapeNode->isValid()) {
+            string obstacle = obstacleShapeNode->toString();
+            if(obstacle == "OBS_BOX" || obstacle == "OBS_CYLINDER" || obstacle == "OBS_SPHERE") {
+                entry.shape = obstacle;
+
+                ValueNode* materialIdNode = info->find("materialId");
+                ValueNode* materialNode = info->find("material");
+
+                // Material IDの取得
+                if(materialIdNode->isValid()) {
+                    entry.materialId = materialIdNode->toDouble();
+                } else if(materialNode->isValid()) {
+                    string name = materialNode->toString();
+                    entry.materialId = elementTable.materialId(name);
+                } else {
+                    return false;
                 }
+
+                entry.isObstacle = true;
             }
+        }
+    }
 
-            // for obstacle
-            {
-                ValueNode* obstacleShapeNode = info->find({ "object_type", "objectType" });
-                if(obstacleShapeNode->isValid()) {
-                    string obstacle = obstacleShapeNode->toString();
-                    if(obstacle == "OBS_BOX" || obstacle == "OBS_CYLINDER" || obstacle == "OBS_SPHERE") {
-                        strObsShape.push_back(obstacleShapeNode->toString());
-                        // リンクの中心座標の取得
-                        const Isometry3 position = link->position();
-                        Vector3 translation = position.translation();
-                        obsCX.push_back(translation.x() * 100); // [m]->[cm]
-                        obsCY.push_back(translation.y() * 100);
-                        obsCZ.push_back(translation.z() * 100);
-                        // リンクの境界の取得
-                        SgNode* node1 = link->shape();
-                        const BoundingBox &bb1 = node1->boundingBox();
-                        // 回転角度の取得
-                        obsRotMat.push_back(link->R());
-
-                        obsW.push_back((bb1.max().x() - bb1.min().x()) * 100);
-                        obsD.push_back((bb1.max().y() - bb1.min().y()) * 100);
-                        obsH.push_back((bb1.max().z() - bb1.min().z()) * 100);
-
-                        ValueNode* materialIdNode = info->find("materialId");
-                        ValueNode* materialNode = info->find("material");
-
-                        // Material IDの取得
-                        if(materialIdNode->isValid()) {
-                            obsMaterialId.push_back(materialIdNode->toDouble());
-                        } else if(materialNode->isValid()) {
-                            string name = materialNode->toString();
-                            int materialId = elementTable.materialId(name);
-                            obsMaterialId.push_back(materialId);
-                        } else {
-                            return false;
-                        }
+    if(entry.isSource || entry.isObstacle) {
+        // リンクの境界の取得
+        SgNode* node1 = link->shape();
+        const BoundingBox &bb1 = node1->boundingBox();
+        entry.width = (bb1.max().x() - bb1.min().x()) * 100; // [m]->[cm]
+        entry.depth = (bb1.max().y() - bb1.min().y()) * 100;
+        entry.height = (bb1.max().z() - bb1.min().z()) * 100;
+    }
 
-                        nObstacle += 1;
-                    }
+    if(entry.isSource) {
+        // srcVolumeの計算
+        if(entry.shape == "SRC_BOX") {
+            entry.volume = entry.width * entry.depth * entry.height;
+        } else if(entry.shape == "SRC_CYLINDER") {
+            entry.volume = pow(entry.width / 2, 2) * entry.depth * M_PI;
+        } else if(entry.shape == "SRC_SPHERE") {
+            entry.volume = (4.0 / 3.0) * M_PI * pow(entry.width / 2, 3);
+        }
+    }
+
+    return true;
+}
+
+
+ItemList<BodyItem> PHITSWriter::targetBodyItems() const
+{
+    return RootItem::instance()->checkedItems<BodyItem>();
+}
+
+
+bool PHITSWriter::searchLink(bool flagQAD)
+{
+    initialize();
+
+    // リンクの検索
+    //
+    ItemList<BodyItem> checked = targetBodyItems();
+
+    // チェックの外れたボディの削除
+    set<BodyItem*> checkedItems;
+    for(const auto& item : checked) {
+        checkedItems.insert(item.get());
+    }
+    for(auto it = bodyEntries.begin(); it != bodyEntries.end(); ) {
+        if(checkedItems.find(it->first) == checkedItems.end()) {
+            it = bodyEntries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for(const auto& item : checked) {
+        Body* body = item->body();
+        BodyEntry& bodyEntry = bodyEntries[item.get()];
+
+        // 新しいボディ及びモデルが置き換えられたボディはすべてのリンクを読み込む
+        if(bodyEntry.body != body || (flagQAD && !bodyEntry.hasQADParameters)
+           || (int)bodyEntry.links.size() != body->numLinks()) {
+            bodyEntry.body = body;
+            bodyEntry.hasQADParameters = flagQAD;
+            bodyEntry.links.clear();
+            bodyEntry.links.resize(body->numLinks());
+        }
+
+        // 注釈または形状の大きさが変わったリンクのみパラメータを読み直す
+        for(int i = 0; i < body->numLinks(); ++i) {
+            Link* link = body->link(i);
+            LinkEntry& entry = bodyEntry.links[i];
+            const size_t signature = linkSignature(link);
+            if(entry.link != link || entry.signature != signature) {
+                entry = LinkEntry();
+                entry.signature = signature;
+                if(!readLinkEntry(link, entry, flagQAD)) {
+                    bodyEntries.erase(item.get());
+                    return false;
                 }
             }
         }
+
+        for(auto& entry : bodyEntry.links) {
+            if(!entry.isSource && !entry.isObstacle) {
+                continue;
+            }
+            Link* link = entry.link;
+            // リンクの中心座標の取得
+            const Isometry3 position = link->position();
+            Vector3 translation = position.translation();
+
+            if(entry.isSource) {
+                // RadiationSourceの取得
+                nEne.push_back(entry.nEne);
+                dEnergy.push_back(entry.energy);
+                dRate.push_back(entry.rate);
+                dActivity.push_back(entry.activity);
+                srcTotalActivity.push_back(entry.totalActivity);
+                strSrcShape.push_back(entry.shape);
+                srcMaterialId.push_back(entry.materialId);
+                srcCX.push_back(translation.x() * 100); // [m]->[cm]
+                srcCY.push_back(translation.y() * 100);
+                srcCZ.push_back(translation.z() * 100);
+                // 回転角度の取得
+                srcRotMat.push_back(link->R());
+                srcW.push_back(entry.width);
+                srcD.push_back(entry.depth);
+                srcH.push_back(entry.height);
+                srcVolume.push_back(entry.volume);
+                if(flagQAD) {
+                    LSO.push_back(entry.lso);
+                    NSO.push_back(entry.nso);
+                    MSO.push_back(entry.mso);
+                    buildupName.push_back(entry.buildupName);
+                }
+                sourceEntries.push_back(&entry);
+                nSource += 1;
+            }
+
+            if(entry.isObstacle) {
+                strObsShape.push_back(entry.shape);
+                obsCX.push_back(translation.x() * 100); // [m]->[cm]
+                obsCY.push_back(translation.y() * 100);
+                obsCZ.push_back(translation.z() * 100);
+                // 回転角度の取得
+                obsRotMat.push_back(link->R());
+                obsW.push_back(entry.width);
+                obsD.push_back(entry.depth);
+                obsH.push_back(entry.height);
+                obsMaterialId.push_back(entry.materialId);
+                obstacleEntries.push_back(&entry);
+                nObstacle += 1;
+            }
+        }
     }
 
     return true;
@@ -445,12 +596,209 @@ bool PHITSWriter::searchCameraLink(const int inputMode)
 }
 
 
+
+void PHITSWriter::updateMaterialBlock()
+{
+    if(!materialBlock.empty()) {
+        return;
+    }
+
+    stringstream sstr;
+    materialRho.clear();
+
+    sstr << "[ M a t e r i a l ]" << endl;
+    // Material Identification
+    int id = 1;
+    int im = 0;
+
+    for(auto& item : elementTable.matData()) {
+        string s = get<0>(item);
+        int n = get<1>(item);
+        double d = get<2>(item);
+
+        materialRho.push_back(d);
+
+        sstr << "$ " << s << " D = "
+            << scientific << setprecision(4) << d << " g/cm3" << endl;
+        sstr << "m" << id << setw(10) << setfill(' ') << elementTable.element()[im][0]
+            << scientific << setprecision(4)
+            << setw(15) << setfill(' ') << -elementTable.weightRate()[im][0] << endl;
+        for(int j = 1; j < n; j++) {
+            sstr << "  " << setw(10) << setfill(' ') << elementTable.element()[im][j]
+                << scientific << setprecision(4)
+                << setw(15) << setfill(' ') << -elementTable.weightRate()[im][j] << endl;
+        }
+        id++;
+        im++;
+    }
+
+    materialBlock = sstr.str();
+    ++numRegeneratedBlocks_;
+}
+
+
+void PHITSWriter::updateBlocks(LinkEntry* entry, int index, int inputMode, int precision)
+{
+    numBlocks_ += entry->isSource ? 3 : 2;
+
+    // 番号と書式が変わらなければ生成済みのブロックを使う
+    if(entry->blockIndex == index && entry->blockMode == inputMode && entry->blockPrecision == precision) {
+        return;
+    }
+    entry->blockIndex = index;
+    entry->blockMode = inputMode;
+    entry->blockPrecision = precision;
+
+    const double w = entry->width;
+    const double d = entry->depth;
+    const double h = entry->height;
+
+    if(entry->isSource) {
+        const int is = index;
+
+        // ***** Source *****
+        stringstream sstr;
+        double subSource = entry->volume * entry->totalActivity;
+        sstr << scientific << setprecision(4);
+        sstr << " <Source> =   " << subSource << "           # weight of this sub-source" << endl;
+        sstr << "   s-type =   2                # axial source  with energy spectrum" << endl;
+        sstr << "     proj =  photon            # kind of incident particle" << endl;
+        sstr << fixed << setprecision(4);
+        sstr << "       x0 =   -" << w << "/2            # minimum position of x-axis [cm]" << endl;
+        sstr << "       x1 =    " << w << "/2            # maximum position of x-axis [cm]" << endl;
+        sstr << "       y0 =   -" << d << "/2            # minimum position of y-axis [cm]" << endl;
+        sstr << "       y1 =    " << d << "/2            # maximum position of y-axis [cm]" << endl;
+        sstr << "       z0 =   -" << h << "/2            # minimum position of z-axis [cm]" << endl;
+        sstr << "       z1 =    " << h << "/2            # maximum position of z-axis [cm]" << endl;
+        sstr << "     trcl = " << is + 2 << endl;
+        sstr << "      dir =   all              # z-direction of beam [cosine]" << endl;
+        if(entry->shape == "SRC_BOX") {
+            //sstr << "      reg = 2" << endl; // BOXの場合、角度によってはPHITSでエラーになるため削除
+        } else {
+            sstr << "      reg = " << is + 2 << endl;
+        }
+        if(inputMode == GammaData::COMPTON) {
+            sstr << "       e0 = " << scientific << setprecision(4) << entry->peakEnergy << "         # number of energy and weight" << endl;
+        } else {
+            sstr << "   e-type =   8                # pointwise energies given by data" << endl;
+            sstr << "       ne =    " << entry->nEne << "               # number of energy and weight" << endl;
+            sstr << scientific << setprecision(4);
+            for(int iEne = 0; iEne < entry->nEne; ++iEne) {
+                sstr << "       " << entry->energy[iEne] << "   "
+                    << entry->activity[iEne] << "*" << entry->volume << "*" << entry->rate[iEne] << endl;
+            }
+        }
+        sstr << "" << endl;
+        entry->sourceBlock = sstr.str();
+
+        // ***** Surface *****
+        sstr.str("");
+        sstr << fixed << setprecision(2);
+        if(entry->shape == "SRC_BOX") {
+            sstr << "   " << is + 2 << "   " << is + 2 << "   rpp"
+                << "   " << -w / 2 << "  " << w / 2
+                << "   " << -d / 2 << "  " << d / 2
+                << "   " << -h / 2 << "  " << h / 2 << endl;
+        } else if(entry->shape == "SRC_CYLINDER") {
+            sstr << "   " << is + 2 << "   " << is + 2 << "   rcc"
+                << "   " << 0 << "  " << -d / 2 << "  " << 0 // P(x0,y0,z0)
+                << "   " << 0 << "  " << d << "  " << 0      // H(Hx,Hy,Hz)
+                << "   " << w / 2 << endl;                   // R
+        } else if(entry->shape == "SRC_SPHERE") {
+            sstr << "   " << is + 2 << "   " << is + 2 << "   so"
+                << "   " << w / 2 << endl;
+        }
+        entry->surfaceBlock = sstr.str();
+
+        // ***** Cell *****
+        sstr.str("");
+        sstr << fixed << setprecision(precision);
+        int id = entry->materialId;
+        sstr << "   " << is + 2 << "   " << id << " " << -materialRho[id - 1] << " " << -(is + 2) << endl;
+        entry->cellBlock = sstr.str();
+
+        numRegeneratedBlocks_ += 3;
+
+    } else if(entry->isObstacle) {
+        const int io = index;
+
+        // ***** Surface *****
+        stringstream sstr;
+        sstr << fixed << setprecision(2);
+        if(entry->shape == "OBS_BOX") {
+            sstr << " " << io + 201 << " " << io + 201 << "   rpp    "
+                << -w / 2 << " "
+                << w / 2 << " "
+                << -d / 2 << " "
+                << d / 2 << " "
+                << -h / 2 << " "
+                << h / 2 << endl;
+        } else if(entry->shape == "OBS_CYLINDER") {
+            sstr << " " << io + 201 << " " << io + 201 << "   rcc    "
+                << 0.0 << " "
+                << -d / 2 << " "
+                << 0.0 << " "
+                << 0.0 << " "
+                << d << " "
+                << 0.0 << " "
+                << w / 2 << endl;
+        } else if(entry->shape == "OBS_SPHERE") {
+            sstr << " " << io + 201 << " " << io + 201 << "   so    "
+                << w / 2 << endl;
+        }
+        entry->surfaceBlock = sstr.str();
+
+        // ***** Cell *****
+        sstr.str("");
+        sstr << fixed << setprecision(precision);
+        int id = entry->materialId;
+        sstr << " " << io + 201 << " " << "    " << id << " " << -materialRho[id - 1] << " "
+            << -(io + 201) << endl;
+        entry->cellBlock = sstr.str();
+
+        numRegeneratedBlocks_ += 2;
+    }
+}
+
+
+void PHITSWriter::updateTransformBlock(LinkEntry* entry, int index, int precision, const Vector3& p, const Matrix3& R)
+{
+    ++numBlocks_;
+
+    // 番号と位置・姿勢が変わらなければ生成済みのブロックを使う
+    if(entry->trIndex == index && entry->trPrecision == precision
+       && entry->trTranslation == p && entry->trRotation == R) {
+        return;
+    }
+    entry->trIndex = index;
+    entry->trPrecision = precision;
+    entry->trTranslation = p;
+    entry->trRotation = R;
+
+    stringstream sstr;
+    sstr << fixed << setprecision(precision);
+    sstr << " TR" << index << "  "
+        << p.x() << " " << p.y() << " " << p.z() << " "
+        << R(0, 0) << " " << R(1, 0) << " " << R(2, 0) << " "
+        << R(0, 1) << " " << R(1, 1) << " " << R(2, 1) << " "
+        << R(0, 2) << " " << R(1, 2) << " " << R(2, 2) << " "
+        << " 1" << endl;
+    entry->transformBlock = sstr.str();
+
+    ++numRegeneratedBlocks_;
+}
+
+
 string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
 {
     PHITSRunner phits;
     stringstream sstr;
     sstr.str("");
 
+    auto startTime = chrono::steady_clock::now();
+    numRegeneratedBlocks_ = 0;
+    numBlocks_ = 1;
+
     // RadiationSource及びObstacleリンクの探索
     if(!searchLink()) return sstr.str();
     if(calcInfo.inputMode != GammaData::DOSERATE) {
@@ -522,6 +870,16 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
     // ***** Source *****
     sstr << "[ S o u r c e ]" << endl;
 
+    // 以降のTransform及びCellは直前の書式を引き継ぐ
+    const int precision = nSource > 0 ? 4 : 2;
+    updateMaterialBlock();
+    for(int is = 0; is < nSource; ++is) {
+        updateBlocks(sourceEntries[is], is, calcInfo.inputMode, precision);
+    }
+    for(int io = 0; io < nObstacle; ++io) {
+        updateBlocks(obstacleEntries[io], io, calcInfo.inputMode, precision);
+    }
+
     double totfact = 0.0;
     for(int is = 0; is < nSource; ++is) {
         // subSourceの計算
@@ -529,46 +887,10 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
 
         totfact += subSource;
 
-        sstr << scientific << setprecision(4);
-        sstr << " <Source> =   " << subSource << "           # weight of this sub-source" << endl;
-        sstr << "   s-type =   2                # axial source  with energy spectrum" << endl;
-        sstr << "     proj =  photon            # kind of incident particle" << endl;
-        sstr << fixed << setprecision(4);
-        sstr << "       x0 =   -" << srcW[is] << "/2            # minimum position of x-axis [cm]" << endl;
-        sstr << "       x1 =    " << srcW[is] << "/2            # maximum position of x-axis [cm]" << endl;
-        sstr << "       y0 =   -" << srcD[is] << "/2            # minimum position of y-axis [cm]" << endl;
-        sstr << "       y1 =    " << srcD[is] << "/2            # maximum position of y-axis [cm]" << endl;
-        sstr << "       z0 =   -" << srcH[is] << "/2            # minimum position of z-axis [cm]" << endl;
-        sstr << "       z1 =    " << srcH[is] << "/2            # maximum position of z-axis [cm]" << endl;
-        sstr << "     trcl = " << is + 2 << endl;
-        sstr << "      dir =   all              # z-direction of beam [cosine]" << endl;
-        if(strSrcShape[is] == "SRC_BOX") {
-            //sstr << "      reg = 2" << endl; // BOXの場合、角度によってはPHITSでエラーになるため削除
-        } else {
-            sstr << "      reg = " << is + 2 << endl;
-        }
         if(calcInfo.inputMode == GammaData::COMPTON) {
-            int jEne = 0;
-            double dRate_max = 0.0;
-            for(int iEne = 0; iEne < nEne[is]; ++iEne) {
-                if(dRate_max <= dRate[is][iEne]) {
-                    dRate_max = dRate[is][iEne];
-                    jEne = iEne;
-                };
-            }
-            energy_ = dEnergy[is][jEne];
-            sstr << "       e0 = " << scientific << setprecision(4) << dEnergy[is][jEne] << "         # number of energy and weight" << endl;
-        } else {
-            sstr << "   e-type =   8                # pointwise energies given by data" << endl;
-            sstr << "       ne =    " << nEne[is] << "               # number of energy and weight" << endl;
-            sstr << scientific << setprecision(4);
-            for(int iEne = 0; iEne < nEne[is]; ++iEne) {
-                sstr << "       " << dEnergy[is][iEne] << "   "
-                    << dActivity[is][iEne] << "*" << srcVolume[is] << "*" << dRate[is][iEne] << endl;
-            }
+            energy_ = sourceEntries[is]->peakEnergy;
         }
-        sstr << "" << endl;
-
+        sstr << sourceEntries[is]->sourceBlock;
     }
 
     sstr << "  totfact =   " << scientific << setprecision(4) << totfact << endl;
@@ -576,31 +898,7 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
 
     //********************************************************************************
     // ***** Material *****
-    sstr << "[ M a t e r i a l ]" << endl;
-    // Material Identification
-    int id = 1;
-    int im = 0;
-
-    for(auto& item : elementTable.matData()) {
-        string s = get<0>(item);
-        int n = get<1>(item);
-        double d = get<2>(item);
-
-        materialRho.push_back(d);
-
-        sstr << "$ " << s << " D = "
-            << scientific << setprecision(4) << d << " g/cm3" << endl;
-        sstr << "m" << id << setw(10) << setfill(' ') << elementTable.element()[im][0]
-            << scientific << setprecision(4)
-            << setw(15) << setfill(' ') << -elementTable.weightRate()[im][0] << endl;
-        for(int j = 1; j < n; j++) {
-            sstr << "  " << setw(10) << setfill(' ') << elementTable.element()[im][j]
-                << scientific << setprecision(4)
-                << setw(15) << setfill(' ') << -elementTable.weightRate()[im][j] << endl;
-        }
-        id++;
-        im++;
-    }
+    sstr << materialBlock;
     sstr << fixed << setprecision(2);
     sstr << "" << endl;
 
@@ -609,20 +907,7 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
     sstr << "[ S u r f a c e ]" << endl;
     sstr << "   1       so     10000." << endl;
     for(int is = 0; is < nSource; ++is) {
-        if(strSrcShape[is] == "SRC_BOX") {
-            sstr << "   " << is + 2 << "   " << is + 2 << "   rpp"
-                << "   " << -srcW[is] / 2 << "  " << srcW[is] / 2
-                << "   " << -srcD[is] / 2 << "  " << srcD[is] / 2
-                << "   " << -srcH[is] / 2 << "  " << srcH[is] / 2 << endl;
-        } else if(strSrcShape[is] == "SRC_CYLINDER") {
-            sstr << "   " << is + 2 << "   " << is + 2 << "   rcc"
-                << "   " << 0 << "  " << -srcD[is] / 2 << "  " << 0 // P(x0,y0,z0)
-                << "   " << 0 << "  " << srcD[is] << "  " << 0      // H(Hx,Hy,Hz)
-                << "   " << srcW[is] / 2 << endl;                   // R
-        } else if(strSrcShape[is] == "SRC_SPHERE") {
-            sstr << "   " << is + 2 << "   " << is + 2 << "   so"
-                << "   " << srcW[is] / 2 << endl;
-        }
+        sstr << sourceEntries[is]->surfaceBlock;
     }
     if(calcInfo.inputMode == GammaData::PINHOLE) {
         sstr << "c Pinhole Camera" << std::endl;
@@ -645,27 +930,7 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
     }
     for(int io = 0; io < nObstacle; ++io) {
         if(io == 0) sstr << "c Obstacles" << std::endl;
-        if(strObsShape[io] == "OBS_BOX") {
-            sstr << " " << io + 201 << " " << io + 201 << "   rpp    "
-                << -obsW[io] / 2 << " "
-                << obsW[io] / 2 << " "
-                << -obsD[io] / 2 << " "
-                << obsD[io] / 2 << " "
-                << -obsH[io] / 2 << " "
-                << obsH[io] / 2 << endl;
-        } else if(strObsShape[io] == "OBS_CYLINDER") {
-            sstr << " " << io + 201 << " " << io + 201 << "   rcc    "
-                << 0.0 << " "
-                << -obsD[io] / 2 << " "
-                << 0.0 << " "
-                << 0.0 << " "
-                << obsD[io] << " "
-                << 0.0 << " "
-                << obsW[io] / 2 << endl;
-        } else if(strObsShape[io] == "OBS_SPHERE") {
-            sstr << " " << io + 201 << " " << io + 201 << "   so    "
-                << obsW[io] / 2 << endl;
-        }
+        sstr << obstacleEntries[io]->surfaceBlock;
     }
     sstr << "" << endl;
 
@@ -673,22 +938,16 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
     // ***** Transform *****
     sstr << "[ Transform ]" << endl;
     //sstr << " *TR1 " << x << " " << y << " " << z << " " << rpyZ << " " << rpyY << " " << rpyX << "   0.0 0.0 0.0    0.0 0.0 0.0    2" << endl; // M=2の方法ではうまくいかない
+    sstr << setprecision(precision);
     for(int is = 0; is < nSource; ++is) {
-        sstr << " TR" << is + 2 << "  " << setprecision(4)
-            << srcCX[is] << " " << srcCY[is] << " " << srcCZ[is] << " "
-            << srcRotMat[is](0, 0) << " " << srcRotMat[is](1, 0) << " " << srcRotMat[is](2, 0) << " "
-            << srcRotMat[is](0, 1) << " " << srcRotMat[is](1, 1) << " " << srcRotMat[is](2, 1) << " "
-            << srcRotMat[is](0, 2) << " " << srcRotMat[is](1, 2) << " " << srcRotMat[is](2, 2) << " "
-            << " 1" << endl;
+        Vector3 p(srcCX[is], srcCY[is], srcCZ[is]);
+        updateTransformBlock(sourceEntries[is], is + 2, 4, p, srcRotMat[is]);
+        sstr << sourceEntries[is]->transformBlock;
     }
     for(int io = 0; io < nObstacle; ++io) {
-        sstr << " TR" << io + 201 << "  "
-            << obsCX[io] << " " << obsCY[io] << " " << obsCZ[io] << " "
-            << obsRotMat[io](0, 0) << " " << obsRotMat[io](1, 0) << " " << obsRotMat[io](2, 0) << " "
-            << obsRotMat[io](0, 1) << " " << obsRotMat[io](1, 1) << " " << obsRotMat[io](2, 1) << " "
-            << obsRotMat[io](0, 2) << " " << obsRotMat[io](1, 2) << " " << obsRotMat[io](2, 2) << " "
-            << " 1" << endl;
-
+        Vector3 p(obsCX[io], obsCY[io], obsCZ[io]);
+        updateTransformBlock(obstacleEntries[io], io + 201, precision, p, obsRotMat[io]);
+        sstr << obstacleEntries[io]->transformBlock;
     }
     sstr << "" << endl;
 
@@ -697,8 +956,7 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
     sstr << "[ C e l l ]" << endl;
     sstr << "   1    -1            1             $ outer region" << endl;
     for(int is = 0; is < nSource; ++is) {
-        int id = srcMaterialId[is];
-        sstr << "   " << is + 2 << "   " << id << " " << -materialRho[id - 1] << " " << -(is + 2) << endl;
+        sstr << sourceEntries[is]->cellBlock;
     }
     if(calcInfo.inputMode == GammaData::PINHOLE) {
         sstr << "c Pinhole Camera" << std::endl;
@@ -747,9 +1005,7 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
     }
     for(int io = 0; io < nObstacle; ++io) {
         if(io == 0) sstr << "c Obstacles" << std::endl;
-        int id = obsMaterialId[io];
-        sstr << " " << io + 201 << " " << "    " << id << " " << -materialRho[id - 1] << " "
-            << -(io + 201) << endl;
+        sstr << obstacleEntries[io]->cellBlock;
     }
     sstr << "c Inner area" << std::endl;
     sstr << " 999     1 -1.21e-3   -1";
@@ -889,5 +1145,7 @@ string PHITSWriter::writePHITS(GammaData::CalcInfo calcInfo)
     sstr << "[END]" << endl;
     sstr << "" << endl;
 
+    lastWriteTime_ = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+
     return sstr.str();
 }
@@ -5,8 +5,12 @@
 #ifndef CNOID_PHITS_PLUGIN_PHITS_WRITER_H
 #define CNOID_PHITS_PLUGIN_PHITS_WRITER_H
 
+#include <cnoid/Body>
 #include <cnoid/Camera>
 #include <cnoid/EigenUtil>
+#include <cnoid/ItemList>
+#include <ctime>
+#include <map>
 #include <string>
 #include <vector>
 #include "ComptonCamera.h"
@@ -15,6 +19,8 @@
 
 namespace cnoid {
 
+class BodyItem;
+
 class PHITSWriter
 {
 public:
@@ -28,6 +34,11 @@ public:
     void setDefaultNuclideTableFile(const std::string& filename);
     void setDefaultElementTableFile(const std::string& filename);
 
+    // statistics of the last writePHITS() call
+    double lastWriteTime() const { return lastWriteTime_; } // unit: ms
+    int numRegeneratedBlocks() const { return numRegeneratedBlocks_; }
+    int numBlocks() const { return numBlocks_; }
+
 protected:
     std::vector<double> materialRho;
     NuclideTable nuclideTable;
@@ -109,11 +120,67 @@ protected:
     PinholeCamera* pcamera;
     std::string defaultNuclideTableFile_;
     std::string defaultElementTableFile_;
+    time_t nuclideTableTime_;
+    time_t elementTableTime_;
+
+    // Deck model
+    // リンクごとの線源・遮蔽体パラメータと生成済みのブロックを保持し，
+    // 変更のあったブロックのみを再生成する
+    struct LinkEntry {
+        Link* link = nullptr;
+        size_t signature = 0; // of the annotations and the shape size of the link
+        bool isSource = false;
+        bool isObstacle = false;
+        std::string shape;
+        int materialId;
+        double width, depth, height;
+        // RadiationSource
+        int nEne = 0;
+        std::vector<double> energy;
+        std::vector<double> rate;
+        std::vector<double> activity;
+        double totalActivity = 0.0;
+        double peakEnergy = 0.0;
+        double volume = 0.0;
+        int lso = 0, mso = 0, nso = 0;
+        std::string buildupName;
+        // cached blocks
+        int blockIndex = -1;
+        int blockMode = -1;
+        int blockPrecision = -1;
+        std::string sourceBlock;
+        std::string surfaceBlock;
+        std::string cellBlock;
+        int trIndex = -1;
+        int trPrecision = -1;
+        Vector3 trTranslation;
+        Matrix3 trRotation;
+        std::string transformBlock;
+    };
+
+    struct BodyEntry {
+        BodyPtr body;
+        bool hasQADParameters = false;
+        std::vector<LinkEntry> links; // of all the links of the body
+    };
+
+    std::map<BodyItem*, BodyEntry> bodyEntries;
+    std::vector<LinkEntry*> sourceEntries;
+    std::vector<LinkEntry*> obstacleEntries;
+    std::string materialBlock;
+    double lastWriteTime_;
+    int numRegeneratedBlocks_;
+    int numBlocks_;
 
     // Function
+    virtual ItemList<BodyItem> targetBodyItems() const;
     void initialize();
     bool searchLink(bool flagQAD = false);
     bool searchCameraLink(const int inputMode);
+    bool readLinkEntry(Link* link, LinkEntry& entry, bool flagQAD);
+    void updateMaterialBlock();
+    void updateBlocks(LinkEntry* entry, int index, int inputMode, int precision);
+    void updateTransformBlock(LinkEntry* entry, int index, int precision, const Vector3& p, const Matrix3& R);
 };
 
 }
@@ -0,0 +1,611 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include <cnoid/Body>
+#include <cnoid/BodyItem>
+#include <cnoid/Image>
+#include <cnoid/Link>
+#include <cnoid/MeshGenerator>
+#include <cnoid/SceneShape>
+#include <cnoid/ValueTree>
+#include <QGuiApplication>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "../ComptonCamera.h"
+#include "../ComptonCone.h"
+#include "../GammaData.h"
+#include "../GammaImageGenerator.h"
+#include "../OrthoNodeData.h"
+#include "../PHITSWriter.h"
+#include "../PinholeCamera.h"
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+struct Options {
+    int nx = 50;
+    int ny = 50;
+    int nz = 50;
+    int ne = 16;
+    int imageSize = 40;
+    int numCones = 100000;
+    int numQueries = 1000000;
+    int volumeSize = 512;
+    int repeat = 3;
+    int numPlantLinks = 500;
+    int numPlantSources = 8;
+    string tableDir = PHITS_BENCHMARK_TABLE_DIR;
+    string workDir = ".";
+    string output;
+};
+
+struct StageResult {
+    string name;
+    bool ok = true;
+    vector<double> times; // unit: ms
+    long peakRss = 0; // unit: KB
+    int numBlocks = -1; // of the PHITS input deck
+    int numRegeneratedBlocks = -1;
+};
+
+long peakRss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+StageResult runStage(const string& name, int repeat, const function<bool()>& func)
+{
+    StageResult result;
+    result.name = name;
+    for(int i = 0; i < repeat; ++i) {
+        auto start = chrono::steady_clock::now();
+        bool ok = func();
+        auto end = chrono::steady_clock::now();
+        result.times.push_back(chrono::duration<double, milli>(end - start).count());
+        result.ok &= ok;
+    }
+    result.peakRss = peakRss();
+    cerr << name << ": " << (result.ok ? "ok" : "failed") << endl;
+    return result;
+}
+
+int roundUpTo10(int n)
+{
+    return ((n + 9) / 10) * 10;
+}
+
+void writeMeshHeader(ostream& out, int nx, int ny, int nz, int ne)
+{
+    out << "[ T - T r a c k ]" << endl;
+    out << "    title = synthetic benchmark data" << endl;
+    out << "     mesh =  xyz" << endl;
+    out << "     xmin =  -100.0000" << endl;
+    out << "     xmax =   100.0000" << endl;
+    out << "       nx =  " << nx << endl;
+    out << "     ymin =  -100.0000" << endl;
+    out << "     ymax =   100.0000" << endl;
+    out << "       ny =  " << ny << endl;
+    out << "     zmin =  -100.0000" << endl;
+    out << "     zmax =   100.0000" << endl;
+    out << "       nz =  " << nz << endl;
+    out << "     emin =   0.000000" << endl;
+    out << "     emax =   3.000000" << endl;
+    out << "       ne =  " << ne << endl;
+    out << endl;
+}
+
+void writeValues(ostream& out, int n, mt19937& rng)
+{
+    uniform_real_distribution<float> value(0.0f, 1.0f);
+    for(int i = 0; i < n; ++i) {
+        out << scientific << value(rng);
+        out << (((i + 1) % 10 == 0 || i == n - 1) ? "\n" : "  ");
+    }
+}
+
+// GammaData::readPHITS(DOSERATE) の入力形式：z ごと，エネルギーごとに nx * ny 個の値
+bool generateDoseOutput(const string& filename, const Options& options, mt19937& rng)
+{
+    ofstream out(filename);
+    writeMeshHeader(out, options.nx, options.ny, options.nz, options.ne);
+    for(int iz = 0; iz < options.nz; ++iz) {
+        for(int ie = 0; ie < options.ne; ++ie) {
+            out << "hc:  y = synthetic" << endl;
+            writeValues(out, options.nx * options.ny, rng);
+        }
+    }
+    return out.good();
+}
+
+// GammaData::readPHITS(PINHOLE) の入力形式：ny = 1, ne = 1
+bool generatePinholeOutput(const string& filename, const Options& options, mt19937& rng)
+{
+    ofstream out(filename);
+    writeMeshHeader(out, options.imageSize, 1, options.imageSize, 1);
+    out << "hc:  y = synthetic" << endl;
+    writeValues(out, options.imageSize * options.imageSize, rng);
+    return out.good();
+}
+
+// GammaData::readQAD の入力形式：評価点ごとに TOTAL 行を1つ出力する
+bool generateQADOutput(const string& filename, const Options& options, mt19937& rng)
+{
+    uniform_real_distribution<float> value(0.0f, 1.0f);
+    ofstream out(filename);
+    out << "1 ne= 1 emin= 0.0 emax= 3.0 TR x= 0.0 y= 0.0 z= 0.0" << endl;
+    out << "DOSE PHOTONS" << endl;
+    for(int iz = 0; iz < options.nz; ++iz) {
+        for(int iy = 0; iy < options.ny; ++iy) {
+            for(int ix = 0; ix < options.nx; ++ix) {
+                double x = -100.0 + (ix + 0.5) * 200.0 / options.nx;
+                double y = -100.0 + (iy + 0.5) * 200.0 / options.ny;
+                double z = -100.0 + (iz + 0.5) * 200.0 / options.nz;
+                out << "P " << x << " " << z << " " << y << " 0" << endl;
+            }
+        }
+    }
+    out << "P 0.0 0.0 0.0 -1" << endl;
+    int n = options.nx * options.ny * options.nz;
+    for(int i = 0; i < n; ++i) {
+        out << "TOTAL 0 0 0 0 0 0 0 0 " << scientific << value(rng) << endl;
+    }
+    return out.good();
+}
+
+// ComptonCone::readComptonCone の入力形式：kf x y z u v w e c1 c2 c3 [cm, MeV]
+bool generateComptonDump(const string& filename, ComptonCamera* camera, double energy,
+                         const Options& options, mt19937& rng)
+{
+    double scatterY = -camera->scattererThickness();
+    double absorbY = scatterY - camera->distance();
+    uniform_real_distribution<double> position(-2.0, 2.0);
+    uniform_real_distribution<double> depositEnergy(0.3 * energy, 0.9 * energy);
+
+    ofstream out(filename);
+    for(int i = 0; i < options.numCones; ++i) {
+        double sx = position(rng), sz = position(rng);
+        double ax = position(rng), az = position(rng);
+        Vector3 d(ax - sx, absorbY - scatterY, az - sz);
+        d.normalize();
+        out << "1 " << ax << " " << absorbY << " " << az << " "
+            << d.x() << " " << d.y() << " " << d.z() << " "
+            << depositEnergy(rng) << " 0 0 0" << endl;
+    }
+    return out.good();
+}
+
+// 線源と遮蔽体の箱が格子状に並ぶプラントモデル
+BodyPtr createPlant(const Options& options, vector<SgShapePtr>& shapes)
+{
+    MeshGenerator generator;
+    BodyPtr body = new Body;
+    body->setName("Plant");
+    Link* rootLink = body->createLink();
+    body->setRootLink(rootLink);
+    for(int i = 0; i < options.numPlantLinks; ++i) {
+        Link* link = body->createLink();
+        link->setName("Part" + to_string(i));
+        link->setOffsetTranslation(Vector3(0.5 * (i % 25) - 6.0, 0.5 * (i / 25) - 5.0, 0.0));
+        SgShapePtr shape = new SgShape;
+        shape->setMesh(generator.generateBox(Vector3(0.2, 0.2, 0.2)));
+        link->addShapeNode(shape);
+        shapes.push_back(shape);
+        Mapping* info = link->info();
+        if(i < options.numPlantSources) {
+            info->write("object_type", "SRC_BOX");
+            info->write("materialId", 2);
+            Listing* energy = info->createFlowStyleListing("energy");
+            energy->append(0.662);
+            energy->append(0.851);
+            energy->append(1.0e6);
+        } else {
+            info->write("object_type", "OBS_BOX");
+            info->write("materialId", 3);
+        }
+        rootLink->appendChild(link);
+    }
+    body->updateLinkTree();
+    body->calcForwardKinematics();
+    return body;
+}
+
+// チェックされたボディの代わりにプラントモデルの入力ファイルを生成する
+class PlantWriter : public PHITSWriter
+{
+public:
+    PlantWriter(BodyItem* item, const Options& options)
+    {
+        items.push_back(item);
+        setDefaultNuclideTableFile(options.tableDir + "/nuclides.yaml");
+        setDefaultElementTableFile(options.tableDir + "/elements.yaml");
+    }
+
+protected:
+    virtual ItemList<BodyItem> targetBodyItems() const override { return items; }
+
+private:
+    ItemList<BodyItem> items;
+};
+
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> const char* { return (i + 1 < argc) ? argv[++i] : nullptr; };
+        const char* value = nullptr;
+        if(arg == "-h" || arg == "--help") {
+            return false;
+        } else if((arg == "--size") && (value = next())) {
+            options.nx = options.ny = options.nz = atoi(value);
+        } else if((arg == "--nx") && (value = next())) {
+            options.nx = atoi(value);
+        } else if((arg == "--ny") && (value = next())) {
+            options.ny = atoi(value);
+        } else if((arg == "--nz") && (value = next())) {
+            options.nz = atoi(value);
+        } else if((arg == "--ne") && (value = next())) {
+            options.ne = atoi(value);
+        } else if((arg == "--image-size") && (value = next())) {
+            options.imageSize = atoi(value);
+        } else if((arg == "--cones") && (value = next())) {
+            options.numCones = atoi(value);
+        } else if((arg == "--queries") && (value = next())) {
+            options.numQueries = atoi(value);
+        } else if((arg == "--volume") && (value = next())) {
+            options.volumeSize = atoi(value);
+        } else if((arg == "--repeat") && (value = next())) {
+            options.repeat = atoi(value);
+        } else if((arg == "--plant-links") && (value = next())) {
+            options.numPlantLinks = atoi(value);
+        } else if((arg == "--plant-sources") && (value = next())) {
+            options.numPlantSources = atoi(value);
+        } else if((arg == "--table-dir") && (value = next())) {
+            options.tableDir = value;
+        } else if((arg == "--work-dir") && (value = next())) {
+            options.workDir = value;
+        } else if((arg == "--output") && (value = next())) {
+            options.output = value;
+        } else {
+            cerr << "Unknown or incomplete option: " << arg << endl;
+            return false;
+        }
+    }
+
+    // PHITS 出力は1行10個の値で書かれるため，nx と画像サイズは10の倍数に揃える
+    options.nx = roundUpTo10(max(options.nx, 1));
+    options.ny = max(options.ny, 1);
+    options.nz = max(options.nz, 1);
+    options.ne = max(options.ne, 1);
+    options.imageSize = roundUpTo10(max(options.imageSize, 1));
+    options.volumeSize = max(options.volumeSize, 0);
+    options.repeat = max(options.repeat, 1);
+    options.numPlantLinks = max(options.numPlantLinks, 0);
+    options.numPlantSources = min(max(options.numPlantSources, 0), options.numPlantLinks);
+    return true;
+}
+
+void printUsage()
+{
+    cerr << "Usage: phits-benchmark [options]\n"
+         << "  --size N        grid size of the synthetic dose data (nx = ny = nz = N)\n"
+         << "  --nx/--ny/--nz N  grid size of each axis\n"
+         << "  --ne N          number of energy channels\n"
+         << "  --image-size N  resolution of the synthetic pinhole image\n"
+         << "  --cones N       number of events in the synthetic Compton dump file\n"
+         << "  --queries N     number of OrthoNodeData point queries\n"
+         << "  --volume N      edge length of the Array3D volume (N^3 cells, 0: skip)\n"
+         << "  --repeat N      number of repetitions of each stage\n"
+         << "  --plant-links N number of links of the plant model of the PHITS input (0: skip)\n"
+         << "  --plant-sources N  number of radiation sources among the links of the plant\n"
+         << "  --table-dir DIR directory of nuclides.yaml and elements.yaml\n"
+         << "  --work-dir DIR  directory for the generated files\n"
+         << "  --output FILE   write the result as JSON to FILE (default: stdout)" << endl;
+}
+
+void writeJson(ostream& os, const Options& options, const vector<StageResult>& results)
+{
+    os << "{\n";
+    os << "  \"benchmark\": \"PHITSPlugin\",\n";
+    os << "  \"parameters\": { \"nx\": " << options.nx << ", \"ny\": " << options.ny
+       << ", \"nz\": " << options.nz << ", \"ne\": " << options.ne
+       << ", \"image_size\": " << options.imageSize << ", \"cones\": " << options.numCones
+       << ", \"queries\": " << options.numQueries << ", \"volume\": " << options.volumeSize
+       << ", \"grid_value_bytes\": " << sizeof(OrthoGridArray::value_type)
+       << ", \"plant_links\": " << options.numPlantLinks << ", \"plant_sources\": " << options.numPlantSources
+       << ", \"repeat\": " << options.repeat << " },\n";
+    os << "  \"stages\": [\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const StageResult& r = results[i];
+        double total = 0.0;
+        double minTime = r.times.empty() ? 0.0 : r.times[0];
+        for(auto& t : r.times) {
+            total += t;
+            minTime = min(minTime, t);
+        }
+        double mean = r.times.empty() ? 0.0 : total / r.times.size();
+        os << "    { \"name\": \"" << r.name << "\", \"ok\": " << (r.ok ? "true" : "false")
+           << ", \"mean_ms\": " << fixed << mean << ", \"min_ms\": " << minTime
+           << ", \"peak_rss_kb\": " << r.peakRss;
+        if(r.numBlocks >= 0) {
+            os << ", \"blocks\": " << r.numBlocks << ", \"regenerated_blocks\": " << r.numRegeneratedBlocks;
+        }
+        os << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}" << endl;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if(!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    // QImage/QPainter のみを使用するため，ウィンドウシステムには接続しない
+    if(qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    mt19937 rng(12345);
+    const string doseFile = options.workDir + "/benchmark_dose.out";
+    const string pinholeFile = options.workDir + "/benchmark_pinhole.out";
+    const string qadFile = options.workDir + "/benchmark_qad.out";
+    const string comptonFile = options.workDir + "/benchmark_compton_dmp.out";
+    const double comptonEnergy = 0.662;
+
+    BodyPtr body = new Body;
+    Link* rootLink = body->createLink();
+    body->setRootLink(rootLink);
+    PinholeCameraPtr pinholeCamera = new PinholeCamera;
+    pinholeCamera->setName("PinholeCamera");
+    pinholeCamera->setResolution(Vector2(options.imageSize, options.imageSize));
+    body->addDevice(pinholeCamera, rootLink);
+    ComptonCameraPtr comptonCamera = new ComptonCamera;
+    comptonCamera->setName("ComptonCamera");
+    body->addDevice(comptonCamera, rootLink);
+    body->updateLinkTree();
+    body->calcForwardKinematics();
+
+    vector<StageResult> results;
+    int repeat = options.repeat;
+
+    results.push_back(runStage("generate_inputs", 1, [&](){
+        return generateDoseOutput(doseFile, options, rng)
+            && generatePinholeOutput(pinholeFile, options, rng)
+            && generateQADOutput(qadFile, options, rng)
+            && generateComptonDump(comptonFile, comptonCamera, comptonEnergy, options, rng);
+    }));
+
+    GammaData gammaData;
+    results.push_back(runStage("phits_parse", repeat, [&](){
+        return gammaData.readPHITS(doseFile, GammaData::DOSERATE);
+    }));
+
+    results.push_back(runStage("qad_parse", repeat, [&](){
+        GammaData qadData;
+        GammaData::CalcInfo calcInfo;
+        calcInfo.xyze[0].n = options.nx;
+        calcInfo.xyze[1].n = options.ny;
+        calcInfo.xyze[2].n = options.nz;
+        calcInfo.srcRotMat[0] = Matrix3::Identity();
+        return qadData.readQAD(qadFile, calcInfo, 0);
+    }));
+
+    const string gbinFile = doseFile + ".gbin";
+    results.push_back(runStage("gbin_write", repeat, [&](){
+        return gammaData.write(gbinFile) && gammaData.setDataHeaderInfo(gammaData.geometryInfo(0));
+    }));
+
+    results.push_back(runStage("gbin_read", repeat, [&](){
+        GammaData data;
+        return data.read(gbinFile) && data.getDataHeaderInfo(data.geometryInfo(0));
+    }));
+
+    results.push_back(runStage("energy_window_sum", repeat, [&](){
+        // 全方向について半分の窓の合計を求める（1回目は累積スペクトルの構築を含む）
+        double sum = 0.0;
+        int numDirections = gammaData.numDirections();
+        for(int i = 0; i < numDirections; ++i) {
+            sum += gammaData.energyWindowSum(i, options.ne / 4, options.ne * 3 / 4);
+        }
+        return sum >= 0.0;
+    }));
+
+    OrthoNodeDataPtr nodeData;
+    results.push_back(runStage("ortho_node_build", repeat, [&](){
+        nodeData = new OrthoNodeData(gammaData);
+        return nodeData->isValid();
+    }));
+
+    results.push_back(runStage("ortho_node_query", repeat, [&](){
+        if(!nodeData || !nodeData->isValid()) {
+            return false;
+        }
+        Boxd bounds = nodeData->bounds();
+        uniform_real_distribution<double> ux(bounds.min().x(), bounds.max().x());
+        uniform_real_distribution<double> uy(bounds.min().y(), bounds.max().y());
+        uniform_real_distribution<double> uz(bounds.min().z(), bounds.max().z());
+        double sum = 0.0;
+        for(int i = 0; i < options.numQueries; ++i) {
+            double value = nodeData->value(Vector3d(ux(rng), uy(rng), uz(rng)));
+            if(value == value) {
+                sum += value;
+            }
+        }
+        return sum >= 0.0;
+    }));
+
+    GammaData& pinholeData = pinholeCamera->gammaData();
+    bool isPinholeReady = pinholeData.readPHITS(pinholeFile, GammaData::PINHOLE)
+        && pinholeData.write(pinholeFile + ".gbin")
+        && pinholeData.setDataHeaderInfo(pinholeData.geometryInfo(0));
+    pinholeCamera->setReady(isPinholeReady);
+
+    GammaImageGenerator generator;
+    results.push_back(runStage("gamma_image_render", repeat, [&](){
+        if(!isPinholeReady) {
+            return false;
+        }
+        auto image = std::make_shared<Image>();
+        image->setSize(640, 480, 3);
+        generator.generateImage(pinholeCamera, image);
+        return !image->empty();
+    }));
+
+    results.push_back(runStage("compton_reconstruct", repeat, [&](){
+        return ComptonCone::readComptonCone(comptonFile, comptonEnergy, comptonCamera);
+    }));
+
+    // プラントモデルの入力ファイルを，すべて生成する場合と変更のあったブロックのみ生成する場合で比べる
+    if(options.numPlantLinks > 0) {
+        vector<SgShapePtr> plantShapes;
+        BodyItemPtr plantItem = new BodyItem;
+        plantItem->setBody(createPlant(options, plantShapes));
+        Body* plant = plantItem->body();
+        GammaData::CalcInfo calcInfo;
+        calcInfo.inputMode = GammaData::DOSERATE;
+
+        auto setBlocks = [&](const PlantWriter& writer){
+            results.back().numBlocks = writer.numBlocks();
+            results.back().numRegeneratedBlocks = writer.numRegeneratedBlocks();
+        };
+
+        // 核種・元素テーブルの読み込みは計測に含めない
+        vector<unique_ptr<PlantWriter>> freshWriters;
+        for(int i = 0; i < repeat; ++i) {
+            freshWriters.emplace_back(new PlantWriter(plantItem, options));
+        }
+        int count = 0;
+        results.push_back(runStage("phits_deck_full", repeat, [&](){
+            return !freshWriters[count++]->writePHITS(calcInfo).empty();
+        }));
+        setBlocks(*freshWriters.back());
+
+        PlantWriter writer(plantItem, options);
+        writer.writePHITS(calcInfo);
+        results.push_back(runStage("phits_deck_unchanged", repeat, [&](){
+            return !writer.writePHITS(calcInfo).empty();
+        }));
+        setBlocks(writer);
+
+        // 線源を1つ動かす
+        count = 0;
+        results.push_back(runStage("phits_deck_moved", repeat, [&](){
+            Link* link = plant->link(1 + (count % max(options.numPlantSources, 1)));
+            link->setTranslation(link->translation() + Vector3(0.0, 0.0, (count++ % 2) ? -0.1 : 0.1));
+            return !writer.writePHITS(calcInfo).empty();
+        }));
+        setBlocks(writer);
+
+        // 遮蔽体の材質を1つ変える
+        count = 0;
+        results.push_back(runStage("phits_deck_edited", repeat, [&](){
+            Link* link = plant->link(plant->numLinks() - 1);
+            link->info()->write("materialId", (count++ % 2) ? 3 : 4);
+            return !writer.writePHITS(calcInfo).empty();
+        }));
+        setBlocks(writer);
+
+        // 遮蔽体の大きさを1つ変える
+        count = 0;
+        MeshGenerator generator;
+        results.push_back(runStage("phits_deck_resized", repeat, [&](){
+            SgShape* shape = plantShapes.back();
+            shape->setMesh(generator.generateBox(Vector3(0.2, 0.2, (count++ % 2) ? 0.2 : 0.3)));
+            shape->notifyUpdate();
+            return !writer.writePHITS(calcInfo).empty();
+        }));
+        setBlocks(writer);
+    }
+
+    // 大きな配列の確保がほかの段階のピークメモリに影響しないよう，最後に計測する
+    if(options.volumeSize > 0) {
+        const size_t n = options.volumeSize;
+        OrthoGridArray volume;
+        results.push_back(runStage("array3d_alloc_fill", 1, [&](){
+            volume.resize(n, n, n, 0.0);
+            volume.fill(1.0);
+            return volume.size() == n * n * n;
+        }));
+
+        results.push_back(runStage("array3d_transform", repeat, [&](){
+            volume.transform([](OrthoGridArray::value_type v){ return v * 0.5 + 0.5; });
+            return volume(n - 1, n - 1, n - 1) > 0.0;
+        }));
+
+        results.push_back(runStage("array3d_subbox_fill", repeat, [&](){
+            volume.subBox(n / 4, n / 4, n / 4, n / 2, n / 2, n / 2).fill(2.0);
+            return volume(n / 2, n / 2, n / 2) == 2.0;
+        }));
+
+        // 全軸の全断面を走査する．ビューはコピーせずに参照し，比較用に断面をコピーする場合も計測する
+        results.push_back(runStage("array3d_slice_view", repeat, [&](){
+            double sum = 0.0;
+            for(int axis = 0; axis < 3; ++axis) {
+                for(size_t k = 0; k < n; ++k) {
+                    OrthoGridArray::ConstView slice = volume.slice(axis, k);
+                    for(size_t v = 0; v < slice.size_y(); ++v) {
+                        for(size_t u = 0; u < slice.size_x(); ++u) {
+                            sum += slice(u, v);
+                        }
+                    }
+                }
+            }
+            return sum > 0.0;
+        }));
+
+        results.push_back(runStage("array3d_slice_copy", repeat, [&](){
+            double sum = 0.0;
+            vector<double> buffer;
+            for(int axis = 0; axis < 3; ++axis) {
+                for(size_t k = 0; k < n; ++k) {
+                    OrthoGridArray::ConstView slice = volume.slice(axis, k);
+                    buffer.resize(slice.size());
+                    for(size_t v = 0; v < slice.size_y(); ++v) {
+                        for(size_t u = 0; u < slice.size_x(); ++u) {
+                            buffer[v * slice.size_x() + u] = slice(u, v);
+                        }
+                    }
+                    for(auto& value : buffer) {
+                        sum += value;
+                    }
+                }
+            }
+            return sum > 0.0;
+        }));
+    }
+
+    if(options.output.empty()) {
+        writeJson(cout, options, results);
+    } else {
+        ofstream out(options.output);
+        writeJson(out, options, results);
+    }
+
+    bool ok = true;
+    for(auto& result : results) {
+        ok &= result.ok;
+    }
+    return ok ? 0 : 1;
+}
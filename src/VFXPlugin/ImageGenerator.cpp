@@ -4,6 +4,12 @@
 
 #include "ImageGenerator.h"
 #include <cnoid/MathUtil>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -11,21 +17,111 @@ using namespace cnoid;
 
 namespace {
 
-const double gaussian3[] = { 1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0,
-                             2.0 / 16.0, 4.0 / 16.0, 2.0 / 16.0,
-                             1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0 };
+inline int clampIndex(int value, int low, int high) { return value < low ? low : (value > high ? high : value); }
 
-const double gaussian5[] = { 1.0 / 256.0, 4.0 / 256.0, 6.0 / 256.0, 4.0 / 256.0, 1.0 / 256.0,
-                             4.0 / 256.0, 16.0 / 256.0, 24.0 / 256.0, 16.0 / 256.0, 4.0 / 256.0,
-                             6.0 / 256.0, 24.0 / 256.0, 36.0 / 256.0, 24.0 / 256.0, 6.0 / 256.0,
-                             4.0 / 256.0, 16.0 / 256.0, 24.0 / 256.0, 16.0 / 256.0, 4.0 / 256.0,
-                             1.0 / 256.0, 4.0 / 256.0, 6.0 / 256.0, 4.0 / 256.0, 1.0 / 256.0 };
+inline unsigned char saturate(float value) { return value <= 0.0f ? 0 : (value >= 255.0f ? 255 : (unsigned char)(value + 0.5f)); }
 
-const double sobel3[2][9] = { { -1.0, 0.0, 1.0, -2.0, 0.0, 2.0, -1.0, 0.0, 1.0 },
-                              { 1.0, 2.0, 1.0, 0.0, 0.0, 0.0, -1.0, -2.0, -1.0 } }; // [0]-horizontal, [1]-vertical
+QImage::Format qimageFormat(int numComponents)
+{
+    switch(numComponents) {
+    case 1: return QImage::Format_Grayscale8;
+    case 3: return QImage::Format_RGB888;
+    case 4: return QImage::Format_RGBA8888;
+    default: return QImage::Format_Invalid;
+    }
+}
+
+// Number of components of the QImage formats that are copied without a conversion
+int numComponentsOf(QImage::Format format)
+{
+    switch(format) {
+    case QImage::Format_Grayscale8: return 1;
+    case QImage::Format_RGB888: return 3;
+    case QImage::Format_RGBA8888: return 4;
+    default: return 0;
+    }
+}
 
-const double prewitt3[2][9] = { { -1.0, 0.0, 1.0, -1.0, 0.0, 1.0, -1.0, 0.0, 1.0 },
-                                { 1.0, 1.0, 1.0, 0.0, 0.0, 0.0, -1.0, -1.0, -1.0 } }; // [0]-horizontal, [1]-vertical
+// Bilinear sampling positions along one axis, shared by all the rows or columns.
+// The weights of the positions outside the source are zero.
+struct SampleTable {
+    vector<int> offsets0;
+    vector<int> offsets1;
+    vector<int> weights0; // unit: 1 / 2048
+    vector<int> weights1;
+    vector<unsigned char> inside;
+};
+
+// Positions of the source pixels scaled by scale around the center. Each entry is repeated
+// for the numComponents bytes of a pixel, and step is the offset of one pixel.
+void makeSampleTable(int size, double scale, int numComponents, int step, SampleTable& table)
+{
+    const int n = size * numComponents;
+    table.offsets0.resize(n);
+    table.offsets1.resize(n);
+    table.weights0.resize(n);
+    table.weights1.resize(n);
+    table.inside.resize(n);
+    const int center = size / 2;
+    for(int i = 0; i < size; ++i) {
+        double position = center + (i - center) / scale;
+        int p = (int)floor(position);
+        bool inside = p >= 0 && p <= size - 1;
+        int weight = inside ? (int)lround((position - p) * 2048.0) : 0;
+        for(int k = 0; k < numComponents; ++k) {
+            int index = i * numComponents + k;
+            table.inside[index] = inside;
+            table.offsets0[index] = inside ? p * step + k : 0;
+            table.offsets1[index] = inside ? std::min(p + 1, size - 1) * step + k : 0;
+            table.weights0[index] = inside ? 2048 - weight : 0;
+            table.weights1[index] = weight;
+        }
+    }
+}
+
+// Normalized weights of a 1D Gaussian kernel of 2 * radius + 1 taps
+vector<float> gaussianKernel(int radius, double sigma)
+{
+    vector<float> kernel(2 * radius + 1);
+    if(sigma <= 0.0 && radius <= 2) {
+        // Binomial kernels, the separated forms of the former 3x3 and 5x5 tables
+        const float binomial[3][5] = { { 1.0f }, { 0.25f, 0.5f, 0.25f }, { 1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16 } };
+        std::copy(binomial[radius], binomial[radius] + 2 * radius + 1, kernel.begin());
+        return kernel;
+    }
+    if(sigma <= 0.0) {
+        sigma = 0.3 * (radius - 1) + 0.8;
+    }
+    double sum = 0.0;
+    vector<double> weights(2 * radius + 1);
+    for(int i = -radius; i <= radius; ++i) {
+        weights[i + radius] = exp(-0.5 * i * i / (sigma * sigma));
+        sum += weights[i + radius];
+    }
+    for(int i = 0; i < 2 * radius + 1; ++i) {
+        kernel[i] = weights[i] / sum;
+    }
+    return kernel;
+}
+
+// Copies a row with radius replicated pixels on both sides
+template<typename T> void padRow(const unsigned char* row, int width, int nc, int radius, T* padded)
+{
+    for(int i = 0; i < radius; ++i) {
+        for(int k = 0; k < nc; ++k) {
+            padded[i * nc + k] = row[k];
+            padded[(width + radius + i) * nc + k] = row[(width - 1) * nc + k];
+        }
+    }
+    for(int i = 0; i < width * nc; ++i) {
+        padded[radius * nc + i] = row[i];
+    }
+}
+
+inline unsigned char median3(unsigned char a, unsigned char b, unsigned char c)
+{
+    return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
 
 }
 
@@ -37,7 +133,23 @@ public:
 
     Impl();
 
-    void differentialFilter(Image& image, const double kernel[2][9]);
+    void forEachRows(int height, const function<void(int begin, int end)>& func);
+    void median3Filter(Image& image);
+    void differentialFilter(Image& image, int weight);
+
+    int numThreads;
+
+    // Buffers reused by the filters
+    vector<float> floatBuffer;
+    vector<float> floatRow;
+    vector<int> intBuffer;
+    vector<int> intRow;
+    vector<unsigned char> byteBuffer;
+    vector<unsigned char> source;
+    vector<uint16_t> fineHistograms;
+    vector<uint16_t> coarseHistograms;
+    SampleTable rowTable;
+    SampleTable columnTable;
 };
 
 }
@@ -51,7 +163,7 @@ ImageGenerator::ImageGenerator()
 
 ImageGenerator::Impl::Impl()
 {
-
+    numThreads = 1;
 }
 
 
@@ -61,132 +173,222 @@ ImageGenerator::~ImageGenerator()
 }
 
 
+void ImageGenerator::setNumThreads(int numThreads)
+{
+    impl->numThreads = std::max(numThreads, 1);
+}
+
+
+int ImageGenerator::numThreads() const
+{
+    return impl->numThreads;
+}
+
+
+void ImageGenerator::Impl::forEachRows(int height, const function<void(int begin, int end)>& func)
+{
+    int n = std::min(numThreads, height);
+    if(n <= 1) {
+        func(0, height);
+        return;
+    }
+    vector<thread> threads;
+    for(int i = 1; i < n; ++i) {
+        threads.emplace_back(func, height * i / n, height * (i + 1) / n);
+    }
+    func(0, height / n);
+    for(auto& thread : threads) {
+        thread.join();
+    }
+}
+
+
 void ImageGenerator::filteredImage(Image& image, const double& m_scalex, const double& m_scaley)
 {
-    //Linear interpolation
-    Image cloneImage = image;
-    cloneImage.setSize(image.width(), image.height(), image.numComponents());
+    // Linear interpolation in 11 bit fixed point. The source positions and weights of the
+    // columns and rows are computed once, so each pixel only reads the tables.
     int width = image.width();
     int height = image.height();
     int nc = image.numComponents();
-    double scalex = m_scalex;
-    double scaley = m_scaley;
-    int xs = width / 2;
-    int ys = height / 2;
-
-    for(int i = -ys; i < ys; i++) {
-        for(int j = -xs; j < xs; j++) {
-            int y = i / scaley;
-            int x = j / scalex;
-            int m, n;
-            if(y > 0) {
-                m = (int)y;
-            } else {
-                m = (int)(y - 1);
-            }
-            if(x > 0) {
-                n = (int)x;
-            } else {
-                n = (int)(x - 1);
+    if(width <= 0 || height <= 0 || m_scalex == 0.0 || m_scaley == 0.0) {
+        return;
+    }
+    const int stride = width * nc;
+    unsigned char* pixels = image.pixels();
+
+    vector<unsigned char>& source = impl->source;
+    source.assign(pixels, pixels + (size_t)stride * height);
+    SampleTable& columns = impl->columnTable;
+    SampleTable& rows = impl->rowTable;
+    makeSampleTable(width, m_scalex, nc, nc, columns);
+    makeSampleTable(height, m_scaley, 1, stride, rows);
+
+    impl->forEachRows(height, [&](int begin, int end) {
+        // The rows are first blended vertically, which is contiguous, and then sampled horizontally.
+        // The tables are read through local pointers, which the stores to the pixels cannot alias.
+        vector<int> buffer(stride);
+        int* blended = buffer.data();
+        const int* offsets0 = columns.offsets0.data();
+        const int* offsets1 = columns.offsets1.data();
+        const int* weights0 = columns.weights0.data();
+        const int* weights1 = columns.weights1.data();
+        for(int j = begin; j < end; ++j) {
+            unsigned char* dst = &pixels[(size_t)j * stride];
+            if(!rows.inside[j]) {
+                std::fill(dst, dst + stride, 0);
+                continue;
             }
-            int q = y - m;
-            int p = x - n;
-            if(q == 1) {
-                q = 0;
-                m++;
+            const unsigned char* top = &source[rows.offsets0[j]];
+            const unsigned char* bottom = &source[rows.offsets1[j]];
+            const int w0 = rows.weights0[j];
+            const int w1 = rows.weights1[j];
+            for(int i = 0; i < stride; ++i) {
+                blended[i] = top[i] * w0 + bottom[i] * w1;
             }
-            if(p == 1) {
-                p = 0;
-                n++;
+            for(int i = 0; i < stride; ++i) {
+                int value = blended[offsets0[i]] * weights0[i] + blended[offsets1[i]] * weights1[i];
+                dst[i] = (value + (1 << 21)) >> 22;
             }
+        }
+    });
+}
 
-            for(int k = 0; k < nc; k++) {
-                int d;
-                if((m > -ys) && (m < ys) && (n >= -xs) && (n < xs)) {
-                    d = (int)((1.0 - q) * ((1.0 - p) * image.pixels()[3 * ((m  + ys) * width + (n  + xs)) + k]
-                            + p * image.pixels()[3 * ((m  + ys) * width + (n + 1 + xs)) + k])
-                            + q * ((1.0 - p) * image.pixels()[3 * ((m + 1 + ys) * width + (n + xs)) + k]
-                            + p * image.pixels()[3 * ((m + 1 + ys) * width + (n + 1 + xs)) + k]));
-                } else {
-                    d = 0;
-                }
-                if(d < 0) {
-                    d = 0;
-                }
-                if(d > 255) {
-                    d = 255;
+
+void ImageGenerator::flippedImage(Image& image)
+{
+    // Swaps the row j with the reversed row height - 1 - j in place, so the pairs of rows
+    // are independent and shared by the threads
+    int width = image.width();
+    int height = image.height();
+    int nc = image.numComponents();
+    if(width <= 0 || height <= 0) {
+        return;
+    }
+    const int stride = width * nc;
+    unsigned char* pixels = image.pixels();
+
+    impl->forEachRows((height + 1) / 2, [&](int begin, int end) {
+        for(int j = begin; j < end; ++j) {
+            unsigned char* a = &pixels[(size_t)j * stride];
+            unsigned char* b = &pixels[(size_t)(height - 1 - j) * stride];
+            // The middle row of an odd height is reversed with itself
+            const int n = (a == b) ? width / 2 : width;
+            for(int i = 0; i < n; ++i) {
+                unsigned char* p = &a[i * nc];
+                unsigned char* q = &b[(width - 1 - i) * nc];
+                for(int k = 0; k < nc; ++k) {
+                    std::swap(p[k], q[k]);
                 }
-                cloneImage.pixels()[3 * ((i + ys) * width + (j + xs)) + k] = d;
             }
         }
-    }
-    image = cloneImage;
+    });
 }
 
 
-void ImageGenerator::flippedImage(Image& image)
+void ImageGenerator::gaussianFilter(Image& image, const int& matrix, const double& sigma)
 {
-    Image cloneImage = image;
-    cloneImage.setSize(image.width(), image.height(), image.numComponents());
     int width = image.width();
     int height = image.height();
     int nc = image.numComponents();
+    int radius = matrix / 2;
+    if(radius < 1 || width <= 0 || height <= 0) {
+        return;
+    }
+    const vector<float> kernel = gaussianKernel(radius, sigma);
+    const int taps = 2 * radius + 1;
+    const int stride = width * nc;
+    unsigned char* pixels = image.pixels();
+
+    // Horizontal pass into the float buffer
+    vector<float>& buffer = impl->floatBuffer;
+    vector<float>& row = impl->floatRow;
+    buffer.resize((size_t)stride * height);
+    row.resize((width + 2 * radius) * nc);
+    for(int j = 0; j < height; ++j) {
+        padRow(&pixels[j * stride], width, nc, radius, row.data());
+        float* dst = &buffer[(size_t)j * stride];
+        std::fill(dst, dst + stride, 0.0f);
+        for(int t = 0; t < taps; ++t) {
+            const float w = kernel[t];
+            const float* src = &row[t * nc];
+            for(int i = 0; i < stride; ++i) {
+                dst[i] += w * src[i];
+            }
+        }
+    }
 
+    // Vertical pass back into the image
+    vector<float> sum(stride);
     for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            int index = nc * (i + j * width);
-            for(int k = 0; k < nc; ++k) {
-                cloneImage.pixels()[index + k] = image.pixels()[nc * ((width - 1 - i) + (height - 1 - j) * width) + k];
+        std::fill(sum.begin(), sum.end(), 0.0f);
+        for(int t = 0; t < taps; ++t) {
+            const float w = kernel[t];
+            const float* src = &buffer[(size_t)clampIndex(j + t - radius, 0, height - 1) * stride];
+            for(int i = 0; i < stride; ++i) {
+                sum[i] += w * src[i];
             }
         }
+        unsigned char* dst = &pixels[j * stride];
+        for(int i = 0; i < stride; ++i) {
+            dst[i] = saturate(sum[i]);
+        }
     }
-    image = cloneImage;
 }
 
 
-void ImageGenerator::gaussianFilter(Image& image, const int& matrix)
+void ImageGenerator::boxFilter(Image& image, const int& matrix)
 {
-    Image cloneImage;
     int width = image.width();
     int height = image.height();
     int nc = image.numComponents();
-    int margin = matrix - 1;
-    cloneImage.setSize(width + margin, height + margin, nc);
-
-    vector<double> kernel;
-    for(int i = 0; i < matrix * matrix; ++i) {
-        if(matrix == 3) {
-            kernel.push_back(gaussian3[i]);
-        } else if(matrix == 5) {
-            kernel.push_back(gaussian5[i]);
-        } else {
-            kernel.push_back(0.0);
-        }
+    int radius = matrix / 2;
+    if(radius < 1 || width <= 0 || height <= 0) {
+        return;
     }
-
+    const int taps = 2 * radius + 1;
+    const int stride = width * nc;
+    unsigned char* pixels = image.pixels();
+
+    // Horizontal running sums
+    vector<int>& buffer = impl->intBuffer;
+    vector<int>& row = impl->intRow;
+    buffer.resize((size_t)stride * height);
+    row.resize((width + 2 * radius) * nc);
     for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            int index = nc * ((i + 1) + (j + 1) * (width + margin));
-            for(int k = 0; k < nc; ++k) {
-                cloneImage.pixels()[index + k] = image.pixels()[nc * (i + j * width) + k];
+        padRow(&pixels[j * stride], width, nc, radius, row.data());
+        int* dst = &buffer[(size_t)j * stride];
+        for(int k = 0; k < nc; ++k) {
+            int sum = 0;
+            for(int t = 0; t < taps; ++t) {
+                sum += row[t * nc + k];
+            }
+            for(int i = 0; i < width; ++i) {
+                dst[i * nc + k] = sum;
+                if(i + 1 < width) {
+                    sum += row[(i + taps) * nc + k] - row[i * nc + k];
+                }
             }
         }
     }
 
+    // Vertical running sums
+    vector<int> sum(stride, 0);
+    for(int t = -radius; t <= radius; ++t) {
+        const int* src = &buffer[(size_t)clampIndex(t, 0, height - 1) * stride];
+        for(int i = 0; i < stride; ++i) {
+            sum[i] += src[i];
+        }
+    }
+    const float scale = 1.0f / (taps * taps);
     for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            int index = nc * (i + j * width);
-            for(int k = 0; k < nc; ++k) {
-                image.pixels()[index + k] = 0;
-                for(int p = j; p < j + matrix; ++p) {
-                    for(int q = i; q < i + matrix; ++q) {
-                        int r = p - j;
-                        int s = q - i;
-                        int t = matrix * r + s;
-                        image.pixels()[index + k] += kernel[t] * (double)cloneImage.pixels()[nc * (q + p * (width + margin)) + k];
-                    }
-                }
-            }
+        unsigned char* dst = &pixels[j * stride];
+        for(int i = 0; i < stride; ++i) {
+            dst[i] = saturate(sum[i] * scale);
+        }
+        const int* added = &buffer[(size_t)clampIndex(j + radius + 1, 0, height - 1) * stride];
+        const int* removed = &buffer[(size_t)clampIndex(j - radius, 0, height - 1) * stride];
+        for(int i = 0; i < stride; ++i) {
+            sum[i] += added[i] - removed[i];
         }
     }
 }
@@ -194,35 +396,119 @@ void ImageGenerator::gaussianFilter(Image& image, const int& matrix)
 
 void ImageGenerator::medianFilter(Image& image, const int& matrix)
 {
-    Image cloneImage;
+    // Perreault and Hebert, "Median Filtering in Constant Time", IEEE TIP 16(9), 2007.
+    // Each column keeps a histogram of its 2 * radius + 1 pixels, split into 16 coarse and
+    // 256 fine bins. The window histogram adds and removes one column per pixel and only
+    // updates the fine bins of the coarse bin that contains the median. The image is processed
+    // in vertical stripes so that the column histograms of a stripe stay in the cache.
     int width = image.width();
     int height = image.height();
     int nc = image.numComponents();
-    int margin = matrix - 1;
-    int median = (matrix * matrix + 1) / 2;
-    cloneImage.setSize(width + margin, height + margin, nc);
-
-    for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            int index = nc * ((i + 1) + (j + 1) * (width + margin));
-            for(int k = 0; k < nc; ++k) {
-                cloneImage.pixels()[index + k] = image.pixels()[nc * (i + j * width) + k];
+    int radius = std::min(matrix / 2, 127);
+    if(radius < 1 || width <= 0 || height <= 0) {
+        return;
+    }
+    if(radius == 1) {
+        impl->median3Filter(image);
+        return;
+    }
+    const int taps = 2 * radius + 1;
+    const int rank = taps * taps / 2;
+    const int stride = width * nc;
+    const int stripeWidth = std::max(256 * 1024 / (nc * 272 * 2) - 2 * radius, 32);
+    unsigned char* pixels = image.pixels();
+
+    vector<unsigned char>& source = impl->source;
+    source.assign(pixels, pixels + (size_t)stride * height);
+    vector<uint16_t>& fine = impl->fineHistograms;
+    vector<uint16_t>& coarse = impl->coarseHistograms;
+
+    for(int x0 = 0; x0 < width; x0 += stripeWidth) {
+        const int x1 = std::min(x0 + stripeWidth, width);
+        const int c0 = std::max(x0 - radius, 0);
+        const int c1 = std::min(x1 - 1 + radius, width - 1);
+        const int numColumns = c1 - c0 + 1;
+        fine.assign((size_t)numColumns * nc * 256, 0);
+        coarse.assign((size_t)numColumns * nc * 16, 0);
+
+        // Histogram index of the column x of the channel k
+        auto column = [&](int x, int k) { return k * numColumns + clampIndex(x, 0, width - 1) - c0; };
+
+        auto addRow = [&](int j, int delta) {
+            const unsigned char* src = &source[(size_t)clampIndex(j, 0, height - 1) * stride];
+            for(int x = c0; x <= c1; ++x) {
+                for(int k = 0; k < nc; ++k) {
+                    int value = src[x * nc + k];
+                    int c = column(x, k);
+                    fine[(size_t)c * 256 + value] += delta;
+                    coarse[(size_t)c * 16 + (value >> 4)] += delta;
+                }
             }
+        };
+        for(int t = -radius; t <= radius; ++t) {
+            addRow(t, 1);
         }
-    }
 
-    for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            int index = nc * (i + j * width);
+        for(int j = 0; j < height; ++j) {
+            if(j > 0) {
+                addRow(j - radius - 1, -1);
+                addRow(j + radius, 1);
+            }
+            unsigned char* dst = &pixels[j * stride];
             for(int k = 0; k < nc; ++k) {
-                vector<double> values;
-                for(int p = j; p < j + matrix; ++p) {
-                    for(int q = i; q < i + matrix; ++q) {
-                        values.push_back((double)cloneImage.pixels()[nc * (q + p * (width + margin)) + k]);
+                uint16_t windowCoarse[16] = { 0 };
+                uint16_t windowFine[16][16];
+                int updated[16];
+                std::fill(updated, updated + 16, x0 - taps - 1);
+
+                for(int t = -radius; t <= radius; ++t) {
+                    const uint16_t* c = &coarse[(size_t)column(x0 + t, k) * 16];
+                    for(int b = 0; b < 16; ++b) {
+                        windowCoarse[b] += c[b];
                     }
                 }
-                sort(values.begin(), values.end());
-                image.pixels()[index + k] = values[median];
+
+                for(int x = x0; x < x1; ++x) {
+                    if(x > x0) {
+                        const uint16_t* added = &coarse[(size_t)column(x + radius, k) * 16];
+                        const uint16_t* removed = &coarse[(size_t)column(x - radius - 1, k) * 16];
+                        for(int b = 0; b < 16; ++b) {
+                            windowCoarse[b] += added[b] - removed[b];
+                        }
+                    }
+
+                    int count = 0;
+                    int b = 0;
+                    while(count + windowCoarse[b] <= rank) {
+                        count += windowCoarse[b++];
+                    }
+
+                    uint16_t* f = windowFine[b];
+                    if(x - updated[b] > taps) {
+                        std::fill(f, f + 16, 0);
+                        for(int t = -radius; t <= radius; ++t) {
+                            const uint16_t* c = &fine[(size_t)column(x + t, k) * 256 + b * 16];
+                            for(int n = 0; n < 16; ++n) {
+                                f[n] += c[n];
+                            }
+                        }
+                    } else {
+                        for(int p = updated[b] + 1; p <= x; ++p) {
+                            const uint16_t* added = &fine[(size_t)column(p + radius, k) * 256 + b * 16];
+                            const uint16_t* removed = &fine[(size_t)column(p - radius - 1, k) * 256 + b * 16];
+                            for(int n = 0; n < 16; ++n) {
+                                f[n] += added[n] - removed[n];
+                            }
+                        }
+                    }
+                    updated[b] = x;
+
+                    int n = 0;
+                    while(count + f[n] <= rank) {
+                        count += f[n++];
+                    }
+                    dst[x * nc + k] = b * 16 + n;
+                }
             }
         }
     }
@@ -231,105 +517,171 @@ void ImageGenerator::medianFilter(Image& image, const int& matrix)
 
 void ImageGenerator::sobelFilter(Image& image)
 {
-    impl->differentialFilter(image, sobel3);
+    impl->differentialFilter(image, 2);
 }
 
 
 void ImageGenerator::prewittFilter(Image& image)
 {
-    impl->differentialFilter(image, prewitt3);
+    impl->differentialFilter(image, 1);
 }
 
 
-void ImageGenerator::Impl::differentialFilter(Image& image, const double kernel[2][9])
+// 3x3 median in two planar passes per row. The first pass sorts the three pixels of each
+// column into low, middle and high planes. The median of the window is then the median of
+// the largest low, the median of the middles and the smallest high of its three columns.
+// Both passes are branchless min / max loops over contiguous bytes, so they vectorize.
+// The rows are padded as in differentialFilter.
+void ImageGenerator::Impl::median3Filter(Image& image)
 {
-    Image cloneImage;
     int width = image.width();
     int height = image.height();
     int nc = image.numComponents();
-    int matrix = 3;
-    int margin = matrix - 1;
-    cloneImage.setSize(width + margin, height + margin, nc);
-
-    vector<double> hkernel;
-    vector<double> vkernel;
-    for(int i = 0; i < matrix * matrix; ++i) {
-        hkernel.push_back(kernel[0][i]);
-        vkernel.push_back(kernel[1][i]);
-    }
+    const int stride = width * nc;
+    const int padded = stride + 2 * nc;
+    unsigned char* pixels = image.pixels();
+
+    byteBuffer.resize(padded * 6);
+    unsigned char* rows[3] = { &byteBuffer[0], &byteBuffer[padded], &byteBuffer[padded * 2] };
+    unsigned char* low = &byteBuffer[padded * 3];
+    unsigned char* middle = &byteBuffer[padded * 4];
+    unsigned char* high = &byteBuffer[padded * 5];
+    padRow(&pixels[0], width, nc, 1, rows[0]);
+    std::copy(rows[0], rows[0] + padded, rows[1]);
 
     for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            int index = nc * ((i + 1) + (j + 1) * (width + margin));
-            for(int k = 0; k < nc; ++k) {
-                cloneImage.pixels()[index + k] = image.pixels()[nc * (i + j * width) + k];
-            }
+        padRow(&pixels[std::min(j + 1, height - 1) * stride], width, nc, 1, rows[2]);
+        const unsigned char* prev = rows[0];
+        const unsigned char* cur = rows[1];
+        const unsigned char* next = rows[2];
+        // One loop per plane keeps the aliasing checks few enough for the loops to vectorize
+        for(int i = 0; i < padded; ++i) {
+            low[i] = std::min(std::min(prev[i], cur[i]), next[i]);
+        }
+        for(int i = 0; i < padded; ++i) {
+            middle[i] = median3(prev[i], cur[i], next[i]);
+        }
+        for(int i = 0; i < padded; ++i) {
+            high[i] = std::max(std::max(prev[i], cur[i]), next[i]);
+        }
+
+        unsigned char* dst = &pixels[j * stride];
+        for(int i = 0; i < stride; ++i) {
+            const unsigned char l = std::max(std::max(low[i], low[i + nc]), low[i + 2 * nc]);
+            const unsigned char m = median3(middle[i], middle[i + nc], middle[i + 2 * nc]);
+            const unsigned char h = std::min(std::min(high[i], high[i + nc]), high[i + 2 * nc]);
+            dst[i] = median3(l, m, h);
         }
+        std::rotate(rows, rows + 1, rows + 3);
     }
+}
+
+
+// 3x3 gradient with the smoothing weights (1, weight, 1) across the derivative (-1, 0, 1).
+// Three padded source rows are kept so that the result can be written in place.
+void ImageGenerator::Impl::differentialFilter(Image& image, int weight)
+{
+    int width = image.width();
+    int height = image.height();
+    int nc = image.numComponents();
+    if(width <= 0 || height <= 0) {
+        return;
+    }
+    const int stride = width * nc;
+    const int padded = stride + 2 * nc;
+    unsigned char* pixels = image.pixels();
+
+    intBuffer.resize(padded * 3);
+    int* rows[3] = { &intBuffer[0], &intBuffer[padded], &intBuffer[padded * 2] };
+    padRow(&pixels[0], width, nc, 1, rows[0]);
+    std::copy(rows[0], rows[0] + padded, rows[1]);
 
     for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            int index = nc * (i + j * width);
-            for(int k = 0; k < nc; ++k) {
-                image.pixels()[index + k] = 0;
-                for(int p = j; p < j + matrix; ++p) {
-                    for(int q = i; q < i + matrix; ++q) {
-                        int r = p - j;
-                        int s = q - i;
-                        int t = matrix * r + s;
-                        image.pixels()[index + k] += hkernel[t] * (double)cloneImage.pixels()[nc * (q + p * (width + margin)) + k];
-                    }
-                }
-            }
+        padRow(&pixels[std::min(j + 1, height - 1) * stride], width, nc, 1, rows[2]);
+        const int* prev = rows[0] + nc;
+        const int* cur = rows[1] + nc;
+        const int* next = rows[2] + nc;
+        unsigned char* dst = &pixels[j * stride];
+        for(int i = 0; i < stride; ++i) {
+            int gx = (prev[i + nc] - prev[i - nc]) + weight * (cur[i + nc] - cur[i - nc]) + (next[i + nc] - next[i - nc]);
+            int gy = (prev[i - nc] + weight * prev[i] + prev[i + nc]) - (next[i - nc] + weight * next[i] + next[i + nc]);
+            int g = std::abs(gx) + std::abs(gy);
+            dst[i] = g > 255 ? 255 : g;
         }
+        std::rotate(rows, rows + 1, rows + 3);
     }
+}
+
 
-    for(int i = 0; i < width; ++i) {
+namespace cnoid {
+
+void toCnoidImage(const QImage& qimage, Image& image)
+{
+    int nc = numComponentsOf(qimage.format());
+    const QImage source = nc > 0 ? qimage : qimage.convertToFormat(QImage::Format_RGB888);
+    nc = nc > 0 ? nc : 3;
+
+    const int width = source.width();
+    const int height = source.height();
+    const int rowSize = width * nc;
+    image.setSize(width, height, nc);
+    if(rowSize == 0 || height == 0) {
+        return;
+    }
+    // QImage pads each row to 4 bytes, so the rows are only copied at once when they are packed
+    unsigned char* pixels = image.pixels();
+    if(source.bytesPerLine() == rowSize) {
+        memcpy(pixels, source.bits(), (size_t)rowSize * height);
+    } else {
         for(int j = 0; j < height; ++j) {
-            int index = nc * (i + j * width);
-            for(int k = 0; k < nc; ++k) {
-                for(int p = j; p < j + matrix; ++p) {
-                    for(int q = i; q < i + matrix; ++q) {
-                        int r = p - j;
-                        int s = q - i;
-                        int t = matrix * r + s;
-                        image.pixels()[index + k] += vkernel[t] * (double)cloneImage.pixels()[nc * (q + p * (width + margin)) + k];
-                    }
-                }
-            }
+            memcpy(&pixels[(size_t)j * rowSize], source.scanLine(j), rowSize);
         }
     }
 }
 
 
-Image toCnoidImage(const QImage& image)
+Image toCnoidImage(const QImage& qimage)
 {
-    Image cimage;
-    cimage.setSize(image.width(), image.height(), 3);
-    unsigned char* pixels = cimage.pixels();
-    for(int j = 0 ; j < image.height() ; ++j) {
-        for(int i = 0 ; i < image.width() ; ++i) {
-            int index = (i + j * image.width()) * 3;
-            QRgb rgb = image.pixel(i, j);
-            pixels[index] = qRed(rgb);
-            pixels[index + 1] = qGreen(rgb);
-            pixels[index + 2] = qBlue(rgb);
-        }
-    }
-    return cimage;
+    Image image;
+    toCnoidImage(qimage, image);
+    return image;
 }
 
 
 QImage toQImage(const Image& image)
 {
-    QImage qimage(image.width(), image.height(), QImage::Format_RGB888);
+    const int width = image.width();
+    const int height = image.height();
+    const int rowSize = width * image.numComponents();
+    QImage qimage(width, height, qimageFormat(image.numComponents()));
+    if(qimage.isNull()) {
+        return qimage;
+    }
     const unsigned char* pixels = image.pixels();
-    for(int j = 0 ; j < image.height() ; ++j) {
-        for(int i = 0 ; i < image.width() ; ++i) {
-            int index = (i + j * image.width()) * 3;
-            QColor color(pixels[index], pixels[index + 1], pixels[index + 2]);
-            qimage.setPixelColor(i, j, color);
-        }
+    for(int j = 0; j < height; ++j) {
+        memcpy(qimage.scanLine(j), &pixels[(size_t)j * rowSize], rowSize);
     }
     return qimage;
 }
+
+
+QImage wrapQImage(Image& image)
+{
+    const int nc = image.numComponents();
+    if(image.empty() || qimageFormat(nc) == QImage::Format_Invalid) {
+        return QImage();
+    }
+    return QImage(image.pixels(), image.width(), image.height(), image.width() * nc, qimageFormat(nc));
+}
+
+
+QImage wrapQImage(const Image& image)
+{
+    const int nc = image.numComponents();
+    if(image.empty() || qimageFormat(nc) == QImage::Format_Invalid) {
+        return QImage();
+    }
+    return QImage(image.pixels(), image.width(), image.height(), image.width() * nc, qimageFormat(nc));
+}
+
+}
@@ -16,10 +16,26 @@ public:
     ImageGenerator();
     virtual ~ImageGenerator();
 
+    // Number of threads that share the rows of filteredImage and flippedImage (default: 1)
+    void setNumThreads(int numThreads);
+    int numThreads() const;
+
+    // Bilinear scaling around the image center. The size is kept and the pixels whose
+    // source is outside the image become black.
     void filteredImage(Image& image, const double& m_scalex, const double& m_scaley);
+    // Rotation by 180 degrees, that is, flipping in both directions
     void flippedImage(Image& image);
-    void gaussianFilter(Image& image, const int& matrix);
+
+    // The filters work in place on images with any number of components and replicate the
+    // border pixels. The window of matrix x matrix pixels is rounded up to an odd size.
+
+    // Separable Gaussian filter. The default sigma gives the binomial kernels for 3 and 5.
+    void gaussianFilter(Image& image, const int& matrix, const double& sigma = 0.0);
+    // Box filter using running sums, whose cost does not depend on the window size
+    void boxFilter(Image& image, const int& matrix);
+    // Median filter using column histograms, whose cost does not depend on the window size (up to 255)
     void medianFilter(Image& image, const int& matrix);
+    // Saturated sum of the absolute horizontal and vertical gradients
     void sobelFilter(Image& image);
     void prewittFilter(Image& image);
 
@@ -28,9 +44,18 @@ private:
     Impl* impl;
 };
 
+// Row-wise copies between Image and QImage. Images of 1, 3 and 4 components correspond to
+// Format_Grayscale8, Format_RGB888 and Format_RGBA8888, and the other QImage formats are
+// converted to Format_RGB888 first.
 CNOID_EXPORT Image toCnoidImage(const QImage& image);
+CNOID_EXPORT void toCnoidImage(const QImage& qimage, Image& image);
 CNOID_EXPORT QImage toQImage(const Image& image);
 
+// QImage that shares the pixel buffer of the image without copying. It is valid while the image
+// is neither resized nor destroyed. Painting on the QImage of a non-const image modifies the image.
+CNOID_EXPORT QImage wrapQImage(Image& image);
+CNOID_EXPORT QImage wrapQImage(const Image& image);
+
 }
 
 #endif // CNOID_VFX_PLUGIN_IMAGE_GENERATOR_H
@@ -3,26 +3,235 @@
 */
 
 #include "VFXConverter.h"
+#include "ImageGenerator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <thread>
 
 using namespace cnoid;
 
 namespace {
 
-unsigned long xorshift128()
+inline unsigned char saturate(int value) { return value < 0 ? 0 : (value > 255 ? 255 : value); }
+
+enum NoisePurpose { GaussianNoise = 1, SaltPepper, Chance };
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", SC 2011)
+inline void philox(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint32_t k0, uint32_t k1, uint32_t* out)
 {
-    static unsigned long x = 123456789;
-    static unsigned long y = 362436069;
-    static unsigned long z = 521288629;
-    static unsigned long w = 88675123;
-    unsigned long t = (x ^ (x << 11));
-    x = y;
-    y = z;
-    z = w;
-    w = (w ^ (w >> 19)) ^ (t ^ (t >> 8));
-    return w;
+    for(int i = 0; i < 10; ++i) {
+        uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
 }
 
-inline unsigned long rand(int min, int max) { return min + xorshift128() % (max - min); }
+inline float fastLog(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    float e = (float)((int)(bits >> 23) - 127);
+    bits = (bits & 0x7fffff) | 0x3f800000;
+    float m;
+    std::memcpy(&m, &bits, sizeof(m));
+    float t = (m - 1.0f) / (m + 1.0f);
+    float t2 = t * t;
+    return e * 0.69314718f + t * (2.0f + t2 * (0.66666667f + t2 * (0.4f + t2 * (0.28571429f + t2 * 0.22222222f))));
+}
+
+// sin(2 pi u) and cos(2 pi u) for u in [0, 1)
+inline void fastSinCos(float u, float& s, float& c)
+{
+    float a = u * 4.0f;
+    int q = (int)a;
+    float x = (a - q) * 1.57079633f;
+    float x2 = x * x;
+    float sn = x * (1.0f + x2 * (-1.6666667e-1f + x2 * (8.3333333e-3f + x2 * (-1.9841270e-4f + x2 * 2.7557319e-6f))));
+    float cs = 1.0f + x2 * (-0.5f + x2 * (4.1666667e-2f + x2 * (-1.3888889e-3f + x2 * (2.4801587e-5f + x2 * -2.7557319e-7f))));
+    // Rotates by the quadrant q without branches
+    float odd = (float)(q & 1);
+    s = (float)(1 - (q & 2)) * (sn + odd * (cs - sn));
+    c = (float)(1 - ((q + 1) & 2)) * (cs + odd * (sn - cs));
+}
+
+// Draws the noise of one frame. The values of a pixel only depend on the key and its index,
+// so any range of rows can be generated independently.
+class NoiseGenerator
+{
+public:
+    NoiseGenerator(uint32_t seed, uint32_t stream, uint64_t frame)
+        : seed(seed), stream(stream), frameLow((uint32_t)frame), frameHigh((uint32_t)(frame >> 32)) { }
+
+    // Standard normal values of the pixels from first to first + n - 1.
+    // Each block of four words gives four values by the Box-Muller transform.
+    const float* gaussian(uint32_t first, int n)
+    {
+        uint32_t firstBlock = first >> 2;
+        int numBlocks = (int)(((first + n - 1) >> 2) - firstBlock + 1);
+        generate(GaussianNoise, firstBlock, numBlocks);
+        values.resize(numBlocks * 4);
+        radii.resize(numBlocks * 2);
+        const uint32_t* w = words.data();
+        float* z = values.data();
+        float* r2 = radii.data();
+        for(int i = 0; i < numBlocks * 2; ++i) {
+            // 24-bit uniform values; converting them as int keeps the loop vectorizable
+            float u1 = (int)((w[i * 2] >> 8) + 1) * (1.0f / 16777216.0f);
+            float u2 = (int)(w[i * 2 + 1] >> 8) * (1.0f / 16777216.0f);
+            r2[i] = -2.0f * fastLog(u1);
+            fastSinCos(u2, z[i * 2 + 1], z[i * 2]);
+        }
+        // std::sqrt may set errno, which keeps it out of the loop above
+        for(int i = 0; i < numBlocks * 2; ++i) {
+            float r = std::sqrt(r2[i]);
+            z[i * 2] *= r;
+            z[i * 2 + 1] *= r;
+        }
+        return z + (first & 3);
+    }
+
+    // Two uniform words (salt and pepper) for each of the pixels from first to first + n - 1
+    const uint32_t* saltPepper(uint32_t first, int n)
+    {
+        uint32_t firstBlock = first >> 1;
+        int numBlocks = (int)(((first + n - 1) >> 1) - firstBlock + 1);
+        generate(SaltPepper, firstBlock, numBlocks);
+        return words.data() + (first & 1) * 2;
+    }
+
+    // Uniform word for the i-th (0 to 3) per-frame decision
+    uint32_t chance(int i)
+    {
+        uint32_t w[4];
+        philox(0, frameLow, frameHigh, Chance, seed, stream, w);
+        return w[i];
+    }
+
+private:
+    void generate(NoisePurpose purpose, uint32_t firstBlock, int numBlocks)
+    {
+        words.resize(numBlocks * 4);
+        uint32_t* w = words.data();
+        for(int i = 0; i < numBlocks; ++i) {
+            philox(firstBlock + i, frameLow, frameHigh, purpose, seed, stream, &w[i * 4]);
+        }
+    }
+
+    uint32_t seed;
+    uint32_t stream;
+    uint32_t frameLow;
+    uint32_t frameHigh;
+    std::vector<uint32_t> words;
+    std::vector<float> values;
+    std::vector<float> radii;
+};
+
+// A uniform word is below the threshold with the given probability
+inline uint64_t toThreshold(double probability)
+{
+    if(probability <= 0.0) {
+        return 0;
+    } else if(probability >= 1.0) {
+        return (uint64_t)1 << 32;
+    }
+    return (uint64_t)(probability * 4294967296.0);
+}
+
+inline void noiseRow(unsigned char* row, int width, const float* z, float scale)
+{
+    for(int i = 0; i < width; ++i) {
+        unsigned char* pix = &row[i * 3];
+        int c = (int)std::floor(scale * z[i]);
+        pix[0] = saturate(pix[0] + c);
+        pix[1] = saturate(pix[1] + c);
+        pix[2] = saturate(pix[2] + c);
+    }
+}
+
+inline void saltPepperRow(unsigned char* row, int width, const uint32_t* words,
+                          uint64_t saltThreshold, uint64_t pepperThreshold)
+{
+    for(int i = 0; i < width; ++i) {
+        unsigned char* pix = &row[i * 3];
+        if(words[i * 2] < saltThreshold) {
+            pix[0] = pix[1] = pix[2] = 255;
+        }
+        if(words[i * 2 + 1] < pepperThreshold) {
+            pix[0] = pix[1] = pix[2] = 0;
+        }
+    }
+}
+
+inline int roundDiv(int numerator, int denominator) { return (2 * numerator + denominator) / (2 * denominator); }
+
+// Integer equivalents of QColor::fromRgb() followed by hue(), saturation() and value(),
+// and of QColor::fromHsv() followed by red(), green() and blue().
+// QColor computes in floating point on 16-bit components, so the channels of the whole
+// hsv effect may differ from the QColor path by at most 1 (measured over all 2^24 colors).
+inline void rgbToHsv(int r, int g, int b, int& h, int& s, int& v)
+{
+    int max = std::max({ r, g, b });
+    int min = std::min({ r, g, b });
+    int delta = max - min;
+    v = max;
+    if(delta == 0) {
+        h = -1;
+        s = 0;
+        return;
+    }
+    s = roundDiv(delta * 255, max);
+
+    // hue in units of 0.01 degree multiplied by delta
+    int hue;
+    if(r == max) {
+        hue = 6000 * (g - b);
+    } else if(g == max) {
+        hue = 12000 * delta + 6000 * (b - r);
+    } else {
+        hue = 24000 * delta + 6000 * (r - g);
+    }
+    if(hue < 0) {
+        hue += 36000 * delta;
+    }
+    h = roundDiv(hue, delta) / 100;
+}
+
+inline void hsvToRgb(int h, int s, int v, unsigned char* pix)
+{
+    if(s == 0) {
+        pix[0] = pix[1] = pix[2] = v;
+        return;
+    }
+    h %= 360;
+    int i = h / 60;
+    int f = h % 60;
+    int p = roundDiv(v * (255 - s), 255);
+    int q = roundDiv(v * (15300 - s * f), 15300);
+    int t = roundDiv(v * (15300 - s * (60 - f)), 15300);
+    switch(i) {
+    case 0: pix[0] = v; pix[1] = t; pix[2] = p; break;
+    case 1: pix[0] = q; pix[1] = v; pix[2] = p; break;
+    case 2: pix[0] = p; pix[1] = v; pix[2] = t; break;
+    case 3: pix[0] = p; pix[1] = q; pix[2] = v; break;
+    case 4: pix[0] = t; pix[1] = p; pix[2] = v; break;
+    default: pix[0] = v; pix[1] = p; pix[2] = q; break;
+    }
+}
+
+// Adding a double to an unsigned char truncates the sum, so adding floor(offset) as an integer
+// and clamping it gives the same result wherever the sum is in the range of 0 to 255.
+inline int toOffset(double offset) { return (int)std::floor(offset); }
 
 }
 
@@ -31,10 +240,23 @@ VFXConverter::VFXConverter()
 {
     width_ = 0;
     height_ = 0;
-    std::default_random_engine engine_init(seed_gen_());
-    engine_ = engine_init;
-    std::normal_distribution<> dist_init(0.0, 1.0);
-    dist_ = dist_init;
+    seed_ = std::random_device()();
+    stream_ = 0;
+    frame_ = 0;
+    numThreads_ = 1;
+}
+
+
+void VFXConverter::setSeed(uint32_t seed, uint32_t stream)
+{
+    seed_ = seed;
+    stream_ = stream;
+}
+
+
+void VFXConverter::setNumThreads(int numThreads)
+{
+    numThreads_ = std::max(numThreads, 1);
 }
 
 
@@ -120,74 +342,37 @@ void VFXConverter::black(Image* image)
 
 void VFXConverter::salt(Image* image, const double& salt_amount)
 {
-    image->setSize(width_, height_, 3);
-    unsigned char* pixels = image->pixels();
-
-    for(int j = 0; j < height_; ++j) {
-        for(int i = 0; i < width_; ++i) {
-            unsigned char* pix = &pixels[(i + j * width_) * 3];
-            double r = (double)(rand(0, 100)) / 100.0;
-            if(r < salt_amount) {
-                pix[0] = pix[1] = pix[2] = 255;
-            }
-        }
-    }
+    noisePass(image, frame_++, 0.0, salt_amount, 0.0);
 }
 
 
 void VFXConverter::random_salt(Image* image, const double& salt_amount, const double& salt_chance)
 {
-    double r = (double)(rand(0, 100)) / 100.0;
-    if(r < salt_chance) {
-        this->salt(image, salt_amount);
+    uint64_t frame = frame_++;
+    if(NoiseGenerator(seed_, stream_, frame).chance(0) < toThreshold(salt_chance)) {
+        noisePass(image, frame, 0.0, salt_amount, 0.0);
     }
 }
 
 
 void VFXConverter::pepper(Image* image, const double& pepper_amount)
 {
-    image->setSize(width_, height_, 3);
-    unsigned char* pixels = image->pixels();
-
-    for(int j = 0; j < height_; ++j) {
-        for(int i = 0; i < width_; ++i) {
-            unsigned char* pix = &pixels[(i + j * width_) * 3];
-            double r = (double)(rand(0, 100)) / 100.0;
-            if(r < pepper_amount) {
-                pix[0] = pix[1] = pix[2] = 0;
-            }
-        }
-    }
+    noisePass(image, frame_++, 0.0, 0.0, pepper_amount);
 }
 
 
 void VFXConverter::random_pepper(Image* image, const double& pepper_amount, const double& pepper_chance)
 {
-    double r = (double)(rand(0, 100)) / 100.0;
-    if(r < pepper_chance) {
-        this->pepper(image, pepper_amount);
+    uint64_t frame = frame_++;
+    if(NoiseGenerator(seed_, stream_, frame).chance(1) < toThreshold(pepper_chance)) {
+        noisePass(image, frame, 0.0, 0.0, pepper_amount);
     }
 }
 
 
 void VFXConverter::salt_pepper(Image* image, const double& salt_amount, const double& pepper_amount)
 {
-    image->setSize(width_, height_, 3);
-    unsigned char* pixels = image->pixels();
-
-    for(int j = 0; j < height_; ++j) {
-        for(int i = 0; i < width_; ++i) {
-            unsigned char* pix = &pixels[(i + j * width_) * 3];
-            double salt = (double)(rand(0, 100)) / 100.0;
-            double pepper = (double)(rand(0, 100)) / 100.0;
-            if(salt < salt_amount) {
-                pix[0] = pix[1] = pix[2] = 255;
-            }
-            if(pepper < pepper_amount) {
-                pix[0] = pix[1] = pix[2] = 0;
-            }
-        }
-    }
+    noisePass(image, frame_++, 0.0, salt_amount, pepper_amount);
 }
 
 
@@ -199,9 +384,9 @@ void VFXConverter::rgb(Image* image, const double& red, const double& green, con
     for(int j = 0; j < height_; ++j) {
         for(int i = 0; i < width_; ++i) {
             unsigned char* pix = &pixels[(i + j * width_) * 3];
-            pix[0] += 255 * red;
-            pix[1] += 255 * green;
-            pix[2] += 255 * blue;
+            pix[0] = saturate(pix[0] + toOffset(255 * red));
+            pix[1] = saturate(pix[1] + toOffset(255 * green));
+            pix[2] = saturate(pix[2] + toOffset(255 * blue));
         }
     }
 }
@@ -213,42 +398,83 @@ void VFXConverter::hsv(Image* image, const double& hue, const double& saturation
     unsigned char* pixels = image->pixels();
 
     for(int j = 0; j < height_; ++j) {
-        for(int i = 0; i < width_; ++i) {
-            unsigned char* pix = &pixels[(i + j * width_) * 3];
-            QColor rgb = QColor::fromRgb(pix[0], pix[1], pix[2]);
-            int h = rgb.hue() + hue * 360.0;
-            int s = rgb.saturation() + saturation * 255.0;
-            int v = rgb.value() + value * 255.0;
-
-            h = h > 359 ? h - 360 : h;
-            h = h < 0 ? 0 : h;
-            s = s > 255 ? 255 : s;
-            s = s < 0 ? 0 : s;
-            v = v > 255 ? 255 : v;
-            v = v < 0 ? 0 : v;
-
-            QColor hsv = QColor::fromHsv(h, s, v);
-            pix[0] = hsv.red();
-            pix[1] = hsv.green();
-            pix[2] = hsv.blue();
-        }
+        hsvRow(&pixels[j * width_ * 3], hue, saturation, value);
+    }
+}
+
+
+void VFXConverter::hsvRow(unsigned char* row, const double& hue, const double& saturation, const double& value)
+{
+    const int dh = toOffset(hue * 360.0);
+    const int ds = toOffset(saturation * 255.0);
+    const int dv = toOffset(value * 255.0);
+
+    for(int i = 0; i < width_; ++i) {
+        unsigned char* pix = &row[i * 3];
+        int h, s, v;
+        rgbToHsv(pix[0], pix[1], pix[2], h, s, v);
+        h += dh;
+        s += ds;
+        v += dv;
+
+        h = h > 359 ? h - 360 : h;
+        h = h < 0 ? 0 : h;
+        s = s > 255 ? 255 : s;
+        s = s < 0 ? 0 : s;
+        v = v > 255 ? 255 : v;
+        v = v < 0 ? 0 : v;
+
+        hsvToRgb(h, s, v, pix);
     }
 }
 
 
 void VFXConverter::gaussian_noise(Image* image, const double& std_dev)
+{
+    noisePass(image, frame_++, std_dev, 0.0, 0.0);
+}
+
+
+void VFXConverter::noisePass(Image* image, uint64_t frame, const double& std_dev,
+                             const double& salt_amount, const double& pepper_amount)
 {
     image->setSize(width_, height_, 3);
     unsigned char* pixels = image->pixels();
 
-    for(int j = 0; j < height_; ++j) {
-        for(int i = 0; i < width_; ++i) {
-            unsigned char* pix = &pixels[(i + j * width_) * 3];
-            double c = 255 * std_dev * dist_(engine_);
-            pix[0] += c;
-            pix[1] += c;
-            pix[2] += c;
+    const float scale = 255 * std_dev;
+    const uint64_t saltThreshold = toThreshold(salt_amount);
+    const uint64_t pepperThreshold = toThreshold(pepper_amount);
+
+    forEachRows([&](int begin, int end){
+        NoiseGenerator generator(seed_, stream_, frame);
+        for(int j = begin; j < end; ++j) {
+            unsigned char* row = &pixels[j * width_ * 3];
+            uint32_t first = (uint32_t)j * width_;
+            if(std_dev > 0.0) {
+                noiseRow(row, width_, generator.gaussian(first, width_), scale);
+            }
+            if(saltThreshold > 0 || pepperThreshold > 0) {
+                saltPepperRow(row, width_, generator.saltPepper(first, width_), saltThreshold, pepperThreshold);
+            }
         }
+    });
+}
+
+
+void VFXConverter::forEachRows(const std::function<void(int begin, int end)>& func)
+{
+    int numThreads = std::min(numThreads_, height_);
+    if(numThreads <= 1) {
+        func(0, height_);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for(int i = 1; i < numThreads; ++i) {
+        threads.emplace_back(func, height_ * i / numThreads, height_ * (i + 1) / numThreads);
+    }
+    func(0, height_ / numThreads);
+    for(auto& thread : threads) {
+        thread.join();
     }
 }
 
@@ -258,36 +484,69 @@ void VFXConverter::barrel_distortion(Image* image, const double& coef_b, const d
     image->setSize(width_, height_, 3);
     unsigned char* pixels = image->pixels();
 
-    std::shared_ptr<Image> srcImage = std::make_shared<Image>(*image);
-    unsigned char* src = srcImage->pixels();
-    this->black(image);
+    updateDistortionTable(coef_b, coef_d);
+
+    size_t size = (size_t)width_ * height_ * 3;
+    buffer_.resize(size);
+    std::copy(pixels, pixels + size, buffer_.begin());
+    const unsigned char* src = buffer_.data();
+    const int* indices = distortionTable_.indices.data();
+
+    for(int i = 0; i < width_ * height_; ++i) {
+        unsigned char* pix = &pixels[i * 3];
+        int index = indices[i];
+        if(index >= 0) {
+            const unsigned char* pix2 = &src[index * 3];
+            pix[0] = pix2[0];
+            pix[1] = pix2[1];
+            pix[2] = pix2[2];
+        } else {
+            pix[0] = pix[1] = pix[2] = 0;
+        }
+    }
+}
+
+
+void VFXConverter::updateDistortionTable(const double& coef_b, const double& coef_d)
+{
+    DistortionTable& table = distortionTable_;
+    if(table.width == width_ && table.height == height_ && table.coef_b == coef_b && table.coef_d == coef_d
+       && table.indices.size() == (size_t)width_ * height_) {
+        return;
+    }
+    table.width = width_;
+    table.height = height_;
+    table.coef_b = coef_b;
+    table.coef_d = coef_d;
+    table.indices.resize((size_t)width_ * height_);
 
     double coefa = 0.0;
     double coefb = coef_b;
     double coefc = 0.0;
     double coefd = coef_d - coefa - coefb - coefc;
 
+    int d = std::min(width_, height_) / 2;
+    double cntx = (width_ - 1) / 2.0;
+    double cnty = (height_ - 1) / 2.0;
+
     for(int j = 0; j < height_; ++j) {
         for(int i = 0; i < width_; ++i) {
-            unsigned char* pix = &pixels[(i + j * width_) * 3];
-            int d = std::min(width_, height_) / 2;
-            double cntx = (width_ - 1) / 2.0;
-            double cnty = (height_ - 1) / 2.0;
             double delx = (i - cntx) / d;
             double dely = (j - cnty) / d;
-            double dstr = sqrt(delx * delx + dely * dely);
+            double dstr = std::sqrt(delx * delx + dely * dely);
             double srcr = (coefa * dstr * dstr * dstr + coefb * dstr * dstr + coefc * dstr + coefd) * dstr;
-            double fctr = abs(dstr / srcr);
+            double fctr = std::abs(dstr / srcr);
             double srcxd = cntx + (delx * fctr * d);
             double srcyd = cnty + (dely * fctr * d);
-            int srcx = (int)srcxd;
-            int srcy = (int)srcyd;
-            unsigned char* pix2 = &src[(srcy * width_ + srcx) * 3];
-            if((srcx >= 0) && (srcy >= 0) && (srcx < width_) && (srcy < height_)) {
-                pix[0] = pix2[0];
-                pix[1] = pix2[1];
-                pix[2] = pix2[2];
+            int index = -1;
+            // The center pixel of an odd-sized image has no defined source and stays black
+            if(std::isfinite(srcxd) && std::isfinite(srcyd)
+               && srcxd > -1.0 && srcyd > -1.0 && srcxd < width_ && srcyd < height_) {
+                int srcx = (int)srcxd;
+                int srcy = (int)srcyd;
+                index = srcy * width_ + srcx;
             }
+            table.indices[i + j * width_] = index;
         }
     }
 }
@@ -339,50 +598,92 @@ void VFXConverter::mosaic(Image* image, int kernel)
 
 void VFXConverter::random_mosaic(Image* image, const double& rate, int kernel)
 {
-    double r = (double)(rand(0, 100)) / 100.0;
-    if(r < rate) {
+    if(NoiseGenerator(seed_, stream_, frame_++).chance(2) < toThreshold(rate)) {
         mosaic(image, kernel);
     }
 }
 
 
-namespace cnoid {
-
-void toCnoidImage(Image* image, QImage q_image)
+void VFXConverter::apply(Image* image, const VFXEffects& effects)
 {
-    int width = q_image.width();
-    int height = q_image.height();
+    initialize(image->width(), image->height());
+
+    NoiseGenerator frameGenerator(seed_, stream_, frame_);
+    const uint64_t frame = frame_++;
+
+    const Vector3 hsv = effects.hsv();
+    const Vector3 rgb = effects.rgb();
+    const double std_dev = effects.stdDev();
+    bool doHsv = hsv[0] > 0.0 || hsv[1] > 0.0 || hsv[2] > 0.0;
+    bool doRgb = rgb[0] > 0.0 || rgb[1] > 0.0 || rgb[2] > 0.0;
+    bool doNoise = std_dev > 0.0;
+    bool doSalt = false;
+    bool doPepper = false;
+    if(effects.saltChance() > 0.0 && effects.saltAmount() > 0.0) {
+        doSalt = frameGenerator.chance(0) < toThreshold(effects.saltChance());
+    }
+    if(effects.pepperChance() > 0.0 && effects.pepperAmount() > 0.0) {
+        doPepper = frameGenerator.chance(1) < toThreshold(effects.pepperChance());
+    }
 
-    image->setSize(width, height, 3);
-    unsigned char* pixels = image->pixels();
+    if(doHsv || doRgb || doNoise || doSalt || doPepper) {
+        image->setSize(width_, height_, 3);
+        unsigned char* pixels = image->pixels();
+
+        const int offset[3] = { toOffset(255 * rgb[0]), toOffset(255 * rgb[1]), toOffset(255 * rgb[2]) };
+        const float scale = 255 * std_dev;
+        const uint64_t saltThreshold = doSalt ? toThreshold(effects.saltAmount()) : 0;
+        const uint64_t pepperThreshold = doPepper ? toThreshold(effects.pepperAmount()) : 0;
+
+        // Every stage saturates before the next one, as the separate passes do
+        forEachRows([&](int begin, int end){
+            NoiseGenerator generator(seed_, stream_, frame);
+            for(int j = begin; j < end; ++j) {
+                unsigned char* row = &pixels[j * width_ * 3];
+                uint32_t first = (uint32_t)j * width_;
+                if(doHsv) {
+                    hsvRow(row, hsv[0], hsv[1], hsv[2]);
+                }
+                if(doRgb) {
+                    unsigned char* pix = row;
+                    for(int i = 0; i < width_; ++i, pix += 3) {
+                        pix[0] = saturate(pix[0] + offset[0]);
+                        pix[1] = saturate(pix[1] + offset[1]);
+                        pix[2] = saturate(pix[2] + offset[2]);
+                    }
+                }
+                if(doNoise) {
+                    noiseRow(row, width_, generator.gaussian(first, width_), scale);
+                }
+                if(doSalt || doPepper) {
+                    saltPepperRow(row, width_, generator.saltPepper(first, width_), saltThreshold, pepperThreshold);
+                }
+            }
+        });
+    }
 
-    for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            unsigned char* pix = &pixels[(i + j * width) * 3];
-            QRgb c = q_image.pixel(i, j);
-            pix[0] = qRed(c);
-            pix[1] = qGreen(c);
-            pix[2] = qBlue(c);
+    if(effects.coefB() < 0.0 || effects.coefD() > 1.0) {
+        barrel_distortion(image, effects.coefB(), effects.coefD());
+    }
+    if(effects.mosaicChance() > 0.0) {
+        if(frameGenerator.chance(2) < toThreshold(effects.mosaicChance())) {
+            mosaic(image, effects.kernel());
         }
     }
 }
 
 
-QImage toQImage(Image* image)
+namespace cnoid {
+
+void toCnoidImage(Image* image, QImage q_image)
 {
-    int width = image->width();
-    int height = image->height();
-    unsigned char* pixels = image->pixels();
+    toCnoidImage(q_image, *image);
+}
 
-    QImage q_image(width, height, QImage::Format_RGB888);
-    for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            unsigned char* pix = &pixels[(i + j * width) * 3];
-            QColor c(pix[0], pix[1], pix[2]);
-            q_image.setPixelColor(i, j, c);
-        }
-    }
-    return q_image;
+
+QImage toQImage(Image* image)
+{
+    return toQImage(*image);
 }
 
 }
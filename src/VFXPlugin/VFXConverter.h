@@ -5,10 +5,13 @@
 #ifndef CNOID_VFX_PLUGIN_VFX_CONVERTER_H
 #define CNOID_VFX_PLUGIN_VFX_CONVERTER_H
 
+#include <cnoid/CustomEffects>
 #include <cnoid/Image>
 #include <QImage>
-#include <random>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <vector>
 #include "exportdecl.h"
 
 namespace cnoid {
@@ -20,6 +23,18 @@ public:
 
     void initialize(int width, int height);
 
+    // Noise is drawn from a counter-based generator (Philox4x32-10) keyed by the seed and
+    // the stream (e.g. the index of the camera) and indexed by the frame and the pixel.
+    // The result is reproducible for a seed and does not depend on the number of threads.
+    // Every call that draws noise uses the current frame number and then advances it.
+    void setSeed(uint32_t seed, uint32_t stream = 0);
+    void setFrame(uint64_t frame) { frame_ = frame; }
+    uint64_t frame() const { return frame_; }
+
+    // Number of threads that share the rows of the per-pixel effects (default: 1)
+    void setNumThreads(int numThreads);
+    int numThreads() const { return numThreads_; }
+
     void red(Image* image);
     void green(Image* image);
     void blue(Image* image);
@@ -38,12 +53,35 @@ public:
     void mosaic(Image* image, int kernel = 16);
     void random_mosaic(Image* image, const double& rate, int kernel = 16);
 
+    // Applies every effect of VFXEffects in the order used by VFXVisionSimulatorItem.
+    // The per-pixel effects (hsv, rgb, gaussian noise, salt and pepper) run in a single
+    // saturating pass over each row, followed by barrel distortion and mosaic.
+    void apply(Image* image, const VFXEffects& effects);
+
 private:
+    void hsvRow(unsigned char* row, const double& hue, const double& saturation, const double& value);
+    void noisePass(Image* image, uint64_t frame, const double& std_dev,
+                   const double& salt_amount, const double& pepper_amount);
+    void forEachRows(const std::function<void(int begin, int end)>& func);
+    void updateDistortionTable(const double& coef_b, const double& coef_d);
+
     int width_;
     int height_;
-    std::random_device seed_gen_;
-    std::default_random_engine engine_;
-    std::normal_distribution<> dist_;
+    uint32_t seed_;
+    uint32_t stream_;
+    uint64_t frame_;
+    int numThreads_;
+
+    // Source pixel index of each destination pixel for barrel_distortion (-1: outside the source)
+    struct DistortionTable {
+        int width = 0;
+        int height = 0;
+        double coef_b = 0.0;
+        double coef_d = 0.0;
+        std::vector<int> indices;
+    };
+    DistortionTable distortionTable_;
+    std::vector<unsigned char> buffer_;
 };
 
 void toCnoidImage(Image* image, QImage q_image);
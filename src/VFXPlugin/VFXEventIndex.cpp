@@ -0,0 +1,119 @@
+/**
+    @author Kenta Suzuki
+*/
+
+#include "VFXEventIndex.h"
+#include <algorithm>
+#include <limits>
+#include <map>
+
+using namespace std;
+using namespace cnoid;
+
+
+VFXEventIndex::VFXEventIndex()
+{
+    clear();
+}
+
+
+void VFXEventIndex::clear()
+{
+    entries.clear();
+    activeEventsOfCollider.clear();
+    pendingEvents = TimedEventQueue();
+    endingEvents = TimedEventQueue();
+    rescheduledEvents.clear();
+    lastTime = -numeric_limits<double>::infinity();
+}
+
+
+void VFXEventIndex::build(const vector<VFXEvent>& events, const vector<string>& colliderNames)
+{
+    clear();
+
+    map<string, vector<int>> colliderIds;
+    for(size_t i = 0; i < colliderNames.size(); ++i) {
+        colliderIds[colliderNames[i]].push_back(static_cast<int>(i));
+    }
+    activeEventsOfCollider.resize(colliderNames.size());
+
+    for(auto& event : events) {
+        Entry entry;
+        for(auto& target_collider : event.targetColliders()) {
+            auto p = colliderIds.find(target_collider);
+            if(p != colliderIds.end()) {
+                entry.colliderIds.insert(entry.colliderIds.end(), p->second.begin(), p->second.end());
+            }
+        }
+        if(entry.colliderIds.empty()) {
+            // Events without an existing target collider are never triggered
+            continue;
+        }
+        sort(entry.colliderIds.begin(), entry.colliderIds.end());
+        entry.colliderIds.erase(unique(entry.colliderIds.begin(), entry.colliderIds.end()), entry.colliderIds.end());
+
+        entry.event = event;
+        entry.beginTime = event.beginTime();
+        entry.endTime = std::max({ event.endTime(), event.beginTime() + event.duration() });
+        entry.event.setEnabled(false);
+        pendingEvents.push(TimedEvent(entry.beginTime, static_cast<int>(entries.size())));
+        entries.push_back(entry);
+    }
+}
+
+
+void VFXEventIndex::update(const double& time)
+{
+    if(time == lastTime) {
+        return;
+    }
+    lastTime = time;
+
+    while(!endingEvents.empty() && time >= endingEvents.top().first) {
+        int index = endingEvents.top().second;
+        endingEvents.pop();
+        setActive(index, false);
+
+        Entry& entry = entries[index];
+        Vector2 cycle = entry.event.cycle();
+        if(cycle[0] > 0.0 && cycle[1] > 0.0) {
+            double end_time = entry.endTime;
+            entry.beginTime = end_time + cycle[1];
+            entry.endTime = std::max({ end_time + cycle[0] + cycle[1], entry.beginTime + entry.event.duration() });
+            rescheduledEvents.push_back(index);
+        }
+    }
+
+    while(!pendingEvents.empty() && time >= pendingEvents.top().first) {
+        int index = pendingEvents.top().second;
+        pendingEvents.pop();
+        // An event whose whole interval passed between two updates is skipped and not repeated
+        if(time < entries[index].endTime) {
+            setActive(index, true);
+            endingEvents.push(TimedEvent(entries[index].endTime, index));
+        }
+    }
+
+    // A repeated event stays disabled at the time it ends, as it does without the index
+    for(auto& index : rescheduledEvents) {
+        pendingEvents.push(TimedEvent(entries[index].beginTime, index));
+    }
+    rescheduledEvents.clear();
+}
+
+
+void VFXEventIndex::setActive(int index, bool on)
+{
+    Entry& entry = entries[index];
+    entry.event.setEnabled(on);
+    for(auto& colliderId : entry.colliderIds) {
+        vector<int>& active = activeEventsOfCollider[colliderId];
+        auto p = lower_bound(active.begin(), active.end(), index);
+        if(on) {
+            active.insert(p, index);
+        } else if(p != active.end() && *p == index) {
+            active.erase(p);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+/**
+    @author Kenta Suzuki
+*/
+
+#ifndef CNOID_VFX_PLUGIN_VFX_EVENT_INDEX_H
+#define CNOID_VFX_PLUGIN_VFX_EVENT_INDEX_H
+
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+#include "VFXEventReader.h"
+
+namespace cnoid {
+
+// Schedules VFX events by their begin, end and cycle times.
+// The target colliders are resolved to indices of the collider list when the index is built,
+// and update() only visits the events that begin or end by the given time.
+class VFXEventIndex
+{
+public:
+    VFXEventIndex();
+
+    void clear();
+    void build(const std::vector<VFXEvent>& events, const std::vector<std::string>& colliderNames);
+    void update(const double& time);
+
+    int numEvents() const { return static_cast<int>(entries.size()); }
+    const VFXEvent& event(int index) const { return entries[index].event; }
+
+    // Indices of the active events that target the collider, in the order of the event file
+    const std::vector<int>& activeEvents(int colliderId) const { return activeEventsOfCollider[colliderId]; }
+
+private:
+    void setActive(int index, bool on);
+
+    struct Entry {
+        VFXEvent event;
+        std::vector<int> colliderIds;
+        double beginTime;
+        double endTime;
+    };
+
+    typedef std::pair<double, int> TimedEvent;
+    typedef std::priority_queue<TimedEvent, std::vector<TimedEvent>, std::greater<TimedEvent>> TimedEventQueue;
+
+    std::vector<Entry> entries;
+    std::vector<std::vector<int>> activeEventsOfCollider;
+    TimedEventQueue pendingEvents; // ordered by begin time
+    TimedEventQueue endingEvents; // active events ordered by end time
+    std::vector<int> rescheduledEvents;
+    double lastTime;
+};
+
+}
+
+#endif // CNOID_VFX_PLUGIN_VFX_EVENT_INDEX_H
@@ -12,15 +12,74 @@
 #include <cnoid/DeviceList>
 #include <cnoid/SimulatorItem>
 #include <cnoid/MultiColliderItem>
+#include <cnoid/Format>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include "VFXConverter.h"
 #include "NoisyCamera.h"
+#include "VFXEventIndex.h"
 #include "VFXEventReader.h"
 #include "gettext.h"
 
 using namespace std;
 using namespace cnoid;
 
+namespace {
+
+// Converts the images of one camera in its own thread.
+// A pushed frame is tagged with its number, and the camera waits for the output of that
+// frame, so the cameras of a step are converted at the same time without any lag.
+// The noise of a frame is keyed by its number.
+class ConversionWorker
+{
+public:
+    ConversionWorker(Camera* camera);
+    ~ConversionWorker();
+
+    // The camera is kept with the counters, which remain visible after the simulation
+    Camera* camera() const { return camera_; }
+    void setSeed(uint32_t seed, uint32_t stream);
+    void start();
+    void stop();
+    void convert(Image* image, const VFXEffects& effects);
+    void push(const shared_ptr<const Image>& image, const VFXEffects& effects);
+    bool hasPendingFrame() const;
+    // Waits for the output of the frame pushed last, which is null if the worker has stopped
+    shared_ptr<Image> takeOutput();
+    string status() const;
+
+private:
+    void run();
+    void updateLatency(const chrono::steady_clock::time_point& time);
+
+    CameraPtr camera_;
+    VFXConverter converter;
+    thread workerThread;
+    mutable mutex workerMutex;
+    condition_variable inputCondition;
+    condition_variable outputCondition;
+    shared_ptr<const Image> input;
+    VFXEffects inputEffects;
+    uint64_t inputFrame;
+    uint64_t nextFrame;
+    chrono::steady_clock::time_point inputTime;
+    shared_ptr<Image> output_;
+    uint64_t outputFrame;
+    bool hasPendingFrame_;
+    bool isRunning;
+    bool isConverting;
+    long numFrames;
+    double lastLatency; // unit: ms
+    double maxLatency;
+    double totalLatency;
+};
+
+}
+
 namespace cnoid {
 
 class VFXVisionSimulatorItem::Impl
@@ -33,15 +92,20 @@ public:
 
     bool initializeSimulation(SimulatorItem* simulatorItem);
     void onCameraStateChanged(Camera* camera);
+    void updatePendingCameras();
+    void updateCameraImage(Camera* camera);
 
     DeviceList<Camera> cameras;
     ItemList<MultiColliderItem> colliders;
     SimulatorItem* simulatorItem;
     ConnectionSet connections;
-    std::mutex convertMutex;
-    VFXConverter converter;
+    map<Camera*, unique_ptr<ConversionWorker>> workers;
+    vector<Camera*> pendingCameras;
+    bool isWorkerThreadEnabled;
+    bool isWorkerThreadActive; // isWorkerThreadEnabled fixed for the current simulation
+    int noiseSeed;
     string vfx_event_file_path;
-    vector<VFXEvent> events;
+    VFXEventIndex eventIndex;
 };
 
 }
@@ -69,7 +133,10 @@ VFXVisionSimulatorItem::Impl::Impl(VFXVisionSimulatorItem* self)
     cameras.clear();
     colliders.clear();
     simulatorItem = nullptr;
-    events.clear();
+    isWorkerThreadEnabled = true;
+    isWorkerThreadActive = false;
+    noiseSeed = 0;
+    eventIndex.clear();
 }
 
 
@@ -86,6 +153,10 @@ VFXVisionSimulatorItem::Impl::Impl(VFXVisionSimulatorItem* self, const Impl& org
 {
     cameras.clear();
     colliders.clear();
+    simulatorItem = nullptr;
+    isWorkerThreadEnabled = org.isWorkerThreadEnabled;
+    isWorkerThreadActive = false;
+    noiseSeed = org.noiseSeed;
     vfx_event_file_path = org.vfx_event_file_path;
 }
 
@@ -109,9 +180,13 @@ bool VFXVisionSimulatorItem::Impl::initializeSimulation(SimulatorItem* simulator
 {
     cameras.clear();
     colliders.clear();
+    workers.clear();
+    pendingCameras.clear();
+    isWorkerThreadActive = isWorkerThreadEnabled;
     this->simulatorItem = simulatorItem;
-    events.clear();
+    eventIndex.clear();
 
+    vector<VFXEvent> events;
     if(!vfx_event_file_path.empty()) {
         VFXEventReader reader;
         if(reader.load(vfx_event_file_path)) {
@@ -135,10 +210,32 @@ bool VFXVisionSimulatorItem::Impl::initializeSimulation(SimulatorItem* simulator
         }
     }
 
-    for(auto& camera : cameras) {
+    // The target colliders of the events are resolved to indices of the collider list here
+    // so that the events of each frame are found without comparing names
+    vector<string> colliderNames;
+    for(auto& collider : colliders) {
+        colliderNames.push_back(collider->name());
+    }
+    eventIndex.build(events, colliderNames);
+
+    for(size_t i = 0; i < cameras.size(); ++i) {
+        Camera* camera = cameras[i];
+        // Each camera keeps its own converter so that the cached distortion table matches its resolution
+        auto& worker = workers[camera];
+        worker = make_unique<ConversionWorker>(camera);
+        worker->setSeed(noiseSeed, i);
+        if(isWorkerThreadActive) {
+            worker->start();
+        }
         connections.add(camera->sigStateChanged().connect([&, camera](){ onCameraStateChanged(camera); }));
     }
 
+    // The frames pushed while GLVisionSimulatorItem updates the cameras are set to them
+    // after its post-dynamics function, which has been added before this one
+    if(isWorkerThreadActive && !cameras.empty()) {
+        simulatorItem->addPostDynamicsFunction([&](){ updatePendingCameras(); });
+    }
+
     return true;
 }
 
@@ -147,6 +244,11 @@ void VFXVisionSimulatorItem::finalizeSimulation()
 {
     GLVisionSimulatorItem::finalizeSimulation();
     impl->connections.disconnect();
+    impl->updatePendingCameras();
+    // The stopped workers are kept so that their counters remain visible in the properties
+    for(auto& kv : impl->workers) {
+        kv.second->stop();
+    }
 }
 
 
@@ -190,7 +292,10 @@ void VFXVisionSimulatorItem::Impl::onCameraStateChanged(Camera* camera)
         kernel = noisyCamera->kernel();
     }
 
-    for(auto& collider : colliders) {
+    eventIndex.update(current_time);
+
+    for(size_t i = 0; i < colliders.size(); ++i) {
+        MultiColliderItem* collider = colliders[i];
         if(collision(collider, link->T().translation())) {
             hue = collider->hsv()[0];
             saturation = collider->hsv()[1];
@@ -209,73 +314,71 @@ void VFXVisionSimulatorItem::Impl::onCameraStateChanged(Camera* camera)
             kernel = collider->kernel();
         }
 
-        for(auto& event : events) {
-            for(auto& target_collider : event.targetColliders()) {
-                if(target_collider == collider->name()) {
-                    double begin_time = event.beginTime();
-                    double end_time = std::max({ event.endTime(), event.beginTime() + event.duration() });
-                    bool is_event_enabled = current_time >= begin_time ? true: false;
-                    is_event_enabled = current_time >= end_time ? false : is_event_enabled;
-                    Vector2 cycle = event.cycle();
-                    if(cycle[0] > 0.0 && cycle[1] > 0.0) {
-                        if(!is_event_enabled && event.isEnabled()) {
-                            event.setBeginTime(end_time + cycle[1]);
-                            event.setEndTime(end_time + cycle[0] + cycle[1]);
-                        }
-                    }
-                    event.setEnabled(is_event_enabled);
-
-                    if(is_event_enabled) {
-                        hue = event.hsv()[0] > 0.0 ? event.hsv()[0] : hue;
-                        saturation = event.hsv()[1] > 0.0 ? event.hsv()[1] : saturation;
-                        value = event.hsv()[2] > 0.0 ? event.hsv()[2] : value;
-                        red = event.rgb()[0] > 0.0 ? event.rgb()[0] : red;
-                        green = event.rgb()[1] > 0.0 ? event.rgb()[1] : green;
-                        blue = event.rgb()[2] > 0.0 ? event.rgb()[2] : blue;
-                        coef_b = event.coefB() < 0.0 ? event.coefB() : coef_b;
-                        coef_d = event.coefD() > 1.0 ? event.coefD() : coef_d;
-                        std_dev = event.stdDev() > 0.0 ? event.stdDev() : std_dev;
-                        salt_amount = event.saltAmount() > 0.0 ? event.saltAmount() : salt_amount;
-                        salt_chance = event.saltChance() > 0.0 ? event.saltChance() : salt_chance;
-                        pepper_amount = event.pepperAmount() > 0.0 ? event.pepperAmount() : pepper_amount;
-                        pepper_chance = event.pepperChance() > 0.0 ? event.pepperChance() : pepper_chance;
-                        mosaic_chance = event.mosaicChance() > 0.0 ? event.mosaicChance() : mosaic_chance;
-                        kernel = event.kernel() != 16 ? event.kernel() : kernel;
-                    }
-                }
-            }
+        for(auto& eventId : eventIndex.activeEvents(i)) {
+            const VFXEvent& event = eventIndex.event(eventId);
+            hue = event.hsv()[0] > 0.0 ? event.hsv()[0] : hue;
+            saturation = event.hsv()[1] > 0.0 ? event.hsv()[1] : saturation;
+            value = event.hsv()[2] > 0.0 ? event.hsv()[2] : value;
+            red = event.rgb()[0] > 0.0 ? event.rgb()[0] : red;
+            green = event.rgb()[1] > 0.0 ? event.rgb()[1] : green;
+            blue = event.rgb()[2] > 0.0 ? event.rgb()[2] : blue;
+            coef_b = event.coefB() < 0.0 ? event.coefB() : coef_b;
+            coef_d = event.coefD() > 1.0 ? event.coefD() : coef_d;
+            std_dev = event.stdDev() > 0.0 ? event.stdDev() : std_dev;
+            salt_amount = event.saltAmount() > 0.0 ? event.saltAmount() : salt_amount;
+            salt_chance = event.saltChance() > 0.0 ? event.saltChance() : salt_chance;
+            pepper_amount = event.pepperAmount() > 0.0 ? event.pepperAmount() : pepper_amount;
+            pepper_chance = event.pepperChance() > 0.0 ? event.pepperChance() : pepper_chance;
+            mosaic_chance = event.mosaicChance() > 0.0 ? event.mosaicChance() : mosaic_chance;
+            kernel = event.kernel() != 16 ? event.kernel() : kernel;
         }
     }
 
     {
-        std::lock_guard<std::mutex> lock(convertMutex);
-        std::shared_ptr<Image> image = std::make_shared<Image>(*camera->sharedImage());
-        converter.initialize(image->width(), image->height());
-        if(hue > 0.0 || saturation > 0.0 || value > 0.0) {
-            converter.hsv(image.get(), hue, saturation, value);
-        }
-        if(red > 0.0 || green > 0.0 || blue > 0.0) {
-            converter.rgb(image.get(), red, green, blue);
-        }
-        if(std_dev > 0.0) {
-            converter.gaussian_noise(image.get(), std_dev);
-        }
-        if(salt_chance > 0.0) {
-            if(salt_amount > 0.0) {
-                converter.random_salt(image.get(), salt_amount, salt_chance);
-            }
-        }
-        if(pepper_chance > 0.0) {
-            if(pepper_amount > 0.0) {
-                converter.random_pepper(image.get(), pepper_amount, pepper_chance);
+        VFXEffects effects;
+        effects.setHsv(Vector3(hue, saturation, value));
+        effects.setRgb(Vector3(red, green, blue));
+        effects.setCoefB(coef_b);
+        effects.setCoefD(coef_d);
+        effects.setStdDev(std_dev);
+        effects.setSaltAmount(salt_amount);
+        effects.setSaltChance(salt_chance);
+        effects.setPepperAmount(pepper_amount);
+        effects.setPepperChance(pepper_chance);
+        effects.setMosaicChance(mosaic_chance);
+        effects.setKernel(kernel);
+
+        ConversionWorker* worker = workers[camera].get();
+        if(isWorkerThreadActive) {
+            // A frame that has not been set yet is set before the next one is pushed
+            if(worker->hasPendingFrame()) {
+                updateCameraImage(camera);
+            } else {
+                pendingCameras.push_back(camera);
             }
+            worker->push(camera->sharedImage(), effects);
+        } else {
+            std::shared_ptr<Image> image = std::make_shared<Image>(*camera->sharedImage());
+            worker->convert(image.get(), effects);
+            camera->setImage(image);
         }
-        if(coef_b < 0.0 || coef_d > 1.0) {
-            converter.barrel_distortion(image.get(), coef_b, coef_d);
-        }
-        if(mosaic_chance > 0.0) {
-            converter.random_mosaic(image.get(), mosaic_chance, kernel);
-        }
+    }
+}
+
+
+void VFXVisionSimulatorItem::Impl::updatePendingCameras()
+{
+    for(auto& camera : pendingCameras) {
+        updateCameraImage(camera);
+    }
+    pendingCameras.clear();
+}
+
+
+void VFXVisionSimulatorItem::Impl::updateCameraImage(Camera* camera)
+{
+    std::shared_ptr<Image> image = workers[camera]->takeOutput();
+    if(image) {
         camera->setImage(image);
     }
 }
@@ -295,6 +398,12 @@ void VFXVisionSimulatorItem::doPutProperties(PutPropertyFunction& putProperty)
                     impl->vfx_event_file_path = value;
                     return true;
                 });
+    putProperty(_("VFX worker threads"), impl->isWorkerThreadEnabled,
+                changeProperty(impl->isWorkerThreadEnabled));
+    putProperty(_("VFX noise seed"), impl->noiseSeed, changeProperty(impl->noiseSeed));
+    for(auto& kv : impl->workers) {
+        putProperty(formatR(_("VFX status ({0})"), kv.second->camera()->name()), kv.second->status());
+    }
 }
 
 
@@ -304,6 +413,8 @@ bool VFXVisionSimulatorItem::store(Archive& archive)
         return false;
     }
     archive.writeRelocatablePath("vfx_event_file_path", impl->vfx_event_file_path);
+    archive.write("use_vfx_worker_threads", impl->isWorkerThreadEnabled);
+    archive.write("vfx_noise_seed", impl->noiseSeed);
     return true;
 }
 
@@ -320,5 +431,161 @@ bool VFXVisionSimulatorItem::restore(const Archive& archive)
             impl->vfx_event_file_path = symbol;
         }
     }
+    archive.read("use_vfx_worker_threads", impl->isWorkerThreadEnabled);
+    archive.read("vfx_noise_seed", impl->noiseSeed);
     return true;
-}
\ No newline at end of file
+}
+
+
+ConversionWorker::ConversionWorker(Camera* camera)
+    : camera_(camera)
+{
+    isRunning = false;
+    isConverting = false;
+    inputFrame = 0;
+    nextFrame = 0;
+    outputFrame = 0;
+    hasPendingFrame_ = false;
+    numFrames = 0;
+    lastLatency = 0.0;
+    maxLatency = 0.0;
+    totalLatency = 0.0;
+}
+
+
+ConversionWorker::~ConversionWorker()
+{
+    stop();
+}
+
+
+void ConversionWorker::setSeed(uint32_t seed, uint32_t stream)
+{
+    converter.setSeed(seed, stream);
+}
+
+
+void ConversionWorker::start()
+{
+    stop();
+    isRunning = true;
+    workerThread = thread([this](){ run(); });
+}
+
+
+void ConversionWorker::stop()
+{
+    {
+        lock_guard<mutex> lock(workerMutex);
+        isRunning = false;
+    }
+    inputCondition.notify_all();
+    outputCondition.notify_all();
+    if(workerThread.joinable()) {
+        workerThread.join();
+    }
+    input.reset();
+    hasPendingFrame_ = false;
+}
+
+
+void ConversionWorker::convert(Image* image, const VFXEffects& effects)
+{
+    auto time = chrono::steady_clock::now();
+    converter.setFrame(nextFrame++);
+    converter.apply(image, effects);
+    lock_guard<mutex> lock(workerMutex);
+    updateLatency(time);
+}
+
+
+void ConversionWorker::push(const shared_ptr<const Image>& image, const VFXEffects& effects)
+{
+    {
+        lock_guard<mutex> lock(workerMutex);
+        input = image;
+        inputEffects = effects;
+        inputFrame = nextFrame++;
+        inputTime = chrono::steady_clock::now();
+        hasPendingFrame_ = true;
+    }
+    inputCondition.notify_one();
+}
+
+
+bool ConversionWorker::hasPendingFrame() const
+{
+    lock_guard<mutex> lock(workerMutex);
+    return hasPendingFrame_;
+}
+
+
+shared_ptr<Image> ConversionWorker::takeOutput()
+{
+    unique_lock<mutex> lock(workerMutex);
+    if(!hasPendingFrame_) {
+        return nullptr;
+    }
+    outputCondition.wait(lock, [this](){ return (output_ && outputFrame == inputFrame) || !isRunning; });
+    hasPendingFrame_ = false;
+    if(!output_ || outputFrame != inputFrame) {
+        return nullptr;
+    }
+    return output_;
+}
+
+
+string ConversionWorker::status() const
+{
+    lock_guard<mutex> lock(workerMutex);
+    int queueDepth = (input ? 1 : 0) + (isConverting ? 1 : 0);
+    double meanLatency = numFrames > 0 ? totalLatency / numFrames : 0.0;
+    return formatC("queue {0}, latency {1:.1f} ms (mean {2:.1f}, max {3:.1f}), frames {4}",
+                   queueDepth, lastLatency, meanLatency, maxLatency, numFrames);
+}
+
+
+void ConversionWorker::run()
+{
+    while(true) {
+        shared_ptr<const Image> source;
+        VFXEffects effects;
+        uint64_t frame;
+        chrono::steady_clock::time_point time;
+        {
+            unique_lock<mutex> lock(workerMutex);
+            inputCondition.wait(lock, [this](){ return input || !isRunning; });
+            if(!isRunning) {
+                break;
+            }
+            source = input;
+            input.reset();
+            effects = inputEffects;
+            frame = inputFrame;
+            time = inputTime;
+            isConverting = true;
+        }
+
+        shared_ptr<Image> image = make_shared<Image>(*source);
+        converter.setFrame(frame);
+        converter.apply(image.get(), effects);
+
+        {
+            lock_guard<mutex> lock(workerMutex);
+            output_ = image;
+            outputFrame = frame;
+            isConverting = false;
+            updateLatency(time);
+        }
+        outputCondition.notify_all();
+    }
+}
+
+
+void ConversionWorker::updateLatency(const chrono::steady_clock::time_point& time)
+{
+    lastLatency = chrono::duration<double, milli>(chrono::steady_clock::now() - time).count();
+    maxLatency = max(maxLatency, lastLatency);
+    totalLatency += lastLatency;
+    ++numFrames;
+}
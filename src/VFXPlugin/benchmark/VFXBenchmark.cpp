@@ -0,0 +1,890 @@
+/**
+   @author Kenta Suzuki
+*/
+
+#include <cnoid/CustomEffects>
+#include <cnoid/Image>
+#include <cnoid/ImageGenerator>
+#include <cnoid/VFXConverter>
+#include <QColor>
+#include <QGuiApplication>
+#include <QImage>
+#include <QString>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace cnoid;
+
+namespace {
+
+struct Resolution {
+    int width;
+    int height;
+};
+
+struct Options {
+    vector<Resolution> resolutions = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+    int frames = 30;
+    int filterFrames = 3;
+    int threads = max(1, (int)thread::hardware_concurrency());
+    string input;
+    string golden;
+    bool updateGolden = false;
+    bool timing = true;
+    string output;
+};
+
+struct EffectSet {
+    string name;
+    VFXEffects effects;
+    // Tolerance of the golden image comparison; maxFraction of the bytes may differ by more than maxDifference
+    int maxDifference = 0;
+    double maxFraction = 0.0;
+};
+
+// Frame loaded by --input, used instead of the synthetic pattern
+QImage inputFrame;
+
+// The golden images are small so that they can be stored in the source tree
+const Resolution goldenResolution = { 160, 120 };
+
+struct Result {
+    string resolution;
+    string effects;
+    string mode;
+    double fps = 0.0;
+    double mean = 0.0; // unit: ms
+};
+
+vector<EffectSet> createEffectSets()
+{
+    vector<EffectSet> sets;
+
+    EffectSet rgb;
+    rgb.name = "rgb";
+    rgb.effects.setRgb(Vector3(0.2, 0.1, 0.05));
+    sets.push_back(rgb);
+
+    EffectSet noise;
+    noise.name = "gaussian_noise";
+    noise.effects.setStdDev(0.1);
+    // The float noise may round to the other side with another compiler
+    noise.maxDifference = 1;
+    sets.push_back(noise);
+
+    EffectSet saltPepper;
+    saltPepper.name = "salt_pepper";
+    saltPepper.effects.setSaltAmount(0.05);
+    saltPepper.effects.setSaltChance(1.0);
+    saltPepper.effects.setPepperAmount(0.05);
+    saltPepper.effects.setPepperChance(1.0);
+    sets.push_back(saltPepper);
+
+    EffectSet hsv;
+    hsv.name = "hsv";
+    hsv.effects.setHsv(Vector3(0.1, 0.2, 0.1));
+    sets.push_back(hsv);
+
+    EffectSet pixel;
+    pixel.name = "rgb+noise+salt_pepper";
+    pixel.effects = noise.effects;
+    pixel.effects.setRgb(rgb.effects.rgb());
+    pixel.effects.setSaltAmount(0.05);
+    pixel.effects.setSaltChance(1.0);
+    pixel.effects.setPepperAmount(0.05);
+    pixel.effects.setPepperChance(1.0);
+    pixel.maxDifference = 1;
+    sets.push_back(pixel);
+
+    EffectSet all;
+    all.name = "all";
+    all.effects = pixel.effects;
+    all.effects.setHsv(hsv.effects.hsv());
+    all.effects.setCoefB(-0.1);
+    all.effects.setCoefD(1.2);
+    all.effects.setMosaicChance(1.0);
+    all.effects.setKernel(16);
+    // The distortion may also pick the neighbor of a few source pixels
+    all.maxDifference = 1;
+    all.maxFraction = 0.002;
+    sets.push_back(all);
+
+    return sets;
+}
+
+void createFrame(Image& image, int width, int height)
+{
+    if(!inputFrame.isNull()) {
+        toCnoidImage(inputFrame.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+                     .convertToFormat(QImage::Format_RGB888), image);
+        return;
+    }
+    image.setSize(width, height, 3);
+    unsigned char* pixels = image.pixels();
+    for(int j = 0; j < height; ++j) {
+        for(int i = 0; i < width; ++i) {
+            unsigned char* pix = &pixels[(i + j * width) * 3];
+            pix[0] = (i * 255) / width;
+            pix[1] = (j * 255) / height;
+            pix[2] = ((i + j) * 7) & 0xff;
+        }
+    }
+}
+
+// The sequence of separate passes that VFXVisionSimulatorItem used before VFXConverter::apply
+void applySeparately(VFXConverter& converter, Image* image, const VFXEffects& effects)
+{
+    converter.initialize(image->width(), image->height());
+    Vector3 hsv = effects.hsv();
+    Vector3 rgb = effects.rgb();
+    if(hsv[0] > 0.0 || hsv[1] > 0.0 || hsv[2] > 0.0) {
+        converter.hsv(image, hsv[0], hsv[1], hsv[2]);
+    }
+    if(rgb[0] > 0.0 || rgb[1] > 0.0 || rgb[2] > 0.0) {
+        converter.rgb(image, rgb[0], rgb[1], rgb[2]);
+    }
+    if(effects.stdDev() > 0.0) {
+        converter.gaussian_noise(image, effects.stdDev());
+    }
+    if(effects.saltChance() > 0.0 && effects.saltAmount() > 0.0) {
+        converter.random_salt(image, effects.saltAmount(), effects.saltChance());
+    }
+    if(effects.pepperChance() > 0.0 && effects.pepperAmount() > 0.0) {
+        converter.random_pepper(image, effects.pepperAmount(), effects.pepperChance());
+    }
+    if(effects.coefB() < 0.0 || effects.coefD() > 1.0) {
+        converter.barrel_distortion(image, effects.coefB(), effects.coefD());
+    }
+    if(effects.mosaicChance() > 0.0) {
+        converter.random_mosaic(image, effects.mosaicChance(), effects.kernel());
+    }
+}
+
+// The QColor based hsv effect that VFXConverter::hsv replaced, kept as the reference
+void hsvWithQColor(Image* image, const Vector3& shift)
+{
+    unsigned char* pixels = image->pixels();
+    int numPixels = image->width() * image->height();
+    for(int i = 0; i < numPixels; ++i) {
+        unsigned char* pix = &pixels[i * 3];
+        QColor rgb = QColor::fromRgb(pix[0], pix[1], pix[2]);
+        int h = rgb.hue() + shift[0] * 360.0;
+        int s = rgb.saturation() + shift[1] * 255.0;
+        int v = rgb.value() + shift[2] * 255.0;
+
+        h = h > 359 ? h - 360 : h;
+        h = h < 0 ? 0 : h;
+        s = s > 255 ? 255 : s;
+        s = s < 0 ? 0 : s;
+        v = v > 255 ? 255 : v;
+        v = v < 0 ? 0 : v;
+
+        QColor hsv = QColor::fromHsv(h, s, v);
+        pix[0] = hsv.red();
+        pix[1] = hsv.green();
+        pix[2] = hsv.blue();
+    }
+}
+
+// Maximum channel difference between VFXConverter::hsv and the QColor path over all 2^24 colors
+int measureHsvError(VFXConverter& converter, const Vector3& shift)
+{
+    const int size = 4096;
+    Image image;
+    image.setSize(size, size, 3);
+    unsigned char* pixels = image.pixels();
+    for(int i = 0; i < size * size; ++i) {
+        pixels[i * 3] = i >> 16;
+        pixels[i * 3 + 1] = (i >> 8) & 0xff;
+        pixels[i * 3 + 2] = i & 0xff;
+    }
+    Image reference(image);
+    converter.initialize(size, size);
+    converter.hsv(&image, shift[0], shift[1], shift[2]);
+    hsvWithQColor(&reference, shift);
+
+    int maxError = 0;
+    const unsigned char* ref = reference.pixels();
+    for(int i = 0; i < size * size * 3; ++i) {
+        maxError = max(maxError, abs(pixels[i] - ref[i]));
+    }
+    return maxError;
+}
+
+// Number of bytes that differ between two conversions of the same frame number
+int countNoiseDifference(const Resolution& resolution, const VFXEffects& effects, int threads1, int threads2)
+{
+    Image image1, image2;
+    createFrame(image1, resolution.width, resolution.height);
+    image2 = image1;
+    VFXConverter converter1, converter2;
+    converter1.setSeed(1234, 5);
+    converter1.setNumThreads(threads1);
+    converter2.setSeed(1234, 5);
+    converter2.setNumThreads(threads2);
+    converter1.apply(&image1, effects);
+    converter2.apply(&image2, effects);
+
+    int count = 0;
+    const unsigned char* pixels1 = image1.pixels();
+    const unsigned char* pixels2 = image2.pixels();
+    for(int i = 0; i < resolution.width * resolution.height * 3; ++i) {
+        count += pixels1[i] != pixels2[i] ? 1 : 0;
+    }
+    return count;
+}
+
+// Largest channel difference between VFXConverter::apply and the separate passes
+int measureFusedDifference(const Resolution& resolution, const VFXEffects& effects)
+{
+    Image fused, separate;
+    createFrame(fused, resolution.width, resolution.height);
+    separate = fused;
+    VFXConverter converter1, converter2;
+    converter1.setSeed(1234, 0);
+    converter2.setSeed(1234, 0);
+    converter1.apply(&fused, effects);
+    applySeparately(converter2, &separate, effects);
+
+    int maxDifference = 0;
+    const unsigned char* pixels1 = fused.pixels();
+    const unsigned char* pixels2 = separate.pixels();
+    for(int i = 0; i < resolution.width * resolution.height * 3; ++i) {
+        maxDifference = max(maxDifference, abs(pixels1[i] - pixels2[i]));
+    }
+    return maxDifference;
+}
+
+// Number of bytes that differ between the scaled and flipped frames of two numbers of threads
+int countTransformDifference(const Resolution& resolution, int threads1, int threads2)
+{
+    Image image1, image2;
+    createFrame(image1, resolution.width, resolution.height);
+    image2 = image1;
+    ImageGenerator generator1, generator2;
+    generator1.setNumThreads(threads1);
+    generator2.setNumThreads(threads2);
+    generator1.filteredImage(image1, 1.25, 1.25);
+    generator2.filteredImage(image2, 1.25, 1.25);
+    generator1.flippedImage(image1);
+    generator2.flippedImage(image2);
+
+    int count = 0;
+    const unsigned char* pixels1 = image1.pixels();
+    const unsigned char* pixels2 = image2.pixels();
+    for(int i = 0; i < resolution.width * resolution.height * 3; ++i) {
+        count += pixels1[i] != pixels2[i] ? 1 : 0;
+    }
+    return count;
+}
+
+// The ImageGenerator filters before they were made separable and constant time, kept as the reference.
+// They pad with zeros at an offset of one pixel and accumulate into the 8-bit pixels.
+void legacyConvolution(const Image& source, Image& image, const vector<double>& kernel, int matrix,
+                       bool clear, bool columnMajor)
+{
+    Image cloneImage;
+    int width = image.width();
+    int height = image.height();
+    int nc = image.numComponents();
+    int margin = matrix - 1;
+    cloneImage.setSize(width + margin, height + margin, nc);
+
+    for(int j = 0; j < height; ++j) {
+        for(int i = 0; i < width; ++i) {
+            int index = nc * ((i + 1) + (j + 1) * (width + margin));
+            for(int k = 0; k < nc; ++k) {
+                cloneImage.pixels()[index + k] = source.pixels()[nc * (i + j * width) + k];
+            }
+        }
+    }
+
+    for(int n = 0; n < width * height; ++n) {
+        int i = columnMajor ? n / height : n % width;
+        int j = columnMajor ? n % height : n / width;
+        int index = nc * (i + j * width);
+        for(int k = 0; k < nc; ++k) {
+            if(clear) {
+                image.pixels()[index + k] = 0;
+            }
+            for(int p = j; p < j + matrix; ++p) {
+                for(int q = i; q < i + matrix; ++q) {
+                    int t = matrix * (p - j) + (q - i);
+                    image.pixels()[index + k] += kernel[t] * (double)cloneImage.pixels()[nc * (q + p * (width + margin)) + k];
+                }
+            }
+        }
+    }
+}
+
+void legacyGaussianFilter(Image& image, int matrix)
+{
+    const double binomial[2][5] = { { 1.0, 2.0, 1.0 }, { 1.0, 4.0, 6.0, 4.0, 1.0 } };
+    const double* weights = binomial[matrix == 3 ? 0 : 1];
+    double sum = matrix == 3 ? 16.0 : 256.0;
+    vector<double> kernel;
+    for(int i = 0; i < matrix * matrix; ++i) {
+        kernel.push_back(weights[i / matrix] * weights[i % matrix] / sum);
+    }
+    legacyConvolution(image, image, kernel, matrix, true, false);
+}
+
+void legacyMedianFilter(Image& image, int matrix)
+{
+    Image cloneImage;
+    int width = image.width();
+    int height = image.height();
+    int nc = image.numComponents();
+    int margin = matrix - 1;
+    int median = (matrix * matrix + 1) / 2;
+    cloneImage.setSize(width + margin, height + margin, nc);
+
+    for(int j = 0; j < height; ++j) {
+        for(int i = 0; i < width; ++i) {
+            int index = nc * ((i + 1) + (j + 1) * (width + margin));
+            for(int k = 0; k < nc; ++k) {
+                cloneImage.pixels()[index + k] = image.pixels()[nc * (i + j * width) + k];
+            }
+        }
+    }
+
+    for(int j = 0; j < height; ++j) {
+        for(int i = 0; i < width; ++i) {
+            int index = nc * (i + j * width);
+            for(int k = 0; k < nc; ++k) {
+                vector<double> values;
+                for(int p = j; p < j + matrix; ++p) {
+                    for(int q = i; q < i + matrix; ++q) {
+                        values.push_back((double)cloneImage.pixels()[nc * (q + p * (width + margin)) + k]);
+                    }
+                }
+                sort(values.begin(), values.end());
+                image.pixels()[index + k] = values[median];
+            }
+        }
+    }
+}
+
+void legacyDifferentialFilter(Image& image, int weight)
+{
+    const double w = weight;
+    const vector<double> hkernel = { -1.0, 0.0, 1.0, -w, 0.0, w, -1.0, 0.0, 1.0 };
+    const vector<double> vkernel = { 1.0, w, 1.0, 0.0, 0.0, 0.0, -1.0, -w, -1.0 };
+    Image source = image;
+    legacyConvolution(source, image, hkernel, 3, true, false);
+    legacyConvolution(source, image, vkernel, 3, false, true);
+}
+
+// The former ImageGenerator::filteredImage, which truncated the source positions
+void legacyScaledImage(Image& image, double scalex, double scaley)
+{
+    Image cloneImage = image;
+    int width = image.width();
+    int height = image.height();
+    int nc = image.numComponents();
+    int xs = width / 2;
+    int ys = height / 2;
+    for(int i = -ys; i < ys; i++) {
+        for(int j = -xs; j < xs; j++) {
+            int m = i / scaley;
+            int n = j / scalex;
+            for(int k = 0; k < nc; k++) {
+                int d = 0;
+                if((m > -ys) && (m < ys) && (n >= -xs) && (n < xs)) {
+                    d = image.pixels()[3 * ((m + ys) * width + (n + xs)) + k];
+                }
+                cloneImage.pixels()[3 * ((i + ys) * width + (j + xs)) + k] = d;
+            }
+        }
+    }
+    image = cloneImage;
+}
+
+// The former ImageGenerator::flippedImage
+void legacyFlippedImage(Image& image)
+{
+    Image cloneImage = image;
+    int width = image.width();
+    int height = image.height();
+    int nc = image.numComponents();
+    for(int j = 0; j < height; ++j) {
+        for(int i = 0; i < width; ++i) {
+            int index = nc * (i + j * width);
+            for(int k = 0; k < nc; ++k) {
+                cloneImage.pixels()[index + k] = image.pixels()[nc * ((width - 1 - i) + (height - 1 - j) * width) + k];
+            }
+        }
+    }
+    image = cloneImage;
+}
+
+// The per-pixel conversions that toQImage and toCnoidImage used before the row-wise copies
+QImage legacyToQImage(const Image& image)
+{
+    QImage qimage(image.width(), image.height(), QImage::Format_RGB888);
+    const unsigned char* pixels = image.pixels();
+    for(int j = 0; j < image.height(); ++j) {
+        for(int i = 0; i < image.width(); ++i) {
+            int index = (i + j * image.width()) * 3;
+            qimage.setPixelColor(i, j, QColor(pixels[index], pixels[index + 1], pixels[index + 2]));
+        }
+    }
+    return qimage;
+}
+
+void legacyToCnoidImage(const QImage& qimage, Image& image)
+{
+    image.setSize(qimage.width(), qimage.height(), 3);
+    unsigned char* pixels = image.pixels();
+    for(int j = 0; j < qimage.height(); ++j) {
+        for(int i = 0; i < qimage.width(); ++i) {
+            int index = (i + j * qimage.width()) * 3;
+            QRgb rgb = qimage.pixel(i, j);
+            pixels[index] = qRed(rgb);
+            pixels[index + 1] = qGreen(rgb);
+            pixels[index + 2] = qBlue(rgb);
+        }
+    }
+}
+
+// Number of bytes changed by a round trip through QImage, whose rows are padded unless the width is a multiple of 4
+int countRoundTripDifference(int width, int height, int numComponents)
+{
+    Image image;
+    image.setSize(width, height, numComponents);
+    unsigned char* pixels = image.pixels();
+    const int size = width * height * numComponents;
+    for(int i = 0; i < size; ++i) {
+        pixels[i] = (i * 31) & 0xff;
+    }
+    int difference = 0;
+    for(const Image& result : { toCnoidImage(toQImage(image)), toCnoidImage(wrapQImage(image)) }) {
+        if(result.width() != width || result.height() != height || result.numComponents() != numComponents) {
+            difference += size;
+            continue;
+        }
+        for(int i = 0; i < size; ++i) {
+            difference += pixels[i] != result.pixels()[i] ? 1 : 0;
+        }
+    }
+    return difference;
+}
+
+Result measure(const Resolution& resolution, const string& effects, const string& mode, int frames,
+               const function<void(Image*)>& convert)
+{
+    Image source;
+    createFrame(source, resolution.width, resolution.height);
+
+    double total = 0.0;
+    for(int i = 0; i < frames; ++i) {
+        // VFXVisionSimulatorItem converts a copy of the camera image, so the copy is measured as well
+        auto start = chrono::steady_clock::now();
+        Image image(source);
+        convert(&image);
+        auto end = chrono::steady_clock::now();
+        total += chrono::duration<double, milli>(end - start).count();
+    }
+
+    Result result;
+    result.resolution = to_string(resolution.width) + "x" + to_string(resolution.height);
+    result.effects = effects;
+    result.mode = mode;
+    result.mean = total / frames;
+    result.fps = total > 0.0 ? frames * 1000.0 / total : 0.0;
+    cerr << result.resolution << " " << result.effects << " " << result.mode << ": "
+         << result.fps << " fps" << endl;
+    return result;
+}
+
+bool parseResolutions(const string& text, vector<Resolution>& resolutions)
+{
+    resolutions.clear();
+    stringstream ss(text);
+    string item;
+    while(getline(ss, item, ',')) {
+        Resolution resolution;
+        if(sscanf(item.c_str(), "%dx%d", &resolution.width, &resolution.height) != 2
+           || resolution.width <= 0 || resolution.height <= 0) {
+            return false;
+        }
+        resolutions.push_back(resolution);
+    }
+    return !resolutions.empty();
+}
+
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> const char* { return (i + 1 < argc) ? argv[++i] : nullptr; };
+        const char* value = nullptr;
+        if(arg == "-h" || arg == "--help") {
+            return false;
+        } else if((arg == "--resolutions") && (value = next())) {
+            if(!parseResolutions(value, options.resolutions)) {
+                cerr << "Invalid resolutions: " << value << endl;
+                return false;
+            }
+        } else if((arg == "--frames") && (value = next())) {
+            options.frames = atoi(value);
+        } else if((arg == "--filter-frames") && (value = next())) {
+            options.filterFrames = max(atoi(value), 1);
+        } else if((arg == "--threads") && (value = next())) {
+            options.threads = max(atoi(value), 1);
+        } else if((arg == "--input") && (value = next())) {
+            options.input = value;
+        } else if((arg == "--golden") && (value = next())) {
+            options.golden = value;
+        } else if(arg == "--update-golden") {
+            options.updateGolden = true;
+        } else if(arg == "--no-timing") {
+            options.timing = false;
+        } else if((arg == "--output") && (value = next())) {
+            options.output = value;
+        } else {
+            cerr << "Unknown or incomplete option: " << arg << endl;
+            return false;
+        }
+    }
+    options.frames = max(options.frames, 1);
+    if(options.updateGolden && options.golden.empty()) {
+        cerr << "--update-golden requires --golden" << endl;
+        return false;
+    }
+    return true;
+}
+
+void printUsage()
+{
+    cerr << "Usage: vfx-benchmark [options]\n"
+         << "  --resolutions WxH[,WxH...]  frame sizes (default: 640x480,1280x720,1920x1080)\n"
+         << "  --frames N                  number of frames converted for each case\n"
+         << "  --filter-frames N           number of frames filtered for each ImageGenerator case (default: 3)\n"
+         << "  --threads N                 threads of the modes ending in _threads (default: number of cores)\n"
+         << "  --input FILE                use an image file scaled to each size instead of the synthetic frame\n"
+         << "  --golden DIR                compare the outputs at " << goldenResolution.width << "x" << goldenResolution.height
+         << " with DIR/<effect>.png\n"
+         << "  --update-golden             write the outputs to the --golden directory instead of comparing\n"
+         << "  --no-timing                 only run the checks\n"
+         << "  --output FILE               write the result as JSON to FILE (default: stdout)" << endl;
+}
+
+struct Check {
+    string name;
+    int value;
+    int tolerance;
+};
+
+struct GoldenCase {
+    string name;
+    function<void(Image*)> apply;
+    int maxDifference;
+    double maxFraction;
+};
+
+// Every effect set and the ImageGenerator operations, with a fixed seed and frame number
+vector<GoldenCase> createGoldenCases(const vector<EffectSet>& sets)
+{
+    vector<GoldenCase> cases;
+    for(auto& set : sets) {
+        VFXEffects effects = set.effects;
+        cases.push_back({ set.name, [effects](Image* image){
+            VFXConverter converter;
+            converter.setSeed(1234, 0);
+            converter.setFrame(0);
+            converter.apply(image, effects);
+        }, set.maxDifference, set.maxFraction });
+    }
+
+    auto generator = make_shared<ImageGenerator>();
+    cases.push_back({ "gaussian5", [generator](Image* image){ generator->gaussianFilter(*image, 5); }, 1, 0.0 });
+    cases.push_back({ "box9", [generator](Image* image){ generator->boxFilter(*image, 9); }, 0, 0.0 });
+    cases.push_back({ "median3", [generator](Image* image){ generator->medianFilter(*image, 3); }, 0, 0.0 });
+    cases.push_back({ "median9", [generator](Image* image){ generator->medianFilter(*image, 9); }, 0, 0.0 });
+    cases.push_back({ "sobel", [generator](Image* image){ generator->sobelFilter(*image); }, 0, 0.0 });
+    cases.push_back({ "prewitt", [generator](Image* image){ generator->prewittFilter(*image); }, 0, 0.0 });
+    cases.push_back({ "scale", [generator](Image* image){ generator->filteredImage(*image, 1.25, 0.8); }, 1, 0.0 });
+    cases.push_back({ "flip", [generator](Image* image){ generator->flippedImage(*image); }, 0, 0.0 });
+    return cases;
+}
+
+// Compares the output of each case with directory/<name>.png, or writes it there with --update-golden
+void checkGoldenImages(const Options& options, const vector<EffectSet>& sets, vector<Check>& checks)
+{
+    Image source;
+    createFrame(source, goldenResolution.width, goldenResolution.height);
+    const int size = source.width() * source.height() * source.numComponents();
+
+    for(auto& c : createGoldenCases(sets)) {
+        Image image(source);
+        c.apply(&image);
+        string path = options.golden + "/" + c.name + ".png";
+
+        if(options.updateGolden) {
+            if(!toQImage(image).save(QString::fromStdString(path), "PNG")) {
+                cerr << "Failed to write " << path << endl;
+            }
+            continue;
+        }
+
+        Check check;
+        check.name = "golden(" + c.name + ")";
+        check.tolerance = (int)(c.maxFraction * size);
+        Image golden;
+        toCnoidImage(QImage(QString::fromStdString(path)).convertToFormat(QImage::Format_RGB888), golden);
+        if(golden.width() != image.width() || golden.height() != image.height() || golden.numComponents() != 3) {
+            cerr << "Missing or mismatched golden image: " << path << endl;
+            check.value = size;
+        } else {
+            check.value = 0;
+            const unsigned char* pixels = image.pixels();
+            const unsigned char* expected = golden.pixels();
+            for(int i = 0; i < size; ++i) {
+                check.value += abs(pixels[i] - expected[i]) > c.maxDifference ? 1 : 0;
+            }
+        }
+        checks.push_back(check);
+    }
+}
+
+void writeJson(ostream& os, const Options& options, const vector<Result>& results, const vector<Check>& checks)
+{
+    os << "{\n";
+    os << "  \"benchmark\": \"VFXPlugin\",\n";
+    os << "  \"parameters\": { \"frames\": " << options.frames << ", \"filter_frames\": " << options.filterFrames
+       << ", \"threads\": " << options.threads << ", \"input\": \"" << options.input << "\" },\n";
+    os << "  \"results\": [\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        os << "    { \"resolution\": \"" << r.resolution << "\", \"effects\": \"" << r.effects
+           << "\", \"mode\": \"" << r.mode << "\", \"fps\": " << fixed << r.fps
+           << ", \"mean_ms\": " << r.mean << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ],\n";
+    os << "  \"checks\": [\n";
+    for(size_t i = 0; i < checks.size(); ++i) {
+        const Check& c = checks[i];
+        os << "    { \"name\": \"" << c.name << "\", \"value\": " << c.value << ", \"tolerance\": " << c.tolerance
+           << ", \"ok\": " << (c.value <= c.tolerance ? "true" : "false") << " }"
+           << (i + 1 < checks.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}" << endl;
+}
+
+// Throughput of every effect set, filter, transform and conversion at each resolution
+void measureThroughput(const Options& options, const vector<EffectSet>& sets, vector<Result>& results)
+{
+    VFXConverter converter;
+    VFXConverter threadedConverter;
+    threadedConverter.setNumThreads(options.threads);
+
+    for(auto& resolution : options.resolutions) {
+        for(auto& set : sets) {
+            results.push_back(measure(resolution, set.name, "separate", options.frames, [&](Image* image){
+                applySeparately(converter, image, set.effects);
+            }));
+            results.push_back(measure(resolution, set.name, "fused", options.frames, [&](Image* image){
+                converter.apply(image, set.effects);
+            }));
+            results.push_back(measure(resolution, set.name, "fused_threads", options.frames, [&](Image* image){
+                threadedConverter.apply(image, set.effects);
+            }));
+            if(set.name == "hsv") {
+                results.push_back(measure(resolution, set.name, "qcolor", options.frames, [&](Image* image){
+                    hsvWithQColor(image, set.effects.hsv());
+                }));
+            }
+        }
+    }
+
+    // ImageGenerator filters; the legacy mode is only run where the former implementation existed
+    ImageGenerator generator;
+    for(auto& resolution : options.resolutions) {
+        auto filter = [&](const string& name, const string& mode, const function<void(Image*)>& func) {
+            results.push_back(measure(resolution, name, mode, options.filterFrames, func));
+        };
+        for(int matrix : { 3, 5 }) {
+            string name = "gaussian" + to_string(matrix);
+            filter(name, "legacy", [&](Image* image){ legacyGaussianFilter(*image, matrix); });
+            filter(name, "separable", [&](Image* image){ generator.gaussianFilter(*image, matrix); });
+            name = "median" + to_string(matrix);
+            filter(name, "legacy", [&](Image* image){ legacyMedianFilter(*image, matrix); });
+            filter(name, matrix == 3 ? "network" : "histogram", [&](Image* image){ generator.medianFilter(*image, matrix); });
+        }
+        filter("gaussian31", "separable", [&](Image* image){ generator.gaussianFilter(*image, 31); });
+        filter("box31", "running_sum", [&](Image* image){ generator.boxFilter(*image, 31); });
+        filter("median31", "histogram", [&](Image* image){ generator.medianFilter(*image, 31); });
+        filter("sobel", "legacy", [&](Image* image){ legacyDifferentialFilter(*image, 2); });
+        filter("sobel", "in_place", [&](Image* image){ generator.sobelFilter(*image); });
+        filter("prewitt", "legacy", [&](Image* image){ legacyDifferentialFilter(*image, 1); });
+        filter("prewitt", "in_place", [&](Image* image){ generator.prewittFilter(*image); });
+    }
+
+    // Scaling and flipping, in the calling thread and shared by the threads
+    ImageGenerator threadedGenerator;
+    threadedGenerator.setNumThreads(options.threads);
+    for(auto& resolution : options.resolutions) {
+        auto transform = [&](const string& name, const string& mode, const function<void(Image*)>& func) {
+            results.push_back(measure(resolution, name, mode, options.frames, func));
+        };
+        transform("scale", "legacy", [&](Image* image){ legacyScaledImage(*image, 1.25, 1.25); });
+        transform("scale", "tables", [&](Image* image){ generator.filteredImage(*image, 1.25, 1.25); });
+        transform("scale", "tables_threads", [&](Image* image){ threadedGenerator.filteredImage(*image, 1.25, 1.25); });
+        transform("flip", "legacy", [&](Image* image){ legacyFlippedImage(*image); });
+        transform("flip", "in_place", [&](Image* image){ generator.flippedImage(*image); });
+        transform("flip", "in_place_threads", [&](Image* image){ threadedGenerator.flippedImage(*image); });
+    }
+
+    // Round trips between Image and QImage; wrap shares the buffer on the way to QImage
+    for(auto& resolution : options.resolutions) {
+        Image output;
+        results.push_back(measure(resolution, "qimage_round_trip", "legacy", options.frames, [&](Image* image){
+            legacyToCnoidImage(legacyToQImage(*image), output);
+        }));
+        results.push_back(measure(resolution, "qimage_round_trip", "copy", options.frames, [&](Image* image){
+            output = toCnoidImage(toQImage(*image));
+        }));
+        results.push_back(measure(resolution, "qimage_round_trip", "wrap", options.frames, [&](Image* image){
+            toCnoidImage(wrapQImage(*image), output);
+        }));
+    }
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if(!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    if(qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    if(!options.input.empty()) {
+        inputFrame = QImage(QString::fromStdString(options.input));
+        if(inputFrame.isNull()) {
+            cerr << "Failed to read " << options.input << endl;
+            return 1;
+        }
+    }
+
+    vector<EffectSet> sets = createEffectSets();
+    vector<Result> results;
+    if(options.timing) {
+        measureThroughput(options, sets, results);
+    }
+
+    VFXConverter converter;
+
+    // The integer hsv kernel is documented to differ from QColor by at most 1 per channel
+    vector<Check> checks;
+    for(auto& shift : { Vector3(0.1, 0.2, 0.1), Vector3(0.9, 0.5, 0.5), Vector3(0.3, -0.2, -0.1) }) {
+        Check check;
+        check.name = "hsv_max_error(" + to_string(shift[0]) + "," + to_string(shift[1]) + "," + to_string(shift[2]) + ")";
+        check.value = measureHsvError(converter, shift);
+        check.tolerance = 1;
+        checks.push_back(check);
+    }
+
+    for(auto& size : { Resolution{ 640, 480 }, Resolution{ 641, 479 }, Resolution{ 3, 2 } }) {
+        for(int nc : { 1, 3, 4 }) {
+            Check check;
+            check.name = "qimage_round_trip(" + to_string(size.width) + "x" + to_string(size.height) + "x" + to_string(nc) + ")";
+            check.value = countRoundTripDifference(size.width, size.height, nc);
+            check.tolerance = 0;
+            checks.push_back(check);
+        }
+    }
+
+    // The fused pass must reproduce the separate passes of the deterministic effects
+    {
+        VFXEffects rgb;
+        rgb.setRgb(Vector3(0.2, 0.1, 0.05));
+        VFXEffects hsv;
+        hsv.setHsv(Vector3(0.1, 0.2, 0.1));
+        VFXEffects distortion;
+        distortion.setCoefB(-0.1);
+        distortion.setCoefD(1.2);
+        VFXEffects mosaic;
+        mosaic.setMosaicChance(1.0);
+        mosaic.setKernel(16);
+        VFXEffects combined = distortion;
+        combined.setRgb(rgb.rgb());
+        combined.setHsv(hsv.hsv());
+        combined.setMosaicChance(1.0);
+        combined.setKernel(16);
+        const pair<string, VFXEffects> cases[] = {
+            { "rgb", rgb }, { "hsv", hsv }, { "distortion", distortion },
+            { "mosaic", mosaic }, { "rgb+hsv+distortion+mosaic", combined } };
+        for(auto& resolution : options.resolutions) {
+            for(auto& c : cases) {
+                Check check;
+                check.name = "fused_max_difference(" + c.first + "," + to_string(resolution.width) + "x"
+                    + to_string(resolution.height) + ")";
+                check.value = measureFusedDifference(resolution, c.second);
+                check.tolerance = 0;
+                checks.push_back(check);
+            }
+        }
+    }
+
+    // The noise is keyed by the frame and the pixel, so it must not depend on the number of threads
+    for(auto& set : sets) {
+        if(set.name == "rgb+noise+salt_pepper") {
+            for(auto& resolution : options.resolutions) {
+                Check check;
+                check.name = "noise_thread_independence(" + to_string(resolution.width) + "x"
+                    + to_string(resolution.height) + ")";
+                check.value = countNoiseDifference(resolution, set.effects, 1, max(options.threads, 4));
+                check.tolerance = 0;
+                checks.push_back(check);
+            }
+        }
+    }
+
+    // The rows of scaling and flipping are split over the threads, which must not change the result
+    for(auto& resolution : options.resolutions) {
+        Check check;
+        check.name = "transform_thread_independence(" + to_string(resolution.width) + "x"
+            + to_string(resolution.height) + ")";
+        check.value = countTransformDifference(resolution, 1, max(options.threads, 4));
+        check.tolerance = 0;
+        checks.push_back(check);
+    }
+
+    if(!options.golden.empty()) {
+        checkGoldenImages(options, sets, checks);
+    }
+
+    if(options.output.empty()) {
+        writeJson(cout, options, results, checks);
+    } else {
+        ofstream out(options.output);
+        writeJson(out, options, results, checks);
+    }
+
+    bool ok = true;
+    for(auto& check : checks) {
+        ok &= check.value <= check.tolerance;
+    }
+    return ok ? 0 : 1;
+}